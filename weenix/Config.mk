@@ -50,9 +50,10 @@
         NTERMS=3
 
 #
-# Set the number of disks that we should be launching
+# Set the number of disks that we should be launching. The second one
+# (disk1) is used as swap space if it is there.
 #
-        NDISKS=1
+        NDISKS=2
 
 # Switches for non-required components. If you wish to try implementing
 # some extra features in Weenix, there are some pre-designed features
@@ -81,7 +82,7 @@
 
 # Parameters for the hard disk we build (must be compatible!)
 # If the FS is too big for the disk, BAD things happen!
-        DISK_BLOCKS=1024 # For fsmaker
+        DISK_BLOCKS=2048 # For fsmaker
         DISK_INODES=240 # for fsmaker
 
 # Debug message behavior. Note that this can be changed at runtime by
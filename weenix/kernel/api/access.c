@@ -16,12 +16,89 @@
 #include "api/access.h"
 #include "api/syscall.h"
 
+/*
+ * The exception table: each entry gives the address of an instruction
+ * which accesses user memory and may fault on it, and the address to
+ * continue at if the fault can't be handled. The entries are put in the
+ * __ex_table section by the instructions' inline assembly, and the
+ * linker script collects them between kernel_start_ex_table and
+ * kernel_end_ex_table.
+ */
+typedef struct ex_entry {
+        uintptr_t ex_insn;
+        uintptr_t ex_fixup;
+} ex_entry_t;
+
+/*
+ * Returns where to continue if the instruction at eip faults on a user
+ * address which can't be mapped, or 0 if eip isn't allowed to fault. Called
+ * by the page fault handler for faults in kernel mode. There are only a
+ * handful of entries, so they are simply searched in order.
+ */
+uintptr_t
+user_access_fixup(uintptr_t eip)
+{
+        ex_entry_t *ex;
+
+        for (ex = (ex_entry_t *)&kernel_start_ex_table;
+             ex < (ex_entry_t *)&kernel_end_ex_table; ++ex) {
+                if (ex->ex_insn == eip)
+                        return ex->ex_fixup;
+        }
+        return 0;
+}
+
+/*
+ * Copies n bytes from src to dst, either of which may be in user memory,
+ * through the current page directory. A fault on a user page is handled
+ * like one from user mode (so pages are faulted in or copied on write as
+ * needed), except that if it can't be the copy stops there instead of the
+ * process being killed. Returns the number of bytes not copied.
+ */
+static size_t
+user_copy(void *dst, const void *src, size_t n)
+{
+        size_t d0, d1;
+
+        __asm__ volatile(
+                "1:     rep movsb\n"
+                "2:\n"
+                ".section __ex_table, \"a\"\n"
+                "       .long 1b, 2b\n"
+                ".previous\n"
+                : "=c"(n), "=D"(d0), "=S"(d1)
+                : "0"(n), "1"(dst), "2"(src)
+                : "memory");
+        return n;
+}
+
+/* Whether [uaddr, uaddr + nbytes) is all in user memory */
+static int
+user_range_ok(const void *uaddr, size_t nbytes)
+{
+        uintptr_t start = (uintptr_t)uaddr;
+
+        return USER_MEM_LOW <= start && start + nbytes >= start
+               && start + nbytes <= USER_MEM_HIGH;
+}
+
 /* copy_to_user and copy_from_user are used to copy to and from the
- * user space of the current process.  They first check that the range
- * of addresses has valid mappings, then call vmmap_read/write.
+ * user space of the current process.  They copy through the process's
+ * own mappings, faulting pages in as needed (see user_copy), after only
+ * checking that the addresses are in user memory: the fault handler
+ * checks the areas' permissions. If that fails, they check that the
+ * range of addresses has valid mappings, then call vmmap_read/write,
+ * which reports the error (or copies what the fault handler couldn't,
+ * e.g. for lack of memory for a page table).
  */
 int copy_from_user(void *kaddr, const void *uaddr, size_t nbytes)
 {
+        if (!user_range_ok(uaddr, nbytes)) {
+                return -EFAULT;
+        }
+        if (0 == user_copy(kaddr, uaddr, nbytes)) {
+                return 0;
+        }
         if (!range_perm(curproc, uaddr, nbytes, PROT_READ)) {
                 return -EFAULT;
         }
@@ -30,6 +107,12 @@ int copy_from_user(void *kaddr, const void *uaddr, size_t nbytes)
 
 int copy_to_user(void *uaddr, const void *kaddr, size_t nbytes)
 {
+        if (!user_range_ok(uaddr, nbytes)) {
+                return -EFAULT;
+        }
+        if (0 == user_copy(uaddr, kaddr, nbytes)) {
+                return 0;
+        }
         if (!range_perm(curproc, uaddr, nbytes, PROT_WRITE)) {
                 return -EFAULT;
         }
@@ -132,17 +215,10 @@ int addr_perm(struct proc *p, const void *vaddr, int perm)
                         }list_iterate_end();
 
 */
-	vmarea_t *myVmarea;
-	list_iterate_begin(&p->p_vmmap->vmm_list,myVmarea,vmarea_t,vma_plink){
-		if(PN_TO_ADDR(myVmarea->vma_start)<= vaddr && PN_TO_ADDR(myVmarea->vma_end)> vaddr){
-			if((myVmarea->vma_prot&perm)==perm){
-				return 1;
-			}else{
-				return 0;
-			}
-		}
-	}list_iterate_end();
-        return 0;
+	vmarea_t *myVmarea = vmmap_lookup(p->p_vmmap, ADDR_TO_PN(vaddr));
+	if(NULL == myVmarea)
+		return 0;
+	return (myVmarea->vma_prot&perm) == perm;
 }
 
 /*
@@ -159,21 +235,26 @@ int range_perm(struct proc *p, const void *avaddr, size_t len, int perm)
         /*NOT_YET_IMPLEMENTED("VM: range_perm");*/
 
 	vmarea_t *myVmarea;
-	size_t tmp_len=0;
-	int i;
+	uint32_t vfn = ADDR_TO_PN(avaddr);
+	uint32_t endvfn;
+
+	/* an empty range still has to start in a mapped page */
+	if(0 == len)
+		return addr_perm(p, avaddr, perm);
+	if((uintptr_t)avaddr + len < (uintptr_t)avaddr)
+		return 0;
+	endvfn = ADDR_TO_PN((uintptr_t)avaddr + len - 1) + 1;
 
-	for(i=0; i*PAGE_SIZE<=len ;i++){
-		myVmarea = vmmap_lookup(p->p_vmmap,ADDR_TO_PN(avaddr)+i);
+	/* one lookup per area rather than per page */
+	while(vfn < endvfn){
+		myVmarea = vmmap_lookup(p->p_vmmap, vfn);
 		if(myVmarea == NULL)
 			return 0;
 		if((myVmarea->vma_prot&perm) != perm)
 			return 0;
-		if(i*PAGE_SIZE == len)
-			return 1;
+		vfn = myVmarea->vma_end;
 	}
-	if((i-1)*PAGE_SIZE < len)
-		return 1;
-	else return 0;
+	return 1;
 
 	/*
         list_iterate_begin(&p->p_vmmap->vmm_list,myVmarea,vmarea_t,vma_plink){
@@ -664,8 +664,10 @@ static int _elf32_load(const char *filename, int fd, char *const argv[],
         map->vmm_proc = NULL;
 
         /* Flush the process pagetables and TLB */
-        pt_unmap_range(curproc->p_pagedir, USER_MEM_LOW, USER_MEM_HIGH);
-        tlb_flush_all();
+        tlb_gather_t tg;
+        tlb_gather_init(&tg, curproc->p_pagedir);
+        pt_unmap_range(curproc->p_pagedir, USER_MEM_LOW, USER_MEM_HIGH, &tg);
+        tlb_gather_finish(&tg);
 
         /* Set the process break and starting break (immediately after the mapped-in
          * text/data/bss from the executable) */
@@ -2,6 +2,7 @@
 #include "globals.h"
 #include "errno.h"
 #include "types.h"
+#include "limits.h"
 
 #include "main/interrupt.h"
 
@@ -12,6 +13,8 @@
 #include "util/string.h"
 #include "util/debug.h"
 #include "util/list.h"
+#include "util/bits.h"
+#include "util/time.h"
 
 #include "mm/mman.h"
 #include "mm/mm.h"
@@ -32,6 +35,7 @@
 #include "api/utsname.h"
 #include "api/access.h"
 #include "api/exec.h"
+#include "api/sysstat.h"
 
 static void syscall_handler(regs_t *regs);
 static int syscall_dispatch(uint32_t sysnum, uint32_t args, regs_t *regs);
@@ -43,13 +47,11 @@ static __attribute__((unused)) void syscall_init(void)
 init_func(syscall_init);
 
 /*
- * this is one of the few sys_* functions you have to write. be sure to
- * check out the sys_* functions we have provided before trying to write
- * this one.
+ * Reads straight into the user's buffer, whatever its size: see
+ * do_read_user, which copies from the page cache to user memory (or
+ * through a bounce page for files which aren't cached).
  *  - copy_from_user() the read_args_t
- *  - page_alloc() a temporary buffer
- *  - call do_read(), and copy_to_user() the read bytes
- *  - page_free() your buffer
+ *  - call do_read_user()
  *  - return the number of bytes actually read, or if anything goes wrong
  *    set curthr->kt_errno and return -1
  */
@@ -57,28 +59,17 @@ static int
 sys_read(read_args_t *arg)
 {
 	read_args_t karg;
-	int rbytes;
-
 	int err;
 
-
 	if((err = copy_from_user(&karg, arg, sizeof(read_args_t)))<0){
 		curthr->kt_errno = -err;
 		return -1;
 	}
-	karg.buf = page_alloc();
-	if((err = do_read(karg.fd, karg.buf, karg.nbytes))<0){
-		curthr->kt_errno = -err;
-		return -1;
-	}
-	rbytes = err;
-	if((err = copy_to_user(arg->buf, karg.buf, rbytes))<0){
+	if((err = do_read_user(karg.fd, karg.buf, karg.nbytes))<0){
 		curthr->kt_errno = -err;
 		return -1;
 	}
-	page_free(karg.buf);
-
-	return rbytes;
+	return err;
 }
 
 /*
@@ -88,31 +79,17 @@ static int
 sys_write(write_args_t *arg)
 {
 	write_args_t karg;
-	int err,rbytes;
-
+	int err;
 
 	if((err = copy_from_user(&karg, arg, sizeof(write_args_t)))<0){
 		curthr->kt_errno = -err;
 		return -1;
 	}
-	
-	karg.buf = page_alloc();
-
-	if((err = copy_from_user(karg.buf, arg->buf, karg.nbytes))<0){
+	if((err = do_write_user(karg.fd, karg.buf, karg.nbytes))<0){
 		curthr->kt_errno = -err;
 		return -1;
 	}
-	if((rbytes = do_write(karg.fd, karg.buf, karg.nbytes))<0){
-		curthr->kt_errno = -rbytes;
-		return -1;
-	}
-	/*if((err = copy_to_user(arg, &karg, sizeof(read_args_t)))<0){
-		curthr->kt_errno = -err;
-		return -1;
-	}*/
-	page_free(karg.buf);
-
-	return rbytes;
+	return err;
 }
 
 /*
@@ -494,6 +471,78 @@ static int sys_munmap(munmap_args_t *args)
         return 0;
 }
 
+static int sys_mprotect(mprotect_args_t *args)
+{
+        mprotect_args_t         kargs;
+        int                     err;
+
+        if (copy_from_user(&kargs, args, sizeof(mprotect_args_t))) {
+                curthr->kt_errno = EFAULT;
+                return -1;
+        }
+
+        err = do_mprotect(kargs.addr, kargs.len, kargs.prot);
+        if (err < 0) {
+                curthr->kt_errno = -err;
+                return -1;
+        }
+        return 0;
+}
+
+static int sys_msync(msync_args_t *args)
+{
+        msync_args_t            kargs;
+        int                     err;
+
+        if (copy_from_user(&kargs, args, sizeof(msync_args_t))) {
+                curthr->kt_errno = EFAULT;
+                return -1;
+        }
+
+        err = do_msync(kargs.addr, kargs.len, kargs.flags);
+        if (err < 0) {
+                curthr->kt_errno = -err;
+                return -1;
+        }
+        return 0;
+}
+
+static int sys_madvise(madvise_args_t *args)
+{
+        madvise_args_t          kargs;
+        int                     err;
+
+        if (copy_from_user(&kargs, args, sizeof(madvise_args_t))) {
+                curthr->kt_errno = EFAULT;
+                return -1;
+        }
+
+        err = do_madvise(kargs.addr, kargs.len, kargs.advice);
+        if (err < 0) {
+                curthr->kt_errno = -err;
+                return -1;
+        }
+        return 0;
+}
+
+static int sys_mlock(mlock_args_t *args, int lock)
+{
+        mlock_args_t            kargs;
+        int                     err;
+
+        if (copy_from_user(&kargs, args, sizeof(mlock_args_t))) {
+                curthr->kt_errno = EFAULT;
+                return -1;
+        }
+
+        err = do_mlock(kargs.addr, kargs.len, lock);
+        if (err < 0) {
+                curthr->kt_errno = -err;
+                return -1;
+        }
+        return 0;
+}
+
 static void *sys_mmap(mmap_args_t *arg)
 {
         mmap_args_t             kargs;
@@ -732,6 +781,81 @@ static int sys_kshell(int ttyid)
         return 0;
 }
 
+/* Whether a multicall may make the call sysnum: not the ones which don't
+ * return, or which need the registers the process trapped with */
+static int multicall_allowed(uint32_t sysnum)
+{
+        switch (sysnum) {
+                case SYS_exit:
+                case SYS_thr_exit:
+                case SYS_fork:
+                case SYS_execve:
+                case SYS_multicall:
+                        return 0;
+                default:
+                        return 1;
+        }
+}
+
+/*
+ * Makes the calls of a user array of multicall entries in order, in this
+ * one trap, and stores each one's return value and errno in its entry. If
+ * MC_STOP is set, stops after the first call which fails. errno itself is
+ * left alone, since each entry has its own.
+ *
+ * @return the number of calls made, or -1 if the arguments couldn't be
+ * read, or the first entry couldn't be
+ */
+static int sys_multicall(multicall_args_t *arg, regs_t *regs)
+{
+        multicall_args_t kern_args;
+        multicall_entry_t *umc;
+        uint32_t call[2];
+        int res[2];
+        int err = 0, i, saved_errno = curthr->kt_errno;
+
+        if ((err = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0) {
+                curthr->kt_errno = -err;
+                return -1;
+        }
+        if (kern_args.mca_ncalls < 0) {
+                curthr->kt_errno = EINVAL;
+                return -1;
+        }
+
+        for (i = 0; i < kern_args.mca_ncalls; ++i) {
+                umc = &kern_args.mca_calls[i];
+                /* mc_sysnum and mc_arg */
+                if ((err = copy_from_user(call, umc, sizeof(call))) < 0)
+                        break;
+
+                curthr->kt_errno = 0;
+                if (multicall_allowed(call[0])) {
+                        res[0] = syscall_dispatch(call[0], call[1], regs);
+                } else {
+                        res[0] = -1;
+                        curthr->kt_errno = EINVAL;
+                }
+                res[1] = (-1 == res[0]) ? curthr->kt_errno : 0;
+
+                /* mc_ret and mc_errno */
+                if ((err = copy_to_user(&umc->mc_ret, res, sizeof(res))) < 0)
+                        break;
+                if (curthr->kt_cancelled
+                    || ((kern_args.mca_flags & MC_STOP) && 0 != res[1])) {
+                        ++i;
+                        break;
+                }
+        }
+
+        if (0 == i && err < 0) {
+                curthr->kt_errno = -err;
+                return -1;
+        }
+        curthr->kt_errno = saved_errno;
+        return i;
+}
+
 /* Interrupt handler for syscalls */
 static void syscall_handler(regs_t *regs)
 {
@@ -767,124 +891,263 @@ static void syscall_handler(regs_t *regs)
         regs->r_eax = ret; /* Return value goes in eax */
 }
 
-static int syscall_dispatch(uint32_t sysnum, uint32_t args, regs_t *regs)
-{
-        switch (sysnum) {
-                case SYS_waitpid:
-                        return sys_waitpid((waitpid_args_t *)args);
-
-                case SYS_exit:
-                        do_exit((int)args);
-                        panic("exit failed!\n");
-                        return 0;
-
-                case SYS_thr_exit:
-                        kthread_exit((void *)args);
-                        panic("thr_exit failed!\n");
-                        return 0;
-
-                case SYS_thr_yield:
-                        sched_make_runnable(curthr);
-                        sched_switch();
-                        return 0;
-
-                case SYS_fork:
-                        return sys_fork(regs);
-
-                case SYS_getpid:
-                        return curproc->p_pid;
+/*
+ * The system call table. The entries are indexed by syscall number, except
+ * for the few debugging calls with big numbers, which go at the end (see
+ * SYSCALL_SLOT). Each entry calls its sys_* function through a wrapper
+ * taking the argument as it came in edx, together with the registers the
+ * process trapped with.
+ */
+typedef int (*syscall_func_t)(uint32_t args, regs_t *regs);
+
+typedef struct syscall_entry {
+        syscall_func_t  se_func;
+        const char     *se_name;
+        int             se_nargs;       /* of the call, not the trap */
+        int             se_flags;       /* SE_* */
+        syscall_stat_t  se_stat;
+} syscall_entry_t;
+
+#define SYSCALL_NLOW            (SYS_multicall + 1)
+#define SYSCALL_SLOT(num)       ((num) >= SYS_debug ? SYSCALL_NLOW + (num) - SYS_debug : (num))
+#define SYSCALL_NSLOTS          SYSCALL_SLOT(SYS_kshell + 1)
+
+/* Wrapper for a sys_* function which takes its argument as type */
+#define SYSCALL_WRAP(name, type)                                        \
+        static int sc_##name(uint32_t args, regs_t *regs)               \
+        {                                                               \
+                return (int) sys_##name((type) args);                   \
+        }
 
-                case SYS_sync:
-                        sys_sync();
-                        return 0;
+#define SYSCALL(num, name, nargs, flags)                                \
+        [SYSCALL_SLOT(num)] = { sc_##name, #name, nargs, flags, { 0 } }
 
+SYSCALL_WRAP(waitpid, waitpid_args_t *)
 #ifdef __MOUNTING__
-                case SYS_mount:
-                        return sys_mount((mount_args_t *) args);
-
-                case SYS_umount:
-                        return sys_umount((argstr_t *) args);
+SYSCALL_WRAP(mount, mount_args_t *)
+SYSCALL_WRAP(umount, argstr_t *)
 #endif
+SYSCALL_WRAP(mmap, mmap_args_t *)
+SYSCALL_WRAP(munmap, munmap_args_t *)
+SYSCALL_WRAP(mprotect, mprotect_args_t *)
+SYSCALL_WRAP(msync, msync_args_t *)
+SYSCALL_WRAP(madvise, madvise_args_t *)
+SYSCALL_WRAP(open, open_args_t *)
+SYSCALL_WRAP(close, int)
+SYSCALL_WRAP(read, read_args_t *)
+SYSCALL_WRAP(write, write_args_t *)
+SYSCALL_WRAP(dup, int)
+SYSCALL_WRAP(dup2, dup2_args_t *)
+SYSCALL_WRAP(mkdir, mkdir_args_t *)
+SYSCALL_WRAP(rmdir, argstr_t *)
+SYSCALL_WRAP(unlink, argstr_t *)
+SYSCALL_WRAP(link, link_args_t *)
+SYSCALL_WRAP(rename, rename_args_t *)
+SYSCALL_WRAP(chdir, argstr_t *)
+SYSCALL_WRAP(getdents, getdents_args_t *)
+SYSCALL_WRAP(brk, void *)
+SYSCALL_WRAP(lseek, lseek_args_t *)
+SYSCALL_WRAP(stat, stat_args_t *)
+SYSCALL_WRAP(uname, struct utsname *)
+SYSCALL_WRAP(debug, argstr_t *)
+SYSCALL_WRAP(kshell, int)
+
+static int sc_exit(uint32_t args, regs_t *regs)
+{
+        do_exit((int)args);
+        panic("exit failed!\n");
+        return 0;
+}
 
-                case SYS_mmap:
-                        return (int) sys_mmap((mmap_args_t *) args);
-
-                case SYS_munmap:
-                        return sys_munmap((munmap_args_t *) args);
-
-                case SYS_open:
-                        return sys_open((open_args_t *) args);
-
-                case SYS_close:
-                        return sys_close((int)args);
-
-                case SYS_read:
-                        return sys_read((read_args_t *)args);
-
-                case SYS_write:
-                        return sys_write((write_args_t *)args);
-
-                case SYS_dup:
-                        return sys_dup((int)args);
-
-                case SYS_dup2:
-                        return sys_dup2((dup2_args_t *)args);
-
-                case SYS_mkdir:
-                        return sys_mkdir((mkdir_args_t *)args);
+static int sc_thr_exit(uint32_t args, regs_t *regs)
+{
+        kthread_exit((void *)args);
+        panic("thr_exit failed!\n");
+        return 0;
+}
 
-                case SYS_rmdir:
-                        return sys_rmdir((argstr_t *)args);
+static int sc_thr_yield(uint32_t args, regs_t *regs)
+{
+        sched_make_runnable(curthr);
+        sched_switch();
+        return 0;
+}
 
-                case SYS_unlink:
-                        return sys_unlink((argstr_t *)args);
+static int sc_fork(uint32_t args, regs_t *regs)
+{
+        return sys_fork(regs);
+}
 
-                case SYS_link:
-                        return sys_link((link_args_t *)args);
+static int sc_getpid(uint32_t args, regs_t *regs)
+{
+        return curproc->p_pid;
+}
 
-                case SYS_rename:
-                        return sys_rename((rename_args_t *)args);
+static int sc_sync(uint32_t args, regs_t *regs)
+{
+        sys_sync();
+        return 0;
+}
 
-                case SYS_chdir:
-                        return sys_chdir((argstr_t *)args);
+static int sc_mlock(uint32_t args, regs_t *regs)
+{
+        return sys_mlock((mlock_args_t *) args, 1);
+}
 
-                case SYS_getdents:
-                        return sys_getdents((getdents_args_t *)args);
+static int sc_munlock(uint32_t args, regs_t *regs)
+{
+        return sys_mlock((mlock_args_t *) args, 0);
+}
 
-                case SYS_brk:
-                        return (int) sys_brk((void *)args);
+static int sc_halt(uint32_t args, regs_t *regs)
+{
+        sys_halt();
+        return -1;
+}
 
-                case SYS_lseek:
-                        return sys_lseek((lseek_args_t *)args);
+static int sc_set_errno(uint32_t args, regs_t *regs)
+{
+        curthr->kt_errno = (int)args;
+        return 0;
+}
 
-                case SYS_halt:
-                        sys_halt();
-                        return -1;
+static int sc_errno(uint32_t args, regs_t *regs)
+{
+        return curthr->kt_errno;
+}
 
-                case SYS_set_errno:
-                        curthr->kt_errno = (int)args;
-                        return 0;
+static int sc_execve(uint32_t args, regs_t *regs)
+{
+        return sys_execve((execve_args_t *)args, regs);
+}
 
-                case SYS_errno:
-                        return curthr->kt_errno;
+static int sc_multicall(uint32_t args, regs_t *regs)
+{
+        return sys_multicall((multicall_args_t *)args, regs);
+}
 
-                case SYS_execve:
-                        return sys_execve((execve_args_t *)args, regs);
+uint32_t syscall_sysenter_calls;
+
+static syscall_entry_t syscall_table[SYSCALL_NSLOTS] = {
+        SYSCALL(SYS_exit,       exit,       1, 0),
+        SYSCALL(SYS_fork,       fork,       0, 0),
+        SYSCALL(SYS_read,       read,       3, SE_COPYIN),
+        SYSCALL(SYS_write,      write,      3, SE_COPYIN),
+        SYSCALL(SYS_open,       open,       3, SE_COPYIN),
+        SYSCALL(SYS_close,      close,      1, 0),
+        SYSCALL(SYS_waitpid,    waitpid,    3, SE_COPYIN),
+        SYSCALL(SYS_link,       link,       2, SE_COPYIN),
+        SYSCALL(SYS_unlink,     unlink,     1, SE_COPYIN),
+        SYSCALL(SYS_execve,     execve,     3, SE_COPYIN),
+        SYSCALL(SYS_chdir,      chdir,      1, SE_COPYIN),
+        SYSCALL(SYS_lseek,      lseek,      3, SE_COPYIN),
+        SYSCALL(SYS_sync,       sync,       0, 0),
+        SYSCALL(SYS_dup,        dup,        1, 0),
+        SYSCALL(SYS_rmdir,      rmdir,      1, SE_COPYIN),
+        SYSCALL(SYS_mkdir,      mkdir,      2, SE_COPYIN),
+        SYSCALL(SYS_getdents,   getdents,   3, SE_COPYIN),
+        SYSCALL(SYS_mmap,       mmap,       6, SE_COPYIN),
+        SYSCALL(SYS_mprotect,   mprotect,   3, SE_COPYIN),
+        SYSCALL(SYS_munmap,     munmap,     2, SE_COPYIN),
+        SYSCALL(SYS_rename,     rename,     2, SE_COPYIN),
+        SYSCALL(SYS_uname,      uname,      1, 0),
+        SYSCALL(SYS_thr_exit,   thr_exit,   1, 0),
+        SYSCALL(SYS_thr_yield,  thr_yield,  0, 0),
+        SYSCALL(SYS_getpid,     getpid,     0, 0),
+        SYSCALL(SYS_errno,      errno,      0, 0),
+        SYSCALL(SYS_halt,       halt,       0, 0),
+        SYSCALL(SYS_set_errno,  set_errno,  1, 0),
+        SYSCALL(SYS_dup2,       dup2,       2, SE_COPYIN),
+        SYSCALL(SYS_brk,        brk,        1, 0),
+#ifdef __MOUNTING__
+        SYSCALL(SYS_mount,      mount,      3, SE_COPYIN),
+        SYSCALL(SYS_umount,     umount,     1, SE_COPYIN),
+#endif
+        SYSCALL(SYS_stat,       stat,       2, SE_COPYIN),
+        SYSCALL(SYS_msync,      msync,      3, SE_COPYIN),
+        SYSCALL(SYS_madvise,    madvise,    3, SE_COPYIN),
+        SYSCALL(SYS_mlock,      mlock,      2, SE_COPYIN),
+        SYSCALL(SYS_munlock,    munlock,    2, SE_COPYIN),
+        SYSCALL(SYS_multicall,  multicall,  3, SE_COPYIN),
+        SYSCALL(SYS_debug,      debug,      1, SE_COPYIN),
+        SYSCALL(SYS_kshell,     kshell,     1, 0),
+};
+
+/* The table entry for sysnum, or NULL if there is no such call */
+static syscall_entry_t *syscall_lookup(uint32_t sysnum)
+{
+        uint32_t slot;
+
+        if (sysnum < SYSCALL_NLOW)
+                slot = sysnum;
+        else if (sysnum >= SYS_debug && sysnum <= SYS_kshell)
+                slot = SYSCALL_SLOT(sysnum);
+        else
+                return NULL;
+        return (NULL == syscall_table[slot].se_func) ? NULL : &syscall_table[slot];
+}
 
-                case SYS_stat:
-                        return sys_stat((stat_args_t *)args);
+static int syscall_dispatch(uint32_t sysnum, uint32_t args, regs_t *regs)
+{
+        syscall_entry_t *se;
+        syscall_stat_t *ss;
+        uint64_t start, cycles64;
+        uint32_t cycles;
+        int ret, bucket;
+
+        if (NULL == (se = syscall_lookup(sysnum))) {
+                dbg(DBG_ERROR, "ERROR: unknown system call: %d (args: %#08x)\n", sysnum, args);
+                curthr->kt_errno = ENOSYS;
+                return -1;
+        }
 
-                case SYS_uname:
-                        return sys_uname((struct utsname *)args);
+        start = time_rdtsc();
+        ret = se->se_func(args, regs);
+        cycles64 = time_rdtsc() - start;
+        cycles = (cycles64 > UINT_MAX) ? UINT_MAX : (uint32_t)cycles64;
+
+        ss = &se->se_stat;
+        ss->ss_count++;
+        if (-1 == ret)
+                ss->ss_errors++;
+        ss->ss_cycles += cycles;
+        if (cycles > ss->ss_max)
+                ss->ss_max = cycles;
+        if ((bucket = bit_log2(cycles)) >= SYSSTAT_BUCKETS)
+                bucket = SYSSTAT_BUCKETS - 1;
+        ss->ss_hist[bucket]++;
+        return ret;
+}
 
-                case SYS_debug:
-                        return sys_debug((argstr_t *)args);
-                case SYS_kshell:
-                        return sys_kshell((int)args);
-                default:
-                        dbg(DBG_ERROR, "ERROR: unknown system call: %d (args: %#08x)\n", sysnum, args);
-                        curthr->kt_errno = ENOSYS;
-                        return -1;
+/*
+ * Copies what the table says about the i'th system call in it, and its
+ * statistics, into si and ss.
+ *
+ * @return 0 on success, -1 if there are no more than i calls
+ */
+int syscall_stat_get(int i, syscall_info_t *si, syscall_stat_t *ss)
+{
+        uint32_t slot;
+
+        for (slot = 0; slot < SYSCALL_NSLOTS; ++slot) {
+                if (NULL == syscall_table[slot].se_func || 0 != i--)
+                        continue;
+                si->si_sysnum = (slot < SYSCALL_NLOW) ? slot
+                                : slot - SYSCALL_NLOW + SYS_debug;
+                si->si_name = syscall_table[slot].se_name;
+                si->si_nargs = syscall_table[slot].se_nargs;
+                si->si_flags = syscall_table[slot].se_flags;
+                *ss = syscall_table[slot].se_stat;
+                return 0;
         }
+        return -1;
 }
 
+void syscall_stat_reset(void)
+{
+        uint32_t slot;
+
+        for (slot = 0; slot < SYSCALL_NSLOTS; ++slot)
+                memset(&syscall_table[slot].se_stat, 0, sizeof(syscall_stat_t));
+        syscall_sysenter_calls = 0;
+}
@@ -30,13 +30,12 @@ install_page_table:
 		dec		%ecx         /* decrement our counter */
 		jnz		1b           /* if counter reaches 0 we are done */
 
-/* map 1mb of memory for the kernel text, starting
- * with the mapping 0xc0000000 => KERNEL_PHYS_BASE */
+/* map the first 4mb of memory, which holds the kernel
+ * text, starting with the mapping KERNEL_VIRT_BASE => 0x0 */
 		mov		$PAGE_DIRECTORY_BASE, %edi
 		add		$0x2000, %edi /* calculate the location of the page table */
 		mov		$0x400, %ecx /* we will fill this many entries (whole table) */
-		mov		$KERNEL_PHYS_BASE, %eax
-		xor		$0x103, %eax /* start by mapping 0xc0000000 => KERNEL_PHYS_BASE, the flags are
+		mov		$0x103, %eax /* start by mapping KERNEL_VIRT_BASE => 0x0, the flags are
 								   priviledged only, global, and present */
 1:		
 		mov		%eax, (%edi) /* store the pte */
@@ -55,9 +54,9 @@ install_page_table:
 		mov		%eax, (%edi)
 
 		add		$0x1000, %eax /* calculate the location of the second page table */
-		mov		$kernel_start, %ecx
-		shr		$20, %ecx
-		mov		%eax, (%ecx, %edi, 1)
+		mov		$KERNEL_VIRT_BASE, %ecx
+		shr		$22, %ecx /* the index of its entry */
+		mov		%eax, (%edi, %ecx, 4)
 
 		mov		$PAGE_DIRECTORY_BASE, %eax
 		mov		%eax, %cr3
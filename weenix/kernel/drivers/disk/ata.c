@@ -351,8 +351,17 @@ ata_intr_wrapper(regs_t *regs)
 static int
 ata_read(blockdev_t *bdev, char *data, blocknum_t blocknum, unsigned int count)
 {
-        NOT_YET_IMPLEMENTED("DRIVERS: ata_read");
-        return -1;
+        ata_disk_t *adisk = bd_to_ata(bdev);
+        unsigned int i;
+        int ret;
+
+        for (i = 0; i < count; i++) {
+                ret = ata_do_operation(adisk, data + i * BLOCK_SIZE,
+                                       blocknum + i, ATA_READ);
+                if (ret < 0)
+                        return ret;
+        }
+        return 0;
 }
 
 /**
@@ -368,8 +377,17 @@ ata_read(blockdev_t *bdev, char *data, blocknum_t blocknum, unsigned int count)
 static int
 ata_write(blockdev_t *bdev, const char *data, blocknum_t blocknum, unsigned int count)
 {
-        NOT_YET_IMPLEMENTED("DRIVERS: ata_write");
-        return -1;
+        ata_disk_t *adisk = bd_to_ata(bdev);
+        unsigned int i;
+        int ret;
+
+        for (i = 0; i < count; i++) {
+                ret = ata_do_operation(adisk, (char *)data + i * BLOCK_SIZE,
+                                       blocknum + i, ATA_WRITE);
+                if (ret < 0)
+                        return ret;
+        }
+        return 0;
 }
 
 /**
@@ -463,9 +481,41 @@ ata_write(blockdev_t *bdev, const char *data, blocknum_t blocknum, unsigned int
 static int
 ata_do_operation(ata_disk_t *adisk, char *data, blocknum_t blocknum, int write)
 {
+        uint8_t channel = adisk->ata_channel;
+        uint32_t sector = blocknum * adisk->ata_sectors_per_block;
+        uint8_t oldipl, status;
+        int ret = 0;
+
+        KASSERT(sector + adisk->ata_sectors_per_block <= adisk->ata_size);
+
+        kmutex_lock(&adisk->ata_mutex);
+        oldipl = intr_getipl();
+        intr_setipl(INTR_DISK_SECONDARY);
+
+        dma_load(channel, data, BLOCK_SIZE, write);
+
+        ata_outb_reg(channel, ATA_REG_SECCOUNT0, adisk->ata_sectors_per_block);
+        ata_outb_reg(channel, ATA_REG_LBA0, sector & 0xff);
+        ata_outb_reg(channel, ATA_REG_LBA1, (sector >> 8) & 0xff);
+        ata_outb_reg(channel, ATA_REG_LBA2, (sector >> 16) & 0xff);
+        ata_outb_reg(channel, ATA_REG_COMMAND,
+                     (write ? ATA_CMD_WRITE_DMA : ATA_CMD_READ_DMA));
+        ata_pause(channel);
+
+        dma_start(channel);
+        sched_sleep_on(&adisk->ata_waitq);
+
+        status = ata_inb_reg(channel, ATA_REG_STATUS);
+        if (status & ATA_SR_ERR) {
+                ret = -ata_inb_reg(channel, ATA_REG_ERROR);
+                dbg(DBG_DISK, "ATA %s of block %d failed: %d\n",
+                    (write ? "write" : "read"), blocknum, ret);
+        }
+        dma_reset(channel);
 
-        NOT_YET_IMPLEMENTED("DRIVERS: ata_do_operation");
-        return -1;
+        intr_setipl(oldipl);
+        kmutex_unlock(&adisk->ata_mutex);
+        return ret;
 }
 
 /**
@@ -479,6 +529,8 @@ ata_do_operation(ata_disk_t *adisk, char *data, blocknum_t blocknum, int write)
 static void
 ata_intr(regs_t *regs, void *arg)
 {
-        NOT_YET_IMPLEMENTED("DRIVERS: ata_intr");
+        ata_disk_t *adisk = (ata_disk_t *)arg;
+
+        sched_wakeup_on(&adisk->ata_waitq);
 }
 
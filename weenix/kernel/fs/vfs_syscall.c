@@ -17,6 +17,9 @@
 #include "fs/fcntl.h"
 #include "fs/lseek.h"
 #include "mm/kmalloc.h"
+#include "mm/pframe.h"
+#include "mm/page.h"
+#include "api/access.h"
 #include "util/string.h"
 #include "util/printf.h"
 #include "fs/stat.h"
@@ -127,9 +130,241 @@ do_write(int fd, const void *buf, size_t nbytes)
 
         fput(ft);
 		TEST_DBG("DO_WRTIE_OUT\n");
+
+        /* we may have just dirtied a lot of pages, throttle the writer if
+         * there are too many of them */
+        if (nb > 0)
+                pframe_balance_dirty();
         return nb;        
 }
 
+/*
+ * Whether the contents of vn are kept in the pages of its own mmobj (its
+ * file system reads and writes them through fillpage and cleanpage), so
+ * that reading and overwriting it can go straight to the page cache.
+ * Special files and ramfs files keep their data elsewhere.
+ */
+static int
+vnode_is_cached(vnode_t *vn)
+{
+        return S_ISREG(vn->vn_mode) && NULL != vn->vn_ops->fillpage;
+}
+
+/*
+ * Copies up to nbytes of vn from offset on straight from its pages to
+ * user memory, reading in the ones which aren't resident. Each page is
+ * pinned while it is copied, since copy_to_user may block to fault in the
+ * user buffer. Like the file system's read, this holds the vnode's mutex,
+ * so that it sees a write either entirely or not at all.
+ *
+ * @return the number of bytes copied, or -errno if there were none
+ */
+static int
+read_cached(vnode_t *vn, off_t offset, char *ubuf, size_t nbytes)
+{
+        size_t done = 0;
+        pframe_t *pf;
+        int err = 0;
+
+        kmutex_lock(&vn->vn_mutex);
+        if (offset >= vn->vn_len)
+                nbytes = 0;
+        else
+                nbytes = MIN(nbytes, (size_t)(vn->vn_len - offset));
+        while (done < nbytes) {
+                off_t pos = offset + done;
+                size_t off = PAGE_OFFSET(pos);
+                size_t n = MIN(nbytes - done, PAGE_SIZE - off);
+
+                if ((err = pframe_get(&vn->vn_mmobj, ADDR_TO_PN(pos), &pf)) < 0)
+                        break;
+                pframe_pin(pf);
+                err = copy_to_user(ubuf + done, (char *)pf->pf_addr + off, n);
+                pframe_unpin(pf);
+                if (err < 0)
+                        break;
+                done += n;
+        }
+        kmutex_unlock(&vn->vn_mutex);
+        return (done > 0) ? (int)done : err;
+}
+
+/*
+ * Overwrites up to nbytes of vn from offset on, but not past its end,
+ * straight from user memory into its pages. The pages are dirtied first,
+ * as the file system's write would, which allocates blocks for holes. The
+ * vnode's mutex is held throughout, as it is by the file system's write,
+ * so that the end of the file can't move and writes don't interleave.
+ *
+ * @return the number of bytes copied, or -errno if there were none
+ */
+static int
+write_cached(vnode_t *vn, off_t offset, const char *ubuf, size_t nbytes)
+{
+        size_t done = 0;
+        pframe_t *pf;
+        int err = 0;
+
+        kmutex_lock(&vn->vn_mutex);
+        if (offset >= vn->vn_len)
+                nbytes = 0;
+        else
+                nbytes = MIN(nbytes, (size_t)(vn->vn_len - offset));
+        while (done < nbytes) {
+                off_t pos = offset + done;
+                size_t off = PAGE_OFFSET(pos);
+                size_t n = MIN(nbytes - done, PAGE_SIZE - off);
+
+                if ((err = pframe_get(&vn->vn_mmobj, ADDR_TO_PN(pos), &pf)) < 0)
+                        break;
+                pframe_pin(pf);
+                if (0 == (err = pframe_dirty(pf)))
+                        err = copy_from_user((char *)pf->pf_addr + off, ubuf + done, n);
+                pframe_unpin(pf);
+                if (err < 0)
+                        break;
+                done += n;
+        }
+        kmutex_unlock(&vn->vn_mutex);
+        return (done > 0) ? (int)done : err;
+}
+
+/*
+ * Reads vn through a page of kernel memory, a page at a time, for files
+ * which aren't cached. Only regular files are read past the first page: a
+ * device could block in a second read although the first returned data.
+ */
+static int
+read_bounced(vnode_t *vn, off_t offset, char *ubuf, size_t nbytes)
+{
+        size_t done = 0;
+        void *kbuf;
+        int nb = 0, err;
+
+        if (NULL == (kbuf = page_alloc()))
+                return -ENOMEM;
+        while (done < nbytes) {
+                size_t n = MIN(nbytes - done, PAGE_SIZE);
+
+                if ((nb = vn->vn_ops->read(vn, offset + done, kbuf, n)) <= 0)
+                        break;
+                if ((err = copy_to_user(ubuf + done, kbuf, nb)) < 0) {
+                        nb = err;
+                        break;
+                }
+                done += nb;
+                if (!S_ISREG(vn->vn_mode) || (size_t)nb < n)
+                        break;
+        }
+        page_free(kbuf);
+        return (done > 0) ? (int)done : nb;
+}
+
+/* Writes vn through a page of kernel memory, a page at a time */
+static int
+write_bounced(vnode_t *vn, off_t offset, const char *ubuf, size_t nbytes)
+{
+        size_t done = 0;
+        void *kbuf;
+        int nb = 0;
+
+        if (NULL == (kbuf = page_alloc()))
+                return -ENOMEM;
+        while (done < nbytes) {
+                size_t n = MIN(nbytes - done, PAGE_SIZE);
+
+                if ((nb = copy_from_user(kbuf, ubuf + done, n)) < 0)
+                        break;
+                if ((nb = vn->vn_ops->write(vn, offset + done, kbuf, n)) <= 0)
+                        break;
+                done += nb;
+                if ((size_t)nb < n)
+                        break;
+        }
+        page_free(kbuf);
+        return (done > 0) ? (int)done : nb;
+}
+
+/*
+ * do_read for a buffer in user memory, of any size: regular files whose
+ * pages are cached are copied straight from the page cache to the buffer,
+ * without going through kernel memory on the way. Other files are read
+ * through a bounce page. Used by sys_read.
+ */
+int
+do_read_user(int fd, void *ubuf, size_t nbytes)
+{
+        file_t *ft;
+        vnode_t *vn;
+        int nb;
+
+        if (-1 == fd || NULL == (ft = fget(fd)))
+                return -EBADF;
+        vn = ft->f_vnode;
+        if (!(ft->f_mode & FMODE_READ)) {
+                fput(ft);
+                return -EBADF;
+        }
+        if (S_ISDIR(vn->vn_mode)) {
+                fput(ft);
+                return -EISDIR;
+        }
+
+        if (vnode_is_cached(vn))
+                nb = read_cached(vn, ft->f_pos, ubuf, nbytes);
+        else
+                nb = read_bounced(vn, ft->f_pos, ubuf, nbytes);
+        if (nb > 0)
+                ft->f_pos += nb;
+        fput(ft);
+        return nb;
+}
+
+/*
+ * do_write for a buffer in user memory, of any size. The part of the
+ * write which overwrites a cached regular file goes straight from the
+ * buffer into the page cache. The rest, which extends the file (and so
+ * needs the file system to update its size), and writes to other files,
+ * go through a bounce page. Used by sys_write.
+ */
+int
+do_write_user(int fd, const void *ubuf, size_t nbytes)
+{
+        file_t *ft;
+        vnode_t *vn;
+        int nb = 0, more;
+        int cached;
+
+        if (-1 == fd || NULL == (ft = fget(fd)))
+                return -EBADF;
+        vn = ft->f_vnode;
+        if (!(ft->f_mode & FMODE_WRITE)) {
+                fput(ft);
+                return -EBADF;
+        }
+        if (ft->f_mode & FMODE_APPEND)
+                ft->f_pos = vn->vn_len;
+
+        if ((cached = vnode_is_cached(vn)))
+                nb = write_cached(vn, ft->f_pos, ubuf, nbytes);
+        if (nb >= 0 && (size_t)nb < nbytes
+            && (!cached || ft->f_pos + nb >= vn->vn_len)) {
+                more = write_bounced(vn, ft->f_pos + nb,
+                                     (const char *)ubuf + nb, nbytes - nb);
+                if (more > 0)
+                        nb += more;
+                else if (0 == nb)
+                        nb = more;
+        }
+        if (nb > 0)
+                ft->f_pos += nb;
+        fput(ft);
+
+        if (nb > 0)
+                pframe_balance_dirty();
+        return nb;
+}
+
 /*
  * Zero curproc->p_files[fd], and fput() the file. Return 0 on success
  *
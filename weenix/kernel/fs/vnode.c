@@ -17,6 +17,7 @@
 #include "proc/sched.h"
 #include "util/debug.h"
 #include "vm/vmmap.h"
+#include "vm/faulttrace.h"
 #include "globals.h"
 
 static slab_allocator_t *vnode_allocator;
@@ -390,6 +391,12 @@ clean:
         list_iterate_begin(&vnode_inuse_list, v, vnode_t, vn_link) {
                 list_iterate_begin(&v->vn_mmobj.mmo_respages,
                                    p, pframe_t, pf_olink) {
+                        /* a read-ahead fill by pframe_iod or a write-back by
+                         * flushd may still be in flight */
+                        if (pframe_is_busy(p)) {
+                                sched_sleep_on(&p->pf_waitq);
+                                goto clean;
+                        }
                         KASSERT(!pframe_is_dirty(p));
                         pframe_free(p);
                 } list_iterate_end();
@@ -569,6 +576,14 @@ special_file_cleanpage(vnode_t *file, off_t offset, void *pagebuf)
 #define mmobj_to_vnode(o) \
         (CONTAINER_OF((o), vnode_t, vn_mmobj))
 
+vnode_t *
+vnode_from_mmobj(mmobj_t *o)
+{
+        if (&vnode_mmobj_ops != o->mmo_ops)
+                return NULL;
+        return mmobj_to_vnode(o);
+}
+
 static void
 vo_vref(mmobj_t *o)
 {
@@ -603,7 +618,11 @@ vreadpage(mmobj_t *o, pframe_t *pf)
         KASSERT(NULL != o);
 
         vnode_t *v = mmobj_to_vnode(o);
-        return v->vn_ops->fillpage(v, (int)PN_TO_ADDR(pf->pf_pagenum), pf->pf_addr);
+        uint64_t start = fault_trace_fill_begin();
+        int ret = v->vn_ops->fillpage(v, (int)PN_TO_ADDR(pf->pf_pagenum), pf->pf_addr);
+
+        fault_trace_fill_end(FT_MAJOR, start);
+        return ret;
 }
 
 static int
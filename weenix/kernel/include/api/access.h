@@ -9,6 +9,8 @@ struct argvec;
 int copy_from_user(void *kaddr, const void *uaddr, size_t nbytes);
 int copy_to_user(void *uaddr, const void *kaddr, size_t nbytes);
 
+uintptr_t user_access_fixup(uintptr_t eip);
+
 char *user_strdup(struct argstr *ustr);
 char **user_vecdup(struct argvec *uvec);
 
@@ -36,7 +36,7 @@
 #define SYS_mkdir               22
 #define SYS_getdents            23
 #define SYS_mmap                24
-#define SYS_mprotect            25 /* NYI */
+#define SYS_mprotect            25
 #define SYS_munmap              26
 #define SYS_rename              27 /* NYI */
 #define SYS_uname               28
@@ -56,6 +56,11 @@
 #define SYS_mount               45
 #define SYS_umount              46
 #define SYS_stat                47
+#define SYS_msync               48
+#define SYS_madvise             49
+#define SYS_mlock               50
+#define SYS_munlock             51
+#define SYS_multicall           52
 
 /*
  * ... what does the scouter say about his syscall?
@@ -98,6 +103,29 @@ typedef struct munmap_args {
         size_t  len;
 } munmap_args_t;
 
+typedef struct mprotect_args {
+        void   *addr;
+        size_t  len;
+        int     prot;
+} mprotect_args_t;
+
+typedef struct msync_args {
+        void   *addr;
+        size_t  len;
+        int     flags;
+} msync_args_t;
+
+typedef struct madvise_args {
+        void   *addr;
+        size_t  len;
+        int     advice;
+} madvise_args_t;
+
+typedef struct mlock_args {
+        void   *addr;
+        size_t  len;
+} mlock_args_t;
+
 typedef struct open_args {
         argstr_t filename;
         int      flags;
@@ -168,3 +196,36 @@ typedef struct stat_args {
 } stat_args_t;
 
 struct utsname;
+
+/*
+ * One call of a multicall: mc_sysnum and mc_arg are what the call would
+ * trap with (in eax and edx), and the kernel fills in what it returned
+ * and, if that was -1 for an error, errno. mc_args is room for the call's
+ * arguments, for mc_arg to point to, so that a batch is one array.
+ */
+typedef struct multicall_entry {
+        uint32_t        mc_sysnum;
+        uint32_t        mc_arg;
+        int             mc_ret;
+        int             mc_errno;
+        union {
+                open_args_t     open;
+                read_args_t     read;
+                write_args_t    write;
+                lseek_args_t    lseek;
+                getdents_args_t getdents;
+                dup2_args_t     dup2;
+                stat_args_t     stat;
+                mmap_args_t     mmap;
+                munmap_args_t   munmap;
+        } mc_args;
+} multicall_entry_t;
+
+/* multicall flags */
+#define MC_STOP         0x1     /* stop after the first call which fails */
+
+typedef struct multicall_args {
+        multicall_entry_t *mca_calls;
+        int                mca_ncalls;
+        int                mca_flags;
+} multicall_args_t;
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "types.h"
+
+/*
+ * System call statistics. syscall_dispatch looks calls up in a table
+ * indexed by syscall number, and counts every call made through it
+ * (including those made by a multicall), the ones which failed (returned
+ * -1), and how long they took in cycles of the time stamp counter, as a
+ * histogram by powers of two. Blocking counts: a read of a tty takes as
+ * long as the user takes to type. See the kshell sysstat command.
+ */
+
+#define SYSSTAT_BUCKETS 32
+
+/* the call's argument (in edx) points to a struct it copies in */
+#define SE_COPYIN       0x1
+
+typedef struct syscall_stat {
+        uint32_t        ss_count;
+        uint32_t        ss_errors;
+        uint64_t        ss_cycles;
+        uint32_t        ss_max;
+        uint32_t        ss_hist[SYSSTAT_BUCKETS];       /* 2^i <= cycles < 2^(i+1) */
+} syscall_stat_t;
+
+/* What the table says about a system call */
+typedef struct syscall_info {
+        uint32_t        si_sysnum;
+        const char     *si_name;
+        int             si_nargs;
+        int             si_flags;
+} syscall_info_t;
+
+/* calls which came in through sysenter rather than int $INTR_SYSCALL */
+extern uint32_t syscall_sysenter_calls;
+
+int syscall_stat_get(int i, syscall_info_t *si, syscall_stat_t *ss);
+void syscall_stat_reset(void);
@@ -1,4 +1,7 @@
 #pragma once
 
 #define KERNEL_PHYS_BASE 0x100000
+/* physical memory is mapped at KERNEL_VIRT_BASE + paddr, the kernel is
+ * linked to run at KERNEL_VIRT_BASE + KERNEL_PHYS_BASE (see link.ld) */
+#define KERNEL_VIRT_BASE 0xc0000000
 #define MEMORY_MAP_BASE 0x9000
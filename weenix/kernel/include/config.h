@@ -26,9 +26,29 @@
 
 /*     pframe/mmobj-system-related: */
 #define PF_HASH_SIZE                  17 /* Number of buckets in pn/mmobj->pframe hash */
-/*         Pageout-related: */
-#define PAGEOUTD_FREE_TARGET_SHIFT     5 /* 3.125% */
-#define PAGEOUTD_FREE_MIN_SHIFT        4 /* 6.25% */
+#define PF_PHYS_HASH_SIZE            509 /* Number of buckets in physical address->pframe hash */
+/*         Pageout-related: free page watermarks, as a fraction of the page
+ *         frames free when the pframe system is initialized */
+#define PAGEOUTD_FREE_MIN_SHIFT        5 /* 3.125%, allocators reclaim themselves below */
+#define PAGEOUTD_FREE_LOW_SHIFT        4 /* 6.25%, pageoutd is woken up below */
+#define PAGEOUTD_FREE_HIGH_SHIFT       3 /* 12.5%, pageoutd reclaims up to */
+#define PFRAME_DIRECT_RECLAIM_PAGES   32 /* max pages an allocator scans per direct reclaim */
+#define PFRAME_DIRECT_RECLAIM_TRIES    8 /* direct reclaim passes before an allocation fails */
+/*         Write-back-related (defaults, tunable at runtime): */
+#define PFRAME_DIRTY_EXPIRE          300 /* ticks a page may stay dirty before flushd writes it */
+#define PFRAME_FLUSH_INTERVAL         50 /* ticks between flushd runs */
+#define PFRAME_DIRTY_BACKGROUND_RATIO 10 /* % of allocated pages dirty before flushd ignores age */
+#define PFRAME_DIRTY_RATIO            20 /* % of allocated pages dirty before writers are throttled */
+#define PFRAME_THROTTLE_PAGES         16 /* pages a throttled writer writes back per call */
+/*         Swap-related: */
+#define SWAP_DISK_MINOR                1 /* minor number of the ATA disk used for swap */
+#define SWAP_NSLOTS                 4096 /* pages of swap space used on that disk */
+#define SWAP_HASH_SIZE              1021 /* Number of buckets in the mmobj/pn->swap slot hash */
+#define SWAP_CLUSTER                   8 /* slots read per swap-in, including read-ahead */
+/*         Page-fault-related (defaults, tunable at runtime): */
+#define VM_FAULTAROUND_PAGES          16 /* window of resident pages mapped on a read fault */
+#define SHADOW_COLLAPSE_MAX            4 /* shadow objects collapsed per page fault or fork */
+#define VM_MLOCK_LIMIT               256 /* pages a process may lock with mlock */
 
 
 /*
@@ -10,6 +10,8 @@
 int do_close(int fd);
 int do_read(int fd, void *buf, size_t nbytes);
 int do_write(int fd, const void *buf, size_t nbytes);
+int do_read_user(int fd, void *ubuf, size_t nbytes);
+int do_write_user(int fd, const void *ubuf, size_t nbytes);
 int do_dup(int fd);
 int do_dup2(int ofd, int nfd);
 int do_mknod(const char *path, int mode, unsigned devid);
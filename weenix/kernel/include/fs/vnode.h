@@ -324,6 +324,12 @@ void vref(vnode_t *vn);
  */
 void vput(vnode_t *vn);
 
+/*
+ *     Returns the vnode whose mmobj is o, or NULL if o does not belong to
+ *     a vnode.
+ */
+vnode_t *vnode_from_mmobj(struct mmobj *o);
+
 
 /* Auxilliary: */
 
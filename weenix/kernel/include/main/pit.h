@@ -3,6 +3,6 @@
 #include "types.h"
 
 /* Starts the Programmable Interval Timer (PIT)
- * delivering periodic interrupts at 1000 Hz
- * (i.e., one every millisecond) to the given interrupt. */
+ * delivering periodic interrupts every TICK_MSECS
+ * milliseconds (see config.h) to the given interrupt. */
 void pit_starttimer(uint8_t intr);
@@ -20,15 +20,18 @@ void page_init();
  * replaces the temporary page table set up by the boot loader with
  * the page directory and first 2 page tables of the permenant page
  * table mappings for the kernel. One page table identity maps the
- * first 1mb of physical memory. The other maps the 4mb of physical
- * memory starting with the kernel text at 0xc0000000. */
+ * first 1mb of physical memory. The other maps the first 4mb of
+ * physical memory, which hold the kernel text, at KERNEL_VIRT_BASE.
+ * The rest of physical memory is mapped after that, with 4mb pages
+ * if the processor supports them. */
 void pt_init();
 
 /* Called from the bootstrap context in order to set up the template
  * page directory used by all future threads. This cannot be set up
  * prior to this because the stack is mapped in to the first 4mb
  * of memory. Page faults are not handled until this function is
- * called. */
+ * called. It creates the slab allocator for page directories, so
+ * slab_init must have been called already. */
 void pt_template_init();
 
 /* Initializes the slab allocator subsystem. This should be done
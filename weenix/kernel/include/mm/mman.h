@@ -23,3 +23,19 @@
 */
 #define MAP_FIXED       4
 #define MAP_ANON        8
+#define MAP_POPULATE    16    /* Fault in the whole mapping right away. */
+
+/* msync flags.
+*/
+#define MS_ASYNC        1     /* Schedule the write-back, don't wait. */
+#define MS_INVALIDATE   2     /* Invalidate cached copies (nothing to do). */
+#define MS_SYNC         4     /* Write back and wait for it. */
+
+/* madvise advice.
+*/
+#define MADV_NORMAL     0     /* No special treatment. */
+#define MADV_RANDOM     1     /* Expect random references, don't read around. */
+#define MADV_SEQUENTIAL 2     /* Expect sequential references, read ahead. */
+#define MADV_WILLNEED   3     /* Start reading the pages in. */
+#define MADV_DONTNEED   4     /* Drop the pages. */
+#define MADV_FREE       8     /* The pages may be dropped unless written again. */
@@ -20,7 +20,9 @@
 
 #define PAGE_ALIGNED(x) (0 == ((uintptr_t)(x)) % PAGE_SIZE)
 
-#define PAGE_NSIZES  8
+/* Blocks of up to 2^(PAGE_NSIZES - 1) pages, i.e. 4mb, can be allocated.
+ * Blocks are always aligned to their size. */
+#define PAGE_NSIZES  11
 
 #define PAGE_SAME(addr1, addr2) (PAGE_ALIGN_DOWN(addr1) == PAGE_ALIGN_DOWN(addr2))
 
@@ -6,6 +6,7 @@
 #define PD_WRITE_THROUGH  0x008
 #define PD_CACHE_DISABLED 0x010
 #define PD_ACCESSED       0x020
+#define PD_SIZE           0x080 /* maps a 4mb page rather than a page table */
 
 #define PT_PRESENT        0x001
 #define PT_WRITE          0x002
@@ -20,8 +21,14 @@
 typedef uint32_t pte_t;
 typedef uint32_t pde_t;
 
+/* The number of pages in a 4mb page, and in the part of the address space
+ * covered by one page table */
+#define PT_LARGE_PAGES    1024
+
 typedef struct pagedir pagedir_t;
 
+struct tlb_gather;
+
 /* Temporarily maps one page at the given physical address in at a
  * virtual address and returns that virtual address. Note that repeated
  * calls to this function will return the same virtual address, thereby
@@ -46,21 +53,83 @@ uintptr_t pt_virt_to_phys(uintptr_t vaddr);
  * given page directory. Creates a new page table if necessary and
  * places an entry in it in the page directory. vaddr must be in the
  * user address space. Both vaddr and paddr must be page aligned.
- * Note that the TLB is not flushed by this function. */
+ * If paddr is a page frame, the mapping is recorded in its reverse map
+ * (see pframe_rmap_add); -ENOMEM is returned if there is no memory to
+ * do so or to create the page table. Note that the TLB is not flushed
+ * by this function. */
 int pt_map(pagedir_t *pd, uintptr_t vaddr, uintptr_t paddr, uint32_t pdflags, uint32_t ptflags);
 
+/* Returns nonzero if the processor supports 4mb pages and nothing is
+ * mapped (and there is no page table) in the 4mb of user address space
+ * around vaddr in the given page directory. */
+int pt_can_map_large(pagedir_t *pd, uintptr_t vaddr);
+
+/* Maps the 4mb of physical memory at paddr, which must be page frames of
+ * the page frame code, as one 4mb page at vaddr. Both must be aligned to
+ * 4mb, and pt_can_map_large must allow it. Every page is recorded in its
+ * reverse map, as if pt_map had mapped it with the same flags. Returns 0
+ * on success, -ENOMEM if the reverse mappings couldn't be allocated or
+ * -EEXIST if something is mapped there already. The TLB is not flushed.
+ *
+ * The functions below which change single pages (pt_map, pt_unmap and
+ * the range functions when they don't cover all of it) first split a 4mb
+ * page into a page table which maps the same pages, or if they can't
+ * allocate one, unmap it entirely. pt_map leaves a 4mb page alone if it
+ * maps paddr at vaddr already with at least ptflags. */
+int pt_map_large(pagedir_t *pd, uintptr_t vaddr, uintptr_t paddr, uint32_t pdflags);
+
+/* Returns the page table entry for the given virtual address in the
+ * given page directory, or 0 if there is no page table for it. vaddr
+ * must be in the user address space. */
+pte_t pt_lookup(pagedir_t *pd, uintptr_t vaddr);
+
+/* Clears the given page table entry flags (e.g. PT_ACCESSED) in the
+ * entry for vaddr in the given page directory and returns the entry as
+ * it was before, or 0 if there is no page table for it. vaddr must be in
+ * the user address space. The TLB is not flushed by this function.
+ *
+ * A 4mb page is never split by this: PT_ACCESSED and PT_WRITE are
+ * cleared for all of it, and PT_DIRTY stays set, because it may stand
+ * for writes to its other pages. */
+pte_t pt_clear_flags(pagedir_t *pd, uintptr_t vaddr, uint32_t ptflags);
+
 /* Unmaps the page for the given virtual page from the given page
  * directory. vaddr must be in the user address space. vaddr must
- * be page aligned. Note that the TLB is not flushed by this function. */
+ * be page aligned. A page table left with nothing mapped in it is
+ * freed. Note that the TLB is not flushed by this function (except
+ * for the directory entry of a freed page table). */
 void pt_unmap(pagedir_t *pd, uintptr_t vaddr);
 
 /* Unmaps the given range of addresses [low, high). As with pt_unmap,
- * the addresses must be page aligned in the user address space */
-void pt_unmap_range(pagedir_t *pd, uintptr_t vlow, uintptr_t vhigh);
+ * the addresses must be page aligned in the user address space, and
+ * page tables which end up empty are freed. The parts of the range
+ * which had page tables are added to tg, and the page tables are only
+ * freed by tlb_gather_finish (see mm/tlb.h). */
+void pt_unmap_range(pagedir_t *pd, uintptr_t vlow, uintptr_t vhigh, struct tlb_gather *tg);
+
+/* Clears the given page table entry flags (e.g. PT_WRITE) in all of
+ * the entries for the range of addresses [low, high) in the given page
+ * directory. As with pt_unmap_range, the addresses must be page aligned
+ * in the user address space, and the TLB is flushed by the
+ * tlb_gather_finish the range is added to. */
+void pt_protect_range(pagedir_t *pd, uintptr_t vlow, uintptr_t vhigh, uint32_t ptflags,
+                      struct tlb_gather *tg);
+
+/* Copies the present page table entries for the range of addresses
+ * [low, high) from src to dest, creating page tables in dest as
+ * necessary, so that dest maps the same pages with the same
+ * permissions. Entries which are not present in src are left alone in
+ * dest. Returns 0 on success or -ENOMEM if a page table couldn't be
+ * allocated, in which case only part of the range may have been copied. */
+int pt_copy_range(pagedir_t *dest, pagedir_t *src, uintptr_t vlow, uintptr_t vhigh);
 
 /* Creates a new page directory which is initialized to contain
  * mappings for all kernel memory. If there is not enough memory
- * to allocate the directory NULL is returned. Note that destroying
+ * to allocate the directory NULL is returned. The new directory uses
+ * the template's page directory page, which maps only kernel memory,
+ * until the first pt_map or pt_map_large on it copies the kernel's
+ * entries into a page of its own (which can fail with -ENOMEM), so a
+ * process which never maps user memory costs no page. Note that destroying
  * a page diretory does not affect the TLB, it is assumed that the
  * page directory being destroyed is not currently in use. Destroying
  * a page directory frees all page tables for user memory referenced
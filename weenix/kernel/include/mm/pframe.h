@@ -8,9 +8,13 @@
 #include "util/init.h"
 
 struct mmobj;
+struct pagedir;
 
 #define PF_BUSY                 0x01
 #define PF_DIRTY                0x02
+#define PF_MAPDIRTY             0x04    /* dirty only because a write fault
+                                         * mapped it writable, see
+                                         * pframe_dirty_mapped */
 
 #define pframe_is_busy(pf)          ((pf)->pf_flags & PF_BUSY)
 #define pframe_set_busy(pf)         do { (pf)->pf_flags |= PF_BUSY; } while (0)
@@ -44,8 +48,48 @@ typedef struct pframe {
         list_link_t         pf_link;     /* link on {free,allocated,pinned}_list */
         list_link_t         pf_hlink;    /* link on hash chain of resident page hash */
         list_link_t         pf_olink;    /* link on object's list of resident pages */
+        uint32_t            pf_dirtytime; /* tick at which the page was last dirtied */
+        uintptr_t           pf_paddr;    /* physical address of the page frame */
+        list_link_t         pf_plink;    /* link on hash chain of physical address hash */
+        list_t              pf_rmap;     /* page table entries mapping the page */
 } pframe_t;
 
+/* Page cache counters. pframe.c keeps a global set and one per object,
+ * the latter only for as long as the object has resident pages. */
+typedef struct pframe_stats {
+        uint32_t            ps_hits;      /* pframe_get found the page resident */
+        uint32_t            ps_misses;    /* pframe_get had to allocate the page */
+        uint32_t            ps_fills;     /* pages filled by the object */
+        uint32_t            ps_evictions; /* pages reclaimed by pageoutd */
+        uint32_t            ps_dirty_wb;  /* dirty pages written back */
+        uint32_t            ps_clean_evict; /* evictions which reclaim didn't have to write back first */
+        uint32_t            ps_busywaits; /* waits for a busy page */
+        uint32_t            ps_stalls;    /* allocations that had to reclaim directly */
+        uint32_t            ps_referenced; /* reclaim skipped pages which were accessed */
+        uint32_t            ps_unwritten; /* write-backs skipped, mapped writable but not written */
+        uint32_t            ps_lazyfree;  /* pages given up with MADV_FREE */
+} pframe_stats_t;
+
+/* Allocation stalls are recorded in a histogram of log2(TSC cycles) */
+#define PFRAME_STALL_BUCKETS 40
+
+void pframe_get_stats(pframe_stats_t *stats);
+void pframe_get_stall_hist(uint32_t *hist, uint64_t *max);
+void pframe_get_watermarks(uint32_t *min, uint32_t *low, uint32_t *high);
+int  pframe_top_objects(struct mmobj **objs, pframe_stats_t *stats, int max);
+
+/* Write-back tunables (see pframe.c), adjustable from the kshell */
+extern int pframe_dirty_expire;
+extern int pframe_flush_interval;
+extern int pframe_dirty_background_ratio;
+extern int pframe_dirty_ratio;
+
+/* Called by pframe_get_async when the requested page is resident and no
+ * longer busy (status 0, pf valid) or when filling it failed (status < 0,
+ * pf NULL). The callback runs in the context of the pframe I/O thread, or
+ * directly in the caller if the page was already resident. */
+typedef void (*pframe_async_func_t)(pframe_t *pf, int status, void *arg);
+
 void pframe_init(void);
 void pframe_add_range(uint32_t startpfn, uint32_t endpfn);
 void pframe_pageoutd_init(void);
@@ -55,16 +99,28 @@ void pframe_shutdown(void);
 pframe_t *pframe_get_resident(struct mmobj *o, uint32_t pagenum);
 
 int pframe_get(struct mmobj *o, uint32_t pagenum, pframe_t **result);
+int pframe_get_async(struct mmobj *o, uint32_t pagenum,
+                     pframe_async_func_t done, void *arg);
 int pframe_lookup(struct mmobj *o, uint32_t pagenum, int forwrite, pframe_t **result);
 void pframe_migrate(pframe_t *pf, mmobj_t *dest);
+int pframe_adopt_block(struct mmobj *o, uint32_t pagenum, uint32_t npages, void *addr);
 
 void pframe_pin(pframe_t *pf);
 void pframe_unpin(pframe_t *pf);
 
 int  pframe_dirty(pframe_t *pf);
+int  pframe_dirty_mapped(pframe_t *pf);
 int  pframe_clean(pframe_t *pf);
 void pframe_free(pframe_t *pf);
+void pframe_lazyfree(pframe_t *pf);
 
 void pframe_clean_all(void);
-
+int  pframe_flush(uint32_t minage, int maxpages);
+void pframe_balance_dirty(void);
+
+/* Reverse mappings, maintained by the page table code */
+pframe_t *pframe_from_paddr(uintptr_t paddr);
+int  pframe_rmap_add(uintptr_t paddr, struct pagedir *pd, uintptr_t vaddr);
+int  pframe_rmap_remove(uint32_t pte, struct pagedir *pd, uintptr_t vaddr);
+uint32_t pframe_clear_pte_flags(pframe_t *pf, uint32_t ptflags);
 void pframe_remove_from_pts(pframe_t *pf);
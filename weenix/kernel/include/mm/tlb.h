@@ -31,3 +31,49 @@ static inline void tlb_flush_all()
         __asm__ volatile("movl %%cr3, %0" : "=r"(pdir));
         __asm__ volatile("movl %0, %%cr3" :: "r"(pdir) : "memory");
 }
+
+struct pagedir;
+
+#define TLB_GATHER_RANGES 8
+#define TLB_GATHER_PAGES  16
+
+/*
+ * A TLB gather collects the ranges of user addresses whose page table
+ * entries were changed in one page directory (see pt_unmap_range and
+ * pt_protect_range), and the pages (page tables) which can't be freed
+ * until no TLB entry can refer to them any more, so that the TLB is
+ * flushed once for the whole operation:
+ *
+ *    tlb_gather_t tg;
+ *    tlb_gather_init(&tg, pd);
+ *    pt_unmap_range(pd, vlow, vhigh, &tg);
+ *    ...
+ *    tlb_gather_finish(&tg);
+ *
+ * tlb_gather_finish invalidates the gathered ranges page by page, or
+ * reloads cr3 if they add up to more than tlb_flush_threshold pages or
+ * there are too many of them to keep, and then frees the pages. If pd
+ * isn't the current page directory none of its entries are in the TLB
+ * and there is nothing to flush. Pages whose frames are freed because
+ * their mappings went away must likewise only be freed after the
+ * finish, so that no other address space can get a frame this one can
+ * still reach through the TLB.
+ */
+typedef struct tlb_gather {
+        struct pagedir *tg_pd;
+        uint32_t        tg_nranges;
+        uintptr_t       tg_start[TLB_GATHER_RANGES];
+        uintptr_t       tg_end[TLB_GATHER_RANGES];
+        uint32_t        tg_npages;      /* pages in the ranges */
+        int             tg_all;         /* the whole TLB has to go */
+        uint32_t        tg_nfree;
+        void           *tg_free[TLB_GATHER_PAGES];
+} tlb_gather_t;
+
+/* the most pages invalidated one by one instead of reloading cr3 */
+extern int tlb_flush_threshold;
+
+void tlb_gather_init(tlb_gather_t *tg, struct pagedir *pd);
+void tlb_gather_range(tlb_gather_t *tg, uintptr_t vlow, uintptr_t vhigh);
+void tlb_gather_page(tlb_gather_t *tg, void *page);
+void tlb_gather_finish(tlb_gather_t *tg);
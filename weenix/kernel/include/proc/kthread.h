@@ -29,6 +29,7 @@ typedef struct kthread {
         int             kt_detached;    /* if the thread has been detached */
         ktqueue_t       kt_joinq;       /* thread waiting to join with this thread */
 #endif
+        struct fault_trace *kt_fault;   /* the page fault being handled, if any */
 } kthread_t;
 
 /* thread states */
@@ -11,6 +11,17 @@ bit_flip(void *addr, uintptr_t bit)
         *map ^= (uint32_t)(1 << (bit & 0x1f));
 }
 
+/* Returns the index of the most significant bit set in val (0 for 0),
+ * i.e. floor(log2(val)). */
+static inline int
+bit_log2(uint64_t val)
+{
+        int log = 0;
+        while (val >>= 1)
+                log++;
+        return log;
+}
+
 static inline int
 bit_check(const void *addr, uintptr_t bit)
 {
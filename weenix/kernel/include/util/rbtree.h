@@ -0,0 +1,73 @@
+#pragma once
+
+#include "kernel.h"
+
+/*
+ * Generic intrusive red-black tree.
+ *
+ * rb_tree_t is the tree itself. rb_node_t should be included in
+ * structures which want to be in a tree. The tree doesn't know how its
+ * nodes are ordered: to insert a node, the caller walks down from
+ * rb_root comparing keys itself, and then hands the node to rb_insert
+ * together with its parent and the child pointer of the parent (or of the
+ * tree, for the root) it goes into:
+ *
+ *    rb_node_t **link = &tree->rb_root, *parent = NULL;
+ *    while (NULL != *link) {
+ *            parent = *link;
+ *            if (key < rb_item(parent, type, member)->key)
+ *                    link = &parent->rb_left;
+ *            else
+ *                    link = &parent->rb_right;
+ *    }
+ *    rb_insert(tree, node, parent, link);
+ *
+ * Trees can be augmented with per-subtree data (e.g. the largest value of
+ * some field in a subtree). The augment function passed to rb_init
+ * recomputes a node's data from the node itself and its children, and is
+ * called for every node whose subtree changes. If the data a node
+ * contributes changes without the tree changing (e.g. a key-independent
+ * field is updated), call rb_propagate on it.
+ *
+ *   rb_init(tree, augment) initializes an empty tree, augment may be NULL.
+ *   rb_insert(tree, node, parent, link) links in node and rebalances.
+ *   rb_remove(tree, node) unlinks node and rebalances.
+ *   rb_propagate(tree, node) calls augment on node and all its ancestors.
+ *   rb_first(tree), rb_last(tree) return the smallest/largest node.
+ *   rb_next(node), rb_prev(node) return the in-order neighbours.
+ *   rb_item(node, type, member) works like list_item.
+ *
+ * All of these except rb_first/rb_last/rb_next/rb_prev return nothing,
+ * the latter return NULL when there is no such node.
+ */
+
+#define RB_RED          0
+#define RB_BLACK        1
+
+typedef struct rb_node {
+        struct rb_node *rb_parent;
+        struct rb_node *rb_left;
+        struct rb_node *rb_right;
+        int             rb_color;
+} rb_node_t;
+
+typedef void (*rb_augment_func_t)(rb_node_t *node);
+
+typedef struct rb_tree {
+        rb_node_t              *rb_root;
+        rb_augment_func_t       rb_augment;
+} rb_tree_t;
+
+#define rb_item(node, type, member)                                     \
+        ((type *)((char *)(node) - offsetof(type, member)))
+
+void rb_init(rb_tree_t *tree, rb_augment_func_t augment);
+void rb_insert(rb_tree_t *tree, rb_node_t *node, rb_node_t *parent,
+               rb_node_t **link);
+void rb_remove(rb_tree_t *tree, rb_node_t *node);
+void rb_propagate(rb_tree_t *tree, rb_node_t *node);
+
+rb_node_t *rb_first(rb_tree_t *tree);
+rb_node_t *rb_last(rb_tree_t *tree);
+rb_node_t *rb_next(rb_node_t *node);
+rb_node_t *rb_prev(rb_node_t *node);
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "types.h"
+#include "config.h"
+
+/* Number of clock ticks per second. The PIT is programmed to interrupt
+ * once per tick (see main/pit.c). */
+#define TIME_HZ (1000 / TICK_MSECS)
+
+#define time_msecs_to_ticks(ms) (((ms) * TIME_HZ) / 1000)
+
+/* Returns the number of ticks since the clock was started. The counter
+ * wraps around, so compare tick values with time_after. */
+uint32_t time_ticks(void);
+
+/* True if tick value a is later than tick value b. */
+#define time_after(a, b)        ((int32_t)((b) - (a)) < 0)
+
+/* Reads the processor's time stamp counter, which counts cycles. Good for
+ * measuring short intervals, the clock ticks are far too coarse for that. */
+static inline uint64_t
+time_rdtsc(void)
+{
+        uint32_t lo, hi;
+        __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+        return ((uint64_t) hi << 32) | lo;
+}
+
+/* Puts the current thread to sleep for (at least) the given number of
+ * ticks. The sleep is cancellable: returns 0 when the time has passed or
+ * -EINTR if the thread was cancelled. */
+int time_sleep(uint32_t nticks);
@@ -4,6 +4,8 @@ struct mmobj;
 
 void anon_init();
 struct mmobj *anon_create(void);
+int mmobj_is_anon(struct mmobj *o);
+void *anon_zero_page(void);
 
 extern int anon_count;
 
@@ -0,0 +1,96 @@
+#pragma once
+
+#include "types.h"
+
+struct mmobj;
+
+/*
+ * Page fault tracing. Every fault handled by handle_pagefault is timed
+ * with the time stamp counter and counted in a histogram (by powers of
+ * two of cycles) for its class: what it was for, how it was resolved and
+ * what the faulting area maps. The fill functions of the objects
+ * (anon_fillpage, shadow_fillpage, vreadpage) report what they did for
+ * the fault and how long it took, so that e.g. a write fault which had
+ * to read the page from disk before copying it counts as major. If the
+ * "faulttrace" tunable is set, each fault is also recorded in a ring
+ * buffer of the last FT_RING_SIZE faults. See the kshell faulttrace
+ * command and tools/faulttrace.py.
+ */
+
+/* what the fault was for */
+#define FT_READ         0
+#define FT_WRITE        1
+#define FT_EXEC         2
+#define FT_NACCESS      3
+
+/* how it was resolved, in increasing order of cost: a fault is counted as
+ * the most expensive thing which happened while handling it */
+#define FT_MINOR        0       /* the page was resident (or the zero page) */
+#define FT_ZERO         1       /* a fresh anonymous page was zeroed */
+#define FT_COW          2       /* a page was copied into a shadow object */
+#define FT_MAJOR        3       /* the page came from disk or swap */
+#define FT_LARGE        4       /* a 4mb page was zeroed and mapped */
+#define FT_BAD          5       /* the access wasn't allowed, or failed */
+#define FT_NKINDS       6
+
+/* what the faulting area maps */
+#define FT_OBJ_ANON     0       /* anonymous memory, shared */
+#define FT_OBJ_SHADOW   1       /* a private mapping (of anything) */
+#define FT_OBJ_FILE     2       /* a file, shared */
+#define FT_OBJ_OTHER    3       /* a device, or nothing at all */
+#define FT_NOBJS        4
+
+#define FT_BUCKETS      32
+#define FT_RING_SIZE    1024
+
+/* The fault a thread is handling, kept on its stack (see kt_fault) */
+typedef struct fault_trace {
+        uint64_t        ft_start;
+        uint32_t        ft_fill;        /* cycles spent filling pages */
+        int             ft_fill_depth;  /* fills in progress (they nest) */
+        uintptr_t       ft_vaddr;
+        uint8_t         ft_access;
+        uint8_t         ft_kind;
+        uint8_t         ft_obj;
+} fault_trace_t;
+
+/* The faults of one class */
+typedef struct fault_class {
+        uint32_t        fc_count;
+        uint64_t        fc_cycles;
+        uint32_t        fc_max;
+        uint32_t        fc_hist[FT_BUCKETS];    /* 2^i <= cycles < 2^(i+1) */
+} fault_class_t;
+
+/* A fault in the ring buffer */
+typedef struct fault_event {
+        uint64_t        fe_tsc;         /* when it started */
+        uint32_t        fe_cycles;
+        uint32_t        fe_fill;
+        uintptr_t       fe_vaddr;
+        pid_t           fe_pid;
+        uint8_t         fe_access;
+        uint8_t         fe_kind;
+        uint8_t         fe_obj;
+} fault_event_t;
+
+extern int vm_fault_trace;
+
+void fault_trace_begin(fault_trace_t *ft, uintptr_t vaddr, uint32_t cause);
+void fault_trace_end(fault_trace_t *ft);
+void fault_trace_object(struct mmobj *o);
+void fault_trace_kind(int kind);
+
+/* Called around the work a fill function does: the time between the two
+ * is charged to the current fault (if any) as filling, and the fault is
+ * counted as kind if nothing more expensive happened in it. */
+uint64_t fault_trace_fill_begin(void);
+void fault_trace_fill_end(int kind, uint64_t start);
+
+const char *fault_trace_access_name(int access);
+const char *fault_trace_kind_name(int kind);
+const char *fault_trace_obj_name(int obj);
+
+void fault_trace_get_class(int access, int kind, int obj, fault_class_t *fc);
+int fault_trace_get_event(uint32_t i, fault_event_t *fe);
+void fault_trace_reset(void);
@@ -8,4 +8,16 @@
 #define FAULT_RESERVED 0x08
 #define FAULT_EXEC     0x10
 
+struct vmarea;
+struct pframe;
+
 void handle_pagefault(uintptr_t vaddr, uint32_t cause);
+int vm_fault(uintptr_t vaddr, uint32_t cause);
+int vm_fault_in(struct vmarea *vma, uint32_t vfn, int forwrite, int pin,
+                struct pframe **result);
+int vm_fault_large(struct vmarea *vma, uint32_t vfn);
+int vm_prefetch(struct vmarea *vma, uint32_t vfn);
+void vm_populate(struct vmarea *vma);
+
+extern int vm_faultaround;
+extern int vm_large_pages;
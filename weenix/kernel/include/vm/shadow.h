@@ -1,9 +1,14 @@
 #pragma once
 
+#include "types.h"
+
 struct mmobj;
 
 void shadow_init();
 struct mmobj *shadow_create(void);
+int mmobj_is_shadow(struct mmobj *o);
+int shadow_collapse(struct mmobj *top, int max);
+int shadow_page_is_zero(struct mmobj *o, uint32_t pagenum);
 
 extern int shadow_count;
 
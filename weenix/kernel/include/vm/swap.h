@@ -0,0 +1,33 @@
+#pragma once
+
+#include "types.h"
+
+struct mmobj;
+struct pframe;
+
+/*
+ * Swap statistics, see swap_get_stats.
+ */
+typedef struct swap_stats {
+        uint32_t ss_nslots;     /* slots on the swap device */
+        uint32_t ss_used;       /* slots holding a page */
+        uint32_t ss_outs;       /* pages written to swap */
+        uint32_t ss_ins;        /* pages read from swap on demand */
+        uint32_t ss_readahead;  /* pages read ahead from swap */
+        uint32_t ss_full;       /* swap-outs which failed for lack of slots */
+} swap_stats_t;
+
+void swap_init(void);
+
+int swap_enabled(void);
+int swap_full(void);
+int mmobj_is_swapbacked(struct mmobj *o);
+
+int swap_has(struct mmobj *o, uint32_t pagenum);
+int swap_out(struct pframe *pf);
+int swap_in(struct pframe *pf);
+void swap_discard(struct mmobj *o, uint32_t pagenum);
+void swap_discard_object(struct mmobj *o);
+int swap_migrate(struct mmobj *src, struct mmobj *dest);
+
+void swap_get_stats(swap_stats_t *stats);
@@ -3,17 +3,27 @@
 #include "types.h"
 
 #include "util/list.h"
+#include "util/rbtree.h"
 
 #define VMMAP_DIR_LOHI 1
 #define VMMAP_DIR_HILO 2
 
+#define VMMAP_CACHE_SIZE 4 /* areas remembered by vmmap_lookup */
+
 struct mmobj;
 struct proc;
 struct vnode;
+struct vmarea;
+struct pframe;
 
 typedef struct vmmap {
         list_t       vmm_list;
         struct proc *vmm_proc;
+        rb_tree_t    vmm_tree;       /* the areas again, by address, with
+                                      * the largest gap in each subtree */
+        struct vmarea *vmm_cache[VMMAP_CACHE_SIZE]; /* recently looked up */
+        int          vmm_cache_next; /* cache entry to replace next */
+        uint32_t     vmm_nlocked;    /* pages locked with mlock */
 } vmmap_t;
 
 /* make sure you understand why mapping boundaries are in terms of frame
@@ -32,6 +42,15 @@ typedef struct vmarea {
         list_link_t    vma_olink;    /* link on the list of all vm_areas
                                       * having the same vm_object at the
                                       * bottom of their chain */
+        rb_node_t      vma_node;     /* node in the address space's tree */
+        uint32_t       vma_gap;      /* free pages right below this area */
+        uint32_t       vma_maxgap;   /* largest vma_gap in vma_node's subtree */
+        int            vma_maxprot;  /* permissions mprotect may grant */
+        int            vma_advice;   /* MADV_NORMAL, MADV_RANDOM or
+                                      * MADV_SEQUENTIAL */
+        struct pframe **vma_pinned;  /* if the area is locked with mlock,
+                                      * the page pinned for each of its
+                                      * pages (NULL if none is yet) */
 } vmarea_t;
 
 void vmmap_init(void);
@@ -42,6 +61,16 @@ void vmmap_destroy(vmmap_t *map);
 vmarea_t *vmmap_lookup(vmmap_t *map, uint32_t vfn);
 int vmmap_map(vmmap_t *map, struct vnode *file, uint32_t lopage, uint32_t npages, int prot, int flags, off_t off, int dir, vmarea_t **new);
 int vmmap_remove(vmmap_t *map, uint32_t lopage, uint32_t npages);
+int vmmap_protect(vmmap_t *map, uint32_t lopage, uint32_t npages, int prot);
+int vmmap_advise(vmmap_t *map, uint32_t lopage, uint32_t npages, int advice);
+int vmmap_lock(vmmap_t *map, uint32_t lopage, uint32_t npages);
+int vmmap_unlock(vmmap_t *map, uint32_t lopage, uint32_t npages);
+void vmmap_unshare_locked(vmmap_t *map);
+void vmarea_pin(vmarea_t *vma, uint32_t vfn, struct pframe *pf);
+int vmarea_grow(vmmap_t *map, vmarea_t *vma, uint32_t npages);
+
+extern int vm_mlock_limit;
+void vmmap_update_area(vmmap_t *map, vmarea_t *vma);
 int vmmap_is_range_empty(vmmap_t *map, uint32_t startvfn, uint32_t npages);
 int vmmap_find_range(vmmap_t *map, uint32_t npages, int dir);
 
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "types.h"
+
+/*
+ * Counters for the virtual memory system, shown by the kshell vmstat
+ * command.
+ */
+typedef struct vm_stats {
+        uint32_t vs_faults;            /* page faults handled */
+        uint32_t vs_faultaround;       /* pages mapped around read faults */
+        uint32_t vs_zeropage;          /* read faults served by the zero page */
+        uint32_t vs_redirty;           /* write faults which only re-dirtied a mapped page */
+        uint32_t vs_prefetch;          /* pages read ahead or for MADV_WILLNEED */
+        uint32_t vs_populated;         /* pages mapped by MAP_POPULATE */
+        uint32_t vs_large;             /* 4mb pages mapped */
+        uint32_t vs_large_fallback;    /* 4mb pages given up on, memory short */
+        uint32_t vs_vmacache_hits;     /* vmmap_lookups answered by the cache */
+        uint32_t vs_vmacache_misses;   /* vmmap_lookups which searched the tree */
+        uint32_t vs_shadow_collapsed;  /* shadow objects spliced out of chains */
+        uint32_t vs_shadow_maxdepth;   /* longest shadow chain seen, in shadow objects */
+        uint32_t vs_tlb_invlpg;        /* pages invalidated one by one by TLB gathers */
+        uint32_t vs_tlb_flush_all;     /* TLB gathers which reloaded cr3 instead */
+        uint32_t vs_uaccess_faults;    /* faults on user memory in copy_to/from_user */
+        uint32_t vs_uaccess_fixups;    /* of those, copies stopped at their fixup */
+} vm_stats_t;
+
+extern vm_stats_t vm_stats;
+
+#define vm_stat_inc(field)      (vm_stats.field++)
+#define vm_stat_max(field, val)                                         \
+        do {                                                            \
+                if ((val) > vm_stats.field)                             \
+                        vm_stats.field = (val);                         \
+        } while (0)
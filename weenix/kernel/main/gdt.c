@@ -1,4 +1,8 @@
+#include "kernel.h"
+
 #include "main/gdt.h"
+#include "main/cpuid.h"
+#include "main/interrupt.h"
 
 #include "util/printf.h"
 #include "util/debug.h"
@@ -47,6 +51,15 @@ struct gdt_location {
         uint32_t gl_offset;
 } __attribute__((packed));
 
+#define MSR_SYSENTER_CS  0x174
+#define MSR_SYSENTER_ESP 0x175
+#define MSR_SYSENTER_EIP 0x176
+
+/* the sysenter entry point, see main/interrupt.c */
+extern intr_handler_t __sysenter_entry;
+
+static void gdt_sysenter_init(void);
+
 static struct gdt_entry gdt[GDT_COUNT];
 static struct tss_entry tss;
 static struct gdt_location gdtl = {
@@ -78,6 +91,40 @@ void gdt_init(void)
 
         int segment = GDT_TSS;
         __asm__ volatile("ltr %0" :: "m"(segment));
+
+        gdt_sysenter_init();
+}
+
+static void wrmsr(uint32_t msr, uint32_t val)
+{
+        __asm__ volatile("wrmsr" :: "c"(msr), "a"(val), "d"(0));
+}
+
+/*
+ * Lets userland make system calls with sysenter as well as with int
+ * $INTR_SYSCALL, if the processor has it (early Pentium Pros claim to but
+ * don't). sysenter goes to __sysenter_entry with the kernel text and data
+ * segments, and sysexit back to the user ones: this relies on the order
+ * of the entries in the gdt. The kernel stack sysenter switches to is the
+ * tss's esp0 field, the entry loads the thread's stack from there.
+ */
+static void gdt_sysenter_init(void)
+{
+        uint32_t a, d;
+
+        cpuid(CPUID_GETFEATURES, &a, &d);
+        if (!(CPUID_FEAT_EDX_SEP & d)
+            || (6 == ((a >> 8) & 0xf) && ((a >> 4) & 0xf) < 3 && (a & 0xf) < 3)) {
+                dbg(DBG_CORE, "sysenter not supported\n");
+                return;
+        }
+        KASSERT(GDT_KERNEL_DATA == GDT_KERNEL_TEXT + 8);
+        KASSERT(GDT_USER_TEXT == GDT_KERNEL_TEXT + 16);
+        KASSERT(GDT_USER_DATA == GDT_KERNEL_TEXT + 24);
+
+        wrmsr(MSR_SYSENTER_CS, GDT_KERNEL_TEXT);
+        wrmsr(MSR_SYSENTER_ESP, (uint32_t)&tss.ts_esp0);
+        wrmsr(MSR_SYSENTER_EIP, (uint32_t)&__sysenter_entry);
 }
 
 void gdt_set_kernel_stack(void *addr)
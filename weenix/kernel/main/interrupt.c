@@ -8,6 +8,9 @@
 #include "main/interrupt.h"
 #include "main/gdt.h"
 
+#include "api/syscall.h"
+#include "api/sysstat.h"
+
 #define MAX_INTERRUPTS          256
 
 #define INTR_SPURIOUS      0xef
@@ -65,6 +68,53 @@
                 "iret\n"                                \
         );
 
+/*
+ * The sysenter entry point (see gdt_sysenter_init). sysenter only loads
+ * the kernel segments, eip and esp, so userland passes the rest along:
+ * the stack pointer to return with in ecx and the address to return to in
+ * esi, besides the syscall number and argument in eax and edx as with int
+ * $INTR_SYSCALL (see user/include/weenix/trap.h). The entry builds the
+ * same saved registers as an int $INTR_SYSCALL would, so that the syscall
+ * handler can't tell the difference (fork and execve use them), and goes
+ * straight to it. It returns with sysexit, which takes the address and
+ * stack pointer to return to in edx and ecx, so those don't survive the
+ * system call.
+ */
+extern intr_handler_t __sysenter_entry;
+__asm__ (
+        ".global __sysenter_entry\n"
+        "__sysenter_entry:\n\t"
+        "movl (%esp), %esp\n\t"       /* the tss's esp0 */
+        "push $(" QUOTE(GDT_USER_DATA) " | 3)\n\t"
+        "push %ecx\n\t"
+        "pushf\n\t"
+        "orl $0x200, (%esp)\n\t"      /* interrupts are enabled in userland */
+        "push $(" QUOTE(GDT_USER_TEXT) " | 3)\n\t"
+        "push %esi\n\t"
+        "push $0\n\t"
+        "push $" QUOTE(INTR_SYSCALL) "\n\t"
+        "pusha\n\t"
+        "push %ds\n\t"
+        "push %es\n\t"
+        "movl %ss, %edx\n\t"
+        "movl %edx, %ds\n\t"
+        "movl %edx, %es\n\t"
+        "sti\n\t"
+        "call __sysenter_handler\n\t"
+        "cli\n\t"
+        "pop %es\n\t"
+        "pop %ds\n\t"
+        "popa\n\t"
+        "add $8, %esp\n\t"
+        "movl (%esp), %edx\n\t"       /* r_eip */
+        "movl 12(%esp), %ecx\n\t"     /* r_useresp */
+        "andl $~0x200, 8(%esp)\n\t"   /* not until sysexit */
+        "add $8, %esp\n\t"
+        "popf\n\t"
+        "sti\n\t"
+        "sysexit\n"
+);
+
 INTR_NOERRCODE(0)
 INTR_NOERRCODE(1)
 INTR_NOERRCODE(2)
@@ -386,6 +436,15 @@ static __attribute__((used)) void __intr_handler(regs_t regs)
         _intr_regs = NULL;
 }
 
+/* Called by __sysenter_entry, with the registers saved where __intr_handler
+ * would get them. Skips the rest of what __intr_handler does: it is always
+ * a syscall, which isn't a hardware interrupt. */
+static __attribute__((used)) void __sysenter_handler(regs_t regs)
+{
+        syscall_sysenter_calls++;
+        intr_handlers[INTR_SYSCALL](&regs);
+}
+
 static void __intr_divide_by_zero_handler(regs_t *regs)
 {
         panic("\nDivide by zero error at eip=0x%08x\n", regs->r_eip);
@@ -1,3 +1,5 @@
+#include "config.h"
+
 #include "main/io.h"
 #include "main/interrupt.h"
 #include "util/delay.h"
@@ -13,7 +15,7 @@
 
 #define CLOCK_TICK_RATE 1193182
 #undef HZ
-#define HZ 1000
+#define HZ (1000 / TICK_MSECS)
 
 #define LATCH (CLOCK_TICK_RATE / HZ)
 
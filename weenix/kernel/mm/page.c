@@ -24,7 +24,8 @@ static uintptr_t page_freecount;
 struct pagegroup {
         list_t       pg_freelist[PAGE_NSIZES];
         void        *pg_map[PAGE_NSIZES];
-        uintptr_t    pg_baseaddr;
+        uintptr_t    pg_baseaddr;  /* aligned, buddies are relative to it */
+        uintptr_t    pg_startaddr; /* first page actually in the group */
         uintptr_t    pg_endaddr;
         list_link_t  pg_link;
 };
@@ -33,20 +34,28 @@ struct freepage {
         list_link_t fp_link;
 };
 
+static void __pagegroup_free(struct pagegroup *group, uintptr_t addr, int order);
+
 static struct pagegroup *
 _pagegroup_create(uintptr_t start, uintptr_t end)
 {
         KASSERT(PAGE_NSIZES > 0);
         KASSERT(sizeof(struct pagegroup) <= PAGE_SIZE);
 
-        uintptr_t npages = (end - start) >> PAGE_SHIFT;
+        uintptr_t npages, current;
         struct pagegroup *group;
 
         end -= sizeof(*group);
         group = (struct pagegroup *)end;
 
-        group->pg_baseaddr = start;
+        /* buddies are found relative to pg_baseaddr, which is aligned to
+         * the largest block size, so that every block is aligned to its
+         * own size (the kernel's direct map preserves that alignment in
+         * physical memory, which e.g. 4mb pages need) */
+        group->pg_baseaddr = start & ~((PAGE_SIZE << (PAGE_NSIZES - 1)) - 1);
+        group->pg_startaddr = start;
         group->pg_map[0] = NULL;
+        npages = (end - group->pg_baseaddr) >> PAGE_SHIFT;
 
         /* allocate some of the space for the buddy bit maps,
          * we allocate enough bits to track all pages even
@@ -54,9 +63,7 @@ _pagegroup_create(uintptr_t start, uintptr_t end)
          * are being used as bitmaps */
         int order;
         for (order = 1; order < PAGE_NSIZES; ++order) {
-                uintptr_t count = npages >> order;
-                count = ((count - 1) & ~((uintptr_t)0x7)) + 8;
-                count = count >> 3;
+                uintptr_t count = ((npages >> order) >> 3) + 1;
                 end -= count;
                 group->pg_map[order] = (void *)end;
                 memset(group->pg_map[order], 0, count);
@@ -65,26 +72,22 @@ _pagegroup_create(uintptr_t start, uintptr_t end)
         /* discard the remainder of the page being used for
          * mappings and read just npages */
         end = (uintptr_t)PAGE_ALIGN_DOWN(end);
-        npages = (end - start) >> PAGE_SHIFT;
         group->pg_endaddr = end;
 
-        /* put pages which do not fit nicely into the largest
-         * order and add them to smaller buckets */
-        for (order = 0; order < PAGE_NSIZES - 1; ++order) {
+        /* with all bits clear every block counts as allocated, the pages
+         * we have are freed in the largest aligned blocks which fit */
+        for (order = 0; order < PAGE_NSIZES; ++order)
                 list_init(&group->pg_freelist[order]);
-                if (npages & (1 << order)) {
-                        end -= (1 << order) << PAGE_SHIFT;
-                        list_insert_head(&group->pg_freelist[order], &((struct freepage *)end)->fp_link);
-                }
-        }
-
-        /* put the remaining pages into the largest bucket */
-        KASSERT(0 == (end - start) % (1 << order));
-        list_init(&group->pg_freelist[order]);
-        uintptr_t current = start;
+        current = start;
         while (current < end) {
-                list_insert_head(&group->pg_freelist[order], &((struct freepage *)current)->fp_link);
-                current += (1 << order) << PAGE_SHIFT;
+                for (order = PAGE_NSIZES - 1; order > 0; --order) {
+                        uintptr_t size = PAGE_SIZE << order;
+                        if (0 == (current - group->pg_baseaddr) % size
+                            && current + size <= end)
+                                break;
+                }
+                __pagegroup_free(group, current, order);
+                current += PAGE_SIZE << order;
         }
 
         return group;
@@ -95,7 +98,7 @@ _pagegroup_from_address(uintptr_t addr)
 {
         struct pagegroup *group;
         list_iterate_begin(&pagegroup_list, group, struct pagegroup, pg_link) {
-                if (addr >= group->pg_baseaddr && addr < group->pg_endaddr)
+                if (addr >= group->pg_startaddr && addr < group->pg_endaddr)
                         return group;
         } list_iterate_end();
         return NULL;
@@ -118,9 +121,9 @@ page_add_range(uintptr_t start, uintptr_t end)
         end = (uintptr_t) PAGE_ALIGN_DOWN(end);
 
         struct pagegroup *group = _pagegroup_create(start, end);
-        if (group->pg_baseaddr < group->pg_endaddr) {
+        if (group->pg_startaddr < group->pg_endaddr) {
                 list_insert_tail(&pagegroup_list, &group->pg_link);
-                page_freecount += ADDR_TO_PN(group->pg_endaddr - group->pg_baseaddr);
+                page_freecount += ADDR_TO_PN(group->pg_endaddr - group->pg_startaddr);
         }
 }
 
@@ -293,6 +296,20 @@ __page_join(struct pagegroup *group, int order, uintptr_t addr)
         }
 }
 
+/* Puts a block of 2^order pages on the free list of its group, joining it
+ * with its buddy (and so on) if that is free too */
+static void
+__pagegroup_free(struct pagegroup *group, uintptr_t addr, int order)
+{
+        list_insert_head(&group->pg_freelist[order], &((struct freepage *)addr)->fp_link);
+
+        if (PAGE_NSIZES - 1 > order) {
+                uintptr_t index = _pagegroup_calculate_index(group, order + 1, addr);
+                bit_flip(group->pg_map[order + 1], index);
+                __page_join(group, order, addr);
+        }
+}
+
 /**
  * Free a block of 2^order pages. Fills the memory with a special
  * MM_POISON_FREE pattern.
@@ -315,15 +332,9 @@ _page_free_order(void *addr, int order)
         if (NULL == group)
                 return;
 
-        list_insert_head(&group->pg_freelist[order], &((struct freepage *)addr)->fp_link);
+        __pagegroup_free(group, (uintptr_t)addr, order);
         page_freecount += (1 << order);
 
-        if (PAGE_NSIZES - 1 > order) {
-                uintptr_t index = _pagegroup_calculate_index(group, order + 1, (uintptr_t)addr);
-                bit_flip(group->pg_map[order + 1], index);
-                __page_join(group, order, (uintptr_t)addr);
-        }
-
         dbg(DBG_MM, "page_free: freed %d pages (addr 0x%p); %u pages currently free\n",
             (1 << order), addr, page_freecount);
 }
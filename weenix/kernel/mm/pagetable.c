@@ -6,6 +6,7 @@
 #include "globals.h"
 
 #include "main/interrupt.h"
+#include "main/cpuid.h"
 
 #include "mm/mm.h"
 #include "mm/page.h"
@@ -13,23 +14,45 @@
 #include "mm/phys.h"
 #include "mm/tlb.h"
 #include "mm/pframe.h"
+#include "mm/slab.h"
 
 #include "util/debug.h"
 #include "util/string.h"
 #include "util/printf.h"
 
+#include "api/access.h"
+
 #include "vm/pagefault.h"
+#include "vm/vmstat.h"
 
 #include "boot/config.h"
 
 #define PT_ENTRY_COUNT    (PAGE_SIZE / sizeof (uint32_t))
 #define PT_VADDR_SIZE     (PAGE_SIZE * PT_ENTRY_COUNT)
-
+/* the page directory entries below this one are for user memory */
+#define PT_USER_TABLES    (USER_MEM_HIGH / PT_VADDR_SIZE)
+
+/*
+ * The page directory itself is the page pd_physical points to. Page
+ * tables are reached through the kernel's direct map of physical memory
+ * (see pde_to_table), so there is no need to keep their virtual
+ * addresses. A new page directory shares the template's page, which has
+ * only the kernel's entries, until something is mapped in user memory
+ * (see pt_unshare), so processes which never run user code (e.g. kernel
+ * daemons) never get one of their own.
+ *
+ * pd_nentries counts the present entries of each user page table, so
+ * that a page table can be freed as soon as its last page is unmapped.
+ */
 struct pagedir {
-        pde_t      pd_physical[PT_ENTRY_COUNT];
-        uintptr_t *pd_virtual[PT_ENTRY_COUNT];
+        pde_t     *pd_physical;
+        uint16_t   pd_nentries[PT_USER_TABLES];
 };
 
+/* the page table a (present, not 4mb) page directory entry points to */
+#define pde_to_table(pde) \
+        ((pte_t *)(((pde) & PAGE_MASK) + KERNEL_VIRT_BASE))
+
 /* for a given virtual memory address these macros will
  * calculate the index into the page directory and page
  * tables for that memory location as well as the offset
@@ -41,13 +64,38 @@ struct pagedir {
 #define vaddr_to_offset(vaddr) \
         (((uint32_t)(vaddr)) & (~PAGE_MASK))
 
+/* 4mb pages are mapped by page directory entries with PD_SIZE set, their
+ * page frame address is aligned to PT_VADDR_SIZE */
+#define PT_LARGE_MASK     (~(PT_VADDR_SIZE - 1))
+#define pde_is_large(pde) \
+        (((pde) & (PD_PRESENT | PD_SIZE)) == (PD_PRESENT | PD_SIZE))
+/* the flags of such an entry which mean the same in a page table entry */
+#define PT_LARGE_FLAGS    (PT_PRESENT | PT_WRITE | PT_USER | PT_WRITE_THROUGH \
+                           | PT_CACHE_DISABLED | PT_ACCESSED | PT_DIRTY)
+
+#define CR4_PSE           0x010
+#define CR0_WP            0x10000 /* supervisor writes honour PT_WRITE */
+
 /* the virtual address of the page directory in cr3 */
 static pagedir_t *current_pagedir = NULL;
 static pagedir_t *template_pagedir = NULL;
+static pagedir_t boot_pagedir;
+static slab_allocator_t *pagedir_allocator = NULL;
 
 static uint32_t phys_map_count = 1;
 static pte_t *final_page;
 
+/* whether 4mb pages are supported (and enabled) */
+static int pt_pse = 0;
+
+/* The page table entry which would map the i'th page of the 4mb page
+ * mapped by the given page directory entry */
+static inline pte_t
+pt_large_pte(pde_t pde, uint32_t i)
+{
+        return ((pde & PT_LARGE_MASK) + (i << PAGE_SHIFT)) | (pde & PT_LARGE_FLAGS);
+}
+
 uintptr_t
 pt_phys_tmp_map(uintptr_t paddr)
 {
@@ -85,7 +133,11 @@ pt_virt_to_phys(uintptr_t vaddr)
         uint32_t entry = vaddr_to_ptindex(vaddr);
         uint32_t offset = vaddr_to_offset(vaddr);
 
-        pte_t *pagetable = (pte_t *)pt_phys_tmp_map(current_pagedir->pd_physical[table] & PAGE_MASK);
+        if (pde_is_large(current_pagedir->pd_physical[table]))
+                return (current_pagedir->pd_physical[table] & PT_LARGE_MASK)
+                       + (vaddr & ~PT_LARGE_MASK);
+
+        pte_t *pagetable = pde_to_table(current_pagedir->pd_physical[table]);
         uintptr_t page = pagetable[entry] & PAGE_MASK;
         return page + offset;
 }
@@ -104,13 +156,165 @@ pt_get(void)
         return current_pagedir;
 }
 
+/*
+ * Clears the user page table entry for vaddr, which is in the given page
+ * table, and tells the page frame code that the page it mapped isn't
+ * mapped there anymore.
+ */
+static void
+pt_clear_entry(pagedir_t *pd, pte_t *pt, uintptr_t vaddr)
+{
+        uint32_t index = vaddr_to_ptindex(vaddr);
+
+        if (PT_PRESENT & pt[index]) {
+                pframe_rmap_remove(pt[index], pd, vaddr);
+                pt[index] = 0;
+                KASSERT(0 < pd->pd_nentries[vaddr_to_pdindex(vaddr)]);
+                pd->pd_nentries[vaddr_to_pdindex(vaddr)]--;
+        }
+}
+
+/* Frees the given user page table of pd, which must be empty. If tg is
+ * not NULL the page is only freed once tg has flushed the TLB, which
+ * must cover the table's range. */
+static void
+pt_free_table(pagedir_t *pd, uint32_t table, tlb_gather_t *tg)
+{
+        pte_t *pt = pde_to_table(pd->pd_physical[table]);
+
+        KASSERT(0 == pd->pd_nentries[table]);
+
+        pd->pd_physical[table] = 0;
+        if (NULL != tg) {
+                tlb_gather_page(tg, pt);
+                return;
+        }
+        /* the processor may have cached the directory entry */
+        if (current_pagedir == pd)
+                tlb_flush(table * PT_VADDR_SIZE);
+        page_free(pt);
+}
+
+/*
+ * Gives pd a page directory of its own, if it still shares the template's,
+ * before anything is mapped in user memory.
+ *
+ * @return 0 on success, -ENOMEM if there is no memory for it
+ */
+static int
+pt_unshare(pagedir_t *pd)
+{
+        pde_t *pdir;
+
+        if (template_pagedir->pd_physical != pd->pd_physical)
+                return 0;
+        if (NULL == (pdir = page_alloc()))
+                return -ENOMEM;
+        memset(pdir, 0, PT_USER_TABLES * sizeof(pde_t));
+        memcpy(pdir + PT_USER_TABLES, template_pagedir->pd_physical + PT_USER_TABLES,
+               (PT_ENTRY_COUNT - PT_USER_TABLES) * sizeof(pde_t));
+        pd->pd_physical = pdir;
+        if (current_pagedir == pd)
+                pt_set(pd);
+        return 0;
+}
+
+/* Clears the present entries of the page table for the user addresses
+ * [vlow, vhigh), which must all be covered by that table */
+static void
+pt_clear_entries(pagedir_t *pd, pte_t *pt, uintptr_t vlow, uintptr_t vhigh)
+{
+        for (; vlow < vhigh; vlow += PAGE_SIZE)
+                pt_clear_entry(pd, pt, vlow);
+}
+
+/*
+ * Unmaps the 4mb page which is mapped by the given entry of pd, telling
+ * the page frame code that none of its pages are mapped there anymore.
+ */
+static void
+pt_drop_large(pagedir_t *pd, uint32_t table)
+{
+        pde_t pde = pd->pd_physical[table];
+        uint32_t i;
+
+        KASSERT(pde_is_large(pde));
+
+        pd->pd_physical[table] = 0;
+        pd->pd_nentries[table] = 0;
+        for (i = 0; i < PT_ENTRY_COUNT; ++i) {
+                pframe_rmap_remove(pt_large_pte(pde, i), pd,
+                                   (table * PT_ENTRY_COUNT + i) << PAGE_SHIFT);
+        }
+        if (current_pagedir == pd)
+                tlb_flush(table * PT_VADDR_SIZE);
+}
+
+/*
+ * Replaces the 4mb page which is mapped by the given entry of pd with a
+ * page table mapping the same pages with the same permissions, so that
+ * they can be changed one at a time. If there is no memory for the page
+ * table, the 4mb page is unmapped instead; its pages are faulted in
+ * again one by one.
+ *
+ * @return the page table, or NULL if the entry is empty now
+ */
+static pte_t *
+pt_split_large(pagedir_t *pd, uint32_t table)
+{
+        pde_t pde = pd->pd_physical[table];
+        pte_t *pt;
+        uint32_t i;
+
+        KASSERT(pde_is_large(pde));
+
+        if (NULL == (pt = page_alloc())) {
+                pt_drop_large(pd, table);
+                return NULL;
+        }
+        for (i = 0; i < PT_ENTRY_COUNT; ++i)
+                pt[i] = pt_large_pte(pde, i);
+        pd->pd_physical[table] = pt_virt_to_phys((uintptr_t)pt)
+                                 | (pde & (PD_PRESENT | PD_WRITE | PD_USER));
+        pd->pd_nentries[table] = PT_ENTRY_COUNT;
+        if (current_pagedir == pd)
+                tlb_flush(table * PT_VADDR_SIZE);
+        return pt;
+}
+
+/* Returns the page table for the given entry of pd, splitting a 4mb page
+ * there first, or NULL if there is none */
+static pte_t *
+pt_get_table(pagedir_t *pd, uint32_t table)
+{
+        if (!(PD_PRESENT & pd->pd_physical[table]))
+                return NULL;
+        if (PD_SIZE & pd->pd_physical[table])
+                return pt_split_large(pd, table);
+        return pde_to_table(pd->pd_physical[table]);
+}
+
 int
 pt_map(pagedir_t *pd, uintptr_t vaddr, uintptr_t paddr, uint32_t pdflags, uint32_t ptflags)
 {
         KASSERT(PAGE_ALIGNED(vaddr) && PAGE_ALIGNED(paddr));
         KASSERT(USER_MEM_LOW <= vaddr && USER_MEM_HIGH > vaddr);
+        KASSERT(PT_PRESENT & ptflags);
 
         int index = vaddr_to_pdindex(vaddr);
+        int ret;
+
+        if ((ret = pt_unshare(pd)) < 0)
+                return ret;
+
+        if (pde_is_large(pd->pd_physical[index])) {
+                pte_t old = pt_large_pte(pd->pd_physical[index], vaddr_to_ptindex(vaddr));
+
+                /* e.g. mlock faulting in a page of a 4mb page */
+                if ((old & PAGE_MASK) == paddr && 0 == (ptflags & ~old))
+                        return 0;
+                pt_split_large(pd, index);
+        }
 
         pte_t *pt;
         if (!(PT_PRESENT & pd->pd_physical[index])) {
@@ -120,114 +324,276 @@ pt_map(pagedir_t *pd, uintptr_t vaddr, uintptr_t paddr, uint32_t pdflags, uint32
                         KASSERT((pdflags & ~PAGE_MASK) == pdflags);
                         memset(pt, 0, PAGE_SIZE);
                         pd->pd_physical[index] = pt_virt_to_phys((uintptr_t)pt) | pdflags;
-                        pd->pd_virtual[index] = pt;
+                        pd->pd_nentries[index] = 0;
                 }
         } else {
                 /* Be sure to add additional pagedir flags if necessary */
                 pd->pd_physical[index] = pd->pd_physical[index] | pdflags;
-                pt = (pte_t *)pd->pd_virtual[index];
+                pt = pde_to_table(pd->pd_physical[index]);
         }
 
-        index = vaddr_to_ptindex(vaddr);
+        uint32_t entry = vaddr_to_ptindex(vaddr);
 
         KASSERT((ptflags & ~PAGE_MASK) == ptflags);
-        pt[index] = paddr | ptflags;
+        if (!(PT_PRESENT & pt[entry]) || (pt[entry] & PAGE_MASK) != paddr) {
+                /* record the new mapping before dropping the old one, so
+                 * that the old one is left alone if we can't */
+                if ((ret = pframe_rmap_add(paddr, pd, vaddr)) < 0) {
+                        /* don't leave behind a table we just made */
+                        if (0 == pd->pd_nentries[index])
+                                pt_free_table(pd, index, NULL);
+                        return ret;
+                }
+                /* this can't empty the table, the new entry goes in */
+                pt_clear_entry(pd, pt, vaddr);
+                pd->pd_nentries[index]++;
+        }
+        pt[entry] = paddr | ptflags;
 
         return 0;
 }
 
-void
-pt_unmap(pagedir_t *pd, uintptr_t vaddr)
+int
+pt_can_map_large(pagedir_t *pd, uintptr_t vaddr)
 {
-        KASSERT(PAGE_ALIGNED(vaddr));
         KASSERT(USER_MEM_LOW <= vaddr && USER_MEM_HIGH > vaddr);
 
+        return pt_pse && !(PD_PRESENT & pd->pd_physical[vaddr_to_pdindex(vaddr)]);
+}
+
+int
+pt_map_large(pagedir_t *pd, uintptr_t vaddr, uintptr_t paddr, uint32_t pdflags)
+{
+        KASSERT(0 == vaddr % PT_VADDR_SIZE && 0 == paddr % PT_VADDR_SIZE);
+        KASSERT(USER_MEM_LOW <= vaddr && USER_MEM_HIGH > vaddr);
+        KASSERT((pdflags & PT_LARGE_FLAGS) == pdflags);
+        KASSERT(pt_pse);
+
         int index = vaddr_to_pdindex(vaddr);
+        uint32_t i;
+        int ret;
 
-        if (PT_PRESENT & pd->pd_physical[index]) {
-                pte_t *pt = (pte_t *)pd->pd_virtual[index];
+        if ((ret = pt_unshare(pd)) < 0)
+                return ret;
+        if (PD_PRESENT & pd->pd_physical[index])
+                return -EEXIST;
 
-                index = vaddr_to_ptindex(vaddr);
-                pt[index] = 0;
+        for (i = 0; i < PT_ENTRY_COUNT; ++i) {
+                if ((ret = pframe_rmap_add(paddr + (i << PAGE_SHIFT), pd,
+                                           vaddr + (i << PAGE_SHIFT))) < 0) {
+                        while (i-- > 0) {
+                                pframe_rmap_remove(paddr + (i << PAGE_SHIFT), pd,
+                                                   vaddr + (i << PAGE_SHIFT));
+                        }
+                        return ret;
+                }
         }
+        pd->pd_physical[index] = paddr | pdflags | PD_SIZE;
+        return 0;
+}
+
+pte_t
+pt_lookup(pagedir_t *pd, uintptr_t vaddr)
+{
+        KASSERT(USER_MEM_LOW <= vaddr && USER_MEM_HIGH > vaddr);
+
+        int index = vaddr_to_pdindex(vaddr);
+        if (!(PD_PRESENT & pd->pd_physical[index]))
+                return 0;
+        if (PD_SIZE & pd->pd_physical[index])
+                return pt_large_pte(pd->pd_physical[index], vaddr_to_ptindex(vaddr));
+        return pde_to_table(pd->pd_physical[index])[vaddr_to_ptindex(vaddr)];
+}
+
+pte_t
+pt_clear_flags(pagedir_t *pd, uintptr_t vaddr, uint32_t ptflags)
+{
+        KASSERT(USER_MEM_LOW <= vaddr && USER_MEM_HIGH > vaddr);
+        KASSERT((ptflags & ~PAGE_MASK) == ptflags);
+        /* entries are only made not present by unmapping them, which
+         * keeps the page table's count of them right */
+        KASSERT(!(PT_PRESENT & ptflags));
+
+        int index = vaddr_to_pdindex(vaddr);
+        pte_t *pt, old;
+
+        if (!(PD_PRESENT & pd->pd_physical[index]))
+                return 0;
+        if (PD_SIZE & pd->pd_physical[index]) {
+                /* the flags are changed in the 4mb page's own entry,
+                 * splitting it would need memory, which reclaim is
+                 * looking for. Its dirty bit is shared by all of its
+                 * pages, so it is left set: write-protecting the entry
+                 * makes the next write to any of them fault and split
+                 * it, and until then they count as written. */
+                old = pt_large_pte(pd->pd_physical[index], vaddr_to_ptindex(vaddr));
+                pd->pd_physical[index] &= ~(ptflags & (PT_ACCESSED | PT_WRITE));
+                return old;
+        }
+        pt = pde_to_table(pd->pd_physical[index]);
+        index = vaddr_to_ptindex(vaddr);
+        old = pt[index];
+        pt[index] &= ~ptflags;
+        return old;
 }
 
 void
-pt_unmap_range(pagedir_t *pd, uintptr_t vlow, uintptr_t vhigh)
+pt_unmap(pagedir_t *pd, uintptr_t vaddr)
 {
-        uint32_t index;
+        KASSERT(PAGE_ALIGNED(vaddr));
+        KASSERT(USER_MEM_LOW <= vaddr && USER_MEM_HIGH > vaddr);
 
+        uint32_t table = vaddr_to_pdindex(vaddr);
+        pte_t *pt;
+
+        if (NULL != (pt = pt_get_table(pd, table))) {
+                pt_clear_entry(pd, pt, vaddr);
+                if (0 == pd->pd_nentries[table])
+                        pt_free_table(pd, table, NULL);
+        }
+}
+
+void
+pt_unmap_range(pagedir_t *pd, uintptr_t vlow, uintptr_t vhigh, struct tlb_gather *tg)
+{
         KASSERT(vlow < vhigh);
         KASSERT(PAGE_ALIGNED(vlow) && PAGE_ALIGNED(vhigh));
         KASSERT(USER_MEM_LOW <= vlow && USER_MEM_HIGH >= vhigh);
-	/*
-	if(vaddr_to_pdindex(vlow) == vaddr_to_pdindex(vhigh)){
-		if (PT_PRESENT & pd->pd_physical[vaddr_to_pdindex(vlow)] 
-			&& vaddr_to_ptindex(vlow) != 0 && vaddr_to_ptindex(vhigh) != 0) {
-		        pte_t *pt = (pte_t *)pd->pd_virtual[vaddr_to_pdindex(vlow)];
-		        size_t size = (vaddr_to_ptindex(vhigh) - vaddr_to_ptindex(vlow)+1) * sizeof(*pt);
-		        memset(&pt[vaddr_to_ptindex(vlow)], 0, size);
-        	}
-		return;
-	}
-	*/
-        index = vaddr_to_ptindex(vlow);
-        if (PT_PRESENT & pd->pd_physical[vaddr_to_pdindex(vlow)] && index != 0) {
-                pte_t *pt = (pte_t *)pd->pd_virtual[vaddr_to_pdindex(vlow)];
-                size_t size = (PT_ENTRY_COUNT - index) * sizeof(*pt);
-                memset(&pt[index], 0, size);
-        }
-        vlow += PAGE_SIZE * ((PT_ENTRY_COUNT - index) % PT_ENTRY_COUNT);
 
-        index = vaddr_to_ptindex(vhigh);
-        if (PT_PRESENT & pd->pd_physical[vaddr_to_pdindex(vhigh)] && index != 0) {
-                pte_t *pt = (pte_t *)pd->pd_virtual[vaddr_to_pdindex(vhigh)];
-                size_t size = index * sizeof(*pt);
-                memset(&pt[0], 0, size);
+        while (vlow < vhigh) {
+                uint32_t table = vaddr_to_pdindex(vlow);
+                uintptr_t vend = MIN(vhigh, (table + 1) * PT_VADDR_SIZE);
+                int whole = (0 == vaddr_to_ptindex(vlow) && 0 == vaddr_to_ptindex(vend));
+                pte_t *pt;
+
+                /* nothing is cached for addresses without a page table */
+                if (PD_PRESENT & pd->pd_physical[table])
+                        tlb_gather_range(tg, vlow, vend);
+                if (whole && pde_is_large(pd->pd_physical[table])) {
+                        pt_drop_large(pd, table);
+                } else if (NULL != (pt = pt_get_table(pd, table))) {
+                        pt_clear_entries(pd, pt, vlow, vend);
+                        /* page tables with nothing left in them go away */
+                        if (0 == pd->pd_nentries[table])
+                                pt_free_table(pd, table, tg);
+                }
+                vlow = vend;
         }
-        vhigh -= PAGE_SIZE * index;
+}
 
-        uint32_t i;
-        for (i = vaddr_to_pdindex(vlow); i < vaddr_to_pdindex(vhigh); ++i) {
-                if (PT_PRESENT & pd->pd_physical[i]) {
-                        page_free(pd->pd_virtual[i]);
-                        pd->pd_virtual[i] = NULL;
-                        pd->pd_physical[i] = 0;
+void
+pt_protect_range(pagedir_t *pd, uintptr_t vlow, uintptr_t vhigh, uint32_t ptflags,
+                 struct tlb_gather *tg)
+{
+        KASSERT(vlow <= vhigh);
+        KASSERT(PAGE_ALIGNED(vlow) && PAGE_ALIGNED(vhigh));
+        KASSERT(USER_MEM_LOW <= vlow && USER_MEM_HIGH >= vhigh);
+        KASSERT((ptflags & ~PAGE_MASK) == ptflags);
+        KASSERT(!(PT_PRESENT & ptflags));
+
+        while (vlow < vhigh) {
+                uint32_t table = vaddr_to_pdindex(vlow);
+                /* the end of this page table's part of the range */
+                uintptr_t vend = MIN(vhigh, (table + 1) * PT_VADDR_SIZE);
+                pte_t *pt;
+
+                if (PD_PRESENT & pd->pd_physical[table])
+                        tlb_gather_range(tg, vlow, vend);
+                if (0 == vaddr_to_ptindex(vlow) && 0 == vaddr_to_ptindex(vend)
+                    && pde_is_large(pd->pd_physical[table])) {
+                        /* the flags mean the same in the directory entry */
+                        pd->pd_physical[table] &= ~ptflags;
+                } else if (NULL != (pt = pt_get_table(pd, table))) {
+                        uint32_t i = vaddr_to_ptindex(vlow);
+                        uint32_t n = (vend - vlow) >> PAGE_SHIFT;
+                        for (; n > 0; ++i, --n) {
+                                pt[i] &= ~ptflags;
+                        }
                 }
+                vlow = vend;
         }
 }
 
+int
+pt_copy_range(pagedir_t *dest, pagedir_t *src, uintptr_t vlow, uintptr_t vhigh)
+{
+        KASSERT(vlow <= vhigh);
+        KASSERT(PAGE_ALIGNED(vlow) && PAGE_ALIGNED(vhigh));
+        KASSERT(USER_MEM_LOW <= vlow && USER_MEM_HIGH >= vhigh);
+
+        while (vlow < vhigh) {
+                uint32_t table = vaddr_to_pdindex(vlow);
+                uintptr_t vend = MIN(vhigh, (table + 1) * PT_VADDR_SIZE);
+
+                if (PT_PRESENT & src->pd_physical[table]) {
+                        pde_t spde = src->pd_physical[table];
+                        pte_t *spt = pde_to_table(spde);
+                        uint32_t i = vaddr_to_ptindex(vlow);
+                        uint32_t n = (vend - vlow) >> PAGE_SHIFT;
+                        for (; n > 0; ++i, --n) {
+                                uintptr_t vaddr = (table * PT_ENTRY_COUNT + i) << PAGE_SHIFT;
+                                /* dest gets 4mb pages as ordinary pages */
+                                pte_t spte = (PD_SIZE & spde) ? pt_large_pte(spde, i) : spt[i];
+                                int ret;
+
+                                if (!(PT_PRESENT & spte))
+                                        continue;
+                                /* pt_map allocates dest's page table only
+                                 * once there is something to put in it,
+                                 * and records the new mapping of the page */
+                                ret = pt_map(dest, vaddr, spte & PAGE_MASK,
+                                             spde & (PD_PRESENT | PD_WRITE | PD_USER),
+                                             spte & ~PAGE_MASK);
+                                if (ret < 0)
+                                        return ret;
+                        }
+                }
+                vlow = vend;
+        }
+        return 0;
+}
 
 pagedir_t *
 pt_create_pagedir()
 {
-        KASSERT(sizeof(pagedir_t) == PAGE_SIZE * 2);
-
         pagedir_t *pdir;
-        if (NULL == (pdir = page_alloc_n(2))) {
+        if (NULL == (pdir = slab_obj_alloc(pagedir_allocator))) {
                 return NULL;
         }
 
-        memcpy(pdir, template_pagedir, sizeof(*pdir));
+        /* shares the template's page directory until pt_unshare */
+        pdir->pd_physical = template_pagedir->pd_physical;
+        memset(pdir->pd_nentries, 0, sizeof(pdir->pd_nentries));
         return pdir;
 }
 
 void
 pt_destroy_pagedir(pagedir_t *pdir)
 {
-        KASSERT(PAGE_ALIGNED(pdir));
+        KASSERT(current_pagedir != pdir);
 
         uint32_t begin = USER_MEM_LOW / PT_VADDR_SIZE;
         uint32_t end = (USER_MEM_HIGH - 1) / PT_VADDR_SIZE;
         KASSERT(begin < end && begin > 0);
 
+        if (template_pagedir->pd_physical == pdir->pd_physical) {
+                slab_obj_free(pagedir_allocator, pdir);
+                return;
+        }
+
         uint32_t i;
         for (i = begin; i <= end; ++i) {
-                if (PT_PRESENT & pdir->pd_physical[i]) {
-                        page_free(pdir->pd_virtual[i]);
+                if (pde_is_large(pdir->pd_physical[i])) {
+                        pt_drop_large(pdir, i);
+                } else if (PT_PRESENT & pdir->pd_physical[i]) {
+                        uintptr_t vlow = MAX(i * PT_VADDR_SIZE, USER_MEM_LOW);
+                        uintptr_t vhigh = MIN((i + 1) * PT_VADDR_SIZE, USER_MEM_HIGH);
+                        pt_clear_entries(pdir, pde_to_table(pdir->pd_physical[i]), vlow, vhigh);
+                        pt_free_table(pdir, i, NULL);
                 }
         }
-        page_free_n(pdir, 2);
+        page_free(pdir->pd_physical);
+        slab_obj_free(pagedir_allocator, pdir);
 }
 
 static void
@@ -237,10 +603,21 @@ _pt_fault_handler(regs_t *regs)
         /* Get the address where the fault occurred */
         __asm__ volatile("movl %%cr2, %0" : "=r"(vaddr));
         uint32_t cause = regs->r_err;
+        uintptr_t fixup;
 
         /* Check if pagefault was in user space (otherwise, BAD!) */
         if (cause & FAULT_USER) {
                 handle_pagefault(vaddr, cause);
+        } else if (vaddr < USER_MEM_HIGH
+                   && 0 != (fixup = user_access_fixup(regs->r_eip))) {
+                /* the kernel copying to or from user memory, which is
+                 * handled like a fault from user space, except that it
+                 * is the copy which fails if the access isn't allowed */
+                vm_stat_inc(vs_uaccess_faults);
+                if (vm_fault(vaddr, cause) < 0) {
+                        vm_stat_inc(vs_uaccess_fixups);
+                        regs->r_eip = fixup;
+                }
         } else {
                 panic("\nPage faulted while accessing 0x%08x\n", vaddr);
         }
@@ -270,7 +647,22 @@ _pt_fill_page(pagedir_t *pd, pte_t *pt, pde_t pdflags, pte_t ptflags,
         uintptr_t page = pagetable[entry] & PAGE_MASK;
 
         pd->pd_physical[base] = page | (pdflags & ~(PAGE_MASK));
-        pd->pd_virtual[base] = pt;
+}
+
+/* Turns on 4mb pages if the processor has them */
+static void
+pt_pse_init(void)
+{
+        uint32_t a, d, cr4;
+
+        cpuid(CPUID_GETFEATURES, &a, &d);
+        if (!(CPUID_FEAT_EDX_PSE & d)) {
+                dbgq(DBG_MM, "4mb pages not supported\n");
+                return;
+        }
+        __asm__ volatile("movl %%cr4, %0" : "=r"(cr4));
+        __asm__ volatile("movl %0, %%cr4" :: "r"(cr4 | CR4_PSE));
+        pt_pse = 1;
 }
 
 void
@@ -285,50 +677,65 @@ pt_init(void)
         pde_t *temppdir;
         __asm__ volatile("movl %%cr3, %0" : "=r"(temppdir));
 
-        pagedir_t *pagedir = (pagedir_t *)&kernel_end;
+        pagedir_t *pagedir = &boot_pagedir;
+        pagedir->pd_physical = (pde_t *)&kernel_end;
         /* The kernel ending address should be page aligned by the linker script */
-        KASSERT(PAGE_ALIGNED(pagedir));
-        memset(pagedir, 0, sizeof(*pagedir));
+        KASSERT(PAGE_ALIGNED(pagedir->pd_physical));
+        memset(pagedir->pd_physical, 0, PAGE_SIZE);
 
         /* set up the necessary stuff for temporary mappings */
-        final_page = (pde_t *)((char *)pagedir + sizeof(*pagedir));
+        final_page = (pte_t *)((char *)pagedir->pd_physical + PAGE_SIZE);
         KASSERT(PAGE_ALIGNED(final_page));
         memset(final_page, 0, PAGE_SIZE);
         temppdir[PT_ENTRY_COUNT - 1] = ((uintptr_t)final_page
                                         - (uintptr_t)&kernel_start + KERNEL_PHYS_BASE) | PT_PRESENT | PT_WRITE;
         pagedir->pd_physical[PT_ENTRY_COUNT - 1] = temppdir[PT_ENTRY_COUNT - 1];
-        pagedir->pd_virtual[PT_ENTRY_COUNT - 1] = final_page;
 
         /* identity map the first 4mb (one page table) of physical memory */
         pte_t *pagetable = final_page + PT_ENTRY_COUNT;
         _pt_fill_page(pagedir, pagetable, PD_PRESENT | PD_WRITE, PT_PRESENT | PT_WRITE, 0, 0);
 
-        /* map in 4mb (one page table) where the kernel is
-         * this will make our new page table identical to the temporary
-         * page table the boot loader created. */
+        /* map in the first 4mb (one page table) of physical memory,
+         * where the kernel is, at KERNEL_VIRT_BASE. This will make our
+         * new page table identical to the temporary page table the boot
+         * loader created. */
         pagetable += PT_ENTRY_COUNT;
         _pt_fill_page(pagedir, pagetable, PD_PRESENT | PD_WRITE, PT_PRESENT | PT_WRITE,
-                      (uintptr_t)&kernel_start, KERNEL_PHYS_BASE);
+                      KERNEL_VIRT_BASE, 0);
 
         current_pagedir = pagedir;
         /* swap the temporary page table with our identical, but more
          * permanant page table */
         pt_set(pagedir);
 
+        /* make read-only pages read-only for the kernel too, so that
+         * copy_to_user faults (and copies on write) on the pages of
+         * private mappings rather than writing through to them */
+        uint32_t cr0;
+        __asm__ volatile("movl %%cr0, %0" : "=r"(cr0));
+        __asm__ volatile("movl %0, %%cr0" : : "r"(cr0 | CR0_WP) : "memory");
+
         uintptr_t physmax = phys_detect_highmem();
         dbgq(DBG_MM, "Highest usable physical memory: 0x%08x\n", physmax);
         dbgq(DBG_MM, "Available memory: 0x%08x\n", physmax - KERNEL_PHYS_BASE);
 
-        uintptr_t vaddr = ((uintptr_t)&kernel_start);
-        uintptr_t paddr = KERNEL_PHYS_BASE;
-        do {
-                pagetable += PT_ENTRY_COUNT;
-                vaddr += PT_VADDR_SIZE;
-                paddr += PT_VADDR_SIZE;
-                _pt_fill_page(pagedir, pagetable, PD_PRESENT | PD_WRITE, PT_PRESENT | PT_WRITE, vaddr, paddr);
-        } while (paddr < physmax);
+        /* map the rest of physical memory, with 4mb pages if we can,
+         * which saves a page table and lots of TLB entries per 4mb */
+        pt_pse_init();
+        uintptr_t paddr;
+        for (paddr = PT_VADDR_SIZE; paddr < physmax; paddr += PT_VADDR_SIZE) {
+                uintptr_t vaddr = KERNEL_VIRT_BASE + paddr;
+
+                if (pt_pse) {
+                        pagedir->pd_physical[vaddr_to_pdindex(vaddr)] =
+                                paddr | PD_PRESENT | PD_WRITE | PD_SIZE;
+                } else {
+                        pagetable += PT_ENTRY_COUNT;
+                        _pt_fill_page(pagedir, pagetable, PD_PRESENT | PD_WRITE, PT_PRESENT | PT_WRITE, vaddr, paddr);
+                }
+        }
 
-        page_add_range((uintptr_t) pagetable + PT_ENTRY_COUNT, physmax + ((uintptr_t)&kernel_start) - KERNEL_PHYS_BASE);
+        page_add_range((uintptr_t)(pagetable + PT_ENTRY_COUNT), KERNEL_VIRT_BASE + physmax);
 }
 
 void
@@ -337,13 +744,21 @@ pt_template_init()
         /* the current page directory should be the same one set up by
          * the pt_init function above, it needs to be slighly modified
          * to remove the mapping of the first 4mb and then saved in a
-         * seperate page as the template */
-        memset(current_pagedir->pd_virtual[0], 0, PAGE_SIZE);
+         * seperate page as the template, which has only the kernel's
+         * half of the address space */
+        memset(pde_to_table(current_pagedir->pd_physical[0]), 0, PAGE_SIZE);
         tlb_flush_all();
 
-        template_pagedir = page_alloc_n(2);
+        pagedir_allocator = slab_allocator_create("pagedir", sizeof(pagedir_t));
+        KASSERT(NULL != pagedir_allocator);
+
+        template_pagedir = slab_obj_alloc(pagedir_allocator);
         KASSERT(NULL != template_pagedir);
-        memcpy(template_pagedir, current_pagedir, sizeof(*template_pagedir));
+        template_pagedir->pd_physical = page_alloc();
+        KASSERT(NULL != template_pagedir->pd_physical);
+        memcpy(template_pagedir->pd_physical, current_pagedir->pd_physical, PAGE_SIZE);
+        memset(template_pagedir->pd_physical, 0, PT_USER_TABLES * sizeof(pde_t));
+        memset(template_pagedir->pd_nentries, 0, sizeof(template_pagedir->pd_nentries));
 
         intr_register(INTR_PAGE_FAULT, _pt_fault_handler);
 }
@@ -366,25 +781,25 @@ pt_mapping_info(const void *pt, char *buf, size_t osize)
         int started = 0;
 
         while (PT_ENTRY_COUNT > pdi) {
-                pte_t *entry = NULL;
-                if (PD_PRESENT & pagedir->pd_physical[pdi]) {
-                        if (PT_PRESENT & pagedir->pd_virtual[pdi][pti]) {
-                                entry = &pagedir->pd_virtual[pdi][pti];
-                        }
+                pte_t entry = 0;
+                if (pde_is_large(pagedir->pd_physical[pdi])) {
+                        entry = pt_large_pte(pagedir->pd_physical[pdi], pti);
+                } else if (PD_PRESENT & pagedir->pd_physical[pdi]) {
+                        entry = pde_to_table(pagedir->pd_physical[pdi])[pti];
                 } else {
                         ++pdi;
                         pti = 0;
                 }
 
-                int present = (NULL != entry);
+                int present = (PT_PRESENT & entry);
                 pexpect += PAGE_SIZE;
                 if (present && !started) {
                         started = 1;
                         vstart = (pdi * PT_ENTRY_COUNT + pti) * PAGE_SIZE;
-                        pstart = *entry & PAGE_MASK;
+                        pstart = entry & PAGE_MASK;
                         pexpect = pstart;
                 } else if ((started && !present)
-                           || (started && present && ((*entry & PAGE_MASK) != pexpect))) {
+                           || (started && present && ((entry & PAGE_MASK) != pexpect))) {
                         uintptr_t vend = (pdi * PT_ENTRY_COUNT + pti) * PAGE_SIZE;
                         uintptr_t pend = pstart + (vend - vstart);
 
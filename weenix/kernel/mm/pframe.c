@@ -4,8 +4,10 @@
 
 #include "proc/proc.h"
 
+#include "util/bits.h"
 #include "util/debug.h"
 #include "util/string.h"
+#include "util/time.h"
 
 #include "mm/mmobj.h"
 #include "mm/page.h"
@@ -16,6 +18,8 @@
 #include "mm/pagetable.h"
 
 #include "vm/vmmap.h"
+#include "vm/swap.h"
+#include "vm/faulttrace.h"
 
 /*
  * In this file, physical pages (as represented by pframes) will be
@@ -45,8 +49,10 @@
  * because if we needed to claim the page frame they're using, we could write
  * the data out to disk and use that page frame.
  *
- * By contrast, pages used by anonymous mappings are pinned because they can't
- * be paged out - there's no other copy of the data they contain.
+ * Pages used by anonymous mappings (anonymous and shadow objects) are
+ * allocated too: their cleanpage op writes them out to swap (see
+ * vm/swap.c). Unlike file pages they are only written out when they are
+ * reclaimed, not by flushd or sync(2), since nobody else can look at them.
  *
  *
  * When a page is allocated or pinned:
@@ -61,6 +67,13 @@
  *     - pf_link links the page into free_list
  *     - pf_hlink does not link the page into any list
  *     - pf_olink does not link the page into any list
+ *
+ * Every page also links itself (pf_plink) into a hash keyed by its physical
+ * address, and keeps a list (pf_rmap) of the page table entries that map
+ * it, the "reverse map". The page table code (mm/pagetable.c) adds and
+ * removes entries as it maps and unmaps pages; this lets us unmap a page
+ * from exactly the address spaces which map it, and look at the accessed
+ * and dirty bits the MMU sets in the entries.
  */
 
 /* Page management structures:
@@ -82,6 +95,12 @@ static list_t pinned_list;
 static int nallocated;
 static list_t alloc_list;
 
+/*     Number of allocated and pinned pages that are dirty and have to be
+ *     written back to a file. Dirty swap-backed pages don't count, they
+ *     are only written out by pageoutd. */
+static int ndirty;
+#define pframe_is_writeback(pf)  (!mmobj_is_swapbacked((pf)->pf_obj))
+
 static slab_allocator_t *pframe_allocator;
 
 /* Used to quickly look up pframes. ALL pages "owned by" some
@@ -91,33 +110,128 @@ static slab_allocator_t *pframe_allocator;
                                   % PF_HASH_SIZE)
 static list_t pframe_hash[PF_HASH_SIZE];
 
+/* Used to find the pframe of the page frame a page table entry maps
+ * physical address --> list of pframes */
+#define hash_paddr(paddr)        (ADDR_TO_PN(paddr) % PF_PHYS_HASH_SIZE)
+static list_t pframe_phys_hash[PF_PHYS_HASH_SIZE];
+
+/*   An entry in a page's reverse map: pd maps the page at vaddr */
+typedef struct pframe_rmap {
+        pagedir_t          *rm_pd;
+        uintptr_t           rm_vaddr;
+        list_link_t         rm_link;
+} pframe_rmap_t;
+
+static slab_allocator_t *pframe_rmap_allocator;
+
+/* Page cache statistics: */
+static pframe_stats_t pframe_stats;
+static uint32_t pframe_stall_hist[PFRAME_STALL_BUCKETS];
+static uint64_t pframe_stall_max;
+
+/*   Per-object counters, in a hash keyed by object. An entry is created
+ *   when the object gets its first resident page and goes away when it
+ *   loses its last one, so we never hold on to a dead object. */
+typedef struct pframe_objstats {
+        mmobj_t            *pos_obj;
+        pframe_stats_t      pos_stats;
+        list_link_t         pos_link;
+} pframe_objstats_t;
+
+#define hash_obj(obj)       ((((uint32_t)(obj)) >> 4) % PF_HASH_SIZE)
+static list_t pframe_objstats_hash[PF_HASH_SIZE];
+static slab_allocator_t *pframe_objstats_allocator;
+
+/*   Bump counter 'field' globally and for 'obj' */
+#define pframe_stat_inc(obj, field)                                     \
+        do {                                                            \
+                pframe_objstats_t *__pos = objstats_lookup(obj);        \
+                pframe_stats.field++;                                   \
+                if (NULL != __pos)                                      \
+                        __pos->pos_stats.field++;                       \
+        } while (0)
+
 /* Related to the Pageout daemon: */
 
+/*
+ * Free page watermarks. pageoutd is woken up when the number of free pages
+ * drops below nfreepages_low and then reclaims pages until there are
+ * nfreepages_high free ones, so that it isn't woken up again right away.
+ * Threads allocating a page when there are fewer than nfreepages_min free
+ * pages don't just wait for pageoutd but reclaim a bounded number of pages
+ * themselves (see pframe_alloc_direct).
+ */
 static uint32_t nfreepages_min = 0;
-static uint32_t nfreepages_target = 0;
+static uint32_t nfreepages_low = 0;
+static uint32_t nfreepages_high = 0;
 
 /*   pageoutd sleeps on this queue */
 static proc_t *pageoutd = NULL;
 static kthread_t *pageoutd_thr = NULL;
 static ktqueue_t pageoutd_waitq;
 
-/* threads waiting for pageoutd to run sleep on this queue */
-static ktqueue_t alloc_waitq;
-
 /* Pageout daemon functions */
 static void *pageoutd_run(int arg1, void *arg2);
 static void pageoutd_exit(void);
+static int pframe_reclaim(uint32_t target, int maxscan, int wait);
 #define pageoutd_wakeup()        (sched_broadcast_on(&pageoutd_waitq))
 #define pageoutd_needed()        \
-	((page_free_count() <= nfreepages_min) && (!list_empty(&alloc_list)))
-#define pageoutd_target_met()    (page_free_count() >= nfreepages_target)
+        ((page_free_count() < nfreepages_low) && (!list_empty(&alloc_list)))
+#define direct_reclaim_needed()  (page_free_count() < nfreepages_min)
+
+/* Related to write-back: */
+
+/*   Tunables, see config.h for what they mean */
+int pframe_dirty_expire = PFRAME_DIRTY_EXPIRE;
+int pframe_flush_interval = PFRAME_FLUSH_INTERVAL;
+int pframe_dirty_background_ratio = PFRAME_DIRTY_BACKGROUND_RATIO;
+int pframe_dirty_ratio = PFRAME_DIRTY_RATIO;
+
+/*   flushd periodically writes back pages that have been dirty too long */
+static proc_t *flushd = NULL;
+static kthread_t *flushd_thr = NULL;
+
+static void *flushd_run(int arg1, void *arg2);
+static void flushd_exit(void);
+#define dirty_limit(ratio)       ((nallocated * (ratio)) / 100)
+
+/* Related to asynchronous page fills: */
+
+/*
+ * An outstanding pframe_get_async request. If pr_pf is non-NULL the issuer
+ * allocated the page and marked it busy, and it still has to be filled.
+ * Otherwise the page was already busy when the request was issued and
+ * pframe_iod just waits for it with pframe_get. Each request holds a
+ * reference on pr_obj until its callback has run.
+ */
+typedef struct pframe_ioreq {
+        mmobj_t                *pr_obj;
+        uint32_t                pr_pagenum;
+        pframe_t               *pr_pf;
+        pframe_async_func_t     pr_done;
+        void                   *pr_arg;
+        list_link_t             pr_link;
+} pframe_ioreq_t;
+
+static slab_allocator_t *pframe_ioreq_allocator;
+
+/*   requests waiting for pframe_iod, in the order they were issued */
+static list_t pframe_ioq;
+
+/*   pframe_iod sleeps on this queue */
+static proc_t *pframe_iod = NULL;
+static kthread_t *pframe_iod_thr = NULL;
+static ktqueue_t pframe_iod_waitq;
+
+static void *pframe_iod_run(int arg1, void *arg2);
+static void pframe_iod_exit(void);
 
 
 /*
  * Initialize the pinned and allocated counts and lists. Then, make a pframe
  * slab allocator. You should also list_init all the lists that make
  * up the pframe_hash. Finally, you need to set things up for pageoutd to
- * run by setting nfreepages_min and nfreepages_target.
+ * run by setting the free page watermarks.
  */
 void
 pframe_init(void)
@@ -127,6 +241,7 @@ pframe_init(void)
         list_init(&pinned_list);
         nallocated = 0;
         list_init(&alloc_list);
+        ndirty = 0;
 
         pframe_allocator = slab_allocator_create("pframe", sizeof(pframe_t));
         KASSERT(NULL != pframe_allocator);
@@ -136,12 +251,37 @@ pframe_init(void)
         for (i = 0; i < PF_HASH_SIZE; ++i)
                 list_init(&pframe_hash[i]);
 
-        /* initialize pageout parameters: */
-        nfreepages_target = page_free_count() >> 1;
-        nfreepages_min = 0;
+        /* initialize reverse mappings: */
+        for (i = 0; i < PF_PHYS_HASH_SIZE; ++i)
+                list_init(&pframe_phys_hash[i]);
+        pframe_rmap_allocator = slab_allocator_create("pframe_rmap",
+                                                      sizeof(pframe_rmap_t));
+        KASSERT(NULL != pframe_rmap_allocator);
+
+        /* initialize statistics: */
+        memset(&pframe_stats, 0, sizeof(pframe_stats));
+        pframe_objstats_allocator =
+                slab_allocator_create("pframe_objstats", sizeof(pframe_objstats_t));
+        KASSERT(NULL != pframe_objstats_allocator);
+        for (i = 0; i < PF_HASH_SIZE; ++i)
+                list_init(&pframe_objstats_hash[i]);
 
-		/* initialize alloc_waitq */
-		sched_queue_init(&alloc_waitq);
+        /* initialize pageout parameters: */
+        uint32_t nfree = page_free_count();
+        nfreepages_min = nfree >> PAGEOUTD_FREE_MIN_SHIFT;
+        nfreepages_low = nfree >> PAGEOUTD_FREE_LOW_SHIFT;
+        nfreepages_high = nfree >> PAGEOUTD_FREE_HIGH_SHIFT;
+        KASSERT(nfreepages_min <= nfreepages_low
+                && nfreepages_low <= nfreepages_high);
+
+        memset(pframe_stall_hist, 0, sizeof(pframe_stall_hist));
+        pframe_stall_max = 0;
+
+        /* initialize the asynchronous fill queue: */
+        pframe_ioreq_allocator = slab_allocator_create("pframe_ioreq",
+                                                       sizeof(pframe_ioreq_t));
+        KASSERT(NULL != pframe_ioreq_allocator);
+        list_init(&pframe_ioq);
 }
 
 void
@@ -149,12 +289,21 @@ pframe_shutdown()
 {
         KASSERT(PID_IDLE == curproc->p_pid); /* Should call from idleproc */
 
-        /* Stop pageoutd and wait for it */
+        /* Stop pageoutd, pframe_iod and flushd and wait for them */
+        int pid = pageoutd->p_pid;
+        int iopid = pframe_iod->p_pid;
+        int flushpid = flushd->p_pid;
         pageoutd_exit();
+        pframe_iod_exit();
+        flushd_exit();
 
-        int pid = pageoutd->p_pid;
-        int child = do_waitpid(-1, 0, NULL);
+        int child = do_waitpid(pid, 0, NULL);
         KASSERT(pid == child && "waited on process other than pageoutd");
+        child = do_waitpid(iopid, 0, NULL);
+        KASSERT(iopid == child && "waited on process other than pframe_iod");
+        child = do_waitpid(flushpid, 0, NULL);
+        KASSERT(flushpid == child && "waited on process other than flushd");
+        KASSERT(list_empty(&pframe_ioq));
         KASSERT(0 == npinned && "WARNING: FOUND PINNED "
                 "PAGES!!!!!!!!!! SOMETHING IS BROKEN!!\n");
 
@@ -171,6 +320,142 @@ pframe_shutdown()
         } list_iterate_end();
 }
 
+/*
+ * Find the per-object counters of o, NULL if it has no resident pages.
+ */
+static pframe_objstats_t *
+objstats_lookup(mmobj_t *o)
+{
+        pframe_objstats_t *pos;
+
+        list_iterate_begin(&pframe_objstats_hash[hash_obj(o)], pos,
+                           pframe_objstats_t, pos_link) {
+                if (o == pos->pos_obj)
+                        return pos;
+        } list_iterate_end();
+        return NULL;
+}
+
+/*
+ * Called when o gets a resident page. If it is its first one, start
+ * keeping counters for it (if we can).
+ */
+static void
+objstats_add_page(mmobj_t *o)
+{
+        pframe_objstats_t *pos;
+
+        if (1 != o->mmo_nrespages)
+                return;
+        KASSERT(NULL == objstats_lookup(o));
+        if (NULL == (pos = slab_obj_alloc(pframe_objstats_allocator)))
+                return;
+        pos->pos_obj = o;
+        memset(&pos->pos_stats, 0, sizeof(pos->pos_stats));
+        list_insert_head(&pframe_objstats_hash[hash_obj(o)], &pos->pos_link);
+}
+
+/*
+ * Called when o loses a resident page, drops its counters once it has none
+ * left since the object may go away at any time after that.
+ */
+static void
+objstats_remove_page(mmobj_t *o)
+{
+        pframe_objstats_t *pos;
+
+        if (0 != o->mmo_nrespages)
+                return;
+        if (NULL != (pos = objstats_lookup(o))) {
+                list_remove(&pos->pos_link);
+                slab_obj_free(pframe_objstats_allocator, pos);
+        }
+}
+
+/*
+ * Copy the global page cache counters into stats.
+ */
+void
+pframe_get_stats(pframe_stats_t *stats)
+{
+        *stats = pframe_stats;
+}
+
+/*
+ * Copy the allocation stall histogram (PFRAME_STALL_BUCKETS entries, bucket
+ * i counts stalls of 2^i to 2^(i+1) - 1 cycles) and the longest stall.
+ */
+void
+pframe_get_stall_hist(uint32_t *hist, uint64_t *max)
+{
+        memcpy(hist, pframe_stall_hist, sizeof(pframe_stall_hist));
+        *max = pframe_stall_max;
+}
+
+void
+pframe_get_watermarks(uint32_t *min, uint32_t *low, uint32_t *high)
+{
+        *min = nfreepages_min;
+        *low = nfreepages_low;
+        *high = nfreepages_high;
+}
+
+/*
+ * Record an allocation that stalled for the given number of cycles.
+ */
+static void
+pframe_record_stall(mmobj_t *o, uint64_t cycles)
+{
+        int bucket = bit_log2(cycles);
+
+        if (bucket >= PFRAME_STALL_BUCKETS)
+                bucket = PFRAME_STALL_BUCKETS - 1;
+        pframe_stall_hist[bucket]++;
+        if (cycles > pframe_stall_max)
+                pframe_stall_max = cycles;
+        pframe_stat_inc(o, ps_stalls);
+}
+
+/*
+ * Find the (at most) max objects with the most resident pages, in
+ * decreasing order. Their counters are copied into stats. A reference is
+ * taken on each object found, which the caller has to put.
+ *
+ * @return the number of objects found
+ */
+int
+pframe_top_objects(mmobj_t **objs, pframe_stats_t *stats, int max)
+{
+        pframe_objstats_t *pos;
+        int n = 0;
+        int i, j;
+
+        for (i = 0; i < PF_HASH_SIZE; ++i) {
+                list_iterate_begin(&pframe_objstats_hash[i], pos,
+                                   pframe_objstats_t, pos_link) {
+                        /* insertion sort into the (short) result array */
+                        for (j = n; j > 0; --j) {
+                                if (objs[j - 1]->mmo_nrespages
+                                    >= pos->pos_obj->mmo_nrespages)
+                                        break;
+                                if (j < max) {
+                                        objs[j] = objs[j - 1];
+                                        stats[j] = stats[j - 1];
+                                }
+                        }
+                        if (j < max) {
+                                objs[j] = pos->pos_obj;
+                                stats[j] = pos->pos_stats;
+                                if (n < max)
+                                        n++;
+                        }
+                } list_iterate_end();
+        }
+        for (i = 0; i < n; ++i)
+                objs[i]->mmo_ops->ref(objs[i]);
+        return n;
+}
+
 /*
  * Obtain the (unique) page identified by 'o' and 'pagenum' only if this page is
  * already resident; if this page is not already resident, NULL is
@@ -211,31 +496,27 @@ pframe_get_resident(struct mmobj *o, uint32_t pagenum)
 }
 
 /*
- * Allocate a pframe to hold the page identified by the object and page number.
- * The given page should not already be resident.
+ * Allocate a pframe to hold the page identified by the object and page number
+ * in the page frame at addr. The given page should not already be resident.
  *
- * We allocate a page from the free list. We then initialize the newly allocated
- * page's object, pagenum, and flags, pin count, and links. We also update the
- * object's nrespages.
+ * We initialize the newly allocated page's object, pagenum, and flags, pin
+ * count, and links. We also update the object's nrespages.
  *
  * @param o the mmobj identifying this page
  * @param pagenum the page number of this page in the object
+ * @param addr the page frame
  *
- * @return a new pframe
+ * @return a new pframe, NULL if there is no memory for it
  */
 static pframe_t *
-pframe_alloc(mmobj_t *o, uint32_t pagenum)
+pframe_alloc_at(mmobj_t *o, uint32_t pagenum, void *addr)
 {
         pframe_t *pf;
         if (NULL == (pf = slab_obj_alloc(pframe_allocator))) {
                 dbg(DBG_PFRAME, "WARNING: not enough kernel memory\n");
                 return NULL;
         }
-        if (NULL == (pf->pf_addr = page_alloc())) {
-                dbg(DBG_PFRAME, "WARNING: not enough kernel memory\n");
-                slab_obj_free(pframe_allocator, pf);
-                return NULL;
-        }
+        pf->pf_addr = addr;
 
         nallocated++;
         list_insert_tail(&alloc_list, &pf->pf_link);
@@ -248,13 +529,82 @@ pframe_alloc(mmobj_t *o, uint32_t pagenum)
 
         list_insert_head(&pframe_hash[hash_page(o, pagenum)], &pf->pf_hlink);
 
+        pf->pf_paddr = pt_virt_to_phys((uintptr_t)pf->pf_addr);
+        list_insert_head(&pframe_phys_hash[hash_paddr(pf->pf_paddr)], &pf->pf_plink);
+        list_init(&pf->pf_rmap);
+
         o->mmo_ops->ref(o);
         o->mmo_nrespages++;
         list_insert_head(&o->mmo_respages, &pf->pf_olink);
+        objstats_add_page(o);
+
+        return pf;
+}
+
+/*
+ * Allocate a pframe, and a page from the free list, to hold the page
+ * identified by the object and page number. The given page should not
+ * already be resident.
+ *
+ * @return a new pframe, NULL if there is no memory
+ */
+static pframe_t *
+pframe_alloc(mmobj_t *o, uint32_t pagenum)
+{
+        pframe_t *pf;
+        void *addr;
 
+        if (NULL == (addr = page_alloc())) {
+                dbg(DBG_PFRAME, "WARNING: not enough kernel memory\n");
+                return NULL;
+        }
+        if (NULL == (pf = pframe_alloc_at(o, pagenum, addr)))
+                page_free(addr);
         return pf;
 }
 
+/*
+ * Makes the pages [pagenum, pagenum + npages) of o resident in the block
+ * of page frames at addr, which the caller has allocated with page_alloc_n
+ * and filled with their contents. None of the pages may be resident. They
+ * are dirty, since nothing else has a copy of them, and from then on are
+ * pages like any other, freed one at a time.
+ *
+ * This is how anonymous memory gets pages which can be mapped as a 4mb
+ * page (see vm_fault_large).
+ *
+ * @return 0 on success, or -errno if the pages couldn't be made resident,
+ * in which case the block is freed
+ */
+int
+pframe_adopt_block(mmobj_t *o, uint32_t pagenum, uint32_t npages, void *addr)
+{
+        pframe_t *pf;
+        uint32_t i, j;
+        int ret = -ENOMEM;
+
+        for (i = 0; i < npages; ++i) {
+                if (NULL == (pf = pframe_alloc_at(o, pagenum + i,
+                                                  (char *)addr + (i << PAGE_SHIFT))))
+                        goto fail;
+                if ((ret = pframe_dirty(pf)) < 0) {
+                        pframe_free(pf);
+                        goto fail;
+                }
+        }
+        return 0;
+
+fail:
+        /* page frames which have a pframe are freed with it */
+        for (j = i + 1; j < npages; ++j)
+                page_free((char *)addr + (j << PAGE_SHIFT));
+        if (NULL == pf)
+                page_free((char *)addr + (i << PAGE_SHIFT));
+        while (i-- > 0)
+                pframe_free(pframe_get_resident(o, pagenum + i));
+        return ret;
+}
+
 /*
  * Fills the contents of the page (using the mmobj's fillpage op).
  * Make sure to mark the page busy while it's being filled.
@@ -265,6 +615,7 @@ pframe_fill(pframe_t *pf)
 {
         int ret;
 
+        pframe_stat_inc(pf->pf_obj, ps_fills);
         pframe_set_busy(pf);
         ret = pf->pf_obj->mmo_ops->fillpage(pf->pf_obj, pf);
         pframe_clear_busy(pf);
@@ -274,6 +625,35 @@ pframe_fill(pframe_t *pf)
         return ret;
 }
 
+/*
+ * Allocates a page for pframe_get when there are fewer than
+ * nfreepages_min free pages, reclaiming some first. If a pass doesn't
+ * free one (the pages it looked at were busy, dirty or in use), the next
+ * ones wait for busy pages and in-flight write-backs, and in between we
+ * sleep a tick to let pageoutd work, before giving up.
+ *
+ * @return 0 with the page in *result, -EAGAIN if somebody else made the
+ * page resident while we blocked or -ENOMEM if there is no memory even so
+ */
+static int
+pframe_alloc_direct(mmobj_t *o, uint32_t pagenum, pframe_t **result)
+{
+        int i;
+
+        for (i = 0; i < PFRAME_DIRECT_RECLAIM_TRIES; ++i) {
+                pframe_reclaim(nfreepages_low, PFRAME_DIRECT_RECLAIM_PAGES,
+                               0 != i);
+                if (NULL != pframe_get_resident(o, pagenum))
+                        return -EAGAIN;
+                if (NULL != (*result = pframe_alloc(o, pagenum)))
+                        return 0;
+                pageoutd_wakeup();
+                if (time_sleep(1))
+                        break;
+        }
+        return -ENOMEM;
+}
+
 /*
  * Find and return the pframe representing the page identified by the object
  * and page number. If the page is already resident in memory, then we return
@@ -297,34 +677,132 @@ pframe_fill(pframe_t *pf)
 int
 pframe_get(struct mmobj *o, uint32_t pagenum, pframe_t **result)
 {
-		KASSERT(NULL != o);
-		KASSERT(NULL != result);
-		pframe_t *pf;
-		int ret;
-
-		pf = pframe_get_resident(o, pagenum);
-		if(pf == NULL){
-			/* check if we need to call pageoutd and wake it up if necessary */
-			while(pageoutd_needed()){
-				/* wake up pageoutd */
-				pageoutd_wakeup();
-				/* wait for pageoutd finish */
-				sched_sleep_on(&alloc_waitq);
-			}
-			/* allocate a new page */
-			if((pf = pframe_alloc(o, pagenum)) == NULL)
-				return -1;
-
-			/* fill it */
-			ret = pframe_fill(pf);
-			*result = pf;
-			return ret;
-		}
-
-		while(pframe_is_busy(pf))
-			sched_sleep_on(&pf->pf_waitq);
-
-		*result = pf;
+        pframe_t *pf;
+        int ret;
+
+        KASSERT(NULL != o);
+        KASSERT(NULL != result);
+
+        /* A busy page may be freed by whoever has it busy (e.g. after a
+         * failed asynchronous fill), so look it up again after waiting */
+again:
+        while (NULL != (pf = pframe_get_resident(o, pagenum))
+               && pframe_is_busy(pf)) {
+                /* someone else is filling it (e.g. read-ahead), a fault
+                 * waiting for that is as good as a major one */
+                uint64_t start = fault_trace_fill_begin();
+
+                pframe_stat_inc(o, ps_busywaits);
+                sched_sleep_on(&pf->pf_waitq);
+                fault_trace_fill_end(FT_MAJOR, start);
+        }
+
+        if (NULL != pf) {
+                pframe_stat_inc(o, ps_hits);
+        } else {
+                /* check if we need to call pageoutd and wake it up if necessary */
+                if (pageoutd_needed())
+                        pageoutd_wakeup();
+
+                if (direct_reclaim_needed()) {
+                        /* pageoutd is not keeping up, help it out rather
+                         * than waiting for it for an unbounded time */
+                        uint64_t start = time_rdtsc();
+
+                        ret = pframe_alloc_direct(o, pagenum, &pf);
+                        pframe_record_stall(o, time_rdtsc() - start);
+                        if (-EAGAIN == ret)
+                                goto again;
+                } else {
+                        pf = pframe_alloc(o, pagenum);
+                }
+
+                if (NULL == pf) {
+                        *result = NULL;
+                        return -ENOMEM;
+                }
+                pframe_stat_inc(o, ps_misses);
+
+                if ((ret = pframe_fill(pf)) < 0) {
+                        /* don't leave a page with garbage in it resident */
+                        pframe_free(pf);
+                        *result = NULL;
+                        return ret;
+                }
+        }
+
+        *result = pf;
+        return 0;
+}
+
+/*
+ * Like pframe_get, but never blocks. If the page is resident and not busy,
+ * done is called right away. Otherwise a page is allocated and marked busy
+ * (if it is not resident yet) and the request is queued for pframe_iod,
+ * which fills the page, wakes up everybody waiting on its pf_waitq and
+ * then calls done. Anybody calling pframe_get for the page in the meantime
+ * simply waits for the fill to complete.
+ *
+ * This is meant for read-ahead: the caller can issue a number of these and
+ * keep working while the pages come in.
+ *
+ * @param o the parent object of the page
+ * @param pagenum the page number of this page in the object
+ * @param done called once the page is resident (or could not be filled)
+ * @param arg passed through to done
+ * @return 0 if the request was issued (or completed), -EAGAIN if there
+ * are not enough free pages to start a fill without blocking, -ENOMEM if
+ * the request could not be allocated
+ */
+int
+pframe_get_async(struct mmobj *o, uint32_t pagenum,
+                 pframe_async_func_t done, void *arg)
+{
+        pframe_ioreq_t *req;
+        pframe_t *pf;
+
+        KASSERT(NULL != o);
+        KASSERT(NULL != done);
+
+        pf = pframe_get_resident(o, pagenum);
+        if (NULL != pf && !pframe_is_busy(pf)) {
+                done(pf, 0, arg);
+                return 0;
+        }
+
+        if (NULL == pf) {
+                /* Making room is pageoutd's job, the synchronous path can
+                 * reclaim pages itself but we can't */
+                if (pageoutd_needed())
+                        pageoutd_wakeup();
+                if (direct_reclaim_needed())
+                        return -EAGAIN;
+        }
+
+        if (NULL == (req = slab_obj_alloc(pframe_ioreq_allocator)))
+                return -ENOMEM;
+
+        if (NULL == pf) {
+                if (NULL == (pf = pframe_alloc(o, pagenum))) {
+                        slab_obj_free(pframe_ioreq_allocator, req);
+                        return -ENOMEM;
+                }
+                /* busy until pframe_iod has filled it */
+                pframe_set_busy(pf);
+                req->pr_pf = pf;
+        } else {
+                req->pr_pf = NULL;
+        }
+
+        o->mmo_ops->ref(o);
+        req->pr_obj = o;
+        req->pr_pagenum = pagenum;
+        req->pr_done = done;
+        req->pr_arg = arg;
+        list_insert_tail(&pframe_ioq, &req->pr_link);
+
+        sched_broadcast_on(&pframe_iod_waitq);
+
         return 0;
 }
 
@@ -349,10 +827,12 @@ void
 pframe_migrate(pframe_t *pf, mmobj_t *dest)
 {
         KASSERT(!pframe_is_busy(pf));
-        if (NULL != pframe_get_resident(dest, pf->pf_pagenum)) {
-                /* dest already has a newer version of the page, clean this page */
-                pframe_unpin(pf);
-                pframe_clean(pf);
+        if (NULL != pframe_get_resident(dest, pf->pf_pagenum)
+            || swap_has(dest, pf->pf_pagenum)) {
+                /* dest already has a newer version of the page, nobody
+                 * will look at this one again */
+                if (pframe_is_pinned(pf))
+                        pframe_unpin(pf);
                 pframe_free(pf);
         } else {
                 mmobj_t *src = pf->pf_obj;
@@ -360,10 +840,12 @@ pframe_migrate(pframe_t *pf, mmobj_t *dest)
                 list_remove(&pf->pf_hlink);
                 list_remove(&pf->pf_olink);
                 src->mmo_nrespages--;
+                objstats_remove_page(src);
                 src->mmo_ops->put(src);
                 list_insert_head(&pframe_hash[hash_page(dest, pf->pf_pagenum)], &pf->pf_hlink);
                 list_insert_head(&dest->mmo_respages, &pf->pf_olink);
                 dest->mmo_nrespages++;
+                objstats_add_page(dest);
                 dest->mmo_ops->ref(dest);
         }
 }
@@ -442,13 +924,22 @@ int
 pframe_dirty(pframe_t *pf)
 {
         int ret;
+        int wasdirty = pframe_is_dirty(pf);
 
         KASSERT(!pframe_is_busy(pf));
 
+        /* somebody is writing to it directly, it has to be written back
+         * whatever the mappings say */
+        pf->pf_flags &= ~PF_MAPDIRTY;
         pframe_set_busy(pf);
 
         if (!(ret = pf->pf_obj->mmo_ops->dirtypage(pf->pf_obj, pf))) {
                 pframe_set_dirty(pf);
+                if (!wasdirty) {
+                        if (pframe_is_writeback(pf))
+                                ndirty++;
+                        pf->pf_dirtytime = time_ticks();
+                }
         }
         pframe_clear_busy(pf);
         sched_broadcast_on(&pf->pf_waitq);
@@ -456,6 +947,32 @@ pframe_dirty(pframe_t *pf)
         return ret;
 }
 
+/*
+ * Like pframe_dirty, for a page which is about to be mapped writable
+ * after a write fault. The page is written to through the mapping, so
+ * the MMU's dirty bit in the page table entries says whether it actually
+ * has been by the time it is cleaned, and pframe_clean doesn't write it
+ * back if it hasn't (see PF_MAPDIRTY). Only file pages are treated
+ * specially: anonymous pages without a copy in swap have to be written
+ * out anyway.
+ *
+ * @param pf the page to dirty
+ * @return 0 on success, -errno on failure
+ */
+int
+pframe_dirty_mapped(pframe_t *pf)
+{
+        int wasdirty = pframe_is_dirty(pf);
+        int wasmapdirty = pf->pf_flags & PF_MAPDIRTY;
+        int ret;
+
+        if ((ret = pframe_dirty(pf)) < 0)
+                return ret;
+        if ((!wasdirty || wasmapdirty) && pframe_is_writeback(pf))
+                pf->pf_flags |= PF_MAPDIRTY;
+        return 0;
+}
+
 /*
  * Clean a dirty page by writing it back to disk. Removes the dirty
  * bit of the page and updates the MMU entry.
@@ -482,14 +999,27 @@ pframe_clean(pframe_t *pf)
          * we won't (incorrectly) think the page has been fully cleaned.
          */
         pframe_clear_dirty(pf);
-
-        /* Make sure a future write to the page will fault (and hence dirty it) */
-        tlb_flush((uintptr_t) pf->pf_addr);
-        pframe_remove_from_pts(pf);
+        if (pframe_is_writeback(pf))
+                ndirty--;
+
+        /* Make sure a future write to the page will fault (and hence dirty
+         * it). Reading it doesn't have to. The dirty bits say whether it
+         * was written through the mappings that made it dirty. */
+        if (!(pframe_clear_pte_flags(pf, PT_WRITE | PT_DIRTY) & PT_DIRTY)
+            && (pf->pf_flags & PF_MAPDIRTY)) {
+                pf->pf_flags &= ~PF_MAPDIRTY;
+                pframe_stat_inc(pf->pf_obj, ps_unwritten);
+                return 0;
+        }
+        pf->pf_flags &= ~PF_MAPDIRTY;
 
         pframe_set_busy(pf);
         if ((ret = pf->pf_obj->mmo_ops->cleanpage(pf->pf_obj, pf)) < 0) {
+                if (!pframe_is_dirty(pf) && pframe_is_writeback(pf))
+                        ndirty++;
                 pframe_set_dirty(pf);
+        } else {
+                pframe_stat_inc(pf->pf_obj, ps_dirty_wb);
         }
         pframe_clear_busy(pf);
         sched_broadcast_on(&pf->pf_waitq);
@@ -516,23 +1046,30 @@ pframe_free(pframe_t *pf)
 
         mmobj_t *o = pf->pf_obj;
 
+        /* Whatever has not been written back is lost */
+        if (pframe_is_dirty(pf)) {
+                pframe_clear_dirty(pf);
+                if (pframe_is_writeback(pf))
+                        ndirty--;
+        }
 
-        /* Flush the TLB */
-        tlb_flush((uintptr_t) pf->pf_addr);
         /* Remove from all pagetables that map it */
         pframe_remove_from_pts(pf);
+        KASSERT(list_empty(&pf->pf_rmap));
 
         list_remove(&pf->pf_hlink);
+        list_remove(&pf->pf_plink);
 
         pf->pf_obj = NULL;
         nallocated--;
         list_remove(&pf->pf_link);
 
-        page_free(pf->pf_addr);
-        slab_obj_free(pframe_allocator, pf);
-
         o->mmo_nrespages--;
         list_remove(&pf->pf_olink);
+        objstats_remove_page(o);
+
+        page_free(pf->pf_addr);
+        slab_obj_free(pframe_allocator, pf);
 
         /* Now that pf has effectively been freed, dereference the corresponding
          * object. We don't do this earlier as we are modifying the object's counts
@@ -540,9 +1077,37 @@ pframe_free(pframe_t *pf)
         o->mmo_ops->put(o);
 }
 
+/*
+ * For MADV_FREE: lets a page of anonymous memory whose contents its owner
+ * doesn't need anymore be reclaimed without writing it to swap. The page
+ * is made clean, loses its copy in swap (if any) and goes to the front of
+ * the allocated list, which pageoutd reclaims first. Its mappings are
+ * write-protected, so if it is written again before it is reclaimed the
+ * write fault dirties it and it is kept like any other page.
+ *
+ * The page must not be busy or pinned.
+ * @param pf the page
+ */
+void
+pframe_lazyfree(pframe_t *pf)
+{
+        KASSERT(!pframe_is_busy(pf));
+        KASSERT(!pframe_is_pinned(pf));
+        KASSERT(!pframe_is_writeback(pf));
+
+        pframe_clear_dirty(pf);
+        pf->pf_flags &= ~PF_MAPDIRTY;
+        pframe_clear_pte_flags(pf, PT_WRITE | PT_DIRTY | PT_ACCESSED);
+        swap_discard(pf->pf_obj, pf->pf_pagenum);
+
+        list_remove(&pf->pf_link);
+        list_insert_head(&alloc_list, &pf->pf_link);
+        pframe_stat_inc(pf->pf_obj, ps_lazyfree);
+}
+
 /*
  * Clean all allocated pages (that is, all pages that are not pinned and
- * not free). This is called by sync(2).
+ * not free) which belong to files. This is called by sync(2).
  */
 void
 pframe_clean_all()
@@ -565,7 +1130,7 @@ list_start:
                         sched_sleep_on(&pf->pf_waitq);
                         goto list_start;
                 }
-                if (pframe_is_dirty(pf)) {
+                if (pframe_is_dirty(pf) && pframe_is_writeback(pf)) {
                         pframe_clean(pf);
                         goto list_start;
                 }
@@ -577,26 +1142,332 @@ list_start:
         dbg(DBG_PFRAME, "pframe_clean_all: completed!\n");
 }
 
-/* Remove a page frame from the page tables of all processes that map it
- * To do that, traverse all processes that map the given page frame into
- * their address space, and zero the corresponding address entry.
+/*
+ * Write back up to maxpages dirty allocated file pages which have been dirty
+ * for at least minage ticks, least-recently-requested first. Unlike
+ * pframe_clean_all, the scan carries on after the page it last cleaned
+ * rather than starting over, so it looks at each page once: the page was
+ * busy while we blocked, so it can't have been freed, and it is still on
+ * alloc_list unless it was pinned meanwhile (then we do start over).
+ *
+ * @return the number of pages written back
  */
-void
-pframe_remove_from_pts(pframe_t *pf)
+int
+pframe_flush(uint32_t minage, int maxpages)
 {
-        vmarea_t *vma;
-        list_iterate_begin(mmobj_bottom_vmas(pf->pf_obj), vma, vmarea_t, vma_olink) {
-                /* Get the virtual address in the area corresponding to this pf */
-                if ((pf->pf_pagenum >= vma->vma_off)
-                    && (pf->pf_pagenum < vma->vma_off + (vma->vma_end - vma->vma_start))) {
-                        uintptr_t vaddr = (uintptr_t) PN_TO_ADDR(vma->vma_start + pf->pf_pagenum - vma->vma_off);
-                        /* And unmap it from that area's proc */
-                        if (NULL != vma->vma_vmmap->vmm_proc) {
-                                pt_unmap(vma->vma_vmmap->vmm_proc->p_pagedir, vaddr);
+        list_link_t *link;
+        pframe_t *pf;
+        int nflushed = 0;
+        int ntried = 0;
+        uint32_t now = time_ticks();
+
+        link = alloc_list.l_next;
+        while (link != &alloc_list && ntried < maxpages) {
+                pf = list_item(link, pframe_t, pf_link);
+                if (pframe_is_dirty(pf) && !pframe_is_busy(pf)
+                    && pframe_is_writeback(pf)
+                    && now - pf->pf_dirtytime >= minage) {
+                        /* a page which fails to clean stays dirty, count
+                         * it anyway so that we don't retry it forever */
+                        ntried++;
+                        if (pframe_clean(pf) >= 0)
+                                nflushed++;
+                        now = time_ticks();
+                        if (pframe_is_pinned(pf)) {
+                                link = alloc_list.l_next;
+                                continue;
                         }
                 }
+                link = link->l_next;
+        }
+
+        return nflushed;
+}
+
+/*
+ * Called by writers after they have dirtied pages. If more than
+ * pframe_dirty_ratio percent of the allocated pages are dirty, the caller
+ * is throttled by having it write back some of the oldest dirty pages
+ * itself, so that a process producing dirty data quickly pays for it
+ * instead of everybody else (or the next sync).
+ */
+void
+pframe_balance_dirty(void)
+{
+        if (ndirty <= dirty_limit(pframe_dirty_ratio))
+                return;
+
+        dbg(DBG_PFRAME, "throttling pid %d: %d dirty pages\n",
+            curproc->p_pid, ndirty);
+        pframe_flush(0, PFRAME_THROTTLE_PAGES);
+}
+
+/* ------------------------------------------------------------------ */
+/* ------------------------- REVERSE MAPPING ------------------------ */
+/* ------------------------------------------------------------------ */
+
+/*
+ * Find the page whose page frame is at the given physical address, NULL if
+ * the frame isn't a page (e.g. it is the zero page).
+ */
+pframe_t *
+pframe_from_paddr(uintptr_t paddr)
+{
+        pframe_t *pf;
+
+        paddr = (uintptr_t)PAGE_ALIGN_DOWN(paddr);
+        list_iterate_begin(&pframe_phys_hash[hash_paddr(paddr)], pf, pframe_t,
+                           pf_plink) {
+                if (paddr == pf->pf_paddr)
+                        return pf;
+        } list_iterate_end();
+        return NULL;
+}
+
+/*
+ * Record that pd maps the page frame at paddr at vaddr. Called by pt_map
+ * before it puts the entry in place. Frames which aren't pages aren't
+ * tracked.
+ *
+ * @return 0 on success, -ENOMEM if there is no memory to record it
+ */
+int
+pframe_rmap_add(uintptr_t paddr, pagedir_t *pd, uintptr_t vaddr)
+{
+        pframe_t *pf;
+        pframe_rmap_t *rm;
+
+        if (NULL == (pf = pframe_from_paddr(paddr)))
+                return 0;
+        if (NULL == (rm = slab_obj_alloc(pframe_rmap_allocator)))
+                return -ENOMEM;
+        rm->rm_pd = pd;
+        rm->rm_vaddr = vaddr;
+        list_insert_tail(&pf->pf_rmap, &rm->rm_link);
+        return 0;
+}
+
+/*
+ * Forget that pd maps a page frame at vaddr with the given entry. Called
+ * by the page table code whenever it clears a present entry. If the page
+ * was written through the entry, that mustn't be forgotten.
+ *
+ * @return 0 on success, -ENOENT if the mapping wasn't recorded, in which
+ * case there is nothing to forget
+ */
+int
+pframe_rmap_remove(uint32_t pte, pagedir_t *pd, uintptr_t vaddr)
+{
+        uintptr_t paddr = pte & PAGE_MASK;
+        pframe_t *pf;
+        pframe_rmap_t *rm;
+
+        if (NULL == (pf = pframe_from_paddr(paddr)))
+                return 0;
+        if (PT_DIRTY & pte)
+                pf->pf_flags &= ~PF_MAPDIRTY;
+        list_iterate_begin(&pf->pf_rmap, rm, pframe_rmap_t, rm_link) {
+                if (pd == rm->rm_pd && vaddr == rm->rm_vaddr) {
+                        list_remove(&rm->rm_link);
+                        slab_obj_free(pframe_rmap_allocator, rm);
+                        return 0;
+                }
+        } list_iterate_end();
+        dbg(DBG_PFRAME, "WARNING: page frame 0x%08x mapped at 0x%08x without "
+            "a reverse mapping\n", paddr, vaddr);
+        return -ENOENT;
+}
 
+/*
+ * Clear the given flags (PT_ACCESSED, PT_WRITE, ...) in every page table
+ * entry which maps pf.
+ *
+ * @return the flags which were set in any of them
+ */
+uint32_t
+pframe_clear_pte_flags(pframe_t *pf, uint32_t ptflags)
+{
+        pframe_rmap_t *rm;
+        uint32_t found = 0;
+
+        list_iterate_begin(&pf->pf_rmap, rm, pframe_rmap_t, rm_link) {
+                found |= pt_clear_flags(rm->rm_pd, rm->rm_vaddr, ptflags);
+                /* other address spaces' entries aren't in the TLB */
+                if (pt_get() == rm->rm_pd)
+                        tlb_flush(rm->rm_vaddr);
         } list_iterate_end();
+        return found & ptflags;
+}
+
+/*
+ * Remove a page frame from the page tables of all processes that map it.
+ */
+void
+pframe_remove_from_pts(pframe_t *pf)
+{
+        while (!list_empty(&pf->pf_rmap)) {
+                pframe_rmap_t *rm = list_head(&pf->pf_rmap, pframe_rmap_t, rm_link);
+                pagedir_t *pd = rm->rm_pd;
+                uintptr_t vaddr = rm->rm_vaddr;
+
+                /* this frees rm */
+                pt_unmap(pd, vaddr);
+                if (pt_get() == pd)
+                        tlb_flush(vaddr);
+        }
+}
+
+/* ------------------------------------------------------------------ */
+/* ------------------------- FLUSH DAEMON --------------------------- */
+/* ------------------------------------------------------------------ */
+
+/*
+ * Start flushd.
+ */
+static void
+flushd_init(void)
+{
+        KASSERT(curproc && (PID_IDLE == curproc->p_pid)
+                && "should be calling this from idleproc");
+        flushd = proc_create("flushd");
+        KASSERT(NULL != flushd);
+        flushd_thr = kthread_create(flushd, flushd_run, 0, NULL);
+        KASSERT(NULL != flushd_thr);
+
+        sched_make_runnable(flushd_thr);
+}
+init_func(flushd_init);
+init_depends(sched_init);
+
+/*
+ * Just cancel flushd, the final write-back is done by pframe_shutdown.
+ */
+static void
+flushd_exit()
+{
+        KASSERT(NULL != flushd_thr);
+        kthread_cancel(flushd_thr, (void *) 0);
+        flushd_thr = NULL;
+}
+
+/*
+ * Every pframe_flush_interval ticks, flushd writes back the pages that
+ * have been dirty for longer than pframe_dirty_expire ticks. If more than
+ * pframe_dirty_background_ratio percent of the allocated pages are dirty,
+ * it writes back the oldest ones regardless of their age until it gets
+ * below that. Both arguments unused.
+ */
+static void *
+flushd_run(int arg1, void *arg2)
+{
+        while (1) {
+                int n;
+
+                /* at least a tick, or with nothing to write back flushd
+                 * would never block, and nothing else would get to run */
+                if (time_sleep(MAX(pframe_flush_interval, 1)))
+                        kthread_exit((void *)0);
+
+                n = pframe_flush(pframe_dirty_expire, nallocated);
+                while (ndirty > dirty_limit(pframe_dirty_background_ratio)) {
+                        int flushed = pframe_flush(0, PFRAME_THROTTLE_PAGES);
+                        if (!flushed)
+                                break;
+                        n += flushed;
+                }
+
+                if (n) {
+                        dbg(DBG_PFRAME, "FLUSHD: wrote back %d pages, "
+                            "%d of %d allocated pages still dirty\n",
+                            n, ndirty, nallocated);
+                }
+        }
+        return NULL;
+}
+
+/* ------------------------------------------------------------------ */
+/* ----------------------- ASYNCHRONOUS FILLS ----------------------- */
+/* ------------------------------------------------------------------ */
+
+/*
+ * Start the thread that services pframe_get_async requests.
+ */
+static void
+pframe_iod_init(void)
+{
+        sched_queue_init(&pframe_iod_waitq);
+
+        KASSERT(curproc && (PID_IDLE == curproc->p_pid)
+                && "should be calling this from idleproc");
+        pframe_iod = proc_create("pframe_iod");
+        KASSERT(NULL != pframe_iod);
+        pframe_iod_thr = kthread_create(pframe_iod, pframe_iod_run, 0, NULL);
+        KASSERT(NULL != pframe_iod_thr);
+
+        sched_make_runnable(pframe_iod_thr);
+}
+init_func(pframe_iod_init);
+init_depends(sched_init);
+
+/*
+ * Cancel pframe_iod, it finishes the requests already queued first.
+ */
+static void
+pframe_iod_exit()
+{
+        KASSERT(NULL != pframe_iod_thr);
+        kthread_cancel(pframe_iod_thr, (void *) 0);
+        pframe_iod_thr = NULL;
+}
+
+/*
+ * Complete one request: fill the page (the issuer already marked it busy)
+ * or wait for whoever has it busy, then call the issuer's callback.
+ */
+static void
+pframe_iod_complete(pframe_ioreq_t *req)
+{
+        pframe_t *pf = req->pr_pf;
+        int ret;
+
+        if (NULL != pf) {
+                if ((ret = pframe_fill(pf)) < 0) {
+                        pframe_free(pf);
+                        pf = NULL;
+                }
+        } else {
+                ret = pframe_get(req->pr_obj, req->pr_pagenum, &pf);
+        }
+
+        dbg(DBG_PFRAME, "async fill of page %d of obj %p done (%d)\n",
+            req->pr_pagenum, req->pr_obj, ret);
+        req->pr_done(pf, ret, req->pr_arg);
+
+        req->pr_obj->mmo_ops->put(req->pr_obj);
+        slab_obj_free(pframe_ioreq_allocator, req);
+}
+
+/*
+ * pframe_iod services the requests in the order they were issued and
+ * sleeps whenever the queue is empty. Both arguments unused.
+ */
+static void *
+pframe_iod_run(int arg1, void *arg2)
+{
+        while (1) {
+                while (!list_empty(&pframe_ioq)) {
+                        pframe_ioreq_t *req;
+
+                        req = list_head(&pframe_ioq, pframe_ioreq_t, pr_link);
+                        list_remove(&req->pr_link);
+                        pframe_iod_complete(req);
+                }
+
+                if (sched_cancellable_sleep_on(&pframe_iod_waitq)
+                    && list_empty(&pframe_ioq))
+                        kthread_exit((void *)0);
+        }
+        return NULL;
 }
 
 /* ------------------------------------------------------------------ */
@@ -639,50 +1510,94 @@ pageoutd_exit()
 }
 
 /*
- * The pageout daemon, when run, gets the least-recently-requested page from the
- * list of pages which are available to be paged out. Make sure to check if the
- * page is busy before yanking it. If the page you select is dirty, make sure
- * to clean it before yanking it. Finally, go back to sleep after having paged
- * out the appropriate page.
- * Both arguments unused.
+ * Reclaim pages from the least-recently-requested end of the allocated
+ * list until there are target free pages or we have looked at maxscan
+ * pages. Dirty pages are cleaned before they are reclaimed. Pages which
+ * can't be cleaned, pages which have been accessed through a mapping since
+ * we last looked at them (their accessed bits are cleared) and, unless
+ * 'wait' is set, busy pages are moved to the other end of the list so we
+ * don't look at them again right away.
+ *
+ * @return the number of pages reclaimed
  */
-static void *
-pageoutd_run(int arg1, void *arg2)
+static int
+pframe_reclaim(uint32_t target, int maxscan, int wait)
 {
-        while (1) {
-                KASSERT(nallocated >= 0);
-                while ((!pageoutd_target_met()) && (!list_empty(&alloc_list))) {
-                        pframe_t *pf;
+        pframe_t *cleaned = NULL;
+        int nscanned = 0;
+        int nreclaimed = 0;
 
-                        /* obtain least-recently-requested page: */
-                        pf = list_head(&alloc_list, pframe_t, pf_link);
+        while (page_free_count() < target && !list_empty(&alloc_list)
+               && nscanned++ < maxscan) {
+                pframe_t *pf;
 
-                        if (pframe_is_busy(pf)) {
+                /* obtain least-recently-requested page: */
+                pf = list_head(&alloc_list, pframe_t, pf_link);
+
+                if (pframe_is_busy(pf)) {
+                        if (wait) {
+                                pframe_stat_inc(pf->pf_obj, ps_busywaits);
                                 sched_sleep_on(&pf->pf_waitq);
-                        } else if (pframe_is_dirty(pf)) {
-                                pframe_clean(pf);
                         } else {
-                                /* it's not busy, it's clean, and it's
-                                 * least-recently-requested; reclaim it: */
-                                pframe_free(pf);
+                                list_remove(&pf->pf_link);
+                                list_insert_tail(&alloc_list, &pf->pf_link);
+                        }
+                } else if (pframe_clear_pte_flags(pf, PT_ACCESSED)) {
+                        /* somebody used it through a mapping since we
+                         * last looked, which pframe_get never saw: give
+                         * it another trip through the list */
+                        pframe_stat_inc(pf->pf_obj, ps_referenced);
+                        list_remove(&pf->pf_link);
+                        list_insert_tail(&alloc_list, &pf->pf_link);
+                } else if (pframe_is_dirty(pf)) {
+                        /* with swap full, trying to clean anonymous pages
+                         * only write-protects them for nothing */
+                        if ((mmobj_is_swapbacked(pf->pf_obj) && swap_full())
+                            || pframe_clean(pf) < 0) {
+                                list_remove(&pf->pf_link);
+                                list_insert_tail(&alloc_list, &pf->pf_link);
+                        } else {
+                                cleaned = pf;
                         }
+                } else {
+                        /* it's not busy, it's clean, and it's
+                         * least-recently-requested; reclaim it: */
+                        pframe_stat_inc(pf->pf_obj, ps_evictions);
+                        if (pf != cleaned)
+                                pframe_stat_inc(pf->pf_obj, ps_clean_evict);
+                        cleaned = NULL;
+                        pframe_free(pf);
+                        nreclaimed++;
                 }
+        }
 
-                /*   release the thundering herd... */
-                sched_broadcast_on(&alloc_waitq);
+        return nreclaimed;
+}
+
+/*
+ * The pageout daemon, when woken up because the number of free pages
+ * dropped below nfreepages_low, reclaims pages until there are
+ * nfreepages_high free pages (or it has gone through all the allocated
+ * pages twice, which gives every dirty page a chance to be cleaned and
+ * then reclaimed), then goes back to sleep.
+ * Both arguments unused.
+ */
+static void *
+pageoutd_run(int arg1, void *arg2)
+{
+        while (1) {
+                KASSERT(nallocated >= 0);
+                pframe_reclaim(nfreepages_high, 2 * nallocated, 1);
 
                 dbg(DBG_PFRAME, "PAGEOUT DEMAON: Falling asleep\n");
                 dbg(DBG_PFRAME, "PAGEOUT DEMAON: "
-                    "nfreepages_target=|%d| "
-					"nfreepages_min=|%d| "
-					"page_free_count=|%d|\n", nfreepages_target, nfreepages_min, page_free_count());
+                    "nfreepages_min=|%d| nfreepages_low=|%d| "
+                    "nfreepages_high=|%d| page_free_count=|%d|\n",
+                    nfreepages_min, nfreepages_low, nfreepages_high,
+                    page_free_count());
                 if (sched_cancellable_sleep_on(&pageoutd_waitq))
                         kthread_exit((void *)0);
                 dbg(DBG_PFRAME, "PAGEOUT DEMAON: Waking up\n");
-                dbg(DBG_PFRAME, "PAGEOUT DEMAON: "
-                    "nfreepages_target=|%d| "
-					"nfreepages_min=|%d| "
-					"page_free_count=|%d|\n", nfreepages_target, nfreepages_min, page_free_count());
         }
         return NULL;
 }
@@ -0,0 +1,100 @@
+#include "types.h"
+#include "kernel.h"
+
+#include "mm/page.h"
+#include "mm/pagetable.h"
+#include "mm/tlb.h"
+
+#include "util/debug.h"
+
+#include "vm/vmstat.h"
+
+/*
+ * Past this many pages, a cr3 reload (which drops every entry, kernel
+ * ones included, and costs the refills) is cheaper than an invlpg per
+ * page. Tunable with the kshell vmtune command.
+ */
+int tlb_flush_threshold = 32;
+
+void
+tlb_gather_init(tlb_gather_t *tg, struct pagedir *pd)
+{
+        tg->tg_pd = pd;
+        tg->tg_nranges = 0;
+        tg->tg_npages = 0;
+        tg->tg_all = 0;
+        tg->tg_nfree = 0;
+}
+
+/* Records that the entries for [vlow, vhigh) changed */
+void
+tlb_gather_range(tlb_gather_t *tg, uintptr_t vlow, uintptr_t vhigh)
+{
+        KASSERT(PAGE_ALIGNED(vlow) && PAGE_ALIGNED(vhigh));
+        KASSERT(vlow <= vhigh);
+
+        /* the TLB only holds entries of the current page directory */
+        if (tg->tg_all || pt_get() != tg->tg_pd || vlow == vhigh)
+                return;
+
+        tg->tg_npages += (vhigh - vlow) >> PAGE_SHIFT;
+        if (tg->tg_npages > (uint32_t)tlb_flush_threshold) {
+                tg->tg_all = 1;
+        } else if (0 < tg->tg_nranges
+                   && tg->tg_end[tg->tg_nranges - 1] == vlow) {
+                /* e.g. one page table's part of a range after another's */
+                tg->tg_end[tg->tg_nranges - 1] = vhigh;
+        } else if (TLB_GATHER_RANGES == tg->tg_nranges) {
+                tg->tg_all = 1;
+        } else {
+                tg->tg_start[tg->tg_nranges] = vlow;
+                tg->tg_end[tg->tg_nranges] = vhigh;
+                tg->tg_nranges++;
+        }
+}
+
+/* Flushes what has been gathered so far and frees the pages, tg can
+ * gather more afterwards */
+static void
+tlb_gather_flush(tlb_gather_t *tg)
+{
+        uint32_t i;
+
+        if (tg->tg_all) {
+                tlb_flush_all();
+                vm_stat_inc(vs_tlb_flush_all);
+        } else {
+                for (i = 0; i < tg->tg_nranges; ++i) {
+                        uint32_t npages = (tg->tg_end[i] - tg->tg_start[i]) >> PAGE_SHIFT;
+                        tlb_flush_range(tg->tg_start[i], npages);
+                        vm_stats.vs_tlb_invlpg += npages;
+                }
+        }
+
+        for (i = 0; i < tg->tg_nfree; ++i)
+                page_free(tg->tg_free[i]);
+
+        tg->tg_nranges = 0;
+        tg->tg_npages = 0;
+        tg->tg_all = 0;
+        tg->tg_nfree = 0;
+}
+
+/* Frees page (with page_free) once the TLB is flushed. A page table
+ * must only be added after the range it mapped, whose invalidation
+ * also drops the processor's cached copy of its directory entry. */
+void
+tlb_gather_page(tlb_gather_t *tg, void *page)
+{
+        KASSERT(PAGE_ALIGNED(page));
+
+        if (TLB_GATHER_PAGES == tg->tg_nfree)
+                tlb_gather_flush(tg);
+        tg->tg_free[tg->tg_nfree++] = page;
+}
+
+void
+tlb_gather_finish(tlb_gather_t *tg)
+{
+        tlb_gather_flush(tg);
+}
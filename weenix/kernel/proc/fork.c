@@ -1,6 +1,7 @@
 #include "types.h"
 #include "globals.h"
 #include "errno.h"
+#include "config.h"
 
 #include "util/debug.h"
 #include "util/string.h"
@@ -60,15 +61,18 @@ do_fork(struct regs *regs)
 	dbg(DBG_PRINT, "(GRADING3A 7.a) the state of current process is runnung\n ");
 
     	int i;
+	tlb_gather_t tg;
 	/*int (*fp3)(struct regs*) = userland_entry;*/
         proc_t *child_proc=proc_create("child_process");
         KASSERT(child_proc->p_pagedir != NULL);
 	dbg(DBG_PRINT, "(GRADING3A 7.a) the page directory of child process is not null\n ");
-	if(!child_proc->p_vmmap) vmmap_destroy(child_proc->p_vmmap);
+	vmmap_destroy(child_proc->p_vmmap);
         child_proc->p_vmmap=vmmap_clone(curproc->p_vmmap);
+        child_proc->p_vmmap->vmm_proc=child_proc;
 
         list_link_t *p_link,*c_link;
         vmarea_t *p_vma,*c_vma;
+	tlb_gather_init(&tg, curproc->p_pagedir);
         for (p_link=curproc->p_vmmap->vmm_list.l_next,c_link=child_proc->p_vmmap->vmm_list.l_next;
              p_link!=&curproc->p_vmmap->vmm_list && c_link!=&child_proc->p_vmmap->vmm_list;
              p_link=p_link->l_next,c_link=c_link->l_next){
@@ -81,6 +85,11 @@ do_fork(struct regs *regs)
                 }
                 else{
                 	mmobj_t *p_shadow,*c_shadow;
+			/* keep repeated forks from growing the chain
+			 * forever: the previous fork's child may be gone */
+			if(mmobj_is_shadow(p_vma->vma_obj)){
+				shadow_collapse(p_vma->vma_obj,SHADOW_COLLAPSE_MAX);
+			}
         		p_shadow = shadow_create();c_shadow = shadow_create();
     			p_shadow->mmo_shadowed = p_vma->vma_obj;c_shadow->mmo_shadowed = p_vma->vma_obj;
     			p_vma->vma_obj->mmo_ops->ref(p_vma->vma_obj);
@@ -95,13 +104,18 @@ do_fork(struct regs *regs)
 			/*p_shadow->mmo_ops->ref(p_shadow);
 			c_shadow->mmo_ops->ref(c_shadow);*/
 			list_insert_tail(&c_vma->vma_obj->mmo_un.mmo_bottom_obj->mmo_un.mmo_vmas,&c_vma->vma_olink);
+
+			/* the pages mapped so far now belong to the object
+			 * both new shadow objects shadow, so writing to them
+			 * has to fault and copy them into the right one */
+			pt_protect_range(curproc->p_pagedir,(uintptr_t)PN_TO_ADDR(p_vma->vma_start),
+			                 (uintptr_t)PN_TO_ADDR(p_vma->vma_end),PT_WRITE,&tg);
                 }
-		/*
-		if(p_vma->vma_prot&PROT_WRITE){
-			if(p_vma->vma_start==p_vma->vma_end) pt_unmap(curproc->p_pagedir,(uintptr_t)PN_TO_ADDR(p_vma->vma_start));
-			else pt_unmap_range(curproc->p_pagedir,(uintptr_t)PN_TO_ADDR(p_vma->vma_start),(uintptr_t)PN_TO_ADDR(p_vma->vma_end));
-		}
-		*/
+		/* give the child the parent's mappings, so that neither has
+		 * to fault on pages which are already resident. If this
+		 * runs out of memory the child just faults on the rest */
+		pt_copy_range(child_proc->p_pagedir,curproc->p_pagedir,(uintptr_t)PN_TO_ADDR(p_vma->vma_start),
+		              (uintptr_t)PN_TO_ADDR(p_vma->vma_end));
         }
 
         	/*list_init(&child_proc->p_child_link);
@@ -135,8 +149,10 @@ do_fork(struct regs *regs)
 
         sched_make_runnable(child_thread);
 
-        pt_unmap_range(curproc->p_pagedir,USER_MEM_LOW, USER_MEM_HIGH);
-		pt_unmap_range(child_proc->p_pagedir,USER_MEM_LOW, USER_MEM_HIGH);
-		tlb_flush_all();
+	/* drop the parent's cached writable translations, page by page
+	 * if only a few were write protected */
+	tlb_gather_finish(&tg);
+	/* don't leave the pins of locked pages with the child */
+	vmmap_unshare_locked(curproc->p_vmmap);
         return child_proc->p_pid;
 }
@@ -104,6 +104,7 @@ kthread_create(struct proc *p, kthread_func_t func, long arg1, void *arg2)
 		new_kthread->kt_proc = p;
 		new_kthread->kt_cancelled = 0;
 		new_kthread->kt_wchan = NULL;
+		new_kthread->kt_fault = NULL;
 		list_init(&new_kthread->kt_qlink);
 		list_init(&new_kthread->kt_plink);
 		list_insert_tail(&p->p_threads, &new_kthread->kt_plink);
@@ -240,6 +241,7 @@ kthread_clone(kthread_t *thr)
 
 	clone_thr->kt_cancelled = thr->kt_cancelled;
 	clone_thr->kt_wchan = NULL;
+	clone_thr->kt_fault = NULL;
 	list_insert_tail(&clone_thr->kt_proc->p_threads,&clone_thr->kt_plink);
 #ifdef __MTP__ 
 	clone_thr->kt_detached = 0;
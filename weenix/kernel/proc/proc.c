@@ -170,10 +170,7 @@ proc_cleanup(int status)
 	dbg(DBG_PROC,"(GRADING1 2.b) This process should have parent process.\n");
 
 	proc_t *myProc;
-	curproc->p_state=PROC_DEAD;
 	curproc->p_status=status;
-	dbg(DBG_PROC,"The proc \"%s\" %d (0x%p) is dead!\n",
-				curproc->p_comm, curproc->p_pid, curproc);
 
 	if(!list_empty(&curproc->p_children)){
 		list_iterate_begin(&curproc->p_children,myProc,proc_t,p_child_link){
@@ -192,6 +189,11 @@ proc_cleanup(int status)
 		}
 		
 	}
+	/* only now, since closing the files may block, and a parent woken up
+	 * by another child mustn't reap this one before its thread exits */
+	curproc->p_state=PROC_DEAD;
+	dbg(DBG_PROC,"The proc \"%s\" %d (0x%p) is dead!\n",
+				curproc->p_comm, curproc->p_pid, curproc);
 	sched_wakeup_on(&curproc->p_pproc->p_wait);
 	KASSERT(NULL != curproc->p_pproc); /* this process should have parent process */
 	dbg(DBG_PROC,"(GRADING1 2.b) This process should have parent process.\n");
@@ -281,6 +283,12 @@ proc_thread_exited(void *retval)
         } list_iterate_end();
 
 		KASSERT(count != 0 && "All threads of curproc are dead!\n");
+
+		/* before the process is dead: getting rid of pages which are
+		 * being swapped out or read in means waiting for them */
+		vmmap_destroy(curproc->p_vmmap);
+		curproc->p_vmmap = NULL;
+
 		if (count == 1){
 			dbg(DBG_THR,"Last thread (0x%p) exited from the proc \"%s\" %d (0x%p)\n",
 					curthr, curproc->p_comm, curproc->p_pid, curproc);
@@ -289,8 +297,6 @@ proc_thread_exited(void *retval)
 			dbg(DBG_THR,"The thread (0x%p) exited from the proc \"%s\" %d (0x%p)\n",
 					curthr, curproc->p_comm, curproc->p_pid, curproc);
 		}
-	
-	vmmap_destroy(curproc->p_vmmap);
 }
 
 /* If pid is -1 dispose of one of the exited children of the current
@@ -178,17 +178,25 @@ void
 sched_cancel(struct kthread *kthr)
 {
 		/*NOT_YET_IMPLEMENTED("PROCS: sched_cancel");*/
+		uint8_t oldIPL;
+
 		KASSERT(kthr->kt_state != KT_NO_STATE && 
 				kthr->kt_state != KT_EXITED);
 		kthr->kt_cancelled = 1;
 		dbg(DBG_SCHED, "The thread (0x%p) of proc \"%s\" %d (0x%p) has been cancelled.\n",
 						curthr, curproc->p_comm, curproc->p_pid, curproc);
+		/* the queue may be one an interrupt handler wakes threads on,
+		 * e.g. time_sleep's, which it must not do in the middle of the
+		 * removal, or after the thread's state was checked */
+		oldIPL = intr_getipl();
+		intr_setipl(IPL_HIGH);
         if(kthr->kt_state == KT_SLEEP_CANCELLABLE){
 			ktqueue_remove(kthr->kt_wchan, kthr);
 			sched_make_runnable(kthr);
 		}else{
 			/* do nothing */
 		}
+		intr_setipl(oldIPL);
 }
 
 /*
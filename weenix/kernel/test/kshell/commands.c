@@ -2,6 +2,7 @@
 
 #include "command.h"
 #include "errno.h"
+#include "limits.h"
 #include "priv.h"
 
 #ifdef __VFS__
@@ -11,6 +12,23 @@
 #include "fs/vnode.h"
 #endif
 
+#ifdef __VM__
+#include "mm/mmobj.h"
+#include "mm/page.h"
+#include "mm/pframe.h"
+#include "mm/tlb.h"
+#include "fs/vnode.h"
+#include "vm/anon.h"
+#include "vm/shadow.h"
+#include "vm/swap.h"
+#include "vm/vmstat.h"
+#include "vm/pagefault.h"
+#include "vm/vmmap.h"
+#include "vm/faulttrace.h"
+#include "api/sysstat.h"
+#include "proc/proc.h"
+#endif
+
 #include "test/kshell/io.h"
 
 #include "util/debug.h"
@@ -60,6 +78,48 @@ int kshell_echo(kshell_t *ksh, int argc, char **argv)
         return 0;
 }
 
+/*
+ * Displays, for each system call made since boot (or the last "sysstat
+ * reset"), how many times it was made, how many of those failed, and how
+ * long it took, in cycles, with a histogram by powers of two. Also shows
+ * how many of all the calls were made with sysenter.
+ */
+int kshell_sysstat(kshell_t *ksh, int argc, char **argv)
+{
+        KASSERT(NULL != ksh);
+        KASSERT(NULL != argv);
+
+        syscall_info_t si;
+        syscall_stat_t ss;
+        int i, b;
+
+        if (argc > 2 || (argc == 2 && strcmp(argv[1], "reset"))) {
+                kprintf(ksh, "Usage: sysstat [reset]\n");
+                return 1;
+        }
+        if (argc == 2) {
+                syscall_stat_reset();
+                return 0;
+        }
+
+        kprintf(ksh, "calls entered with sysenter %u\n", syscall_sysenter_calls);
+        kprintf(ksh, "%-10s %4s %8s %8s %10s %10s  %s\n", "NAME", "NUM",
+                "CALLS", "ERRORS", "AVG CYC", "MAX CYC", "log2(cycles):calls");
+        for (i = 0; 0 == syscall_stat_get(i, &si, &ss); ++i) {
+                if (0 == ss.ss_count)
+                        continue;
+                kprintf(ksh, "%-10s %4u %8u %8u %10u %10u ", si.si_name,
+                        si.si_sysnum, ss.ss_count, ss.ss_errors,
+                        (uint32_t)(ss.ss_cycles / ss.ss_count), ss.ss_max);
+                for (b = 0; b < SYSSTAT_BUCKETS; ++b) {
+                        if (0 != ss.ss_hist[b])
+                                kprintf(ksh, " %d:%u", b, ss.ss_hist[b]);
+                }
+                kprintf(ksh, "\n");
+        }
+        return 0;
+}
+
 #ifdef __VFS__
 int kshell_cat(kshell_t *ksh, int argc, char **argv)
 {
@@ -321,3 +381,365 @@ int kshell_stat(kshell_t *ksh, int argc, char **argv)
         return exit_val;
 }
 #endif
+
+#ifdef __VM__
+/* VM parameters that can be changed at runtime with vmtune, and the
+ * values they may be set to */
+static struct {
+        const char *vt_name;
+        int        *vt_var;
+        int         vt_min;
+        int         vt_max;
+        const char *vt_desc;
+} vm_tunables[] = {
+        { "dirty_expire", &pframe_dirty_expire, 0, INT_MAX,
+          "ticks a page may stay dirty before flushd writes it back" },
+        { "flush_interval", &pframe_flush_interval, 1, INT_MAX,
+          "ticks between flushd runs" },
+        { "dirty_bg_ratio", &pframe_dirty_background_ratio, 1, 100,
+          "% of allocated pages dirty before flushd ignores page age" },
+        { "dirty_ratio", &pframe_dirty_ratio, 1, 100,
+          "% of allocated pages dirty before writers are throttled" },
+        { "faultaround", &vm_faultaround, 0, INT_MAX,
+          "resident pages mapped around a read fault, 0 to disable" },
+        { "largepages", &vm_large_pages, 0, 1,
+          "map untouched anonymous memory with 4mb pages, 0 to disable" },
+        { "mlock_limit", &vm_mlock_limit, 0, INT_MAX,
+          "pages each process may lock with mlock" },
+        { "tlbflush", &tlb_flush_threshold, 0, INT_MAX,
+          "most pages invalidated one by one before reloading cr3" },
+        { "faulttrace", &vm_fault_trace, 0, 1,
+          "record each page fault for faulttrace dump, 0 to disable" },
+};
+
+#define VM_NTUNABLES (sizeof(vm_tunables) / sizeof(vm_tunables[0]))
+
+static int parse_uint(const char *str, int *result)
+{
+        int val = 0;
+
+        if ('\0' == *str)
+                return -EINVAL;
+        for (; '\0' != *str; ++str) {
+                if (*str < '0' || *str > '9')
+                        return -EINVAL;
+                if (val > (INT_MAX - (*str - '0')) / 10)
+                        return -ERANGE;
+                val = val * 10 + (*str - '0');
+        }
+        *result = val;
+        return 0;
+}
+
+int kshell_vmtune(kshell_t *ksh, int argc, char **argv)
+{
+        KASSERT(NULL != ksh);
+        KASSERT(NULL != argv);
+
+        unsigned int i;
+        int val;
+
+        if (argc > 3) {
+                kprintf(ksh, "Usage: vmtune [<name> [<value>]]\n");
+                return 1;
+        }
+
+        for (i = 0; i < VM_NTUNABLES; ++i) {
+                if (argc > 1 && strcmp(argv[1], vm_tunables[i].vt_name))
+                        continue;
+
+                if (argc == 3) {
+                        if (parse_uint(argv[2], &val) < 0) {
+                                kprintf(ksh, "vmtune: invalid value `%s'\n",
+                                        argv[2]);
+                                return 1;
+                        }
+                        if (val < vm_tunables[i].vt_min
+                            || val > vm_tunables[i].vt_max) {
+                                kprintf(ksh, "vmtune: %s must be between "
+                                        "%d and %d\n", argv[1],
+                                        vm_tunables[i].vt_min,
+                                        vm_tunables[i].vt_max);
+                                return 1;
+                        }
+                        /* flushd has to start writing back before writers
+                         * are throttled */
+                        if ((vm_tunables[i].vt_var == &pframe_dirty_background_ratio
+                             && val > pframe_dirty_ratio)
+                            || (vm_tunables[i].vt_var == &pframe_dirty_ratio
+                                && val < pframe_dirty_background_ratio)) {
+                                kprintf(ksh, "vmtune: dirty_bg_ratio can't "
+                                        "be above dirty_ratio\n");
+                                return 1;
+                        }
+                        *vm_tunables[i].vt_var = val;
+                }
+                kprintf(ksh, "%-16s %8d  %s\n", vm_tunables[i].vt_name,
+                        *vm_tunables[i].vt_var, vm_tunables[i].vt_desc);
+                if (argc > 1)
+                        return 0;
+        }
+
+        if (argc > 1) {
+                kprintf(ksh, "vmtune: no such parameter `%s'\n", argv[1]);
+                return 1;
+        }
+        return 0;
+}
+
+#define PCSTAT_DEFAULT_NOBJS 10
+#define PCSTAT_MAX_NOBJS     32
+
+int kshell_pcstat(kshell_t *ksh, int argc, char **argv)
+{
+        KASSERT(NULL != ksh);
+        KASSERT(NULL != argv);
+
+        mmobj_t *objs[PCSTAT_MAX_NOBJS];
+        pframe_stats_t stats[PCSTAT_MAX_NOBJS];
+        pframe_stats_t total;
+        uint32_t stallhist[PFRAME_STALL_BUCKETS];
+        uint64_t stallmax;
+        uint32_t wmin, wlow, whigh;
+        swap_stats_t swstats;
+        int nobjs = PCSTAT_DEFAULT_NOBJS;
+        int i, n;
+
+        if (argc > 2 || (argc == 2 && parse_uint(argv[1], &nobjs) < 0)) {
+                kprintf(ksh, "Usage: pcstat [<number of objects>]\n");
+                return 1;
+        }
+        if (nobjs > PCSTAT_MAX_NOBJS)
+                nobjs = PCSTAT_MAX_NOBJS;
+
+        pframe_get_stats(&total);
+        kprintf(ksh, "hits %u, misses %u, fills %u, evictions %u\n",
+                total.ps_hits, total.ps_misses, total.ps_fills,
+                total.ps_evictions);
+        kprintf(ksh, "dirty write-backs %u, clean evictions %u, "
+                "busy waits %u, referenced %u\n", total.ps_dirty_wb,
+                total.ps_clean_evict, total.ps_busywaits, total.ps_referenced);
+        kprintf(ksh, "write-backs skipped (mapped writable, not written) %u, "
+                "pages given up with MADV_FREE %u\n",
+                total.ps_unwritten, total.ps_lazyfree);
+
+        pframe_get_watermarks(&wmin, &wlow, &whigh);
+        kprintf(ksh, "free pages %u (watermarks min %u, low %u, high %u)\n",
+                page_free_count(), wmin, wlow, whigh);
+
+        if (swap_enabled()) {
+                swap_get_stats(&swstats);
+                kprintf(ksh, "swap slots %u of %u used, swapped out %u, "
+                        "in %u, read ahead %u, swap full %u\n",
+                        swstats.ss_used, swstats.ss_nslots, swstats.ss_outs,
+                        swstats.ss_ins, swstats.ss_readahead, swstats.ss_full);
+        } else {
+                kprintf(ksh, "no swap\n");
+        }
+
+        pframe_get_stall_hist(stallhist, &stallmax);
+        kprintf(ksh, "allocation stalls %u, longest %llu cycles\n",
+                total.ps_stalls, stallmax);
+        for (i = 0; i < PFRAME_STALL_BUCKETS; ++i) {
+                if (0 != stallhist[i])
+                        kprintf(ksh, "    2^%-2d cycles: %u\n", i, stallhist[i]);
+        }
+
+        /* printing can block, the references we get keep the objects
+         * alive until we are done */
+        n = pframe_top_objects(objs, stats, nobjs);
+        if (0 == n)
+                return 0;
+
+        kprintf(ksh, "\n%6s %7s %7s %7s %6s %6s %6s %6s  %s\n", "pages",
+                "hits", "misses", "fills", "evict", "dirtwb", "clnev",
+                "busy", "object");
+        for (i = 0; i < n; ++i) {
+                vnode_t *vn;
+
+                kprintf(ksh, "%6d %7u %7u %7u %6u %6u %6u %6u  ",
+                        objs[i]->mmo_nrespages, stats[i].ps_hits,
+                        stats[i].ps_misses, stats[i].ps_fills,
+                        stats[i].ps_evictions, stats[i].ps_dirty_wb,
+                        stats[i].ps_clean_evict, stats[i].ps_busywaits);
+                if (NULL != (vn = vnode_from_mmobj(objs[i]))) {
+                        kprintf(ksh, "vnode ino %d\n", vn->vn_vno);
+                } else if (mmobj_is_anon(objs[i])) {
+                        kprintf(ksh, "anon %p\n", objs[i]);
+                } else if (mmobj_is_shadow(objs[i])) {
+                        kprintf(ksh, "shadow %p\n", objs[i]);
+                } else {
+                        kprintf(ksh, "other %p\n", objs[i]);
+                }
+        }
+        for (i = 0; i < n; ++i)
+                objs[i]->mmo_ops->put(objs[i]);
+
+        return 0;
+}
+
+/* Percentage of n in total, 0 if total is 0 */
+static uint32_t
+percent(uint32_t n, uint32_t total)
+{
+        if (0 == total)
+                return 0;
+        return (uint32_t)(((uint64_t)n * 100) / total);
+}
+
+int kshell_vmstat(kshell_t *ksh, int argc, char **argv)
+{
+        KASSERT(NULL != ksh);
+        KASSERT(NULL != argv);
+
+        vm_stats_t st;
+
+        if (argc > 2 || (argc == 2 && strcmp(argv[1], "reset"))) {
+                kprintf(ksh, "Usage: vmstat [reset]\n");
+                return 1;
+        }
+
+        /* copy first so that the numbers we print are consistent */
+        st = vm_stats;
+        if (argc == 2)
+                memset(&vm_stats, 0, sizeof(vm_stats));
+
+        kprintf(ksh, "page faults %u, pages mapped by fault-around %u, "
+                "zero page mappings %u, shared pages re-dirtied %u\n",
+                st.vs_faults, st.vs_faultaround, st.vs_zeropage,
+                st.vs_redirty);
+        kprintf(ksh, "pages prefetched %u, populated %u\n",
+                st.vs_prefetch, st.vs_populated);
+        kprintf(ksh, "4mb pages mapped %u, fallbacks to small pages %u\n",
+                st.vs_large, st.vs_large_fallback);
+        kprintf(ksh, "vma cache: hits %u, misses %u (%u%% hits)\n",
+                st.vs_vmacache_hits, st.vs_vmacache_misses,
+                percent(st.vs_vmacache_hits,
+                        st.vs_vmacache_hits + st.vs_vmacache_misses));
+        kprintf(ksh, "shadow chains: max depth %u, objects collapsed %u\n",
+                st.vs_shadow_maxdepth, st.vs_shadow_collapsed);
+        kprintf(ksh, "tlb: pages invalidated %u, full flushes %u\n",
+                st.vs_tlb_invlpg, st.vs_tlb_flush_all);
+        kprintf(ksh, "user copies: faults %u, stopped at fixup %u\n",
+                st.vs_uaccess_faults, st.vs_uaccess_fixups);
+        return 0;
+}
+
+int kshell_mlocked(kshell_t *ksh, int argc, char **argv)
+{
+        KASSERT(NULL != ksh);
+        KASSERT(NULL != argv);
+
+        proc_t *p;
+        uint32_t total = 0;
+
+        if (argc > 1) {
+                kprintf(ksh, "Usage: mlocked\n");
+                return 1;
+        }
+
+        kprintf(ksh, "%5s %-16s %8s\n", "PID", "NAME", "LOCKED");
+        list_iterate_begin(proc_list(), p, proc_t, p_list_link) {
+                if (NULL == p->p_vmmap || 0 == p->p_vmmap->vmm_nlocked)
+                        continue;
+                kprintf(ksh, "%5d %-16s %8u\n", p->p_pid, p->p_comm,
+                        p->p_vmmap->vmm_nlocked);
+                total += p->p_vmmap->vmm_nlocked;
+        } list_iterate_end();
+        kprintf(ksh, "%u pages locked, at most %d per process\n",
+                total, vm_mlock_limit);
+        return 0;
+}
+
+/*
+ * Writes the fault classes and the faults in the ring buffer to the
+ * serial port (which is where dbg output goes, and what the host can
+ * capture), in the format tools/faulttrace.py reads.
+ */
+static void
+faulttrace_dump(kshell_t *ksh)
+{
+        fault_class_t fc;
+        fault_event_t fe;
+        int a, k, o, b, nclasses = 0;
+        uint32_t i;
+
+        dbg_print("faulttrace begin\n");
+        for (a = 0; a < FT_NACCESS; ++a) {
+                for (k = 0; k < FT_NKINDS; ++k) {
+                        for (o = 0; o < FT_NOBJS; ++o) {
+                                fault_trace_get_class(a, k, o, &fc);
+                                if (0 == fc.fc_count)
+                                        continue;
+                                dbg_print("class %s %s %s %u %llu %u",
+                                          fault_trace_access_name(a),
+                                          fault_trace_kind_name(k),
+                                          fault_trace_obj_name(o),
+                                          fc.fc_count, fc.fc_cycles, fc.fc_max);
+                                for (b = 0; b < FT_BUCKETS; ++b)
+                                        dbg_print(" %u", fc.fc_hist[b]);
+                                dbg_print("\n");
+                                ++nclasses;
+                        }
+                }
+        }
+        for (i = 0; 0 == fault_trace_get_event(i, &fe); ++i) {
+                dbg_print("event %llu %d %#.8x %s %s %s %u %u\n", fe.fe_tsc,
+                          fe.fe_pid, fe.fe_vaddr,
+                          fault_trace_access_name(fe.fe_access),
+                          fault_trace_kind_name(fe.fe_kind),
+                          fault_trace_obj_name(fe.fe_obj),
+                          fe.fe_cycles, fe.fe_fill);
+        }
+        dbg_print("faulttrace end\n");
+        kprintf(ksh, "wrote %d fault classes and %u faults to the serial port\n",
+                nclasses, i);
+}
+
+int kshell_faulttrace(kshell_t *ksh, int argc, char **argv)
+{
+        KASSERT(NULL != ksh);
+        KASSERT(NULL != argv);
+
+        fault_class_t fc;
+        int a, k, o, b;
+
+        if (argc > 2 || (argc == 2 && strcmp(argv[1], "reset")
+                         && strcmp(argv[1], "dump"))) {
+                kprintf(ksh, "Usage: faulttrace [reset|dump]\n");
+                return 1;
+        }
+        if (argc == 2 && !strcmp(argv[1], "reset")) {
+                fault_trace_reset();
+                return 0;
+        }
+        if (argc == 2) {
+                faulttrace_dump(ksh);
+                return 0;
+        }
+
+        kprintf(ksh, "%-6s %-5s %-6s %8s %10s %10s  %s\n", "ACCESS", "KIND",
+                "OBJECT", "FAULTS", "AVG CYC", "MAX CYC", "log2(cycles):faults");
+        for (a = 0; a < FT_NACCESS; ++a) {
+                for (k = 0; k < FT_NKINDS; ++k) {
+                        for (o = 0; o < FT_NOBJS; ++o) {
+                                fault_trace_get_class(a, k, o, &fc);
+                                if (0 == fc.fc_count)
+                                        continue;
+                                kprintf(ksh, "%-6s %-5s %-6s %8u %10u %10u ",
+                                        fault_trace_access_name(a),
+                                        fault_trace_kind_name(k),
+                                        fault_trace_obj_name(o), fc.fc_count,
+                                        (uint32_t)(fc.fc_cycles / fc.fc_count),
+                                        fc.fc_max);
+                                for (b = 0; b < FT_BUCKETS; ++b) {
+                                        if (0 != fc.fc_hist[b])
+                                                kprintf(ksh, " %d:%u", b, fc.fc_hist[b]);
+                                }
+                                kprintf(ksh, "\n");
+                        }
+                }
+        }
+        return 0;
+}
+#endif
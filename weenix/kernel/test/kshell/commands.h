@@ -8,6 +8,7 @@
 KSHELL_CMD(help);
 KSHELL_CMD(exit);
 KSHELL_CMD(echo);
+KSHELL_CMD(sysstat);
 #ifdef __VFS__
 KSHELL_CMD(cat);
 KSHELL_CMD(ls);
@@ -18,3 +19,10 @@ KSHELL_CMD(rmdir);
 KSHELL_CMD(mkdir);
 KSHELL_CMD(stat);
 #endif
+#ifdef __VM__
+KSHELL_CMD(vmtune);
+KSHELL_CMD(pcstat);
+KSHELL_CMD(vmstat);
+KSHELL_CMD(mlocked);
+KSHELL_CMD(faulttrace);
+#endif
@@ -34,6 +34,8 @@ static __attribute__((unused)) void kshell_init()
         kshell_add_command("help", kshell_help,
                            "prints a list of available commands");
         kshell_add_command("echo", kshell_echo, "display a line of text");
+        kshell_add_command("sysstat", kshell_sysstat,
+                           "display system call counts and latencies");
 #ifdef __VFS__
         kshell_add_command("cat", kshell_cat,
                            "concatenate files and print on the standard output");
@@ -47,6 +49,18 @@ static __attribute__((unused)) void kshell_init()
         kshell_add_command("mkdir", kshell_mkdir, "make directories");
         kshell_add_command("stat", kshell_stat, "display file status");
 #endif
+#ifdef __VM__
+        kshell_add_command("vmtune", kshell_vmtune,
+                           "display or set VM tunables");
+        kshell_add_command("pcstat", kshell_pcstat,
+                           "display page cache statistics");
+        kshell_add_command("vmstat", kshell_vmstat,
+                           "display virtual memory statistics");
+        kshell_add_command("mlocked", kshell_mlocked,
+                           "display the pages processes have locked");
+        kshell_add_command("faulttrace", kshell_faulttrace,
+                           "display page fault latencies, or dump them");
+#endif
 
         kshell_add_command("exit", kshell_exit, "exits the shell");
 }
@@ -0,0 +1,324 @@
+#include "kernel.h"
+
+#include "util/debug.h"
+#include "util/rbtree.h"
+
+/*
+ * A classic red-black tree (see CLRS, chapter 13) with NULL leaves.
+ * Augmented data is kept up to date by recomputing it bottom-up for
+ * every node whose set of descendants changes: along the path to the
+ * root when a node is linked in or unlinked, and for the two nodes
+ * involved in a rotation. Recoloring doesn't change any subtree.
+ */
+
+#define rb_is_red(n)    (NULL != (n) && RB_RED == (n)->rb_color)
+#define rb_is_black(n)  (NULL == (n) || RB_BLACK == (n)->rb_color)
+
+static void
+rb_augment(rb_tree_t *tree, rb_node_t *node)
+{
+        if (NULL != tree->rb_augment)
+                tree->rb_augment(node);
+}
+
+void
+rb_init(rb_tree_t *tree, rb_augment_func_t augment)
+{
+        tree->rb_root = NULL;
+        tree->rb_augment = augment;
+}
+
+void
+rb_propagate(rb_tree_t *tree, rb_node_t *node)
+{
+        for (; NULL != node; node = node->rb_parent)
+                rb_augment(tree, node);
+}
+
+/* Makes new take old's place as a child of parent */
+static void
+rb_replace_child(rb_tree_t *tree, rb_node_t *parent, rb_node_t *old,
+                 rb_node_t *new)
+{
+        if (NULL == parent)
+                tree->rb_root = new;
+        else if (parent->rb_left == old)
+                parent->rb_left = new;
+        else
+                parent->rb_right = new;
+}
+
+/*
+ *      x                 y
+ *     / \               / \
+ *    a   y     -->     x   c
+ *       / \           / \
+ *      b   c         a   b
+ */
+static void
+rb_rotate_left(rb_tree_t *tree, rb_node_t *x)
+{
+        rb_node_t *y = x->rb_right;
+
+        x->rb_right = y->rb_left;
+        if (NULL != y->rb_left)
+                y->rb_left->rb_parent = x;
+        y->rb_parent = x->rb_parent;
+        rb_replace_child(tree, x->rb_parent, x, y);
+        y->rb_left = x;
+        x->rb_parent = y;
+
+        /* x is now below y */
+        rb_augment(tree, x);
+        rb_augment(tree, y);
+}
+
+/* The mirror image of rb_rotate_left */
+static void
+rb_rotate_right(rb_tree_t *tree, rb_node_t *x)
+{
+        rb_node_t *y = x->rb_left;
+
+        x->rb_left = y->rb_right;
+        if (NULL != y->rb_right)
+                y->rb_right->rb_parent = x;
+        y->rb_parent = x->rb_parent;
+        rb_replace_child(tree, x->rb_parent, x, y);
+        y->rb_right = x;
+        x->rb_parent = y;
+
+        rb_augment(tree, x);
+        rb_augment(tree, y);
+}
+
+void
+rb_insert(rb_tree_t *tree, rb_node_t *node, rb_node_t *parent,
+          rb_node_t **link)
+{
+        rb_node_t *gparent, *uncle;
+
+        node->rb_parent = parent;
+        node->rb_left = node->rb_right = NULL;
+        node->rb_color = RB_RED;
+        *link = node;
+        rb_propagate(tree, node);
+
+        while (rb_is_red(parent = node->rb_parent)) {
+                /* the root is black, so a red parent has a parent */
+                gparent = parent->rb_parent;
+                if (parent == gparent->rb_left) {
+                        uncle = gparent->rb_right;
+                        if (rb_is_red(uncle)) {
+                                parent->rb_color = RB_BLACK;
+                                uncle->rb_color = RB_BLACK;
+                                gparent->rb_color = RB_RED;
+                                node = gparent;
+                                continue;
+                        }
+                        if (node == parent->rb_right) {
+                                rb_rotate_left(tree, parent);
+                                node = parent;
+                                parent = node->rb_parent;
+                        }
+                        parent->rb_color = RB_BLACK;
+                        gparent->rb_color = RB_RED;
+                        rb_rotate_right(tree, gparent);
+                } else {
+                        uncle = gparent->rb_left;
+                        if (rb_is_red(uncle)) {
+                                parent->rb_color = RB_BLACK;
+                                uncle->rb_color = RB_BLACK;
+                                gparent->rb_color = RB_RED;
+                                node = gparent;
+                                continue;
+                        }
+                        if (node == parent->rb_left) {
+                                rb_rotate_right(tree, parent);
+                                node = parent;
+                                parent = node->rb_parent;
+                        }
+                        parent->rb_color = RB_BLACK;
+                        gparent->rb_color = RB_RED;
+                        rb_rotate_left(tree, gparent);
+                }
+        }
+        tree->rb_root->rb_color = RB_BLACK;
+}
+
+/*
+ * Restores the red-black properties after a black node was unlinked from
+ * parent, leaving child (possibly NULL) in its place one black short.
+ */
+static void
+rb_remove_fixup(rb_tree_t *tree, rb_node_t *child, rb_node_t *parent)
+{
+        rb_node_t *sib;
+
+        while (child != tree->rb_root && rb_is_black(child)) {
+                /* parent's other subtree has a black height of at least
+                 * one, so sib is never NULL, and if child is NULL it is
+                 * on the side which is */
+                if (child == parent->rb_left) {
+                        sib = parent->rb_right;
+                        if (rb_is_red(sib)) {
+                                sib->rb_color = RB_BLACK;
+                                parent->rb_color = RB_RED;
+                                rb_rotate_left(tree, parent);
+                                sib = parent->rb_right;
+                        }
+                        if (rb_is_black(sib->rb_left)
+                            && rb_is_black(sib->rb_right)) {
+                                sib->rb_color = RB_RED;
+                                child = parent;
+                                parent = child->rb_parent;
+                        } else {
+                                if (rb_is_black(sib->rb_right)) {
+                                        sib->rb_left->rb_color = RB_BLACK;
+                                        sib->rb_color = RB_RED;
+                                        rb_rotate_right(tree, sib);
+                                        sib = parent->rb_right;
+                                }
+                                sib->rb_color = parent->rb_color;
+                                parent->rb_color = RB_BLACK;
+                                sib->rb_right->rb_color = RB_BLACK;
+                                rb_rotate_left(tree, parent);
+                                child = tree->rb_root;
+                        }
+                } else {
+                        sib = parent->rb_left;
+                        if (rb_is_red(sib)) {
+                                sib->rb_color = RB_BLACK;
+                                parent->rb_color = RB_RED;
+                                rb_rotate_right(tree, parent);
+                                sib = parent->rb_left;
+                        }
+                        if (rb_is_black(sib->rb_left)
+                            && rb_is_black(sib->rb_right)) {
+                                sib->rb_color = RB_RED;
+                                child = parent;
+                                parent = child->rb_parent;
+                        } else {
+                                if (rb_is_black(sib->rb_left)) {
+                                        sib->rb_right->rb_color = RB_BLACK;
+                                        sib->rb_color = RB_RED;
+                                        rb_rotate_left(tree, sib);
+                                        sib = parent->rb_left;
+                                }
+                                sib->rb_color = parent->rb_color;
+                                parent->rb_color = RB_BLACK;
+                                sib->rb_left->rb_color = RB_BLACK;
+                                rb_rotate_right(tree, parent);
+                                child = tree->rb_root;
+                        }
+                }
+        }
+        if (NULL != child)
+                child->rb_color = RB_BLACK;
+}
+
+void
+rb_remove(rb_tree_t *tree, rb_node_t *node)
+{
+        rb_node_t *child, *parent;
+        int color;
+
+        if (NULL == node->rb_left || NULL == node->rb_right) {
+                child = (NULL == node->rb_left) ? node->rb_right : node->rb_left;
+                parent = node->rb_parent;
+                color = node->rb_color;
+
+                if (NULL != child)
+                        child->rb_parent = parent;
+                rb_replace_child(tree, parent, node, child);
+        } else {
+                /* Replace node with its successor, which has no left
+                 * child, and unlink the successor from where it was */
+                rb_node_t *succ = node->rb_right;
+                while (NULL != succ->rb_left)
+                        succ = succ->rb_left;
+
+                child = succ->rb_right;
+                parent = succ->rb_parent;
+                color = succ->rb_color;
+
+                if (parent == node) {
+                        parent = succ;
+                } else {
+                        if (NULL != child)
+                                child->rb_parent = parent;
+                        parent->rb_left = child;
+                        succ->rb_right = node->rb_right;
+                        node->rb_right->rb_parent = succ;
+                }
+
+                succ->rb_parent = node->rb_parent;
+                succ->rb_color = node->rb_color;
+                succ->rb_left = node->rb_left;
+                node->rb_left->rb_parent = succ;
+                rb_replace_child(tree, node->rb_parent, node, succ);
+        }
+
+        /* parent is the lowest node whose subtree changed */
+        rb_propagate(tree, parent);
+
+        if (RB_BLACK == color)
+                rb_remove_fixup(tree, child, parent);
+
+        node->rb_parent = node->rb_left = node->rb_right = NULL;
+}
+
+rb_node_t *
+rb_first(rb_tree_t *tree)
+{
+        rb_node_t *node = tree->rb_root;
+
+        if (NULL == node)
+                return NULL;
+        while (NULL != node->rb_left)
+                node = node->rb_left;
+        return node;
+}
+
+rb_node_t *
+rb_last(rb_tree_t *tree)
+{
+        rb_node_t *node = tree->rb_root;
+
+        if (NULL == node)
+                return NULL;
+        while (NULL != node->rb_right)
+                node = node->rb_right;
+        return node;
+}
+
+rb_node_t *
+rb_next(rb_node_t *node)
+{
+        rb_node_t *parent;
+
+        if (NULL != node->rb_right) {
+                node = node->rb_right;
+                while (NULL != node->rb_left)
+                        node = node->rb_left;
+                return node;
+        }
+        while (NULL != (parent = node->rb_parent) && node == parent->rb_right)
+                node = parent;
+        return parent;
+}
+
+rb_node_t *
+rb_prev(rb_node_t *node)
+{
+        rb_node_t *parent;
+
+        if (NULL != node->rb_left) {
+                node = node->rb_left;
+                while (NULL != node->rb_right)
+                        node = node->rb_right;
+                return node;
+        }
+        while (NULL != (parent = node->rb_parent) && node == parent->rb_left)
+                node = parent;
+        return parent;
+}
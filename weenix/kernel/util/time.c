@@ -1,4 +1,5 @@
 #include "globals.h"
+#include "errno.h"
 
 #include "main/interrupt.h"
 #include "main/apic.h"
@@ -6,9 +7,70 @@
 
 #include "util/debug.h"
 #include "util/init.h"
+#include "util/time.h"
 
 #include "proc/sched.h"
 #include "proc/kthread.h"
 
-#ifdef __UPREEMPT__
-#endif
+/* Ticks since time_init, incremented by the PIT interrupt handler */
+static volatile uint32_t time_nticks = 0;
+
+/*
+ * Threads in time_sleep sleep on this queue. The interrupt handler wakes
+ * all of them once the earliest deadline (time_next_wakeup) has passed
+ * and each one goes back to sleep if its own deadline hasn't. The queue is
+ * only ever touched with the PIT interrupt masked: time_sleep raises the
+ * IPL to INTR_PIT, and sched_cancel, which takes a cancelled sleeper off
+ * it, to IPL_HIGH.
+ */
+static ktqueue_t time_waitq;
+static uint32_t time_next_wakeup = 0;
+
+static void
+time_intr_handler(regs_t *regs)
+{
+        time_nticks++;
+        if (!sched_queue_empty(&time_waitq)
+            && !time_after(time_next_wakeup, time_nticks)) {
+                sched_broadcast_on(&time_waitq);
+        }
+}
+
+static __attribute__((unused)) void
+time_init(void)
+{
+        sched_queue_init(&time_waitq);
+
+        intr_register(INTR_PIT, time_intr_handler);
+        pit_starttimer(INTR_PIT);
+}
+init_func(time_init);
+init_depends(sched_init);
+
+uint32_t
+time_ticks(void)
+{
+        return time_nticks;
+}
+
+int
+time_sleep(uint32_t nticks)
+{
+        uint32_t deadline = time_nticks + nticks;
+        uint8_t oldipl = intr_getipl();
+        int ret = 0;
+
+        intr_setipl(INTR_PIT);
+        while (time_after(deadline, time_nticks)) {
+                if (sched_queue_empty(&time_waitq)
+                    || time_after(time_next_wakeup, deadline)) {
+                        time_next_wakeup = deadline;
+                }
+                if ((ret = sched_cancellable_sleep_on(&time_waitq)) < 0) {
+                        break;
+                }
+        }
+        intr_setipl(oldipl);
+
+        return ret;
+}
@@ -11,10 +11,17 @@
 #include "mm/slab.h"
 #include "mm/tlb.h"
 
+#include "vm/swap.h"
+#include "vm/faulttrace.h"
+
 int anon_count = 0; /* for debugging/verification purposes */
 
 static slab_allocator_t *anon_allocator;
 
+/* A page of zeroes, mapped read-only wherever anonymous memory which has
+ * never been written to is read, see anon_zero_page */
+static void *zero_page;
+
 static void anon_ref(mmobj_t *o);
 static void anon_put(mmobj_t *o);
 static int  anon_lookuppage(mmobj_t *o, uint32_t pagenum, int forwrite, pframe_t **pf);
@@ -45,6 +52,20 @@ anon_init()
 	dbg(DBG_PRINT, "(GRADING3A 4.a) anon_allocator is successfully created.\n");
 	KASSERT(anon_allocator);
 	dbg(DBG_PRINT, "(GRADING3A 4.a) anon_allocator is successfully created.\n");
+
+	zero_page = page_alloc();
+	KASSERT(NULL != zero_page && "failed to allocate the zero page!");
+	memset(zero_page, 0, PAGE_SIZE);
+}
+
+/*
+ * Returns the kernel address of the shared zero page. Its contents must
+ * never change, so it is only ever mapped read-only.
+ */
+void *
+anon_zero_page()
+{
+        return zero_page;
 }
 
 /*
@@ -64,6 +85,15 @@ anon_create()
 	return myAnon;
 }
 
+/*
+ * Returns true if o is an anonymous object.
+ */
+int
+mmobj_is_anon(mmobj_t *o)
+{
+        return &anon_mmobj_ops == o->mmo_ops;
+}
+
 /* Implementation of mmobj entry points: */
 
 /*
@@ -104,48 +134,21 @@ anon_put(mmobj_t *o)
 			while(pframe_is_busy(myFrame)){
 				sched_sleep_on(&myFrame->pf_waitq);
 			}
-			if(pframe_is_dirty(myFrame)){
-				pframe_clean(myFrame);
-			}
-
+			/* nobody can see the data anymore, don't write it out */
 			pframe_free(myFrame);
 		} list_iterate_end();	
+		swap_discard_object(o);
 	}o->mmo_refcount--;
 	if(o->mmo_refcount==0) slab_obj_free(anon_allocator,o);
 }
 
 /* Get the corresponding page from the mmobj. No special handling is
- * required. */
+ * required. pframe_get waits for the page if it is busy, e.g. being
+ * swapped out. */
 static int
 anon_lookuppage(mmobj_t *o, uint32_t pagenum, int forwrite, pframe_t **pf)
 {
-        /*NOT_YET_IMPLEMENTED("VM: anon_lookuppage");*/
-	pframe_t *myFrame;
-/*	list_iterate_begin(&o->mmo_respages, myFrame, pframe_t, pf_olink) {
-        	if(myFrame->pf_pagenum == pagenum){
-			*pf = myFrame;
-			return 0;	
-		}
-        } list_iterate_end();
-*/	
-	/*if(forwrite==1){
-		return -EPERM;
-	}else{*/
-		if(o->mmo_nrespages>0){
-			list_iterate_begin(&o->mmo_respages, myFrame, pframe_t, pf_olink) {
-				if(myFrame->pf_obj==o && myFrame->pf_pagenum==pagenum){
-					*pf = myFrame;
-					return 0;
-				}
-		    }list_iterate_end();
-			return pframe_get(o,pagenum,pf);
-		}else{
-			return pframe_get(o,pagenum,pf);
-		}
-
-	/*}*/
-	
-        return 0;
+        return pframe_get(o, pagenum, pf);
 }
 
 /* The following three functions should not be difficult. */
@@ -159,9 +162,20 @@ anon_fillpage(mmobj_t *o, pframe_t *pf)
 	KASSERT(!pframe_is_pinned(pf));
 	dbg(DBG_PRINT, "(GRADING3A 4.d) pframe is not pinned\n ");
 	
+	uint64_t start = fault_trace_fill_begin();
+	int ret;
+
+	/* a page which was written to before has to come back from swap */
+	if (swap_has(o, pf->pf_pagenum)) {
+		ret = swap_in(pf);
+		fault_trace_fill_end(FT_MAJOR, start);
+		return ret;
+	}
+
 	pframe_pin(pf);
 	memset(pf->pf_addr,0,PAGE_SIZE);
 	pframe_unpin(pf);
+	fault_trace_fill_end(FT_ZERO, start);
 	/*pframe_t *myFrame=NULL;
 	list_iterate_begin(&o->mmo_respages, myFrame, pframe_t,pf_olink){
 		if(myFrame->pf_obj==o&& myFrame->pf_pagenum==pf->pf_pagenum){
@@ -189,8 +203,9 @@ static int
 anon_dirtypage(mmobj_t *o, pframe_t *pf)
 {
         /*NOT_YET_IMPLEMENTED("VM: anon_dirtypage");*/
-	/*since teh anonymous object should not be dirty. Nothing have to do here*/
-        return -EPERM;
+	/* the copy in swap (if any) is about to become stale */
+	swap_discard(o, pf->pf_pagenum);
+        return 0;
 }
 
 static int
@@ -212,5 +227,5 @@ anon_cleanpage(mmobj_t *o, pframe_t *pf)
 	}else{
 		return -EFAULT;
 	}*/
-        return 0;
+        return swap_out(pf);
 }
@@ -81,7 +81,9 @@ do_brk(void *addr, void **ret)
 				myFrame=vmmap_lookup(curproc->p_vmmap,cur_brkn);
 				KASSERT(myFrame != NULL);
 				if(myFrame!=NULL){
-					myFrame->vma_end += in_brkn-cur_brkn;
+					int err = vmarea_grow(curproc->p_vmmap, myFrame, in_brkn-cur_brkn);
+					if(err < 0)
+						return err;
 					curproc->p_brk = addr;
 					*ret = addr;
 				}
@@ -0,0 +1,197 @@
+#include "types.h"
+#include "globals.h"
+#include "kernel.h"
+#include "limits.h"
+
+#include "util/bits.h"
+#include "util/debug.h"
+#include "util/string.h"
+#include "util/time.h"
+
+#include "proc/proc.h"
+#include "proc/kthread.h"
+
+#include "mm/mmobj.h"
+
+#include "fs/vnode.h"
+
+#include "vm/pagefault.h"
+#include "vm/anon.h"
+#include "vm/shadow.h"
+#include "vm/faulttrace.h"
+
+/* Whether faults are recorded in the ring buffer, see kshell vmtune */
+int vm_fault_trace = 0;
+
+static fault_class_t fault_classes[FT_NACCESS][FT_NKINDS][FT_NOBJS];
+
+static fault_event_t fault_ring[FT_RING_SIZE];
+/* the number of faults ever put in the ring, the last FT_RING_SIZE of
+ * which are still there */
+static uint32_t fault_ring_count;
+
+static const char *fault_access_names[FT_NACCESS] = {
+        "read", "write", "exec"
+};
+static const char *fault_kind_names[FT_NKINDS] = {
+        "minor", "zero", "cow", "major", "large", "bad"
+};
+static const char *fault_obj_names[FT_NOBJS] = {
+        "anon", "shadow", "file", "other"
+};
+
+const char *
+fault_trace_access_name(int access)
+{
+        return fault_access_names[access];
+}
+
+const char *
+fault_trace_kind_name(int kind)
+{
+        return fault_kind_names[kind];
+}
+
+const char *
+fault_trace_obj_name(int obj)
+{
+        return fault_obj_names[obj];
+}
+
+/*
+ * Starts timing a fault on vaddr, with the given cause (FAULT_* flags),
+ * which the current thread is about to handle.
+ */
+void
+fault_trace_begin(fault_trace_t *ft, uintptr_t vaddr, uint32_t cause)
+{
+        ft->ft_vaddr = vaddr;
+        ft->ft_fill = 0;
+        ft->ft_fill_depth = 0;
+        ft->ft_kind = FT_MINOR;
+        ft->ft_obj = FT_OBJ_OTHER;
+        if (cause & FAULT_WRITE)
+                ft->ft_access = FT_WRITE;
+        else if (cause & FAULT_EXEC)
+                ft->ft_access = FT_EXEC;
+        else
+                ft->ft_access = FT_READ;
+
+        KASSERT(NULL == curthr->kt_fault);
+        curthr->kt_fault = ft;
+        ft->ft_start = time_rdtsc();
+}
+
+/* Records that the current fault is on an area mapping object o */
+void
+fault_trace_object(mmobj_t *o)
+{
+        fault_trace_t *ft = curthr->kt_fault;
+
+        if (NULL == ft)
+                return;
+        if (mmobj_is_shadow(o))
+                ft->ft_obj = FT_OBJ_SHADOW;
+        else if (mmobj_is_anon(o))
+                ft->ft_obj = FT_OBJ_ANON;
+        else if (NULL != vnode_from_mmobj(o))
+                ft->ft_obj = FT_OBJ_FILE;
+        else
+                ft->ft_obj = FT_OBJ_OTHER;
+}
+
+/* Counts the current fault as kind, unless it is counted as something
+ * more expensive already */
+void
+fault_trace_kind(int kind)
+{
+        fault_trace_t *ft = curthr->kt_fault;
+
+        if (NULL != ft && kind > ft->ft_kind)
+                ft->ft_kind = kind;
+}
+
+uint64_t
+fault_trace_fill_begin(void)
+{
+        if (NULL != curthr->kt_fault)
+                curthr->kt_fault->ft_fill_depth++;
+        return time_rdtsc();
+}
+
+void
+fault_trace_fill_end(int kind, uint64_t start)
+{
+        fault_trace_t *ft = curthr->kt_fault;
+
+        if (NULL == ft)
+                return;
+        /* e.g. shadow_fillpage reading the page it copies, the time is
+         * only counted once, by the outermost fill */
+        if (0 == --ft->ft_fill_depth)
+                ft->ft_fill += (uint32_t)(time_rdtsc() - start);
+        fault_trace_kind(kind);
+}
+
+/* Stops timing the current thread's fault and accounts for it */
+void
+fault_trace_end(fault_trace_t *ft)
+{
+        uint64_t cycles64 = time_rdtsc() - ft->ft_start;
+        uint32_t cycles = (cycles64 > UINT_MAX) ? UINT_MAX : (uint32_t)cycles64;
+        fault_class_t *fc = &fault_classes[ft->ft_access][ft->ft_kind][ft->ft_obj];
+        int bucket = bit_log2(cycles);
+
+        KASSERT(curthr->kt_fault == ft);
+        curthr->kt_fault = NULL;
+
+        if (bucket >= FT_BUCKETS)
+                bucket = FT_BUCKETS - 1;
+        fc->fc_count++;
+        fc->fc_cycles += cycles;
+        fc->fc_hist[bucket]++;
+        if (cycles > fc->fc_max)
+                fc->fc_max = cycles;
+
+        if (vm_fault_trace) {
+                fault_event_t *fe = &fault_ring[fault_ring_count++ % FT_RING_SIZE];
+
+                fe->fe_tsc = ft->ft_start;
+                fe->fe_cycles = cycles;
+                fe->fe_fill = ft->ft_fill;
+                fe->fe_vaddr = ft->ft_vaddr;
+                fe->fe_pid = curproc->p_pid;
+                fe->fe_access = ft->ft_access;
+                fe->fe_kind = ft->ft_kind;
+                fe->fe_obj = ft->ft_obj;
+        }
+}
+
+void
+fault_trace_get_class(int access, int kind, int obj, fault_class_t *fc)
+{
+        *fc = fault_classes[access][kind][obj];
+}
+
+/*
+ * Copies the i'th oldest fault still in the ring buffer into fe.
+ *
+ * @return 0 on success, -1 if there are no more than i faults in it
+ */
+int
+fault_trace_get_event(uint32_t i, fault_event_t *fe)
+{
+        uint32_t n = MIN(fault_ring_count, FT_RING_SIZE);
+
+        if (i >= n)
+                return -1;
+        *fe = fault_ring[(fault_ring_count - n + i) % FT_RING_SIZE];
+        return 0;
+}
+
+void
+fault_trace_reset(void)
+{
+        memset(fault_classes, 0, sizeof(fault_classes));
+        fault_ring_count = 0;
+}
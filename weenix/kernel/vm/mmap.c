@@ -18,12 +18,19 @@
 
 #include "vm/vmmap.h"
 #include "vm/mmap.h"
+#include "vm/swap.h"
+#include "vm/pagefault.h"
+#include "vm/anon.h"
+#include "vm/shadow.h"
 #include "mm/pagetable.h"
+#include "mm/pframe.h"
+#include "mm/mmobj.h"
+#include "proc/sched.h"
 
 /*
  * This function implements the mmap(2) syscall, but only
- * supports the MAP_SHARED, MAP_PRIVATE, MAP_FIXED, and
- * MAP_ANON flags.
+ * supports the MAP_SHARED, MAP_PRIVATE, MAP_FIXED, MAP_ANON and
+ * MAP_POPULATE flags.
  *
  * Add a mapping to the current process's address space.
  * You need to do some error checking; see the ERRORS section
@@ -120,12 +127,16 @@ do_mmap(void *addr, size_t len, int prot, int flags,
 	vmp_ret = vmmap_map(curproc->p_vmmap, vn, lopage, npages, prot, flags, off, VMMAP_DIR_LOHI, &vma);
 	if(vmp_ret < 0)
 		return vmp_ret;
+	/* mprotect mustn't make a shared mapping of a file writable if the
+	 * file isn't open for writing */
+	if(vn != NULL && (flags & MAP_SHARED) && !(ft->f_mode & FMODE_WRITE))
+		vma->vma_maxprot &= ~PROT_WRITE;
 	*ret = PN_TO_ADDR(vma->vma_start);
+	/* vmmap_map unmapped whatever was in the way (see vmmap_remove) */
 	KASSERT(NULL != curproc->p_pagedir);
 	dbg(DBG_PRINT, "(GRADING3A 2.a) the page directory of current process is no NULL.\n");
-	pt_unmap_range(curproc->p_pagedir, (uintptr_t)*ret, (uintptr_t)*ret+npages*PAGE_SIZE);
-	tlb_flush_range((uintptr_t)*ret, npages);
-	/*tlb_flush_all();*/
+	if(flags & MAP_POPULATE)
+		vm_populate(vma);
 	return 0;
 }
 
@@ -149,13 +160,344 @@ do_munmap(void *addr, size_t len)
 	uint32_t npages = len/PAGE_SIZE + ((uint32_t)(len%PAGE_SIZE == 0)?0:1);
 	uint32_t lopage = ADDR_TO_PN(addr);
 
-	int vmp_ret = vmmap_remove(curproc->p_vmmap, lopage, npages);
-	if(vmp_ret < 0) return vmp_ret;
 	KASSERT(NULL != curproc->p_pagedir);
 	dbg(DBG_PRINT, "(GRADING3A 2.b) the page directory of current process is no NULL.\n");
-	pt_unmap_range(curproc->p_pagedir, (uintptr_t)PN_TO_ADDR(lopage), (uintptr_t)(PN_TO_ADDR(lopage+npages)));
-	tlb_flush_range((uintptr_t)addr,npages);
+	/* this unmaps the pages and flushes the TLB too */
+	int vmp_ret = vmmap_remove(curproc->p_vmmap, lopage, npages);
+	if(vmp_ret < 0) return vmp_ret;
+	return 0;
+
+}
+
+
+/*
+ * This function implements the mprotect(2) syscall.
+ *
+ * vmmap_protect changes the areas, splitting and merging them as needed.
+ * The pages stay where they are, in their objects and in the page table:
+ * taking a permission away is done right away on the mapped pages, a
+ * permission which is granted is picked up by the next fault on a page,
+ * like for pages which aren't mapped yet.
+ */
+int
+do_mprotect(void *addr, size_t len, int prot)
+{
+	uint32_t lopage, npages;
+	uintptr_t vlow, vhigh;
+	tlb_gather_t tg;
+	int err;
+
+	/*
+	 * EINVAL addr is not a valid pointer, or not a multiple of the
+	 *        system page size; or prot has unknown bits set.
+	 */
+	if(!PAGE_ALIGNED(addr) || (prot & ~(PROT_READ|PROT_WRITE|PROT_EXEC)) ||
+			len > (USER_MEM_HIGH-USER_MEM_LOW) ||
+			addr < (void*)USER_MEM_LOW || addr >= (void*)USER_MEM_HIGH ||
+			(uintptr_t)addr + len > USER_MEM_HIGH)
+		return -EINVAL;
+	if(len == 0)
+		return 0;
+
+	lopage = ADDR_TO_PN(addr);
+	npages = len/PAGE_SIZE + ((len%PAGE_SIZE == 0)?0:1);
+
+	/*
+	 * ENOMEM Addresses in the range [addr, addr+len] are not mapped.
+	 * EACCES The memory cannot be given the specified access.
+	 */
+	if((err = vmmap_protect(curproc->p_vmmap, lopage, npages, prot)) < 0)
+		return err;
+
+	vlow = (uintptr_t)PN_TO_ADDR(lopage);
+	vhigh = (uintptr_t)PN_TO_ADDR(lopage + npages);
+	tlb_gather_init(&tg, curproc->p_pagedir);
+	if(!(prot & PROT_READ)){
+		/* the MMU can't map a page which can't be read */
+		pt_unmap_range(curproc->p_pagedir, vlow, vhigh, &tg);
+	}else if(!(prot & PROT_WRITE)){
+		pt_protect_range(curproc->p_pagedir, vlow, vhigh, PT_WRITE, &tg);
+	}
+	/* else nothing mapped gets more access than it had */
+	tlb_gather_finish(&tg);
+	return 0;
+}
+
+/*
+ * This function implements the msync(2) syscall.
+ *
+ * Writes the dirty pages of shared file mappings in the given range back
+ * to their files. Private and anonymous mappings have nothing to write
+ * back. With MS_ASYNC the pages are left to flushd, which writes back
+ * dirty pages anyway, so only the arguments are checked. Pages which
+ * are pinned (being read or written by the kernel) are skipped, whoever
+ * pinned them dirties them afresh.
+ *
+ * Cleaning a page write-protects it and clears the dirty bits of its
+ * mappings, so a page which isn't written again isn't written back by
+ * the next msync or by flushd either.
+ */
+int
+do_msync(void *addr, size_t len, int flags)
+{
+	uint32_t lopage, npages, vfn;
+	vmarea_t *vma;
+	pframe_t *pf;
+	int unmapped = 0, err;
+
+	/*
+	 * EINVAL addr is not a multiple of PAGESIZE; or any bit other than
+	 *        MS_ASYNC | MS_INVALIDATE | MS_SYNC is set in flags; or both
+	 *        MS_SYNC and MS_ASYNC are set in flags.
+	 */
+	if(!PAGE_ALIGNED(addr) || (flags & ~(MS_ASYNC|MS_INVALIDATE|MS_SYNC)) ||
+			(flags & (MS_ASYNC|MS_SYNC)) == (MS_ASYNC|MS_SYNC) ||
+			len > (USER_MEM_HIGH-USER_MEM_LOW) ||
+			addr < (void*)USER_MEM_LOW || addr >= (void*)USER_MEM_HIGH ||
+			(uintptr_t)addr + len > USER_MEM_HIGH)
+		return -EINVAL;
+
+	lopage = ADDR_TO_PN(addr);
+	npages = len/PAGE_SIZE + ((len%PAGE_SIZE == 0)?0:1);
+
+	for(vfn = lopage; vfn < lopage + npages; vfn++){
+		/*
+		 * ENOMEM The indicated memory (or part of it) was not mapped.
+		 * The rest of the range is still written back.
+		 */
+		if((vma = vmmap_lookup(curproc->p_vmmap, vfn)) == NULL){
+			unmapped = 1;
+			continue;
+		}
+		if((flags & MS_ASYNC) || !(vma->vma_flags & MAP_SHARED) ||
+				mmobj_is_swapbacked(vma->vma_obj))
+			continue;
+
+		while((pf = pframe_get_resident(vma->vma_obj,
+				vfn - vma->vma_start + vma->vma_off)) != NULL &&
+				pframe_is_busy(pf)){
+			sched_sleep_on(&pf->pf_waitq);
+		}
+		if(pf == NULL || !pframe_is_dirty(pf) || pframe_is_pinned(pf))
+			continue;
+		if((err = pframe_clean(pf)) < 0)
+			return err;
+	}
+	return unmapped ? -ENOMEM : 0;
+}
+
+
+/*
+ * Returns 1 if a shadow object below top in its chain has a copy of the
+ * page, i.e. if dropping top's copy would bring back older private
+ * contents (from before a fork) rather than the file's or zeros.
+ */
+static int
+madvise_copy_below(mmobj_t *top, uint32_t pagenum)
+{
+	mmobj_t *o;
+
+	for(o = top->mmo_shadowed; NULL != o && mmobj_is_shadow(o); o = o->mmo_shadowed){
+		if(NULL != pframe_get_resident(o, pagenum) || swap_has(o, pagenum))
+			return 1;
+	}
 	return 0;
+}
+
+/*
+ * MADV_DONTNEED on page vfn of the private area vma: afterwards the page
+ * reads like it did when it was mapped, from the file or as zeros.
+ * Usually the area's own copy of the page is simply dropped. If that
+ * would bring back an older copy, the area's copy is overwritten instead.
+ */
+static int
+madvise_dontneed(vmarea_t *vma, uint32_t vfn)
+{
+	mmobj_t *top = vma->vma_obj;
+	mmobj_t *bottom = mmobj_bottom_obj(top);
+	uint32_t pagenum = vfn - vma->vma_start + vma->vma_off;
+	pframe_t *pf, *orig;
+	int err;
+
+	while((pf = pframe_get_resident(top, pagenum)) != NULL && pframe_is_busy(pf))
+		sched_sleep_on(&pf->pf_waitq);
+	if(!madvise_copy_below(top, pagenum) && (NULL == pf || !pframe_is_pinned(pf))){
+		if(NULL != pf)
+			pframe_free(pf);
+		swap_discard(top, pagenum);
+		return 0;
+	}
+
+	if((err = pframe_lookup(top, pagenum, 1, &pf)) < 0)
+		return err;
+	pframe_pin(pf);
+	if((err = pframe_dirty(pf)) < 0)
+		goto out;
+	if(mmobj_is_anon(bottom)){
+		memset(pf->pf_addr, 0, PAGE_SIZE);
+	}else{
+		if((err = pframe_get(bottom, pagenum, &orig)) < 0)
+			goto out;
+		memcpy(pf->pf_addr, orig->pf_addr, PAGE_SIZE);
+	}
+out:
+	pframe_unpin(pf);
+	return err;
+}
+
+/*
+ * MADV_FREE on page vfn of the area vma: if the page is private anonymous
+ * memory which nothing else has a copy of, it may be reclaimed without
+ * being written to swap, see pframe_lazyfree. Anything else is left
+ * alone.
+ */
+static void
+madvise_free(vmarea_t *vma, uint32_t vfn)
+{
+	mmobj_t *top = vma->vma_obj;
+	uint32_t pagenum = vfn - vma->vma_start + vma->vma_off;
+	pframe_t *pf;
+
+	if(!(vma->vma_flags & MAP_PRIVATE) || !mmobj_is_anon(mmobj_bottom_obj(top)) ||
+			madvise_copy_below(top, pagenum))
+		return;
+	if((pf = pframe_get_resident(top, pagenum)) == NULL)
+		swap_discard(top, pagenum);
+	else if(!pframe_is_busy(pf) && !pframe_is_pinned(pf))
+		pframe_lazyfree(pf);
+}
+
+/*
+ * This function implements the madvise(2) syscall.
+ *
+ * MADV_NORMAL, MADV_RANDOM and MADV_SEQUENTIAL set the read-ahead policy
+ * of the areas in the range: random areas don't map the pages around a
+ * fault, sequential ones start reading the next pages on every fault.
+ * MADV_WILLNEED starts reading in the pages which aren't resident.
+ * MADV_DONTNEED drops private pages, so they read like freshly mapped
+ * ones, and unmaps the range (shared pages stay in their objects); it
+ * fails if any of the private pages is locked.
+ * MADV_FREE lets pageoutd reclaim private anonymous pages without saving
+ * them, unless they are written again first.
+ */
+int
+do_madvise(void *addr, size_t len, int advice)
+{
+	uint32_t lopage, npages, vfn;
+	vmarea_t *vma;
+	tlb_gather_t tg;
+	int unmapped = 0, prefetching = 1, err;
+
+	/*
+	 * EINVAL addr is not page-aligned, or advice is not valid.
+	 */
+	if(!PAGE_ALIGNED(addr) || len > (USER_MEM_HIGH-USER_MEM_LOW) ||
+			addr < (void*)USER_MEM_LOW || addr >= (void*)USER_MEM_HIGH ||
+			(uintptr_t)addr + len > USER_MEM_HIGH)
+		return -EINVAL;
+
+	lopage = ADDR_TO_PN(addr);
+	npages = len/PAGE_SIZE + ((len%PAGE_SIZE == 0)?0:1);
 
+	switch(advice){
+		case MADV_NORMAL:
+		case MADV_RANDOM:
+		case MADV_SEQUENTIAL:
+			if(npages == 0)
+				return 0;
+			return vmmap_advise(curproc->p_vmmap, lopage, npages, advice);
+		case MADV_WILLNEED:
+		case MADV_DONTNEED:
+		case MADV_FREE:
+			break;
+		default:
+			return -EINVAL;
+	}
+
+	/*
+	 * EINVAL advice is MADV_DONTNEED and some of the private pages in
+	 *        the range are locked. Nothing is changed then.
+	 */
+	if(advice == MADV_DONTNEED){
+		for(vfn = lopage; vfn < lopage + npages; vfn++){
+			if((vma = vmmap_lookup(curproc->p_vmmap, vfn)) != NULL &&
+					(vma->vma_flags & MAP_PRIVATE) &&
+					NULL != vma->vma_pinned)
+				return -EINVAL;
+		}
+	}
+
+	/* unmap the range first, so that the TLB is flushed once and
+	 * before any of the pages is freed */
+	if(advice == MADV_DONTNEED && npages > 0){
+		tlb_gather_init(&tg, curproc->p_pagedir);
+		pt_unmap_range(curproc->p_pagedir, (uintptr_t)PN_TO_ADDR(lopage),
+				(uintptr_t)PN_TO_ADDR(lopage + npages), &tg);
+		tlb_gather_finish(&tg);
+	}
+
+	for(vfn = lopage; vfn < lopage + npages; vfn++){
+		/*
+		 * ENOMEM Addresses in the specified range are not currently
+		 *        mapped. The rest of the range is still advised.
+		 */
+		if((vma = vmmap_lookup(curproc->p_vmmap, vfn)) == NULL){
+			unmapped = 1;
+			continue;
+		}
+		switch(advice){
+			case MADV_WILLNEED:
+				/* don't push other pages out for this */
+				if(prefetching && vm_prefetch(vma, vfn) < 0)
+					prefetching = 0;
+				break;
+			case MADV_DONTNEED:
+				if((vma->vma_flags & MAP_PRIVATE) &&
+						(err = madvise_dontneed(vma, vfn)) < 0)
+					return err;
+				break;
+			case MADV_FREE:
+				madvise_free(vma, vfn);
+				break;
+		}
+	}
+	return unmapped ? -ENOMEM : 0;
 }
 
+
+/*
+ * This function implements the mlock(2) and munlock(2) syscalls: lock
+ * is 1 for mlock and 0 for munlock. Locked pages are faulted in and
+ * pinned (see vmmap_lock), so they can be used without faulting until
+ * they are unlocked or unmapped. Each process may lock vm_mlock_limit
+ * pages. Locks aren't inherited by children, and a fork gives the parent
+ * its own copies of its locked pages (see vmmap_unshare_locked).
+ */
+int
+do_mlock(void *addr, size_t len, int lock)
+{
+	uint32_t lopage, npages;
+
+	/*
+	 * EINVAL addr + len overflowed, or is outside of user memory.
+	 * The range is rounded out to whole pages.
+	 */
+	if(len > (USER_MEM_HIGH-USER_MEM_LOW) ||
+			addr < (void*)USER_MEM_LOW || addr >= (void*)USER_MEM_HIGH ||
+			(uintptr_t)addr + len > USER_MEM_HIGH)
+		return -EINVAL;
+	if(len == 0)
+		return 0;
+
+	lopage = ADDR_TO_PN(addr);
+	npages = ADDR_TO_PN(PAGE_ALIGN_UP((uintptr_t)addr + len)) - lopage;
+
+	/*
+	 * ENOMEM Some of the range is not mapped, or locking it would
+	 *        exceed the number of pages the process may lock, or there
+	 *        is no memory to lock or unlock part of an area.
+	 */
+	if(lock)
+		return vmmap_lock(curproc->p_vmmap, lopage, npages);
+	return vmmap_unlock(curproc->p_vmmap, lopage, npages);
+}
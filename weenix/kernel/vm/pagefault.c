@@ -1,9 +1,11 @@
 #include "types.h"
 #include "globals.h"
 #include "kernel.h"
+#include "config.h"
 #include "errno.h"
 
 #include "util/debug.h"
+#include "util/string.h"
 
 #include "proc/proc.h"
 
@@ -13,9 +15,419 @@
 #include "mm/mmobj.h"
 #include "mm/pframe.h"
 #include "mm/pagetable.h"
+#include "mm/tlb.h"
 
 #include "vm/pagefault.h"
 #include "vm/vmmap.h"
+#include "vm/anon.h"
+#include "vm/shadow.h"
+#include "vm/vmstat.h"
+#include "vm/swap.h"
+#include "vm/faulttrace.h"
+
+/* Size of the window of pages mapped around a read fault, see faultaround */
+int vm_faultaround = VM_FAULTAROUND_PAGES;
+
+/* Whether untouched anonymous memory may get 4mb pages, see vm_fault_large */
+int vm_large_pages = 1;
+
+/*
+ * Returns the page a read fault on the given page of o would map, if it
+ * is resident and not busy, i.e. if mapping it doesn't take any I/O (or
+ * waiting for I/O). Like shadow_lookuppage, this takes the page from the
+ * first object in the shadow chain which has a copy of it.
+ */
+static pframe_t *
+faultaround_page(mmobj_t *o, uint32_t pagenum)
+{
+        pframe_t *pf;
+
+        for (; NULL != o; o = o->mmo_shadowed) {
+                if (NULL != (pf = pframe_get_resident(o, pagenum)))
+                        return pframe_is_busy(pf) ? NULL : pf;
+                if (swap_has(o, pagenum))
+                        return NULL;
+        }
+        return NULL;
+}
+
+/*
+ * After a read fault on vfn, maps the other pages in the aligned window
+ * of vm_faultaround pages around it (and in the same area) which are
+ * already resident, so that e.g. running a program whose text is in the
+ * page cache doesn't take a fault for every page. The pages are mapped
+ * read-only like on any read fault, so that writing to them faults;
+ * pages which are mapped already are left alone.
+ */
+static void
+faultaround(vmarea_t *vma, uint32_t vfn)
+{
+        pagedir_t *pd = curproc->p_pagedir;
+        uint32_t lo, hi, vpn;
+
+        if (vm_faultaround <= 1 || !(vma->vma_prot & PROT_READ)
+            || MADV_RANDOM == vma->vma_advice)
+                return;
+
+        lo = MAX(vfn - vfn % vm_faultaround, vma->vma_start);
+        hi = MIN(vfn - vfn % vm_faultaround + vm_faultaround, vma->vma_end);
+
+        for (vpn = lo; vpn < hi; ++vpn) {
+                uintptr_t vaddr = (uintptr_t)PN_TO_ADDR(vpn);
+                uintptr_t paddr;
+                pframe_t *pf;
+
+                if (vpn == vfn || (PT_PRESENT & pt_lookup(pd, vaddr)))
+                        continue;
+                pf = faultaround_page(vma->vma_obj,
+                                      vpn - vma->vma_start + vma->vma_off);
+                if (NULL == pf)
+                        continue;
+
+                paddr = (uintptr_t)PAGE_ALIGN_DOWN(pt_virt_to_phys((uintptr_t)pf->pf_addr));
+                if (pt_map(pd, vaddr, paddr, PD_PRESENT | PD_USER,
+                           PT_PRESENT | PT_USER) < 0)
+                        return;
+                vm_stat_inc(vs_faultaround);
+        }
+}
+
+/*
+ * Called when a prefetched page has come in. It just stays resident until
+ * it is faulted on (or reclaimed).
+ */
+static void
+prefetch_done(pframe_t *pf, int status, void *arg)
+{
+        if (status < 0)
+                dbg(DBG_VM, "prefetch failed: %d\n", status);
+}
+
+/*
+ * Starts reading in page vfn of vma without waiting for it, if a fault
+ * on it would have to read it: from swap if the first object in the
+ * shadow chain with a copy of the page has it there, or from the file at
+ * the bottom of the chain. Anonymous pages which were never written are
+ * left alone, faulting them in doesn't take any I/O.
+ *
+ * @return 1 if a read was started, 0 if there was nothing to read,
+ * -errno from pframe_get_async (-EAGAIN if memory is short)
+ */
+int
+vm_prefetch(vmarea_t *vma, uint32_t vfn)
+{
+        uint32_t pagenum = vfn - vma->vma_start + vma->vma_off;
+        mmobj_t *o;
+        int ret;
+
+        for (o = vma->vma_obj; NULL != o; o = o->mmo_shadowed) {
+                if (NULL != pframe_get_resident(o, pagenum))
+                        return 0;
+                if (swap_has(o, pagenum))
+                        break;
+                if (NULL == o->mmo_shadowed && mmobj_is_swapbacked(o))
+                        return 0;
+        }
+        if (NULL == o)
+                return 0;
+
+        if ((ret = pframe_get_async(o, pagenum, prefetch_done, NULL)) < 0)
+                return ret;
+        vm_stat_inc(vs_prefetch);
+        return 1;
+}
+
+/*
+ * After a fault on vfn in an MADV_SEQUENTIAL area, starts reading in the
+ * next vm_faultaround pages of the area, so that they are (being) read by
+ * the time they are faulted on. Stops when memory is short.
+ */
+static void
+readahead(vmarea_t *vma, uint32_t vfn)
+{
+        uint32_t vpn, hi = MIN(vfn + 1 + vm_faultaround, vma->vma_end);
+
+        for (vpn = vfn + 1; vpn < hi; ++vpn) {
+                if (vm_prefetch(vma, vpn) < 0)
+                        return;
+        }
+}
+
+/*
+ * Handles a write fault on the present page vfn of the shared area vma
+ * without looking the page up in the area's object: the page table entry
+ * already says which page it is. Returns 1 if the page was dirtied and
+ * mapped writable, 0 if the fault has to take the slow path (e.g. the
+ * page is busy being cleaned, or the entry maps some other page).
+ */
+static int
+redirty_shared(vmarea_t *vma, uint32_t vfn)
+{
+        pagedir_t *pd = curproc->p_pagedir;
+        uintptr_t vaddr = (uintptr_t)PN_TO_ADDR(vfn);
+        pte_t pte = pt_lookup(pd, vaddr);
+        pframe_t *pf;
+
+        if (!(PT_PRESENT & pte)
+            || NULL == (pf = pframe_from_paddr(pte & PAGE_MASK))
+            || pf->pf_obj != vma->vma_obj
+            || pf->pf_pagenum != vfn - vma->vma_start + vma->vma_off
+            || pframe_is_busy(pf))
+                return 0;
+
+        if (pframe_dirty_mapped(pf) < 0)
+                return 0;
+        if (pt_map(pd, vaddr, pte & PAGE_MASK, PD_PRESENT | PD_USER | PD_WRITE,
+                   PT_PRESENT | PT_USER | PT_WRITE) < 0)
+                return 0;
+        tlb_flush(vaddr);
+        vm_stat_inc(vs_redirty);
+        return 1;
+}
+
+/*
+ * Maps page vfn of vma into the current process, for reading or for
+ * writing, the way a fault on it would, and returns the page it mapped in
+ * *result (if result isn't NULL), pinned if pin is set. In a locked area
+ * the page is pinned for the area as well (see vmarea_pin).
+ *
+ * Reading private anonymous memory which was never written, e.g. a fresh
+ * heap or bss, maps the zero page instead of allocating one; *result is
+ * NULL then. A write faults again, since the mapping is read-only, and
+ * then gets a page of its own. Nothing else can write the page under us
+ * in a private area, so the mapping stays valid until then.
+ *
+ * @return 0 on success, -errno if the page couldn't be read, dirtied or
+ * mapped
+ */
+int
+vm_fault_in(vmarea_t *vma, uint32_t vfn, int forwrite, int pin, pframe_t **result)
+{
+        pagedir_t *pd = curproc->p_pagedir;
+        uintptr_t vaddr = (uintptr_t)PN_TO_ADDR(vfn);
+        uint32_t pagenum = vfn - vma->vma_start + vma->vma_off;
+        uint32_t pdflags = PD_PRESENT | PD_USER, ptflags = PT_PRESENT | PT_USER;
+        pframe_t *pf = NULL;
+        uintptr_t paddr;
+        int ret;
+
+        KASSERT(vma->vma_vmmap == curproc->p_vmmap);
+
+        if (!forwrite && (vma->vma_flags & MAP_PRIVATE)
+            && shadow_page_is_zero(vma->vma_obj, pagenum)) {
+                paddr = (uintptr_t)PAGE_ALIGN_DOWN(pt_virt_to_phys((uintptr_t)anon_zero_page()));
+                vm_stat_inc(vs_zeropage);
+        } else {
+                if ((ret = pframe_lookup(vma->vma_obj, pagenum, forwrite, &pf)) < 0)
+                        return ret;
+                if (pin)
+                        pframe_pin(pf);
+                if (forwrite) {
+                        /* the page is only mapped writable while it is
+                         * dirty, so that it can't change behind the back
+                         * of whoever cleans it */
+                        if ((ret = pframe_dirty_mapped(pf)) < 0)
+                                goto fail;
+                        pdflags |= PD_WRITE;
+                        ptflags |= PT_WRITE;
+                }
+                paddr = (uintptr_t)PAGE_ALIGN_DOWN(pt_virt_to_phys((uintptr_t)pf->pf_addr));
+        }
+
+        if ((ret = pt_map(pd, vaddr, paddr, pdflags, ptflags)) < 0)
+                goto fail;
+        /* a write to a page mapped read-only replaces its translation */
+        tlb_flush(vaddr);
+        if (NULL != vma->vma_pinned)
+                vmarea_pin(vma, vfn, pf);
+
+        if (NULL != result)
+                *result = pf;
+        return 0;
+
+fail:
+        if (pin && NULL != pf)
+                pframe_unpin(pf);
+        return ret;
+}
+
+/*
+ * Returns nonzero if none of the npages pages of o from pagenum on is
+ * resident or in swap.
+ */
+static int
+untouched(mmobj_t *o, uint32_t pagenum, uint32_t npages)
+{
+        uint32_t i;
+
+        for (i = 0; i < npages; ++i) {
+                if ((0 != o->mmo_nrespages
+                     && NULL != pframe_get_resident(o, pagenum + i))
+                    || swap_has(o, pagenum + i))
+                        return 0;
+        }
+        return 1;
+}
+
+/*
+ * Called for a write fault on vfn of vma, which isn't mapped, before
+ * vm_fault_in. If vfn is in an aligned 4mb piece of the area which is
+ * anonymous memory that was never touched (nothing of it is mapped, and
+ * no object in the shadow chain has any of its pages), backs all of it at
+ * once with a 4mb block of zeroed page frames, which becomes those pages
+ * of the area's object, and maps the block writable as a 4mb page. That
+ * saves the other 1023 faults and lots of TLB entries. If memory is short
+ * or too fragmented for a 4mb block, the fault is left to vm_fault_in.
+ *
+ * @return 1 if the 4mb page was mapped, 0 if the fault still needs to be
+ * handled
+ */
+int
+vm_fault_large(vmarea_t *vma, uint32_t vfn)
+{
+        pagedir_t *pd = curproc->p_pagedir;
+        uint32_t lo = vfn - vfn % PT_LARGE_PAGES;
+        uintptr_t vaddr = (uintptr_t)PN_TO_ADDR(lo);
+        uint32_t pagenum = lo - vma->vma_start + vma->vma_off;
+        uint32_t min, low, high;
+        mmobj_t *o;
+        void *block;
+
+        KASSERT(vma->vma_vmmap == curproc->p_vmmap);
+
+        if (!vm_large_pages
+            || lo < vma->vma_start || lo + PT_LARGE_PAGES > vma->vma_end
+            || !(vma->vma_prot & PROT_WRITE) || NULL != vma->vma_pinned
+            || !pt_can_map_large(pd, vaddr))
+                return 0;
+
+        pframe_get_watermarks(&min, &low, &high);
+        if (page_free_count() < PT_LARGE_PAGES + high
+            || NULL == (block = page_alloc_n(PT_LARGE_PAGES))) {
+                vm_stat_inc(vs_large_fallback);
+                return 0;
+        }
+
+        /* checked only now, since allocating the block may block */
+        for (o = vma->vma_obj; NULL != o; o = o->mmo_shadowed) {
+                if ((NULL == o->mmo_shadowed && !mmobj_is_swapbacked(o))
+                    || !untouched(o, pagenum, PT_LARGE_PAGES)) {
+                        page_free_n(block, PT_LARGE_PAGES);
+                        return 0;
+                }
+        }
+
+        memset(block, 0, PAGE_SIZE * PT_LARGE_PAGES);
+        if (pframe_adopt_block(vma->vma_obj, pagenum, PT_LARGE_PAGES, block) < 0)
+                return 0;
+        /* if this fails, the pages are simply faulted in one at a time */
+        if (pt_map_large(pd, vaddr, pt_virt_to_phys((uintptr_t)block),
+                         PD_PRESENT | PD_USER | PD_WRITE) < 0)
+                return 0;
+        vm_stat_inc(vs_large);
+        return 1;
+}
+
+/*
+ * Faults in all of vma at once, for MAP_POPULATE. Every page which has to
+ * be read is asked for first, so that the reads are all issued together
+ * (and pframe_iod does them in order), then the pages are mapped in
+ * order, for writing if the area is writable, so that using the area
+ * never faults. Aligned 4mb pieces of writable anonymous areas are
+ * mapped as 4mb pages where possible (see vm_fault_large). If memory runs
+ * out the rest is left to be faulted in on demand.
+ */
+void
+vm_populate(vmarea_t *vma)
+{
+        uint32_t vfn;
+        int forwrite = vma->vma_prot & PROT_WRITE;
+
+        if (!(vma->vma_prot & (PROT_READ | PROT_WRITE)))
+                return;
+
+        for (vfn = vma->vma_start; vfn < vma->vma_end; ++vfn) {
+                if (vm_prefetch(vma, vfn) < 0)
+                        break;
+        }
+        for (vfn = vma->vma_start; vfn < vma->vma_end; ++vfn) {
+                if (forwrite && 0 == vfn % PT_LARGE_PAGES
+                    && vm_fault_large(vma, vfn)) {
+                        vm_stats.vs_populated += PT_LARGE_PAGES;
+                        vfn += PT_LARGE_PAGES - 1;
+                        continue;
+                }
+                if (vm_fault_in(vma, vfn, forwrite, 0, NULL) < 0)
+                        return;
+                vm_stat_inc(vs_populated);
+        }
+}
+
+/*
+ * Does the work of handle_pagefault.
+ *
+ * @return 0 if the page was mapped, -EFAULT if the access isn't allowed
+ * or -errno if the page couldn't be mapped
+ */
+static int
+resolve_fault(uintptr_t vaddr, uint32_t cause)
+{
+	int err;
+	vm_stat_inc(vs_faults);
+        /* find the vmarea */
+	vmarea_t *vmarea;
+	if((vmarea=vmmap_lookup(curproc->p_vmmap,ADDR_TO_PN(vaddr)))==NULL){
+		return -EFAULT;
+	}
+	fault_trace_object(vmarea->vma_obj);
+
+	/* check the permissions on the area, also when the page is present:
+	 * pages of writable areas are mapped read-only until they are
+	 * dirtied or copied (after fork), so a write to a present page is
+	 * only legal if the area is writable */
+	if( ((cause&FAULT_WRITE)!=FAULT_WRITE)&&!(vmarea->vma_prot&PROT_READ)){
+		return -EFAULT;
+	}
+
+	if(((cause&FAULT_WRITE)&&!(vmarea->vma_prot&PROT_WRITE)) || ((cause&FAULT_RESERVED)&&!(vmarea->vma_prot&PROT_NONE))
+	 || ((cause&FAULT_EXEC)&&!(vmarea->vma_prot&PROT_EXEC)) ){
+		return -EFAULT;
+	}
+
+	/* writing to a present, write-protected page of a shared mapping
+	 * (it was cleaned since it was last written) only has to dirty the
+	 * page again, which is mapped already */
+	if((cause&FAULT_PRESENT)&&(cause&FAULT_WRITE)&&(vmarea->vma_flags&MAP_SHARED)){
+		if(redirty_shared(vmarea,ADDR_TO_PN(vaddr))){
+			return 0;
+		}
+	}
+
+	/* splice objects which aren't shared anymore out of the shadow chain
+	 * before walking it */
+	if(mmobj_is_shadow(vmarea->vma_obj)){
+		shadow_collapse(vmarea->vma_obj,SHADOW_COLLAPSE_MAX);
+	}
+
+	/* writing to untouched anonymous memory may get a whole 4mb page */
+	if(((cause&(FAULT_PRESENT|FAULT_WRITE))==FAULT_WRITE)&&vm_fault_large(vmarea,ADDR_TO_PN(vaddr))){
+		fault_trace_kind(FT_LARGE);
+		return 0;
+	}
+
+	/* find the correct page (remember shadow obj) and map it */
+	if((err=vm_fault_in(vmarea,ADDR_TO_PN(vaddr),(cause&FAULT_WRITE)==FAULT_WRITE,0,NULL))<0){
+		return err;
+	}
+
+	if(!(cause&FAULT_WRITE)){
+		faultaround(vmarea,ADDR_TO_PN(vaddr));
+	}
+	if(vmarea->vma_advice==MADV_SEQUENTIAL){
+		readahead(vmarea,ADDR_TO_PN(vaddr));
+	}
+	return 0;
+}
 
 /*
  * This gets called by _pt_fault_handler in mm/pagetable.c The
@@ -51,48 +463,29 @@
 void
 handle_pagefault(uintptr_t vaddr, uint32_t cause)
 {
-	uint32_t pdflags=0, ptflags=0;
-        /* find the vmarea */
-	vmarea_t *vmarea;
-	if((vmarea=vmmap_lookup(curproc->p_vmmap,ADDR_TO_PN(vaddr)))==NULL){
-		proc_kill(curproc,EFAULT);
-		return;
-	}
-
-	/* check the permissions on the area */	
-	if(!(cause&FAULT_PRESENT)){
-		if( ((cause&FAULT_WRITE)!=FAULT_WRITE)&&!(vmarea->vma_prot&PROT_READ)){
-			proc_kill(curproc,EFAULT);
-			return;
-		}
+	int err;
 
-		if(((cause&FAULT_WRITE)&&!(vmarea->vma_prot&PROT_WRITE)) || ((cause&FAULT_RESERVED)&&!(vmarea->vma_prot&PROT_NONE))
-		 || ((cause&FAULT_EXEC)&&!(vmarea->vma_prot&PROT_EXEC)) ){
-			proc_kill(curproc,EFAULT);
-			return;
-		}	
-	}
+	/* this doesn't return */
+	if((err=vm_fault(vaddr,cause))<0)
+		proc_kill(curproc,(-ENOMEM==err)?ENOMEM:EFAULT);
+}
 
-	/* find the vmarea(remember shadow obj), search for correct page */
-	pframe_t *pf;
-	if(vmarea->vma_flags&MAP_PRIVATE){
-		if(vmarea->vma_obj->mmo_ops->lookuppage(vmarea->vma_obj,ADDR_TO_PN(vaddr)-vmarea->vma_start+vmarea->vma_off,(cause&FAULT_WRITE)==FAULT_WRITE,&pf)<0){
-			return;
-		}
-	}
-	else{
-		if(vmarea->vma_obj->mmo_ops->lookuppage(vmarea->vma_obj,ADDR_TO_PN(vaddr)-vmarea->vma_start+vmarea->vma_off,(cause&FAULT_WRITE)==FAULT_WRITE,&pf)<0){
-		/*if(pframe_get(vmarea->vma_obj,ADDR_TO_PN(vaddr)-vmarea->vma_start+vmarea->vma_off,&pf)<0){*/
-			return;
-		}
-	}
-	
-	if(cause&FAULT_WRITE){
-		pdflags=PD_WRITE;
-		ptflags=PT_WRITE;
-	}
+/*
+ * Handles a fault on vaddr in the current process's address space like
+ * handle_pagefault, but returns -errno instead of killing the process if
+ * the access isn't allowed or the page can't be mapped. Also used for
+ * faults the kernel takes while copying to and from user memory (see
+ * _pt_fault_handler).
+ */
+int
+vm_fault(uintptr_t vaddr, uint32_t cause)
+{
+	fault_trace_t ft;
+	int err;
 
-	/* call pt_map */
-	uintptr_t paddr=(uintptr_t)PAGE_ALIGN_DOWN(pt_virt_to_phys((uintptr_t)pf->pf_addr));
-	pt_map(curproc->p_pagedir,(uintptr_t)PAGE_ALIGN_DOWN(vaddr),paddr,pdflags|PD_PRESENT|PD_USER,ptflags|PT_PRESENT|PT_USER);
+	fault_trace_begin(&ft, vaddr, cause);
+	if((err=resolve_fault(vaddr,cause))<0)
+		fault_trace_kind(FT_BAD);
+	fault_trace_end(&ft);
+	return err;
 }
@@ -12,8 +12,12 @@
 #include "mm/tlb.h"
 
 #include "vm/vmmap.h"
+#include "vm/anon.h"
 #include "vm/shadow.h"
 #include "vm/shadowd.h"
+#include "vm/swap.h"
+#include "vm/vmstat.h"
+#include "vm/faulttrace.h"
 
 #define SHADOW_SINGLETON_THRESHOLD 5
 
@@ -75,6 +79,106 @@ shadow_create()
     	return shadowobj;
 }
 
+/*
+ * Returns true if o is a shadow object.
+ */
+int
+mmobj_is_shadow(mmobj_t *o)
+{
+        return &shadow_mmobj_ops == o->mmo_ops;
+}
+
+/*
+ * Returns true if the pages of the intermediate shadow object o can be
+ * migrated right now: none of them is being read or written (which
+ * would mean blocking) or pinned by somebody who expects it to stay.
+ */
+static int
+shadow_can_migrate(mmobj_t *o)
+{
+        pframe_t *pf;
+
+        list_iterate_begin(&o->mmo_respages, pf, pframe_t, pf_olink) {
+                if (pframe_is_busy(pf) || pframe_is_pinned(pf))
+                        return 0;
+        } list_iterate_end();
+        return 1;
+}
+
+/*
+ * Shortens the shadow chain below top by splicing out the intermediate
+ * shadow objects which only have one shadow object above them left (the
+ * others having died): their pages are migrated up into that object,
+ * which takes over what they shadowed. Objects whose pages can't be
+ * migrated without blocking, or whose swapped pages can't be handed over
+ * for lack of memory, are left for next time.
+ *
+ * This is what shadowd does for every vmarea, but cheap enough to be
+ * done whenever a chain is about to be walked or extended (on page faults
+ * and forks), so at most max objects are collapsed per call (0 means no
+ * limit). Never blocks.
+ *
+ * @return the number of objects collapsed
+ */
+int
+shadow_collapse(mmobj_t *top, int max)
+{
+        mmobj_t *last = top, *o;
+        uint32_t depth = 1;
+        int ncollapsed = 0;
+
+        KASSERT(mmobj_is_shadow(top));
+
+        for (o = top->mmo_shadowed; NULL != o->mmo_shadowed; o = last->mmo_shadowed) {
+                /* o is an intermediate shadow object; its references are
+                 * its resident pages and the objects above it */
+                if (o->mmo_refcount - o->mmo_nrespages == 1
+                    && (0 == max || ncollapsed < max) && shadow_can_migrate(o)
+                    && 0 == swap_migrate(o, last)) {
+                        pframe_t *pf;
+
+                        list_iterate_begin(&o->mmo_respages, pf, pframe_t, pf_olink) {
+                                /* o keeps a reference for every page it
+                                 * has left, so this won't free it yet */
+                                pframe_migrate(pf, last);
+                        } list_iterate_end();
+
+                        last->mmo_shadowed = o->mmo_shadowed;
+                        o->mmo_shadowed->mmo_ops->ref(o->mmo_shadowed);
+                        KASSERT(o->mmo_refcount == 1 && o->mmo_nrespages == 0);
+                        o->mmo_ops->put(o);
+
+                        vm_stat_inc(vs_shadow_collapsed);
+                        ncollapsed++;
+                } else {
+                        last = o;
+                        depth++;
+                }
+        }
+
+        vm_stat_max(vs_shadow_maxdepth, depth);
+        return ncollapsed;
+}
+
+/*
+ * Returns true if the given page of o reads as zeroes because it has
+ * never been written: no object in the chain starting at o (which may be
+ * a shadow object or the bottom object) has a copy of it, resident or in
+ * swap, and the bottom object is anonymous, so it would fill the page
+ * with zeroes. Never blocks or allocates.
+ */
+int
+shadow_page_is_zero(mmobj_t *o, uint32_t pagenum)
+{
+        for (;; o = o->mmo_shadowed) {
+                if (NULL != pframe_get_resident(o, pagenum)
+                    || swap_has(o, pagenum))
+                        return 0;
+                if (NULL == o->mmo_shadowed)
+                        return mmobj_is_anon(o);
+        }
+}
+
 /* Implementation of mmobj entry points: */
 
 /*
@@ -106,9 +210,10 @@ shadow_put(mmobj_t *o)
 			list_iterate_begin(&o->mmo_respages,pf,pframe_t,pf_olink){
 				if(pframe_is_pinned(pf)) pframe_unpin(pf);
                 		while(pframe_is_busy(pf)) sched_sleep_on(&pf->pf_waitq);
-                		if(pframe_is_dirty(pf)) pframe_clean(pf);
+                		/* nobody can see the data anymore, don't write it out */
                 		pframe_free(pf);
 			}list_iterate_end();
+			swap_discard_object(o);
 		}o->mmo_refcount--;
 		if(o->mmo_refcount==0){
 			KASSERT(o->mmo_shadowed != NULL);
@@ -129,26 +234,22 @@ shadow_put(mmobj_t *o)
 static int
 shadow_lookuppage(mmobj_t *o, uint32_t pagenum, int forwrite, pframe_t **pf)
 {
-		pframe_t *tmp_pf;
-		list_iterate_begin(&o->mmo_respages,tmp_pf,pframe_t,pf_olink){
-			if(tmp_pf->pf_pagenum==pagenum&&tmp_pf->pf_obj==o){
-				/*if(pframe_is_dirty(tmp_pf)){
-					pframe_free(tmp_pf);
-					return pframe_get(o,pagenum,pf);
-				}*/
-				*pf=tmp_pf;
-				return 0;
-			}
-		}list_iterate_end();
+		mmobj_t *cur;
 
-		if(!forwrite){/* looked up for reading */
-			if(o->mmo_shadowed){
-				return o->mmo_shadowed->mmo_ops->lookuppage(o->mmo_shadowed,pagenum,forwrite,pf);
-			}else return -1; /* Should not be here */
-		}
-		else{/* looked up for writing */
+		if(forwrite){/* looked up for writing */
 			return pframe_get(o,pagenum,pf);
 		}
+
+		/* looked up for reading: the first shadow object in the chain
+		 * with its own copy of the page has it, whether the copy is
+		 * resident or has been swapped out. pframe_get waits for the
+		 * page if it is busy. */
+		for(cur=o;NULL!=cur->mmo_shadowed;cur=cur->mmo_shadowed){
+			if(NULL!=pframe_get_resident(cur,pagenum)||swap_has(cur,pagenum)){
+				return pframe_get(cur,pagenum,pf);
+			}
+		}
+		return cur->mmo_ops->lookuppage(cur,pagenum,0,pf);
 }
 
 /* As per the specification in mmobj.h, fill the page frame starting
@@ -167,12 +268,35 @@ shadow_fillpage(mmobj_t *o, pframe_t *pf)
         	KASSERT(!pframe_is_pinned(pf));
 	        dbg(DBG_PRINT, "(GRADING3A 6.d) pframe is not pinned\n ");
 		pframe_t *tmp_pf;
+		int ret;
+		uint64_t start = fault_trace_fill_begin();
+		/* our own copy was swapped out */
+		if(swap_has(o,pf->pf_pagenum)){
+			ret = swap_in(pf);
+			fault_trace_fill_end(FT_MAJOR,start);
+			return ret;
+		}
+		/* copying a page that was never written would just allocate
+		 * a zero page in the anonymous object at the bottom */
+		if(shadow_page_is_zero(o->mmo_shadowed,pf->pf_pagenum)){
+			memset(pf->pf_addr,0,PAGE_SIZE);
+			fault_trace_fill_end(FT_ZERO,start);
+			return 0;
+		}
+		/* always a copy, even of a page the reverse map shows mapped
+		 * only here: the rmap knows who maps the page now, not which
+		 * other shadow objects can still read it from below, e.g. a
+		 * child's which hasn't touched it yet. The page could only be
+		 * taken over if nothing else referred to the object it is in,
+		 * and then collapsing the chain migrates it anyway. */
 		pframe_pin(pf);
-		if(o->mmo_shadowed->mmo_ops->lookuppage(o->mmo_shadowed,pf->pf_pagenum,0,&tmp_pf)==0){
+		/* this counts as major instead if the page has to be read */
+		if((ret=o->mmo_shadowed->mmo_ops->lookuppage(o->mmo_shadowed,pf->pf_pagenum,0,&tmp_pf))==0){
 			memcpy(pf->pf_addr,tmp_pf->pf_addr,PAGE_SIZE);
-			pframe_unpin(pf);
-			return 0;
-		}else return -1; /* Should not be here */
+		}
+		pframe_unpin(pf);
+		fault_trace_fill_end(FT_COW,start);
+		return ret;
 }
 
 /* These next two functions are not difficult. */
@@ -180,25 +304,13 @@ shadow_fillpage(mmobj_t *o, pframe_t *pf)
 static int
 shadow_dirtypage(mmobj_t *o, pframe_t *pf)
 {
-	pframe_t *tmp_pf;
-	list_iterate_begin(&o->mmo_respages,tmp_pf,pframe_t,pf_olink){
-		if(tmp_pf->pf_pagenum==pf->pf_pagenum&&tmp_pf->pf_obj==pf->pf_obj){
-			pframe_set_dirty(tmp_pf);
-			return 0;
-		}
-	}list_iterate_end();
+	/* the copy in swap (if any) is about to become stale */
+	swap_discard(o,pf->pf_pagenum);
 	return 0;
 }
 
 static int
 shadow_cleanpage(mmobj_t *o, pframe_t *pf)
 {
-	pframe_t *tmp_pf;
-	list_iterate_begin(&o->mmo_respages,tmp_pf,pframe_t,pf_olink){
-		if(tmp_pf->pf_pagenum==pf->pf_pagenum&&tmp_pf->pf_obj==pf->pf_obj){
-			memcpy(tmp_pf->pf_addr,pf->pf_addr,PAGE_SIZE);
-			return 0;
-		}
-	}list_iterate_end();
-	return 0;
+	return swap_out(pf);
 }
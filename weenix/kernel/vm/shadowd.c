@@ -4,6 +4,8 @@
 #include "mm/mmobj.h"
 #include "mm/pframe.h"
 
+#include "vm/shadow.h"
+
 #include "util/debug.h"
 #include "util/string.h"
 
@@ -47,7 +49,10 @@ shadowd_alloc_sleep()
  * For each shadow object we want to migrate all of its pages up
  * to the closest mmobj with at least 2 parents, or the topmost
  * one, then remove this object from the tree (if we remove it any
- * earlier we can cause big problems).
+ * earlier we can cause big problems). shadow_collapse does that for
+ * one chain; page faults and forks also use it, a few objects at a
+ * time, so shadowd is only needed to catch up with chains which
+ * haven't been touched in a while.
  *
  */
 
@@ -59,46 +64,11 @@ shadowd(int arg1, void *arg2)
                 /* for each process, go through its vmareas */
                 list_iterate_begin(proc_list(), p, proc_t, p_list_link) {
                         /* all of the dead process's shadow objects will be takenen care of by init */
-                        if (PROC_RUNNING == p->p_state) {
+                        if (PROC_RUNNING == p->p_state && NULL != p->p_vmmap) {
                                 vmarea_t *vma;
                                 list_iterate_begin(&p->p_vmmap->vmm_list, vma, vmarea_t, vma_plink) {
-                                        mmobj_t *last = vma->vma_obj, *o = last->mmo_shadowed;
-                                        /* ref last, so if all processes on this branch die while shadowd is
-                                         * sleeping, the branch won't get destroyed until shadowd() is done
-                                         * with it */
-                                        last->mmo_ops->ref(last);
-                                        while (NULL != o && NULL != o->mmo_shadowed) {
-                                                mmobj_t *shadow = o->mmo_shadowed;
-                                                /* iff the object has only one parent, and is not right under vm_area */
-                                                KASSERT(o != last);
-                                                if (o->mmo_refcount - o->mmo_nrespages == 1) {
-                                                        /* migrate all its pages to last, and remove it from the shadow tree */
-                                                        pframe_t *pf;
-                                                        list_iterate_begin(&o->mmo_respages, pf, pframe_t, pf_olink) {
-                                                                /* Because the operations that could be
-                                                                 * performed with an intermediate shadow object
-                                                                 * to make pages busy are non-blocking,
-                                                                 * we always expect to see non-busy pages. */
-                                                                KASSERT(!pframe_is_busy(pf));
-                                                                /* o has refcount 1+nrespages, so this won't delete it yet */
-                                                                pframe_migrate(pf, last);
-                                                        } list_iterate_end();
-                                                        last->mmo_shadowed = o->mmo_shadowed;
-                                                        /* Ref o's shadowed, so we don't accidentally delete it when we
-                                                         * finally put o */
-                                                        o->mmo_shadowed->mmo_ops->ref(o->mmo_shadowed);
-                                                        KASSERT(o->mmo_refcount == 1 && o->mmo_nrespages == 0);
-                                                        o->mmo_ops->put(o);
-                                                } else {
-                                                        KASSERT(o->mmo_refcount - o->mmo_nrespages == 2);
-                                                        o->mmo_ops->ref(o);
-                                                        last->mmo_ops->put(last);
-                                                        last = o;
-                                                }
-                                                o = shadow;
-                                        }
-                                        KASSERT(NULL != last);
-                                        last->mmo_ops->put(last);
+                                        if (mmobj_is_shadow(vma->vma_obj))
+                                                shadow_collapse(vma->vma_obj, 0);
                                 } list_iterate_end();
                         }
                 } list_iterate_end();
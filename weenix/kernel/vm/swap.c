@@ -0,0 +1,495 @@
+#include "globals.h"
+#include "config.h"
+#include "errno.h"
+
+#include "util/debug.h"
+#include "util/init.h"
+#include "util/list.h"
+#include "util/string.h"
+
+#include "drivers/dev.h"
+#include "drivers/blockdev.h"
+
+#include "mm/mmobj.h"
+#include "mm/pframe.h"
+#include "mm/slab.h"
+
+#include "vm/anon.h"
+#include "vm/shadow.h"
+#include "vm/swap.h"
+
+/*
+ * Swap space for anonymous and shadow objects.
+ *
+ * The swap device is divided into SWAP_NSLOTS page-sized slots. When
+ * pageoutd reclaims a dirty page of such an object, the object's cleanpage
+ * op calls swap_out, which writes the page to a free slot and records a
+ * swap entry for the page's identity (object, page number). The page is
+ * then freed like any clean page. When the page is needed again, fillpage
+ * finds the entry and reads the page back with swap_in.
+ *
+ * The entry is kept after a swap-in, so a page which is not modified
+ * again can be reclaimed once more without writing it out. Dirtying the
+ * page (the dirtypage op) discards the entry, since its contents are then
+ * stale. When an object dies all of its entries are discarded.
+ *
+ * Slots are handed out next-fit, so pages which are evicted together
+ * (which, as pageoutd works through the LRU list, tend to be pages which
+ * were used together) end up in neighbouring slots. A swap-in therefore
+ * also starts asynchronous fills for the pages in the following
+ * SWAP_CLUSTER - 1 slots.
+ *
+ * Swap entries don't hold a reference on their object.
+ */
+
+typedef struct swap_entry {
+        mmobj_t        *se_obj;
+        uint32_t        se_pagenum;
+        uint32_t        se_slot;
+        int             se_readahead; /* being read ahead, don't read ahead
+                                       * again when filling the page */
+        list_link_t     se_hlink;     /* link on the (obj, pagenum) hash */
+        list_link_t     se_olink;     /* link on the object's entries */
+} swap_entry_t;
+
+/*
+ * All of the entries of one object, so that they can be discarded when
+ * the object dies without going through the whole swap space.
+ */
+typedef struct swap_objent {
+        mmobj_t        *so_obj;
+        list_t          so_entries;
+        list_link_t     so_link;
+} swap_objent_t;
+
+#define hash_page(obj, pagenum)  ((((uint32_t)(obj)) + (pagenum)) \
+                                  % SWAP_HASH_SIZE)
+#define hash_obj(obj)            ((((uint32_t)(obj)) >> 4) % SWAP_HASH_SIZE)
+
+static blockdev_t *swap_dev = NULL;
+
+/*   slot -> entry occupying it, NULL if the slot is free */
+static swap_entry_t *swap_slots[SWAP_NSLOTS];
+static uint32_t swap_next_slot;
+
+static list_t swap_hash[SWAP_HASH_SIZE];
+static list_t swap_objhash[SWAP_HASH_SIZE];
+
+static slab_allocator_t *swap_entry_allocator;
+static slab_allocator_t *swap_objent_allocator;
+
+static swap_stats_t swap_stats;
+
+/*
+ * Sets up the swap device if there is one. Without it, swap_out always
+ * fails, so anonymous pages which have been written to stay in memory.
+ */
+void
+swap_init(void)
+{
+        int i;
+
+        for (i = 0; i < SWAP_HASH_SIZE; ++i) {
+                list_init(&swap_hash[i]);
+                list_init(&swap_objhash[i]);
+        }
+        memset(swap_slots, 0, sizeof(swap_slots));
+        swap_next_slot = 0;
+        memset(&swap_stats, 0, sizeof(swap_stats));
+
+        swap_entry_allocator = slab_allocator_create("swapent",
+                                                     sizeof(swap_entry_t));
+        KASSERT(NULL != swap_entry_allocator);
+        swap_objent_allocator = slab_allocator_create("swapobj",
+                                                      sizeof(swap_objent_t));
+        KASSERT(NULL != swap_objent_allocator);
+
+        swap_dev = blockdev_lookup(MKDEVID(DISK_MAJOR, SWAP_DISK_MINOR));
+        if (NULL == swap_dev) {
+                dbg(DBG_VM, "no swap device (disk%d), swap disabled\n",
+                    SWAP_DISK_MINOR);
+                return;
+        }
+        swap_stats.ss_nslots = SWAP_NSLOTS;
+        dbg(DBG_VM, "swapping to disk%d, %d slots\n", SWAP_DISK_MINOR,
+            SWAP_NSLOTS);
+}
+init_func(swap_init);
+
+/*
+ * Returns true if there is a swap device.
+ */
+int
+swap_enabled(void)
+{
+        return NULL != swap_dev;
+}
+
+/*
+ * Returns true if a page which isn't in swap yet can't be swapped out,
+ * because there is no swap device or no free slot on it.
+ */
+int
+swap_full(void)
+{
+        return NULL == swap_dev || SWAP_NSLOTS == swap_stats.ss_used;
+}
+
+/*
+ * Returns true if the pages of o are backed by swap rather than by a
+ * file, i.e. if o is an anonymous or a shadow object.
+ */
+int
+mmobj_is_swapbacked(mmobj_t *o)
+{
+        return mmobj_is_anon(o) || mmobj_is_shadow(o);
+}
+
+static swap_entry_t *
+swap_lookup(mmobj_t *o, uint32_t pagenum)
+{
+        swap_entry_t *se;
+
+        list_iterate_begin(&swap_hash[hash_page(o, pagenum)], se,
+                           swap_entry_t, se_hlink) {
+                if (o == se->se_obj && pagenum == se->se_pagenum)
+                        return se;
+        } list_iterate_end();
+
+        return NULL;
+}
+
+static swap_objent_t *
+swap_objent_lookup(mmobj_t *o)
+{
+        swap_objent_t *so;
+
+        list_iterate_begin(&swap_objhash[hash_obj(o)], so, swap_objent_t,
+                           so_link) {
+                if (o == so->so_obj)
+                        return so;
+        } list_iterate_end();
+
+        return NULL;
+}
+
+/*
+ * Like swap_objent_lookup, but creates the group if o doesn't have one.
+ */
+static swap_objent_t *
+swap_objent_get(mmobj_t *o)
+{
+        swap_objent_t *so;
+
+        if (NULL != (so = swap_objent_lookup(o)))
+                return so;
+        if (NULL == (so = slab_obj_alloc(swap_objent_allocator)))
+                return NULL;
+        so->so_obj = o;
+        list_init(&so->so_entries);
+        list_insert_head(&swap_objhash[hash_obj(o)], &so->so_link);
+        return so;
+}
+
+/*
+ * Finds a free slot, starting at the slot after the one handed out last.
+ * A swap-out which fails because swap is full mustn't cost a scan of all
+ * of the slots.
+ *
+ * @return the slot, or -ENOSPC if swap is full
+ */
+static int
+swap_slot_alloc(void)
+{
+        uint32_t i;
+
+        if (SWAP_NSLOTS == swap_stats.ss_used)
+                return -ENOSPC;
+        for (i = 0; i < SWAP_NSLOTS; ++i) {
+                uint32_t slot = (swap_next_slot + i) % SWAP_NSLOTS;
+                if (NULL == swap_slots[slot]) {
+                        swap_next_slot = (slot + 1) % SWAP_NSLOTS;
+                        return slot;
+                }
+        }
+        return -ENOSPC;
+}
+
+/*
+ * Creates an entry with a newly allocated slot for the given page.
+ *
+ * @return the entry, or NULL if swap is full or we are out of memory
+ */
+static swap_entry_t *
+swap_entry_create(mmobj_t *o, uint32_t pagenum)
+{
+        swap_entry_t *se;
+        swap_objent_t *so;
+        int slot;
+
+        if ((slot = swap_slot_alloc()) < 0)
+                return NULL;
+
+        if (NULL == (so = swap_objent_get(o)))
+                return NULL;
+
+        if (NULL == (se = slab_obj_alloc(swap_entry_allocator))) {
+                if (list_empty(&so->so_entries)) {
+                        list_remove(&so->so_link);
+                        slab_obj_free(swap_objent_allocator, so);
+                }
+                return NULL;
+        }
+        se->se_obj = o;
+        se->se_pagenum = pagenum;
+        se->se_slot = slot;
+        se->se_readahead = 0;
+        list_insert_head(&swap_hash[hash_page(o, pagenum)], &se->se_hlink);
+        list_insert_tail(&so->so_entries, &se->se_olink);
+
+        swap_slots[slot] = se;
+        swap_stats.ss_used++;
+
+        return se;
+}
+
+/*
+ * Releases an entry and its slot. so is the entry's object's group.
+ */
+static void
+swap_entry_destroy(swap_objent_t *so, swap_entry_t *se)
+{
+        KASSERT(so->so_obj == se->se_obj);
+        KASSERT(se == swap_slots[se->se_slot]);
+
+        swap_slots[se->se_slot] = NULL;
+        swap_stats.ss_used--;
+
+        list_remove(&se->se_hlink);
+        list_remove(&se->se_olink);
+        slab_obj_free(swap_entry_allocator, se);
+
+        if (list_empty(&so->so_entries)) {
+                list_remove(&so->so_link);
+                slab_obj_free(swap_objent_allocator, so);
+        }
+}
+
+/*
+ * Returns true if the given page is in swap.
+ */
+int
+swap_has(mmobj_t *o, uint32_t pagenum)
+{
+        return NULL != swap_lookup(o, pagenum);
+}
+
+/*
+ * Writes a page to swap, reusing its slot if it already has one. This is
+ * meant to be called by the cleanpage op of swap-backed objects, so pf is
+ * busy.
+ *
+ * @return 0 on success, -ENOSPC if there is no swap device or it is full,
+ * or the error from the device
+ */
+int
+swap_out(pframe_t *pf)
+{
+        swap_entry_t *se;
+        int ret;
+
+        KASSERT(pframe_is_busy(pf));
+
+        if (NULL == swap_dev)
+                return -ENOSPC;
+
+        if (NULL == (se = swap_lookup(pf->pf_obj, pf->pf_pagenum))
+            && NULL == (se = swap_entry_create(pf->pf_obj, pf->pf_pagenum))) {
+                swap_stats.ss_full++;
+                return -ENOSPC;
+        }
+
+        /* Nobody can get rid of the entry while we block, that would take
+         * dirtying the page or the object dying, and both wait for pf to
+         * stop being busy */
+        ret = swap_dev->bd_ops->write_block(swap_dev, pf->pf_addr,
+                                            se->se_slot, 1);
+        if (ret < 0) {
+                dbg(DBG_VM, "failed to write slot %d: %d\n", se->se_slot, ret);
+                swap_entry_destroy(swap_objent_lookup(se->se_obj), se);
+                return ret;
+        }
+
+        swap_stats.ss_outs++;
+        return 0;
+}
+
+/*
+ * Called when a page read ahead from swap has come in. There is nothing
+ * left to do, the page just stays around in case it is needed.
+ */
+static void
+swap_readahead_done(pframe_t *pf, int status, void *arg)
+{
+        if (status < 0)
+                dbg(DBG_VM, "swap read-ahead failed: %d\n", status);
+}
+
+/*
+ * Starts reading in the pages in the slots following slot, up to the end
+ * of its cluster. Pages which are already resident are skipped, and we
+ * give up as soon as pframe_get_async can't get a free page without
+ * blocking: read-ahead shouldn't make anybody wait.
+ */
+static void
+swap_readahead(uint32_t slot)
+{
+        uint32_t s;
+
+        for (s = slot + 1; s < slot + SWAP_CLUSTER && s < SWAP_NSLOTS; ++s) {
+                swap_entry_t *se = swap_slots[s];
+
+                if (NULL == se
+                    || NULL != pframe_get_resident(se->se_obj, se->se_pagenum))
+                        continue;
+
+                se->se_readahead = 1;
+                if (pframe_get_async(se->se_obj, se->se_pagenum,
+                                     swap_readahead_done, NULL) < 0) {
+                        se->se_readahead = 0;
+                        return;
+                }
+                swap_stats.ss_readahead++;
+        }
+}
+
+/*
+ * Reads a page in from swap. This is meant to be called by the fillpage op
+ * of swap-backed objects, so pf is busy. The page keeps its slot until it
+ * is dirtied.
+ *
+ * @return 0 on success, -ENOENT if the page isn't in swap, or the error
+ * from the device
+ */
+int
+swap_in(pframe_t *pf)
+{
+        swap_entry_t *se;
+        uint32_t slot;
+        int readahead;
+        int ret;
+
+        KASSERT(pframe_is_busy(pf));
+
+        if (NULL == (se = swap_lookup(pf->pf_obj, pf->pf_pagenum)))
+                return -ENOENT;
+        KASSERT(NULL != swap_dev);
+
+        slot = se->se_slot;
+        readahead = se->se_readahead;
+        se->se_readahead = 0;
+
+        ret = swap_dev->bd_ops->read_block(swap_dev, pf->pf_addr, slot, 1);
+        if (ret < 0) {
+                dbg(DBG_VM, "failed to read slot %d: %d\n", slot, ret);
+                return ret;
+        }
+
+        /* Only a demand fill reads ahead, otherwise one fault would end up
+         * pulling in everything that's in swap */
+        if (!readahead) {
+                swap_stats.ss_ins++;
+                swap_readahead(slot);
+        }
+        return 0;
+}
+
+/*
+ * Forgets about the swapped copy of a page, if it has one. Called when
+ * the resident copy gets dirtied.
+ */
+void
+swap_discard(mmobj_t *o, uint32_t pagenum)
+{
+        swap_entry_t *se;
+
+        if (NULL != (se = swap_lookup(o, pagenum)))
+                swap_entry_destroy(swap_objent_lookup(o), se);
+}
+
+/*
+ * Forgets about all of the swapped pages of an object which is going
+ * away.
+ */
+void
+swap_discard_object(mmobj_t *o)
+{
+        swap_objent_t *so;
+
+        /* destroying the last entry frees the group, so look it up again
+         * every time */
+        while (NULL != (so = swap_objent_lookup(o))) {
+                swap_entry_destroy(so, list_head(&so->so_entries,
+                                                 swap_entry_t, se_olink));
+        }
+}
+
+/*
+ * Hands the swapped pages of src over to dest, when src is collapsed
+ * into dest. Pages which dest already has a copy of (resident or in swap)
+ * are newer than src's and are left alone, src's slot is just freed.
+ * Must be called before src's resident pages are migrated.
+ *
+ * @return 0 on success, or -ENOMEM if there is no memory to keep track
+ * of dest's entries, in which case nothing has been handed over and src
+ * can't be collapsed
+ */
+int
+swap_migrate(mmobj_t *src, mmobj_t *dest)
+{
+        swap_objent_t *so, *dso;
+        swap_entry_t *se;
+
+        if (NULL == swap_objent_lookup(src))
+                return 0;
+        /* this is the only allocation, so get it out of the way before
+         * anything is moved */
+        if (NULL == (dso = swap_objent_get(dest)))
+                return -ENOMEM;
+
+        while (NULL != (so = swap_objent_lookup(src))) {
+                se = list_head(&so->so_entries, swap_entry_t, se_olink);
+
+                if (NULL != pframe_get_resident(dest, se->se_pagenum)
+                    || NULL != swap_lookup(dest, se->se_pagenum)) {
+                        swap_entry_destroy(so, se);
+                        continue;
+                }
+
+                /* move the entry, slot and all, over to dest */
+                list_remove(&se->se_hlink);
+                list_remove(&se->se_olink);
+                se->se_obj = dest;
+                list_insert_head(&swap_hash[hash_page(dest, se->se_pagenum)],
+                                 &se->se_hlink);
+                list_insert_tail(&dso->so_entries, &se->se_olink);
+
+                if (list_empty(&so->so_entries)) {
+                        list_remove(&so->so_link);
+                        slab_obj_free(swap_objent_allocator, so);
+                }
+        }
+
+        /* every page had a newer copy in dest */
+        if (list_empty(&dso->so_entries)) {
+                list_remove(&dso->so_link);
+                slab_obj_free(swap_objent_allocator, dso);
+        }
+        return 0;
+}
+
+void
+swap_get_stats(swap_stats_t *stats)
+{
+        *stats = swap_stats;
+}
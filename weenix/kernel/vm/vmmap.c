@@ -1,15 +1,19 @@
 #include "kernel.h"
+#include "config.h"
 #include "errno.h"
 #include "globals.h"
 
 #include "vm/vmmap.h"
 #include "vm/shadow.h"
 #include "vm/anon.h"
+#include "vm/vmstat.h"
+#include "vm/pagefault.h"
 
 #include "proc/proc.h"
 
 #include "util/debug.h"
 #include "util/list.h"
+#include "util/rbtree.h"
 #include "util/string.h"
 #include "util/printf.h"
 
@@ -19,14 +23,32 @@
 #include "fs/vfs_syscall.h"
 
 #include "mm/slab.h"
+#include "mm/kmalloc.h"
 #include "mm/page.h"
 #include "mm/mm.h"
 #include "mm/mman.h"
 #include "mm/mmobj.h"
+#include "mm/pframe.h"
+#include "mm/pagetable.h"
+#include "mm/tlb.h"
 
 static slab_allocator_t *vmmap_allocator;
 static slab_allocator_t *vmarea_allocator;
 
+vm_stats_t vm_stats;
+
+/* Pages each process may lock with mlock, adjustable from the kshell */
+int vm_mlock_limit = VM_MLOCK_LIMIT;
+
+/*
+ * Pages are locked with mlock by area: vmmap_lock splits the areas at the
+ * ends of the range, like vmmap_protect does, and gives each area in it
+ * an array of the pages pinned for it (vma_pinned). A page is pinned when
+ * it is faulted in, and when a write fault copies it the copy is pinned
+ * in its place (see vmarea_pin), so what stays pinned is what the area
+ * maps. vmm_nlocked counts the pages of the locked areas.
+ */
+
 void
 vmmap_init(void)
 {
@@ -36,24 +58,174 @@ vmmap_init(void)
         KASSERT(NULL != vmarea_allocator && "failed to create vmarea allocator!");
 }
 
+/*
+ * Besides being on vmm_list in address order, the areas of an address
+ * space are in a red-black tree keyed by vma_start, so that they can be
+ * found in O(log n). Each area also records the gap (in pages) between
+ * itself and the area below it (or USER_MEM_LOW), and the tree is
+ * augmented with the largest such gap in every subtree, so that
+ * vmmap_find_range can find a first-fit gap in O(log n) as well. The gap
+ * above the highest area isn't in the tree, vmmap_find_range checks it
+ * separately.
+ */
+
+#define vma_of(node)            rb_item(node, vmarea_t, vma_node)
+#define vma_subtree_gap(node)   ((NULL == (node)) ? 0 : vma_of(node)->vma_maxgap)
+
+static void
+vmarea_augment(rb_node_t *node)
+{
+        vmarea_t *vma = vma_of(node);
+        uint32_t gap = vma->vma_gap;
+
+        if (vma_subtree_gap(node->rb_left) > gap)
+                gap = vma_subtree_gap(node->rb_left);
+        if (vma_subtree_gap(node->rb_right) > gap)
+                gap = vma_subtree_gap(node->rb_right);
+        vma->vma_maxgap = gap;
+}
+
+/* The areas right before/after vma in map, or NULL */
+static vmarea_t *
+vmarea_prev(vmmap_t *map, vmarea_t *vma)
+{
+        if (vma->vma_plink.l_prev == &map->vmm_list)
+                return NULL;
+        return list_item(vma->vma_plink.l_prev, vmarea_t, vma_plink);
+}
+
+static vmarea_t *
+vmarea_next(vmmap_t *map, vmarea_t *vma)
+{
+        if (vma->vma_plink.l_next == &map->vmm_list)
+                return NULL;
+        return list_item(vma->vma_plink.l_next, vmarea_t, vma_plink);
+}
+
+/* Recomputes vma's gap to the area below it */
+static void
+vmarea_update_gap(vmmap_t *map, vmarea_t *vma)
+{
+        vmarea_t *prev = vmarea_prev(map, vma);
+
+        vma->vma_gap = vma->vma_start
+                       - ((NULL == prev) ? ADDR_TO_PN(USER_MEM_LOW) : prev->vma_end);
+        rb_propagate(&map->vmm_tree, &vma->vma_node);
+}
+
+/*
+ * Every address space remembers the last few areas vmmap_lookup found:
+ * most faults are in the same area as the one before (a growing heap or
+ * stack, a freshly mapped region), and copying from/to user space looks
+ * up the same area over and over. The cache is simply emptied whenever
+ * an area is added, removed or changes its bounds.
+ */
+static void
+vmmap_cache_invalidate(vmmap_t *map)
+{
+        memset(map->vmm_cache, 0, sizeof(map->vmm_cache));
+        map->vmm_cache_next = 0;
+}
+
+/*
+ * Must be called after the bounds of an area in map have been changed
+ * (without making it overlap another area).
+ */
+void
+vmmap_update_area(vmmap_t *map, vmarea_t *vma)
+{
+        vmarea_t *next;
+
+        KASSERT(map == vma->vma_vmmap);
+        KASSERT(vma->vma_start < vma->vma_end);
+
+        vmmap_cache_invalidate(map);
+        vmarea_update_gap(map, vma);
+        if (NULL != (next = vmarea_next(map, vma)))
+                vmarea_update_gap(map, next);
+}
+
+/*
+ * Returns the lowest area which ends above vfn, which is the area vfn is
+ * in if it is in one. NULL if there is no such area.
+ */
+static vmarea_t *
+vmmap_lower_bound(vmmap_t *map, uint32_t vfn)
+{
+        rb_node_t *node = map->vmm_tree.rb_root;
+        vmarea_t *found = NULL;
+
+        while (NULL != node) {
+                vmarea_t *vma = vma_of(node);
+                if (vma->vma_end > vfn) {
+                        found = vma;
+                        node = node->rb_left;
+                } else {
+                        node = node->rb_right;
+                }
+        }
+        return found;
+}
+
 vmarea_t *
 vmarea_alloc(void)
 {
         vmarea_t *newvma = (vmarea_t *) slab_obj_alloc(vmarea_allocator);
         if (newvma) {
                 newvma->vma_vmmap = NULL;
+                newvma->vma_pinned = NULL;
+                list_link_init(&newvma->vma_olink);
         }
         return newvma;
 }
 
+/* Unpins the pages pinned for [lo, hi) of the locked area vma, and
+ * takes those pages off the address space's count of locked ones */
+static void
+vmarea_unpin(vmarea_t *vma, uint32_t lo, uint32_t hi)
+{
+        uint32_t vfn;
+        pframe_t **pfp;
+
+        lo = MAX(lo, vma->vma_start);
+        hi = MIN(hi, vma->vma_end);
+        for (vfn = lo; vfn < hi; vfn++) {
+                pfp = &vma->vma_pinned[vfn - vma->vma_start];
+                if (NULL != *pfp) {
+                        pframe_unpin(*pfp);
+                        *pfp = NULL;
+                }
+        }
+        if (NULL != vma->vma_vmmap && lo < hi)
+                vma->vma_vmmap->vmm_nlocked -= hi - lo;
+}
+
+/* Unlocks all of the locked area vma */
+static void
+vmarea_unlock(vmarea_t *vma)
+{
+        vmarea_unpin(vma, vma->vma_start, vma->vma_end);
+        kfree(vma->vma_pinned);
+        vma->vma_pinned = NULL;
+}
+
 void
 vmarea_free(vmarea_t *vma)
 {
         KASSERT(NULL != vma);
+        if(NULL != vma->vma_pinned)
+        	vmarea_unlock(vma);
         if(list_link_is_linked(&vma->vma_olink))
         	list_remove(&vma->vma_olink);
-        if(list_link_is_linked(&vma->vma_plink))
+        if(NULL != vma->vma_vmmap){
+        	vmmap_t *map = vma->vma_vmmap;
+        	vmarea_t *next = vmarea_next(map, vma);
+        	vmmap_cache_invalidate(map);
+        	rb_remove(&map->vmm_tree, &vma->vma_node);
         	list_remove(&vma->vma_plink);
+        	if(NULL != next)
+        		vmarea_update_gap(map, next);
+        }
 		if(vma->vma_obj != NULL)
 			vma->vma_obj->mmo_ops->put(vma->vma_obj);
         slab_obj_free(vmarea_allocator, vma);
@@ -68,6 +240,9 @@ vmmap_create(void)
 	if(vmmp){
 		list_init(&vmmp->vmm_list);
 		vmmp->vmm_proc = NULL;
+		rb_init(&vmmp->vmm_tree, vmarea_augment);
+		vmmap_cache_invalidate(vmmp);
+		vmmp->vmm_nlocked = 0;
 	}
 	return vmmp;
 }
@@ -80,6 +255,14 @@ vmmap_destroy(vmmap_t *map)
 	KASSERT(NULL != map);
 	dbg(DBG_PRINT, "(GRADING3A 3.a) map is not null.\n");
 	vmarea_t * vma;
+	tlb_gather_t tg;
+	/* on exit, drop the whole address space with one TLB flush rather
+	 * than one per page as the areas free their pages */
+	if(NULL != map->vmm_proc){
+		tlb_gather_init(&tg, map->vmm_proc->p_pagedir);
+		pt_unmap_range(map->vmm_proc->p_pagedir, USER_MEM_LOW, USER_MEM_HIGH, &tg);
+		tlb_gather_finish(&tg);
+	}
 	while(!list_empty(&map->vmm_list)){
 		vma = list_head(&map->vmm_list,vmarea_t,vma_plink);
 		vmarea_free(vma);
@@ -105,16 +288,25 @@ vmmap_insert(vmmap_t *map, vmarea_t *newvma)
 	KASSERT(ADDR_TO_PN(USER_MEM_LOW) <= newvma->vma_start && ADDR_TO_PN(USER_MEM_HIGH) >= newvma->vma_end);
 	dbg(DBG_PRINT, "(GRADING3A 3.b) The range of the newvma is inside the range of user memmory.\n");
 
-	vmarea_t * vma;
+	rb_node_t **link = &map->vmm_tree.rb_root, *parent = NULL, *succ;
 	newvma->vma_vmmap = map;
-	list_iterate_begin(&map->vmm_list,vma,vmarea_t,vma_plink){
-		if(vma->vma_start > newvma->vma_start){
-			list_insert_before(&vma->vma_plink,&newvma->vma_plink);
-			return;
-		}
-	}list_iterate_end();
-	list_insert_tail(&map->vmm_list, &newvma->vma_plink);
+	while(NULL != *link){
+		parent = *link;
+		if(newvma->vma_start < vma_of(parent)->vma_start)
+			link = &parent->rb_left;
+		else
+			link = &parent->rb_right;
+	}
+	newvma->vma_gap = newvma->vma_maxgap = 0;
+	rb_insert(&map->vmm_tree, &newvma->vma_node, parent, link);
+
+	/* keep the list in the same order as the tree */
+	if(NULL != (succ = rb_next(&newvma->vma_node)))
+		list_insert_before(&vma_of(succ)->vma_plink,&newvma->vma_plink);
+	else
+		list_insert_tail(&map->vmm_list, &newvma->vma_plink);
 
+	vmmap_update_area(map, newvma);
 }
 
 /* Find a contiguous range of free virtual pages of length npages in
@@ -127,37 +319,50 @@ vmmap_insert(vmmap_t *map, vmarea_t *newvma)
 int
 vmmap_find_range(vmmap_t *map, uint32_t npages, int dir)
 {
-	vmarea_t *vma;
-	/* the maximum entry of the pagetable, page number */
+	rb_node_t *node;
+	vmarea_t *last;
 	KASSERT(NULL != map);
 	dbg(DBG_PRINT, "(GRADING3A 3.c) map is not null.\n");
 	KASSERT(0 < npages);
 	dbg(DBG_PRINT, "(GRADING3A 3.c) number of pages is greater than 0.\n");
 	uint32_t hi = ADDR_TO_PN(USER_MEM_HIGH);
-	uint32_t lo = ADDR_TO_PN(USER_MEM_LOW);
+	/* start of the gap above the highest area */
+	uint32_t toplo = ADDR_TO_PN(USER_MEM_LOW);
+
+	if(NULL != (node = rb_last(&map->vmm_tree))){
+		last = vma_of(node);
+		toplo = last->vma_end;
+	}
 
 	switch(dir){
 		case VMMAP_DIR_HILO:
-			list_iterate_reverse(&map->vmm_list,vma,vmarea_t,vma_plink){
-				lo = vma->vma_end;
-				if((hi-lo) >= npages)
-					return lo;
-				hi = vma->vma_start;
-			}list_iterate_end();
-			lo = ADDR_TO_PN(USER_MEM_LOW);
-			if((hi-lo) >= npages)
-				return lo;
+			if((hi-toplo) >= npages)
+				return toplo;
+			/* the highest area with a big enough gap below it:
+			 * try right subtrees before the node before left ones */
+			node = map->vmm_tree.rb_root;
+			while(NULL != node && vma_subtree_gap(node) >= npages){
+				if(vma_subtree_gap(node->rb_right) >= npages)
+					node = node->rb_right;
+				else if(vma_of(node)->vma_gap >= npages)
+					return vma_of(node)->vma_start - vma_of(node)->vma_gap;
+				else
+					node = node->rb_left;
+			}
 			break;
 		case VMMAP_DIR_LOHI:
-			list_iterate_begin(&map->vmm_list,vma,vmarea_t,vma_plink){
-				hi = vma->vma_start;
-				if((hi-lo) >= npages)
-					return lo;
-				lo = vma->vma_end;
-			}list_iterate_end();
-			hi = ADDR_TO_PN(USER_MEM_HIGH);
-			if((hi-lo) >= npages)
-				return lo;
+			/* the lowest area with a big enough gap below it */
+			node = map->vmm_tree.rb_root;
+			while(NULL != node && vma_subtree_gap(node) >= npages){
+				if(vma_subtree_gap(node->rb_left) >= npages)
+					node = node->rb_left;
+				else if(vma_of(node)->vma_gap >= npages)
+					return vma_of(node)->vma_start - vma_of(node)->vma_gap;
+				else
+					node = node->rb_right;
+			}
+			if((hi-toplo) >= npages)
+				return toplo;
 			break;
 		default:
 			return -1;
@@ -165,19 +370,38 @@ vmmap_find_range(vmmap_t *map, uint32_t npages, int dir)
 	return -1;
 }
 
-/* Find the vm_area that vfn lies in. Simply scan the address space
- * looking for a vma whose range covers vfn. If the page is unmapped,
- * return NULL. */
+/* Find the vm_area that vfn lies in, in the address space's cache of
+ * recently found areas or else by walking down its tree. If the page is
+ * unmapped, return NULL. */
 vmarea_t *
 vmmap_lookup(vmmap_t *map, uint32_t vfn)
 {
 	KASSERT(NULL != map);
 	dbg(DBG_PRINT, "(GRADING3A 3.d) map is not null.\n");
-	vmarea_t * vma;
-	list_iterate_begin(&map->vmm_list,vma,vmarea_t,vma_plink){
-		if(vma->vma_start <= vfn && vfn < vma->vma_end)
+	vmarea_t *vma;
+	int i;
+	for(i = 0; i < VMMAP_CACHE_SIZE; ++i){
+		vma = map->vmm_cache[i];
+		if(NULL != vma && vma->vma_start <= vfn && vfn < vma->vma_end){
+			vm_stat_inc(vs_vmacache_hits);
 			return vma;
-	}list_iterate_end();
+		}
+	}
+	vm_stat_inc(vs_vmacache_misses);
+
+	rb_node_t *node = map->vmm_tree.rb_root;
+	while(NULL != node){
+		vma = vma_of(node);
+		if(vfn < vma->vma_start){
+			node = node->rb_left;
+		}else if(vfn >= vma->vma_end){
+			node = node->rb_right;
+		}else{
+			map->vmm_cache[map->vmm_cache_next] = vma;
+			map->vmm_cache_next = (map->vmm_cache_next + 1) % VMMAP_CACHE_SIZE;
+			return vma;
+		}
+	}
 	return NULL;
 }
 
@@ -202,6 +426,8 @@ vmmap_clone(vmmap_t *map)
 				new_vmarea->vma_start = vma->vma_start;
 				new_vmarea->vma_end = vma->vma_end;
 				new_vmarea->vma_prot = vma->vma_prot;
+				new_vmarea->vma_maxprot = vma->vma_maxprot;
+				new_vmarea->vma_advice = vma->vma_advice;
 				new_vmarea->vma_flags = vma->vma_flags;
 				new_vmarea->vma_off = vma->vma_off;
 				/* plink , vma_vmmap initialize */
@@ -288,8 +514,10 @@ vmmap_map(vmmap_t *map, vnode_t *file, uint32_t lopage, uint32_t npages,
 			new_vmarea->vma_start = vfn;
 			new_vmarea->vma_end = vfn+npages;
 			new_vmarea->vma_prot = prot;
+			new_vmarea->vma_maxprot = PROT_READ | PROT_WRITE | PROT_EXEC;
+			new_vmarea->vma_advice = MADV_NORMAL;
 			new_vmarea->vma_flags = flags;
-			new_vmarea->vma_off = off;
+			new_vmarea->vma_off = ADDR_TO_PN(off);
 	
 			/* assume anaomous objects ,each vmarea needs to have one */
 			
@@ -343,6 +571,94 @@ vmmap_map(vmmap_t *map, vnode_t *file, uint32_t lopage, uint32_t npages,
 
 }
 
+/*
+ * Splits vma in two at vfn, which must be inside it. vma keeps the pages
+ * below vfn, the new area (which is returned) gets the rest. Both map the
+ * same object, so none of its pages move; the pages pinned for a locked
+ * area stay pinned for the part they are in. Returns NULL if there is no
+ * memory for the new area.
+ */
+static vmarea_t *
+vmarea_split(vmmap_t *map, vmarea_t *vma, uint32_t vfn)
+{
+        vmarea_t *newvma;
+        pframe_t **pinned = NULL;
+
+        KASSERT(vma->vma_start < vfn && vfn < vma->vma_end);
+
+        if (NULL != vma->vma_pinned) {
+                /* the lower part keeps the array, it's just too long */
+                if (NULL == (pinned = kmalloc((vma->vma_end - vfn) * sizeof(pframe_t *))))
+                        return NULL;
+                memcpy(pinned, vma->vma_pinned + (vfn - vma->vma_start),
+                       (vma->vma_end - vfn) * sizeof(pframe_t *));
+        }
+        if (NULL == (newvma = vmarea_alloc())) {
+                if (NULL != pinned)
+                        kfree(pinned);
+                return NULL;
+        }
+        newvma->vma_pinned = pinned;
+        newvma->vma_start = vfn;
+        newvma->vma_end = vma->vma_end;
+        newvma->vma_off = vma->vma_off + (vfn - vma->vma_start);
+        newvma->vma_prot = vma->vma_prot;
+        newvma->vma_maxprot = vma->vma_maxprot;
+        newvma->vma_advice = vma->vma_advice;
+        newvma->vma_flags = vma->vma_flags;
+        newvma->vma_obj = vma->vma_obj;
+        vma->vma_obj->mmo_ops->ref(vma->vma_obj);
+        if (list_link_is_linked(&vma->vma_olink))
+                list_insert_before(vma->vma_olink.l_next, &newvma->vma_olink);
+
+        vma->vma_end = vfn;
+        vmmap_update_area(map, vma);
+        vmmap_insert(map, newvma);
+        return newvma;
+}
+
+/*
+ * Merges vma with the area right after it if that maps the next pages of
+ * the same object in the same way, i.e. if the two were split from one
+ * area and have the same permissions again, and both or neither are
+ * locked. Returns 1 if they were merged, 0 if not.
+ */
+static int
+vmarea_merge_next(vmmap_t *map, vmarea_t *vma)
+{
+        vmarea_t *next = vmarea_next(map, vma);
+        uint32_t n = vma->vma_end - vma->vma_start;
+        pframe_t **pinned;
+
+        if (NULL == next || next->vma_start != vma->vma_end
+            || next->vma_obj != vma->vma_obj
+            || next->vma_off != vma->vma_off + (vma->vma_end - vma->vma_start)
+            || next->vma_prot != vma->vma_prot
+            || next->vma_maxprot != vma->vma_maxprot
+            || next->vma_advice != vma->vma_advice
+            || next->vma_flags != vma->vma_flags
+            || (NULL == next->vma_pinned) != (NULL == vma->vma_pinned))
+                return 0;
+
+        if (NULL != vma->vma_pinned) {
+                if (NULL == (pinned = kmalloc((next->vma_end - vma->vma_start)
+                                              * sizeof(pframe_t *))))
+                        return 0;
+                memcpy(pinned, vma->vma_pinned, n * sizeof(pframe_t *));
+                memcpy(pinned + n, next->vma_pinned,
+                       (next->vma_end - next->vma_start) * sizeof(pframe_t *));
+                kfree(vma->vma_pinned);
+                kfree(next->vma_pinned);
+                /* the pins move over with the pages */
+                next->vma_pinned = NULL;
+                vma->vma_pinned = pinned;
+        }
+        vma->vma_end = next->vma_end;
+        vmarea_free(next);
+        vmmap_update_area(map, vma);
+        return 1;
+}
+
 /*
  * We have no guarantee that the region of the address space being
  * unmapped will play nicely with our list of vmareas.
@@ -375,17 +691,34 @@ vmmap_map(vmmap_t *map, vnode_t *file, uint32_t lopage, uint32_t npages,
 int
 vmmap_remove(vmmap_t *map, uint32_t lopage, uint32_t npages)
 {
-	vmarea_t *vma;
+	vmarea_t *vma, *next;
 	uint32_t lo = lopage;
 	uint32_t hi = lopage+npages;
 	uint32_t tmp;
-	list_iterate_begin(&map->vmm_list,vma,vmarea_t,vma_plink){
+	tlb_gather_t tg;
+	/* unmap the range before the areas let go of their pages, so that
+	 * the frames are only freed once no TLB entry can reach them */
+	if(NULL != map->vmm_proc){
+		tlb_gather_init(&tg, map->vmm_proc->p_pagedir);
+		pt_unmap_range(map->vmm_proc->p_pagedir, (uintptr_t)PN_TO_ADDR(lo),
+				(uintptr_t)PN_TO_ADDR(hi), &tg);
+		tlb_gather_finish(&tg);
+	}
+	/* start at the first area which can overlap the range */
+	for(vma = vmmap_lower_bound(map, lo); NULL != vma; vma = next){
+		next = vmarea_next(map, vma);
 		if(lo > hi) return 0;
 		if((lo <= vma->vma_start) && ( vma->vma_start < hi)
 				&& (hi < vma->vma_end)){
 			/*case 3*/
+			if(NULL != vma->vma_pinned){
+				vmarea_unpin(vma, vma->vma_start, hi);
+				for(tmp = hi; tmp < vma->vma_end; tmp++)
+					vma->vma_pinned[tmp - hi] = vma->vma_pinned[tmp - vma->vma_start];
+			}
 			vma->vma_off += hi-vma->vma_start;
 			vma->vma_start = hi;
+			vmmap_update_area(map, vma);
 			return 0;
 
 		}else if((lo <= vma->vma_start) &&
@@ -397,29 +730,314 @@ vmmap_remove(vmmap_t *map, uint32_t lopage, uint32_t npages)
 		}else if((lo > vma->vma_start) &&
 				(hi < vma->vma_end)){
 			/*case 1(split)*/
-			vmarea_t * newvma = vmarea_alloc();
-			newvma->vma_off = vma->vma_off + (hi-vma->vma_start);
-			newvma->vma_start = hi;
-			newvma->vma_end = vma->vma_end;
+			if(NULL == vmarea_split(map, vma, hi))
+				return -ENOMEM;
+			if(NULL != vma->vma_pinned)
+				vmarea_unpin(vma, lo, hi);
 			vma->vma_end = lo;
-
-			vma->vma_obj->mmo_ops->ref(vma->vma_obj);
-			newvma->vma_obj = vma->vma_obj;
-
-			vmmap_insert(map,newvma);
+			vmmap_update_area(map, vma);
 			return 0;
 
 		}else if((vma->vma_start < lo) && (lo < vma->vma_end)
 				&& (vma->vma_end <= hi)){
 			/*case 2*/
+			if(NULL != vma->vma_pinned)
+				vmarea_unpin(vma, lo, vma->vma_end);
 			tmp = vma->vma_end;
 			vma->vma_end = lo;
+			vmmap_update_area(map, vma);
 			lo = tmp;
 
 		}else{
-			/*no match*/
+			/* past the range, there is nothing else to remove */
+			return 0;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Checks that all of [lopage, hi) is mapped, and that the areas can have
+ * the permissions prot. Returns -ENOMEM or -EACCES if not.
+ */
+static int
+vmmap_check_range(vmmap_t *map, uint32_t lopage, uint32_t hi, int prot)
+{
+	uint32_t vfn = lopage;
+	vmarea_t *vma;
+
+	for(vma = vmmap_lower_bound(map, lopage); vfn < hi; vma = vmarea_next(map, vma)){
+		if(NULL == vma || vma->vma_start > vfn)
+			return -ENOMEM;
+		if(prot & ~vma->vma_maxprot)
+			return -EACCES;
+		vfn = vma->vma_end;
+	}
+	return 0;
+}
+
+/*
+ * Splits the areas which straddle lopage or hi, so that [lopage, hi)
+ * consists of whole areas which can be changed on their own.
+ */
+static int
+vmmap_clip_range(vmmap_t *map, uint32_t lopage, uint32_t hi)
+{
+	vmarea_t *vma;
+
+	vma = vmmap_lower_bound(map, lopage);
+	if(NULL != vma && vma->vma_start < lopage && lopage < vma->vma_end){
+		if(NULL == vmarea_split(map, vma, lopage))
+			return -ENOMEM;
+	}
+	vma = vmmap_lower_bound(map, hi - 1);
+	if(NULL != vma && vma->vma_start < hi && hi < vma->vma_end){
+		if(NULL == vmarea_split(map, vma, hi))
+			return -ENOMEM;
+	}
+	return 0;
+}
+
+/*
+ * Merges what can be merged of the areas in [lopage, hi) and the areas
+ * right before and after it, after they were changed.
+ */
+static void
+vmmap_merge_range(vmmap_t *map, uint32_t lopage, uint32_t hi)
+{
+	vmarea_t *vma = vmmap_lower_bound(map, lopage - 1);
+
+	while(NULL != vma && vma->vma_start < hi){
+		if(!vmarea_merge_next(map, vma))
+			vma = vmarea_next(map, vma);
+	}
+}
+
+/*
+ * Changes the permissions of the pages [lopage, lopage+npages), which
+ * must all be mapped, to prot. Areas which are only partly in the range
+ * are split, and areas which end up mapping consecutive pages of the
+ * same object with the same permissions are merged again, so the pages
+ * stay in their objects. Only the areas change: the caller has to make
+ * the page tables agree (see do_mprotect).
+ *
+ * Returns -ENOMEM if part of the range isn't mapped (then nothing is
+ * changed) or there is no memory to split an area, -EACCES if prot
+ * grants a permission an area can't have (writing to a shared mapping
+ * of a file which wasn't opened for writing).
+ */
+int
+vmmap_protect(vmmap_t *map, uint32_t lopage, uint32_t npages, int prot)
+{
+	uint32_t hi = lopage + npages;
+	vmarea_t *vma;
+	int err;
+
+	if((err = vmmap_check_range(map, lopage, hi, prot)) < 0)
+		return err;
+	if((err = vmmap_clip_range(map, lopage, hi)) < 0)
+		return err;
+	for(vma = vmmap_lower_bound(map, lopage); NULL != vma && vma->vma_start < hi;
+			vma = vmarea_next(map, vma))
+		vma->vma_prot = prot;
+	vmmap_merge_range(map, lopage, hi);
+	return 0;
+}
+
+/*
+ * Sets the read-ahead policy (MADV_NORMAL, MADV_RANDOM or
+ * MADV_SEQUENTIAL, see handle_pagefault) of the pages [lopage,
+ * lopage+npages), splitting and merging areas like vmmap_protect.
+ *
+ * Returns -ENOMEM if part of the range isn't mapped or there is no
+ * memory to split an area.
+ */
+int
+vmmap_advise(vmmap_t *map, uint32_t lopage, uint32_t npages, int advice)
+{
+	uint32_t hi = lopage + npages;
+	vmarea_t *vma;
+	int err;
+
+	KASSERT(MADV_NORMAL == advice || MADV_RANDOM == advice || MADV_SEQUENTIAL == advice);
+
+	if((err = vmmap_check_range(map, lopage, hi, 0)) < 0)
+		return err;
+	if((err = vmmap_clip_range(map, lopage, hi)) < 0)
+		return err;
+	for(vma = vmmap_lower_bound(map, lopage); NULL != vma && vma->vma_start < hi;
+			vma = vmarea_next(map, vma))
+		vma->vma_advice = advice;
+	vmmap_merge_range(map, lopage, hi);
+	return 0;
+}
+
+/*
+ * Locks the pages [lopage, lopage+npages) of map, which must all be
+ * mapped, for mlock: the areas in the range are split off and locked,
+ * and each page is faulted in (for writing if its area is writable, so
+ * that writing to it doesn't fault either), which pins it, so pageoutd
+ * can't take it away. Must be called for the current process's address
+ * space.
+ *
+ * Returns -ENOMEM if part of the range isn't mapped, the process would
+ * lock more than vm_mlock_limit pages or there is no memory to lock an
+ * area, or the error from faulting in a page. The range stays locked as
+ * far as it got then; its other pages are pinned when they are faulted
+ * in.
+ */
+int
+vmmap_lock(vmmap_t *map, uint32_t lopage, uint32_t npages)
+{
+	uint32_t hi = lopage + npages;
+	uint32_t vfn, n, nnew = 0;
+	vmarea_t *vma;
+	int err;
+
+	KASSERT(NULL != curproc && map == curproc->p_vmmap);
+
+	if((err = vmmap_check_range(map, lopage, hi, 0)) < 0)
+		return err;
+	for(vma = vmmap_lower_bound(map, lopage); NULL != vma && vma->vma_start < hi;
+			vma = vmarea_next(map, vma)){
+		if(NULL == vma->vma_pinned)
+			nnew += MIN(hi, vma->vma_end) - MAX(lopage, vma->vma_start);
+	}
+	if(map->vmm_nlocked + nnew > (uint32_t)vm_mlock_limit)
+		return -ENOMEM;
+	if((err = vmmap_clip_range(map, lopage, hi)) < 0)
+		return err;
+
+	for(vma = vmmap_lower_bound(map, lopage); NULL != vma && vma->vma_start < hi;
+			vma = vmarea_next(map, vma)){
+		if(NULL != vma->vma_pinned)
+			continue;
+		n = vma->vma_end - vma->vma_start;
+		if(NULL == (vma->vma_pinned = kmalloc(n * sizeof(pframe_t *)))){
+			err = -ENOMEM;
+			goto out;
+		}
+		memset(vma->vma_pinned, 0, n * sizeof(pframe_t *));
+		map->vmm_nlocked += n;
+	}
+
+	for(vfn = lopage; vfn < hi; vfn++){
+		vma = vmmap_lookup(map, vfn);
+		KASSERT(NULL != vma && NULL != vma->vma_pinned);
+		if(NULL != vma->vma_pinned[vfn - vma->vma_start] ||
+				!(vma->vma_prot & (PROT_READ | PROT_WRITE)))
+			continue;
+		/* the zero page isn't pinned, it is never reclaimed anyway */
+		if((err = vm_fault_in(vma, vfn, vma->vma_prot & PROT_WRITE, 0, NULL)) < 0)
+			goto out;
+	}
+out:
+	vmmap_merge_range(map, lopage, hi);
+	return err;
+}
+
+/*
+ * Unlocks the pages in [lopage, lopage+npages) of map, they can be
+ * reclaimed again. Called for munlock; unmapped pages are unlocked as
+ * their areas go away.
+ *
+ * Returns -ENOMEM if there is no memory to split a locked area which is
+ * only partly in the range.
+ */
+int
+vmmap_unlock(vmmap_t *map, uint32_t lopage, uint32_t npages)
+{
+	uint32_t hi = lopage + npages;
+	vmarea_t *vma;
+	int err;
+
+	if((err = vmmap_clip_range(map, lopage, hi)) < 0)
+		return err;
+	for(vma = vmmap_lower_bound(map, lopage); NULL != vma && vma->vma_start < hi;
+			vma = vmarea_next(map, vma)){
+		if(NULL != vma->vma_pinned)
+			vmarea_unlock(vma);
+	}
+	vmmap_merge_range(map, lopage, hi);
+	return 0;
+}
+
+/*
+ * Page vfn of the locked area vma maps pf now (NULL for the zero page):
+ * pins pf for it, instead of the page pinned for it before if that is
+ * another one, e.g. the page a write fault just copied. Called by
+ * vm_fault_in.
+ */
+void
+vmarea_pin(vmarea_t *vma, uint32_t vfn, pframe_t *pf)
+{
+	pframe_t **pfp = &vma->vma_pinned[vfn - vma->vma_start];
+
+	KASSERT(vma->vma_start <= vfn && vfn < vma->vma_end);
+
+	if(NULL == pf || *pfp == pf)
+		return;
+	pframe_pin(pf);
+	if(NULL != *pfp)
+		pframe_unpin(*pfp);
+	*pfp = pf;
+}
+
+/*
+ * Called by fork for the current process's address space map, after its
+ * private areas got new shadow objects. The pages pinned for locked areas
+ * are in the objects shared with the child now, where they would stay
+ * pinned until the parent writes them, and keep the chain from being
+ * collapsed once the child is gone. So the writable ones are copied into
+ * the parent's own objects right away, as a write fault would, which
+ * moves the pins to the copies. If there is no memory for a copy, the
+ * page stays pinned where it is until a write fault copies it.
+ */
+void
+vmmap_unshare_locked(vmmap_t *map)
+{
+	vmarea_t *vma;
+	uint32_t vfn;
+
+	KASSERT(NULL != curproc && map == curproc->p_vmmap);
+
+	list_iterate_begin(&map->vmm_list, vma, vmarea_t, vma_plink){
+		if(NULL == vma->vma_pinned || !(vma->vma_flags & MAP_PRIVATE) ||
+				!(vma->vma_prot & PROT_WRITE))
+			continue;
+		for(vfn = vma->vma_start; vfn < vma->vma_end; vfn++){
+			if(NULL != vma->vma_pinned[vfn - vma->vma_start])
+				vm_fault_in(vma, vfn, 1, 0, NULL);
 		}
 	}list_iterate_end();
+}
+
+/*
+ * Grows vma, an area of map, by npages pages at its end, which must be
+ * unmapped (for brk). If the area is locked, so are the new pages.
+ *
+ * Returns -ENOMEM if that would lock more than vm_mlock_limit pages or
+ * there is no memory for it.
+ */
+int
+vmarea_grow(vmmap_t *map, vmarea_t *vma, uint32_t npages)
+{
+	uint32_t n = vma->vma_end - vma->vma_start;
+	pframe_t **pinned;
+
+	if(NULL != vma->vma_pinned){
+		if(map->vmm_nlocked + npages > (uint32_t)vm_mlock_limit)
+			return -ENOMEM;
+		if(NULL == (pinned = kmalloc((n + npages) * sizeof(pframe_t *))))
+			return -ENOMEM;
+		memcpy(pinned, vma->vma_pinned, n * sizeof(pframe_t *));
+		memset(pinned + n, 0, npages * sizeof(pframe_t *));
+		kfree(vma->vma_pinned);
+		vma->vma_pinned = pinned;
+		map->vmm_nlocked += npages;
+	}
+	vma->vma_end += npages;
+	vmmap_update_area(map, vma);
 	return 0;
 }
 
@@ -439,18 +1057,10 @@ vmmap_is_range_empty(vmmap_t *map, uint32_t startvfn, uint32_t npages)
 	uint32_t endvfn = startvfn+npages;
 	KASSERT((startvfn < endvfn) && (ADDR_TO_PN(USER_MEM_LOW) <= startvfn) && (ADDR_TO_PN(USER_MEM_HIGH) >= endvfn));
 	dbg(DBG_PRINT, "(GRADING3A 3.e) end frame is greater than the start frame and the frames are inside user memory.\n");
-	vmarea_t *vma;
-	uint32_t hi = startvfn+npages;
-	uint32_t lo = startvfn;
-
-	list_iterate_begin(&map->vmm_list,vma,vmarea_t,vma_plink){
-		if(((vma->vma_start <= lo) && (lo < vma->vma_end)) ||   /* lo is inside a vmarea */
-				((vma->vma_start < hi) && (hi <= vma->vma_end)) || /* hi is inside a vmarea */
-				((lo <= vma->vma_start) && (vma->vma_end <= hi))){ /* vmarea is in side the range we specified */
-			return 0;
-		}
-	}list_iterate_end();
-	return 1;
+	/* the range is empty unless the first area ending above its start
+	 * begins below its end */
+	vmarea_t *vma = vmmap_lower_bound(map, startvfn);
+	return (NULL == vma) || (vma->vma_start >= endvfn);
 }
 
 /* Read into 'buf' from the virtual address space of 'map' starting at
@@ -464,87 +1074,30 @@ vmmap_is_range_empty(vmmap_t *map, uint32_t startvfn, uint32_t npages)
 int
 vmmap_read(vmmap_t *map, const void *vaddr, void *buf, size_t count)
 {
-
-		size_t remainsize = count;
-		vmarea_t *vma;
-		struct pframe *pf;
-		/* ------assume vaddr is 32 bits not ust 20 bits  -------*/
-		uintptr_t vma_saddr= (uintptr_t) vaddr;
-		uint32_t boffset = 0;
-		
-
-		
-		list_iterate_begin(&map->vmm_list,vma,vmarea_t,vma_plink){
-			
-			uintptr_t vfs= ADDR_TO_PN(((uintptr_t)vma_saddr));
-			if((vma->vma_start <= vfs) && (vfs < vma->vma_end)  && (remainsize!=0) )
-			{
-				size_t size;
-				/*uint32_t v_pdindex;
-				uint32_t v_ptindex;
-				uint32_t pagenum;
-				uint32_t *pt_vaddr;				
-				uint32_t ppage_paddr;*/								
-				uint32_t poffset;
-				uint32_t pagenum;
-
-				pagenum =  (((uint32_t)(vma_saddr)) >> PAGE_SHIFT) - vma->vma_start + vma->vma_off;
-				poffset =  (((uint32_t)(vma_saddr)) & 0x00000FFF);
-
-				
-				if (remainsize <=PAGE_SIZE *(vma->vma_end - vma->vma_start) )/* located in one VMarea */
-				{
-					size = remainsize;
-					remainsize -= size;
-
-				}
-				else /* need to find another VMarea , preparing next vma_saddr which starting from current VMarea puls one*/
-				{
-					size = PAGE_SIZE *(vma->vma_end - vma->vma_start);
-					vfs = vma->vma_end;
-					vma_saddr = (uintptr_t) PN_TO_ADDR(vfs);
-					remainsize -= size;
-				}
-
-				/*v_pdindex = (((*(uint32_t *)(vaddr)) >> PAGE_SHIFT) / (PAGE_SIZE / sizeof (uint32_t)));
-				v_ptindex = (((*(uint32_t *)(vaddr)) >> PAGE_SHIFT) % (PAGE_SIZE / sizeof (uint32_t)));
-
-
-				pd = map->vmm_proc->p_pagedir;
-				pt_vaddr = pd->pd_virtual[v_pdindex];
-				ppage_paddr =pt_vaddr[v_ptindex];*/
-				
-
-				
-				/*--forwrite =1, performing read from page--*/	
-				if (!vma->vma_obj->mmo_ops->lookuppage(vma->vma_obj, pagenum, 0, &pf)) /* success */
-				{
-
-
-						memcpy(  (void*)(((uint32_t)buf)+boffset), (void*)(((uint32_t)pf->pf_addr) | poffset), size);
-
-						boffset+=size;
-						
-						/*return v->vn_ops->fillpage(v, (int)PN_TO_ADDR(pf->pf_pagenum), pf->pf_addr);*/
-						/*return v->vn_ops->fillpage(v, (int)PN_TO_ADDR(pf->pf_pagenum), pf->pf_addr);*/					
-						/*map->vmm_proc->p_pagedir->pd_virtual[pdindex] 
-						ppaddr = uintptr_t pt_virt_to_phys((uintptr_t) (*pf->pf_addr));*/
-
-						if (0 == remainsize) /* read finish*/
-							return 0;
-					
-				}
-				else
-					return -EFAULT;
-			
-			}
-			
-		}list_iterate_end();
-
-
-		return 0;
-
-
+	uintptr_t addr = (uintptr_t)vaddr;
+	char *dst = (char *)buf;
+
+	/* one page at a time, the pages of an area needn't be contiguous */
+	while(count > 0){
+		vmarea_t *vma = vmmap_lookup(map, ADDR_TO_PN(addr));
+		size_t n = MIN(count, PAGE_SIZE - PAGE_OFFSET(addr));
+		pframe_t *pf;
+		int ret;
+
+		KASSERT(NULL != vma && "reading from an unmapped address");
+		if(NULL == vma)
+			return -EFAULT;
+		if((ret = pframe_lookup(vma->vma_obj,
+		                        ADDR_TO_PN(addr) - vma->vma_start + vma->vma_off,
+		                        0, &pf)) < 0)
+			return ret;
+
+		memcpy(dst, (char *)pf->pf_addr + PAGE_OFFSET(addr), n);
+		dst += n;
+		addr += n;
+		count -= n;
+	}
+	return 0;
 }
 
 /* Write from 'buf' into the virtual address space of 'map' starting at
@@ -558,82 +1111,38 @@ vmmap_read(vmmap_t *map, const void *vaddr, void *buf, size_t count)
 int
 vmmap_write(vmmap_t *map, void *vaddr, const void *buf, size_t count)
 {
-	size_t remainsize = count;
-	vmarea_t *vma;
-	struct pframe *pf;
-	/* ------assume vaddr is 32 bits not ust 20 bits  -------*/
-	uintptr_t vma_saddr= (uintptr_t) vaddr;
-	uint32_t boffset = 0;
-	
-	
-	
-	list_iterate_begin(&map->vmm_list,vma,vmarea_t,vma_plink){
-		
-		uintptr_t vfs= ADDR_TO_PN(((uintptr_t)vma_saddr));
-		if((vma->vma_start <= vfs) && (vfs < vma->vma_end)  && (remainsize!=0) )
-		{
-			size_t size;
-			/*uint32_t v_pdindex;
-			uint32_t v_ptindex;
-			uint32_t pagenum;
-			uint32_t *pt_vaddr; 			
-			uint32_t ppage_paddr;*/ 							
-			uint32_t poffset;
-			uint32_t pagenum;
-	
-			pagenum =  (((uint32_t)(vma_saddr)) >> PAGE_SHIFT) - vma->vma_start + vma->vma_off;
-			poffset =  (((uint32_t)(vma_saddr)) & 0x00000FFF);
-	
-			
-			if (remainsize <=PAGE_SIZE *(vma->vma_end - vma->vma_start) )/* located in one VMarea */
-			{
-				size = remainsize;
-				remainsize -= size;
-	
-			}
-			else /* need to find another VMarea , preparing next vma_saddr which starting from current VMarea puls one*/
-			{
-				size = PAGE_SIZE *(vma->vma_end - vma->vma_start);
-				vfs = vma->vma_end;
-				vma_saddr = (uintptr_t) PN_TO_ADDR(vfs);
-				remainsize -= size;
-			}
-	
-			/*v_pdindex = (((*(uint32_t *)(vaddr)) >> PAGE_SHIFT) / (PAGE_SIZE / sizeof (uint32_t)));
-			v_ptindex = (((*(uint32_t *)(vaddr)) >> PAGE_SHIFT) % (PAGE_SIZE / sizeof (uint32_t)));
-	
-	
-			pd = map->vmm_proc->p_pagedir;
-			pt_vaddr = pd->pd_virtual[v_pdindex];
-			ppage_paddr =pt_vaddr[v_ptindex];*/
-			
-	
-			
-			/*--forwrite =1, performing write to page--*/	
-			if (!vma->vma_obj->mmo_ops->lookuppage(vma->vma_obj, pagenum, 1, &pf)) /* success */
-			{
-	
-	
-					memcpy(  (void *) (((uint32_t)pf->pf_addr)| poffset),(void*)(((uint32_t)buf)+boffset), size);
-					boffset+=size;
-					vma->vma_obj->mmo_ops->dirtypage(vma->vma_obj,pf);
-					
-					/*return v->vn_ops->fillpage(v, (int)PN_TO_ADDR(pf->pf_pagenum), pf->pf_addr);*/
-					/*return v->vn_ops->fillpage(v, (int)PN_TO_ADDR(pf->pf_pagenum), pf->pf_addr);*/					
-					/*map->vmm_proc->p_pagedir->pd_virtual[pdindex] 
-					ppaddr = uintptr_t pt_virt_to_phys((uintptr_t) (*pf->pf_addr));*/
-	
-					if (0 == remainsize) /* read finish*/
-						return 0;
-				
-			}
-			else
-				return -EFAULT;
-		
+	uintptr_t addr = (uintptr_t)vaddr;
+	const char *src = (const char *)buf;
+
+	while(count > 0){
+		vmarea_t *vma = vmmap_lookup(map, ADDR_TO_PN(addr));
+		size_t n = MIN(count, PAGE_SIZE - PAGE_OFFSET(addr));
+		pframe_t *pf;
+		int ret;
+
+		KASSERT(NULL != vma && "writing to an unmapped address");
+		if(NULL == vma)
+			return -EFAULT;
+		if((ret = pframe_lookup(vma->vma_obj,
+		                        ADDR_TO_PN(addr) - vma->vma_start + vma->vma_off,
+		                        1, &pf)) < 0)
+			return ret;
+		/* dirty the page before writing to it */
+		if((ret = pframe_dirty(pf)) < 0)
+			return ret;
+		/* a private area may still map an older copy of the page (or
+		 * the zero page) read-only, which looking it up for writing
+		 * has just superseded */
+		if((vma->vma_flags & MAP_PRIVATE) && NULL != map->vmm_proc){
+			pt_unmap(map->vmm_proc->p_pagedir, (uintptr_t)PAGE_ALIGN_DOWN(addr));
+			tlb_flush((uintptr_t)PAGE_ALIGN_DOWN(addr));
 		}
-		
-	}list_iterate_end();
-	
+
+		memcpy((char *)pf->pf_addr + PAGE_OFFSET(addr), src, n);
+		src += n;
+		addr += n;
+		count -= n;
+	}
 	return 0;
 }
 
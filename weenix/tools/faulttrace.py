@@ -0,0 +1,102 @@
+#!/usr/bin/env python
+# -*- coding: utf-8 -*-
+#
+# Converts the output of the kshell "faulttrace dump" command into the
+# "folded stacks" format which flame graph tools (e.g. Brendan Gregg's
+# flamegraph.pl, or speedscope) read: one line per stack, its frames
+# separated by semicolons, followed by its weight.
+#
+# The dump goes to the serial port, which ./weenix connects to its
+# standard output, so capture that and point this script at it:
+#
+#    $ ./weenix | tee weenix.log
+#    kshell> vmtune faulttrace 1
+#    (run the workload)
+#    kshell> faulttrace dump
+#    $ tools/faulttrace.py weenix.log | flamegraph.pl > faults.svg
+#
+# If the dump has individual faults (the faulttrace tunable was set), the
+# stacks are process;access;kind;object;{fill,handler}, weighted by
+# cycles, where fill is the time the object's fill functions took.
+# Otherwise (or with --classes) they come from the per-class totals, as
+# access;kind;object. --count weighs the stacks by number of faults
+# instead.
+
+from __future__ import print_function
+
+import argparse
+import collections
+import re
+import sys
+
+ANSI = re.compile(r'\x1b\[[0-9;]*m')
+
+
+def read_dump(lines):
+    """Returns the class and event lines of the last dump in lines."""
+    classes, events, inside = [], [], False
+    for line in lines:
+        line = ANSI.sub('', line).strip()
+        if line == 'faulttrace begin':
+            classes, events, inside = [], [], True
+        elif line == 'faulttrace end':
+            inside = False
+        elif inside and line.startswith('class '):
+            classes.append(line.split()[1:])
+        elif inside and line.startswith('event '):
+            events.append(line.split()[1:])
+    return classes, events
+
+
+def fold_events(events, count):
+    stacks = collections.OrderedDict()
+    for tsc, pid, vaddr, access, kind, obj, cycles, fill in events:
+        base = 'pid %s;%s;%s;%s' % (pid, access, kind, obj)
+        cycles, fill = int(cycles), int(fill)
+        if count:
+            parts = [(base, 1)]
+        else:
+            parts = [(base + ';fill', fill), (base + ';handler', cycles - fill)]
+        for stack, weight in parts:
+            if weight > 0:
+                stacks[stack] = stacks.get(stack, 0) + weight
+    return stacks
+
+
+def fold_classes(classes, count):
+    stacks = collections.OrderedDict()
+    for fields in classes:
+        access, kind, obj, nfaults, cycles = fields[:5]
+        stacks['%s;%s;%s' % (access, kind, obj)] = \
+            int(nfaults) if count else int(cycles)
+    return stacks
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Convert a faulttrace dump into folded stacks.')
+    parser.add_argument('log', nargs='?', default='-',
+                        help='serial output containing the dump (default stdin)')
+    parser.add_argument('--classes', action='store_true',
+                        help='use the per-class totals even if there are events')
+    parser.add_argument('--count', action='store_true',
+                        help='weigh stacks by faults rather than cycles')
+    args = parser.parse_args()
+
+    f = sys.stdin if args.log == '-' else open(args.log)
+    classes, events = read_dump(f)
+    if not classes and not events:
+        print('faulttrace.py: no faulttrace dump found', file=sys.stderr)
+        return 1
+
+    if events and not args.classes:
+        stacks = fold_events(events, args.count)
+    else:
+        stacks = fold_classes(classes, args.count)
+    for stack, weight in stacks.items():
+        print('%s %d' % (stack, weight))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
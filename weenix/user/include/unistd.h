@@ -56,6 +56,11 @@ int     stat(const char *path, struct stat *buf);
 /* VM-related */
 void    *mmap(void *addr, size_t len, int prot, int flags, int fd, off_t off);
 int     munmap(void *addr, size_t len);
+int     mprotect(void *addr, size_t len, int prot);
+int     msync(void *addr, size_t len, int flags);
+int     madvise(void *addr, size_t len, int advice);
+int     mlock(const void *addr, size_t len);
+int     munlock(const void *addr, size_t len);
 int     brk(void *addr);
 void    *sbrk(int incr);
 
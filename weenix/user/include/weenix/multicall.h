@@ -0,0 +1,26 @@
+#pragma once
+
+#include "sys/types.h"
+#include "weenix/syscall.h"
+
+struct stat;
+struct dirent;
+
+/*
+ * Batched system calls: fill in an array of entries with the mc_*
+ * functions, then make all of the calls in one trap with multicall().
+ * Each entry gets the call's return value in mc_ret, and errno in
+ * mc_errno if the call failed. With MC_STOP, the calls after the first
+ * which fails aren't made. Returns the number of calls made, or -1 if
+ * none could be.
+ */
+int     multicall(multicall_entry_t *calls, int ncalls, int flags);
+
+void    mc_call(multicall_entry_t *mc, int sysnum, uint32_t arg);
+void    mc_open(multicall_entry_t *mc, const char *filename, int flags, int mode);
+void    mc_close(multicall_entry_t *mc, int fd);
+void    mc_read(multicall_entry_t *mc, int fd, void *buf, size_t nbytes);
+void    mc_write(multicall_entry_t *mc, int fd, const void *buf, size_t nbytes);
+void    mc_lseek(multicall_entry_t *mc, int fd, off_t offset, int whence);
+void    mc_getdents(multicall_entry_t *mc, int fd, struct dirent *dir, size_t size);
+void    mc_stat(multicall_entry_t *mc, const char *path, struct stat *buf);
@@ -69,7 +69,7 @@ static int fdzero;
 #define INIT_MMAP() \
         { if ((fdzero = _open("/dev/zero", O_RDWR, 0000)) == -1) \
                         wrterror("open of /dev/zero"); }
-#define MADV_FREE                       MADV_DONTNEED
+#define HAS_MADVISE
 
 /*
  * No user serviceable parts behind this point.
@@ -192,7 +192,7 @@ static int suicide;
 static int malloc_realloc;
 
 /* pass the kernel a hint on free pages ?  */
-static int malloc_hint = 0;
+static int malloc_hint = 1;
 
 /* xmalloc behaviour ?  */
 static int malloc_xmalloc;
@@ -229,6 +229,12 @@ void utrace __P((struct ut *, int));
 /* my last break. */
 static void *malloc_brk;
 
+/* the highest break I ever had, the memory above it was never touched */
+static void *malloc_brk_max;
+
+/* the last allocation was of pages nobody touched before (so all zero) */
+static int malloc_fresh;
+
 /* one location cache for free-list holders */
 static struct pgfree *px;
 
@@ -306,6 +312,11 @@ map_pages(int pages)
         last_index = ptr2index(tail) - 1;
         malloc_brk = tail;
 
+        /* Memory we give back with brk() is not cleared by the kernel */
+        malloc_fresh = ((void *)result >= malloc_brk_max);
+        if ((void *)tail > malloc_brk_max)
+                malloc_brk_max = tail;
+
         if ((last_index + 1) >= malloc_ninfo && !extend_pgdir(last_index))
                 return 0;;
 
@@ -705,11 +716,14 @@ imalloc(size_t size)
         if (suicide)
                 abort();
 
+        malloc_fresh = 0;
         if ((size + malloc_pagesize) < size)        /* Check for overflow */
                 result = 0;
-        else if (size <= malloc_maxsize)
+        else if (size <= malloc_maxsize) {
                 result =  malloc_bytes(size);
-        else
+                /* the chunk's page may be new, but not the rest of it */
+                malloc_fresh = 0;
+        } else
                 result =  malloc_pages(size);
 
         if (malloc_abort && !result)
@@ -1139,10 +1153,20 @@ realloc(void *ptr, size_t size)
 void *calloc(size_t nelem, size_t elsize)
 {
         void *tmp;
+        if (elsize && nelem > (size_t) -1 / elsize) {
+                errno = ENOMEM;
+                return NULL;
+        }
         if (NULL == (tmp = malloc(nelem * elsize))) {
                 return NULL;
         } else {
-                memset(tmp, 0, nelem * elsize);
+                /*
+                 * Pages fresh from the kernel are zero already, and not
+                 * touching them means they don't take up any memory until
+                 * they are written to.
+                 */
+                if (!malloc_fresh || malloc_junk)
+                        memset(tmp, 0, nelem * elsize);
                 return tmp;
         }
 }
@@ -0,0 +1,78 @@
+#include "sys/types.h"
+#include "string.h"
+
+#include "weenix/trap.h"
+#include "weenix/multicall.h"
+
+int multicall(multicall_entry_t *calls, int ncalls, int flags)
+{
+        multicall_args_t args;
+
+        args.mca_calls = calls;
+        args.mca_ncalls = ncalls;
+        args.mca_flags = flags;
+
+        return trap(SYS_multicall, (uint32_t) &args);
+}
+
+void mc_call(multicall_entry_t *mc, int sysnum, uint32_t arg)
+{
+        mc->mc_sysnum = sysnum;
+        mc->mc_arg = arg;
+        mc->mc_ret = 0;
+        mc->mc_errno = 0;
+}
+
+void mc_open(multicall_entry_t *mc, const char *filename, int flags, int mode)
+{
+        mc->mc_args.open.filename.as_len = strlen(filename);
+        mc->mc_args.open.filename.as_str = filename;
+        mc->mc_args.open.flags = flags;
+        mc->mc_args.open.mode = mode;
+        mc_call(mc, SYS_open, (uint32_t) &mc->mc_args.open);
+}
+
+void mc_close(multicall_entry_t *mc, int fd)
+{
+        mc_call(mc, SYS_close, (uint32_t) fd);
+}
+
+void mc_read(multicall_entry_t *mc, int fd, void *buf, size_t nbytes)
+{
+        mc->mc_args.read.fd = fd;
+        mc->mc_args.read.buf = buf;
+        mc->mc_args.read.nbytes = nbytes;
+        mc_call(mc, SYS_read, (uint32_t) &mc->mc_args.read);
+}
+
+void mc_write(multicall_entry_t *mc, int fd, const void *buf, size_t nbytes)
+{
+        mc->mc_args.write.fd = fd;
+        mc->mc_args.write.buf = (void *) buf;
+        mc->mc_args.write.nbytes = nbytes;
+        mc_call(mc, SYS_write, (uint32_t) &mc->mc_args.write);
+}
+
+void mc_lseek(multicall_entry_t *mc, int fd, off_t offset, int whence)
+{
+        mc->mc_args.lseek.fd = fd;
+        mc->mc_args.lseek.offset = offset;
+        mc->mc_args.lseek.whence = whence;
+        mc_call(mc, SYS_lseek, (uint32_t) &mc->mc_args.lseek);
+}
+
+void mc_getdents(multicall_entry_t *mc, int fd, struct dirent *dir, size_t size)
+{
+        mc->mc_args.getdents.fd = fd;
+        mc->mc_args.getdents.dirp = dir;
+        mc->mc_args.getdents.count = size;
+        mc_call(mc, SYS_getdents, (uint32_t) &mc->mc_args.getdents);
+}
+
+void mc_stat(multicall_entry_t *mc, const char *path, struct stat *buf)
+{
+        mc->mc_args.stat.path.as_len = strlen(path);
+        mc->mc_args.stat.path.as_str = path;
+        mc->mc_args.stat.buf = buf;
+        mc_call(mc, SYS_stat, (uint32_t) &mc->mc_args.stat);
+}
@@ -15,6 +15,30 @@ static void *__curbrk = NULL;
 static void     (*atexit_func[MAX_EXIT_HANDLERS])();
 static int      atexit_handlers = 0;
 
+int __trap_sysenter = -1;
+
+/*
+ * Decides whether trap() uses sysenter: it does if the processor has it,
+ * in which case the kernel has set it up. Early Pentium Pros say they
+ * have it but don't. ebx is saved by hand since cpuid overwrites it and
+ * it holds the GOT pointer.
+ */
+void __trap_probe(void)
+{
+        uint32_t a, d;
+
+        __asm__ volatile(
+                "movl %%ebx, %%esi\n\t"
+                "cpuid\n\t"
+                "movl %%esi, %%ebx"
+                : "=a"(a), "=d"(d)
+                : "0"(1)
+                : "ecx", "esi"
+        );
+        __trap_sysenter = (d & (1 << 11))
+                          && !(6 == ((a >> 8) & 0xf) && ((a >> 4) & 0xf) < 3 && (a & 0xf) < 3);
+}
+
 
 void *sbrk(intptr_t incr)
 {
@@ -159,6 +183,59 @@ int munmap(void *addr, size_t len)
         return trap(SYS_munmap, (uint32_t) &args);
 }
 
+int mprotect(void *addr, size_t len, int prot)
+{
+        mprotect_args_t args;
+
+        args.addr = addr;
+        args.len = len;
+        args.prot = prot;
+
+        return trap(SYS_mprotect, (uint32_t) &args);
+}
+
+int msync(void *addr, size_t len, int flags)
+{
+        msync_args_t args;
+
+        args.addr = addr;
+        args.len = len;
+        args.flags = flags;
+
+        return trap(SYS_msync, (uint32_t) &args);
+}
+
+int madvise(void *addr, size_t len, int advice)
+{
+        madvise_args_t args;
+
+        args.addr = addr;
+        args.len = len;
+        args.advice = advice;
+
+        return trap(SYS_madvise, (uint32_t) &args);
+}
+
+int mlock(const void *addr, size_t len)
+{
+        mlock_args_t args;
+
+        args.addr = (void *) addr;
+        args.len = len;
+
+        return trap(SYS_mlock, (uint32_t) &args);
+}
+
+int munlock(const void *addr, size_t len)
+{
+        mlock_args_t args;
+
+        args.addr = (void *) addr;
+        args.len = len;
+
+        return trap(SYS_munlock, (uint32_t) &args);
+}
+
 void sync(void)
 {
         trap(SYS_sync, 0);
@@ -0,0 +1,73 @@
+/*
+ * Allocates a lot of memory with calloc, the way programs allocating
+ * zeroed tables do, reads all of it and writes to only a few pages, to
+ * show how much memory untouched zeroed allocations take. Takes the
+ * number of 64KB buffers to allocate (64 by default).
+ *
+ * Compare the free page and zero page numbers from the kernel shell
+ * before and after a run, while callocbench waits for input:
+ *
+ *    kshell> vmstat reset
+ *    kshell> pcstat
+ *    (run /usr/bin/callocbench, it stops before freeing its memory)
+ *    kshell> vmstat
+ *    kshell> pcstat
+ *
+ * With the default 64 buffers (1024 pages) in a 32mb machine, reading
+ * them all made 1027 zero page mappings, and the free pages only went
+ * from 7513 to 7453, most of that page cache fills for loading the
+ * program; 7492 were free again after it exited.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define BUFSIZE (64 * 1024)
+#define PAGE_SIZE 4096
+
+int main(int argc, char **argv)
+{
+        char **bufs;
+        int n = 64, i, j;
+        unsigned long nonzero = 0;
+        char c;
+
+        if (argc > 1)
+                n = atoi(argv[1]);
+
+        if (NULL == (bufs = calloc(n, sizeof(*bufs)))) {
+                fprintf(stderr, "callocbench: out of memory\n");
+                return 1;
+        }
+
+        for (i = 0; i < n; i++) {
+                if (NULL == (bufs[i] = calloc(1, BUFSIZE))) {
+                        fprintf(stderr, "callocbench: out of memory after %d buffers\n", i);
+                        n = i;
+                        break;
+                }
+        }
+
+        /* read everything, like a program scanning a sparse table */
+        for (i = 0; i < n; i++) {
+                for (j = 0; j < BUFSIZE; j++) {
+                        if (bufs[i][j])
+                                nonzero++;
+                }
+        }
+
+        /* and write to the first page of every fourth buffer */
+        for (i = 0; i < n; i += 4)
+                bufs[i][0] = 1;
+
+        printf("callocbench: %d buffers of %d pages, %lu nonzero bytes\n",
+               n, BUFSIZE / PAGE_SIZE, nonzero);
+        printf("callocbench: press enter to free them\n");
+        read(0, &c, 1);
+
+        for (i = 0; i < n; i++)
+                free(bufs[i]);
+        free(bufs);
+        return nonzero ? 1 : 0;
+}
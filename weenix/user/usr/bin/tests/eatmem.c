@@ -19,27 +19,53 @@
 /* TODO ensure this matches the kernel value */
 #define PAGE_SIZE 4096
 
-static void eat(void *addr, int *count, int *num)
+/* Touches the next page: reads it, or with -w writes its number into it,
+ * so that it has to go to swap rather than just being dropped */
+static void bite(void *addr, int *count, int write)
+{
+        int *page = (int *)((char *)addr + (*count)++ * PAGE_SIZE);
+
+        if (write)
+                *page = *count;
+        else
+                (void)*(volatile int *)page;
+        if ((*count & 0x7f) == 0)
+                printf("Ate %d pages\n", *count);
+}
+
+/* Checks that the pages written with -w still hold their numbers, which
+ * reads back the ones that were swapped out */
+static int check(void *addr, int count)
+{
+        int i, bad = 0;
+
+        for (i = 0; i < count; i++) {
+                if (*(int *)((char *)addr + i * PAGE_SIZE) != i + 1)
+                        bad++;
+        }
+        printf("Checked %d pages, %d bad\n", count, bad);
+        return bad;
+}
+
+static void eat(void *addr, int *count, int *num, int write)
 {
         int status;
         test_fork_begin() {
                 if (*num <= 0) {
                         /* Eat the memory until we die */
-                        while (1) {
-                                char foo = *((char *)addr + ((*count)++ * PAGE_SIZE));
-                                if ((*count & 0x7f) == 0)
-                                        printf("Ate %d pages\n", *count);
-                        }
+                        while (1)
+                                bite(addr, count, write);
                 } else {
                         /* Eat until we have the necessary number of pages */
-                        while (*count < *num) {
-                                char foo = *((char *)addr + ((*count)++ * PAGE_SIZE));
-                                if ((*count & 0x7f) == 0)
-                                        printf("Ate %d pages\n", *count);
-                        }
+                        while (*count < *num)
+                                bite(addr, count, write);
+                        if (write && check(addr, *count))
+                                exit(1);
                 }
         } test_fork_end(&status);
-        if (*num <= 0 && EFAULT != status) {
+        /* Running off the end of the mapping is a segfault, running out of
+         * memory and swap first gets the child killed with ENOMEM */
+        if (*num <= 0 && EFAULT != status && ENOMEM != status) {
                 fprintf(stderr, "Child process didn't segfault!\n");
                 exit(1);
         }
@@ -55,11 +81,13 @@ static void eat(void *addr, int *count, int *num)
 #define FLAG_INFINITE "-i"
 #define FLAG_ITER     "-y"
 #define FLAG_NUM      "-#"
+#define FLAG_WRITE    "-w"
 
 #define OPT_DAEMON    1
 #define OPT_INFINITE  2
 #define OPT_ITER       4
 #define OPT_NUM    8
+#define OPT_WRITE     16
 
 int parse_args(int argc, char **argv, int *opts, int *iter, int *num)
 {
@@ -70,6 +98,8 @@ int parse_args(int argc, char **argv, int *opts, int *iter, int *num)
                         *opts |= OPT_DAEMON;
                 } else if (!strcmp(FLAG_INFINITE, argv[i])) {
                         *opts |= OPT_INFINITE;
+                } else if (!strcmp(FLAG_WRITE, argv[i])) {
+                        *opts |= OPT_WRITE;
                 } else if (!strcmp(FLAG_ITER, argv[i])) {
                         *opts |= OPT_ITER;
                         if (++i >= argc || (errno = 0,
@@ -126,7 +156,8 @@ int main(int argc, char **argv)
                         FLAG_DAEMON   "          run as daemon\n"
                         FLAG_INFINITE "          run forever\n"
                         FLAG_ITER     " [num]    number of iterations to yield\n"
-                        FLAG_NUM      " [num]    number of pages to eat (if negative, to relinquish)\n");
+                        FLAG_NUM      " [num]    number of pages to eat (if negative, to relinquish)\n"
+                        FLAG_WRITE    "          write the pages (and check them afterwards)\n");
                 return 1;
         }
 
@@ -139,7 +170,7 @@ int main(int argc, char **argv)
                         exit(0);
         }
 
-        eat(addr, count, num);
+        eat(addr, count, num, *opts & OPT_WRITE);
 
         printf("Ate %d pages in total\n", *count);
 
@@ -0,0 +1,116 @@
+/*
+ * Compares making small system calls one trap at a time with making them
+ * in batches with multicall(): stats of the same path, and reads of a
+ * file a few bytes at a time. Takes the number of calls of each kind
+ * (4096 by default) and the batch size (32 by default), and prints the
+ * cycles per call both ways.
+ *
+ * In the emulator, where a null system call took 1.8 million cycles,
+ * batching brought reads down from 8.0 to 7.3 million cycles per call,
+ * and stats stayed at 10 million: there most of the time of a stat is
+ * spent in the kernel, not in the trap.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <weenix/multicall.h>
+
+#define FILENAME "/mcbench.tmp"
+#define CHUNK 16
+
+static unsigned long long rdtsc(void)
+{
+        unsigned long long tsc;
+        __asm__ volatile("rdtsc" : "=A"(tsc));
+        return tsc;
+}
+
+static void report(const char *what, int ncalls, unsigned long long single,
+                   unsigned long long batched)
+{
+        printf("mcbench: %s: %llu cycles per call alone, %llu batched\n",
+               what, single / ncalls, batched / ncalls);
+}
+
+int main(int argc, char **argv)
+{
+        int ncalls = 4096, batch = 32, fd, i, j, n;
+        unsigned long long start, single, batched;
+        multicall_entry_t *calls;
+        struct stat st;
+        char *buf;
+
+        if (argc > 1)
+                ncalls = atoi(argv[1]);
+        if (argc > 2)
+                batch = atoi(argv[2]);
+        if (ncalls <= 0 || batch <= 0) {
+                fprintf(stderr, "USAGE: mcbench [<calls> [<batch size>]]\n");
+                return 1;
+        }
+        calls = malloc(batch * sizeof(*calls));
+        buf = malloc(batch * CHUNK);
+        if (NULL == calls || NULL == buf) {
+                fprintf(stderr, "mcbench: out of memory\n");
+                return 1;
+        }
+
+        /* stat */
+        start = rdtsc();
+        for (i = 0; i < ncalls; i++)
+                stat("/", &st);
+        single = rdtsc() - start;
+
+        start = rdtsc();
+        for (i = 0; i < ncalls; i += n) {
+                n = (ncalls - i < batch) ? ncalls - i : batch;
+                for (j = 0; j < n; j++)
+                        mc_stat(&calls[j], "/", &st);
+                if (multicall(calls, n, 0) != n) {
+                        fprintf(stderr, "mcbench: multicall failed, errno %d\n", errno);
+                        return 1;
+                }
+        }
+        batched = rdtsc() - start;
+        report("stat", ncalls, single, batched);
+
+        /* small reads, of a file big enough for all of them */
+        if (0 > (fd = open(FILENAME, O_RDWR | O_CREAT | O_TRUNC, 0))) {
+                fprintf(stderr, "mcbench: can't create %s\n", FILENAME);
+                return 1;
+        }
+        memset(buf, 'm', batch * CHUNK);
+        for (i = 0; i < ncalls; i += batch)
+                write(fd, buf, batch * CHUNK);
+
+        lseek(fd, 0, SEEK_SET);
+        start = rdtsc();
+        for (i = 0; i < ncalls; i++)
+                read(fd, buf, CHUNK);
+        single = rdtsc() - start;
+
+        lseek(fd, 0, SEEK_SET);
+        start = rdtsc();
+        for (i = 0; i < ncalls; i += n) {
+                n = (ncalls - i < batch) ? ncalls - i : batch;
+                for (j = 0; j < n; j++)
+                        mc_read(&calls[j], fd, buf + j * CHUNK, CHUNK);
+                if (multicall(calls, n, MC_STOP) != n || CHUNK != calls[n - 1].mc_ret) {
+                        fprintf(stderr, "mcbench: batched read failed\n");
+                        break;
+                }
+        }
+        batched = rdtsc() - start;
+        report("read", ncalls, single, batched);
+
+        close(fd);
+        unlink(FILENAME);
+        free(buf);
+        free(calls);
+        return 0;
+}
@@ -1,6 +1,7 @@
 /*
  * Test correct user space memory management, particularly segfaults
- * Tests fun cases of mmap, munmap, and brk
+ * Tests fun cases of mmap, munmap, mprotect, madvise, mlock, msync and brk,
+ * also on memory mapped with 4mb pages
  * -- Alvin Kerber (alvin)
  */
 
@@ -284,6 +285,251 @@ static int test_munmap(void)
         return 0;
 }
 
+static int test_mprotect(void)
+{
+        char *addr;
+        int fd;
+
+        printf("Testing mprotect()\n");
+
+        test_assert(MAP_FAILED != (addr = mmap(NULL, PAGE_SIZE * 8,
+                                               PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0)), NULL);
+        *addr = 'a';
+        *(addr + PAGE_SIZE * 4) = 'b';
+        *(addr + PAGE_SIZE * 7) = 'c';
+
+        /* Bad arguments */
+        test_assert(-1 == mprotect(addr + 1, PAGE_SIZE, PROT_READ) && EINVAL == errno, NULL);
+        test_assert(-1 == mprotect(addr, PAGE_SIZE, 0x100) && EINVAL == errno, NULL);
+        test_assert(-1 == mprotect(addr, PAGE_SIZE * 9, PROT_READ) && ENOMEM == errno, NULL);
+
+        /* Write-protect the middle of the area, the pages are still there */
+        test_assert(0 == mprotect(addr + PAGE_SIZE * 3, PAGE_SIZE * 2, PROT_READ), NULL);
+        test_assert('b' == *(addr + PAGE_SIZE * 4), NULL);
+        assert_fault(*(addr + PAGE_SIZE * 4) = 'x', "");
+        assert_fault(*(addr + PAGE_SIZE * 3) = 'x', "");
+        assert_nofault(*(addr + PAGE_SIZE * 2) = 'x', "");
+        assert_nofault(*(addr + PAGE_SIZE * 5) = 'x', "");
+
+        /* Take everything away */
+        test_assert(0 == mprotect(addr + PAGE_SIZE * 4, PAGE_SIZE, PROT_NONE), NULL);
+        assert_fault(char foo = *(addr + PAGE_SIZE * 4), "");
+        test_assert('\0' == *(addr + PAGE_SIZE * 3), NULL);
+
+        /* And give it back, merging the area again */
+        test_assert(0 == mprotect(addr, PAGE_SIZE * 8, PROT_READ | PROT_WRITE), NULL);
+        test_assert('b' == *(addr + PAGE_SIZE * 4), NULL);
+        *(addr + PAGE_SIZE * 4) = 'd';
+        test_assert('d' == *(addr + PAGE_SIZE * 4), NULL);
+        test_assert('a' == *addr, NULL);
+        test_assert('c' == *(addr + PAGE_SIZE * 7), NULL);
+
+        /* Unmapping the middle still works after splitting and merging */
+        test_assert(0 == munmap(addr + PAGE_SIZE * 2, PAGE_SIZE * 2), NULL);
+        assert_fault(char foo = *(addr + PAGE_SIZE * 3), "");
+        test_assert('d' == *(addr + PAGE_SIZE * 4), NULL);
+        test_assert(0 == munmap(addr, PAGE_SIZE * 8), NULL);
+
+        /* A file which is only open for reading can't be made writable */
+        test_assert(0 < (fd = open("/dev/zero", O_RDONLY, 0)), NULL);
+        test_assert(MAP_FAILED != (addr = mmap(NULL, PAGE_SIZE, PROT_READ, MAP_SHARED, fd, 0)), NULL);
+        test_assert(-1 == mprotect(addr, PAGE_SIZE, PROT_READ | PROT_WRITE) && EACCES == errno, NULL);
+        test_assert(0 == munmap(addr, PAGE_SIZE), NULL);
+        test_assert(0 == close(fd), NULL);
+
+        return 0;
+}
+
+static int test_user_copy(void)
+{
+        char *addr, buf[16];
+        int fd;
+
+        printf("Testing system calls on user memory\n");
+
+        test_assert(0 < (fd = open("/README", O_RDONLY, 0)), NULL);
+        test_assert(16 == read(fd, buf, 16), NULL);
+        test_assert(MAP_FAILED != (addr = mmap(NULL, PAGE_SIZE * 3,
+                                               PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0)), NULL);
+
+        /* The kernel faults in the pages it copies to or from, across a
+         * page boundary too */
+        test_assert(0 == lseek(fd, 0, SEEK_SET), NULL);
+        test_assert(16 == read(fd, addr + PAGE_SIZE - 8, 16), NULL);
+        test_assert(0 == memcmp(buf, addr + PAGE_SIZE - 8, 16), NULL);
+        test_assert(0 == close(fd), NULL);
+        test_assert(0 < (fd = open("/dev/null", O_WRONLY, 0)), NULL);
+        test_assert(16 == write(fd, addr + PAGE_SIZE * 2, 16), NULL);
+
+        /* But copies to read-only or unmapped memory fail */
+        test_assert(0 == mprotect(addr + PAGE_SIZE * 2, PAGE_SIZE, PROT_READ), NULL);
+        test_assert(-1 == stat("/README", (struct stat *)(addr + PAGE_SIZE * 2)) && EFAULT == errno, NULL);
+        test_assert(0 == munmap(addr + PAGE_SIZE, PAGE_SIZE), NULL);
+        test_assert(-1 == stat("/README", (struct stat *)(addr + PAGE_SIZE - 8)) && EFAULT == errno, NULL);
+        test_assert(-1 == write(fd, addr + PAGE_SIZE - 8, 16) && EFAULT == errno, NULL);
+        test_assert('\0' == *(addr + PAGE_SIZE * 2), NULL);
+
+        test_assert(0 == close(fd), NULL);
+        test_assert(0 == munmap(addr, PAGE_SIZE * 3), NULL);
+        return 0;
+}
+
+static int test_madvise(void)
+{
+        char *addr;
+        int status;
+
+        printf("Testing madvise()\n");
+
+        test_assert(MAP_FAILED != (addr = mmap(NULL, PAGE_SIZE * 8,
+                                               PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0)), NULL);
+        memset(addr, 'a', PAGE_SIZE * 8);
+
+        /* Bad arguments */
+        test_assert(-1 == madvise(addr + 1, PAGE_SIZE, MADV_NORMAL) && EINVAL == errno, NULL);
+        test_assert(-1 == madvise(addr, PAGE_SIZE, 42) && EINVAL == errno, NULL);
+        test_assert(-1 == madvise(addr, PAGE_SIZE * 9, MADV_WILLNEED) && ENOMEM == errno, NULL);
+
+        /* Hints don't change the contents */
+        test_assert(0 == madvise(addr + PAGE_SIZE, PAGE_SIZE * 2, MADV_SEQUENTIAL), NULL);
+        test_assert(0 == madvise(addr + PAGE_SIZE * 4, PAGE_SIZE, MADV_RANDOM), NULL);
+        test_assert(0 == madvise(addr, PAGE_SIZE * 8, MADV_WILLNEED), NULL);
+        test_assert('a' == *(addr + PAGE_SIZE * 2) && 'a' == *(addr + PAGE_SIZE * 4), NULL);
+        test_assert(0 == madvise(addr, PAGE_SIZE * 8, MADV_NORMAL), NULL);
+
+        /* Dropped pages read as zeros again */
+        test_assert(0 == madvise(addr + PAGE_SIZE * 2, PAGE_SIZE * 2, MADV_DONTNEED), NULL);
+        test_assert('a' == *(addr + PAGE_SIZE * 2 - 1), NULL);
+        test_assert('\0' == *(addr + PAGE_SIZE * 2), NULL);
+        test_assert('\0' == *(addr + PAGE_SIZE * 4 - 1), NULL);
+        test_assert('a' == *(addr + PAGE_SIZE * 4), NULL);
+        assert_nofault(*(addr + PAGE_SIZE * 3) = 'b', "");
+
+        /* Also those a child shares with its parent, and not in the parent */
+        test_fork_begin() {
+                if (0 != madvise(addr, PAGE_SIZE, MADV_DONTNEED) || '\0' != *addr)
+                        return 1;
+                return 0;
+        } test_fork_end(&status);
+        test_assert(0 == status, "dropping a page shared with the parent");
+        test_assert('a' == *addr, NULL);
+
+        /* Freed pages which are written again keep what was written */
+        test_assert(0 == madvise(addr + PAGE_SIZE * 5, PAGE_SIZE * 3, MADV_FREE), NULL);
+        *(addr + PAGE_SIZE * 6) = 'c';
+        test_assert('c' == *(addr + PAGE_SIZE * 6), NULL);
+        test_assert(0 == munmap(addr, PAGE_SIZE * 8), NULL);
+
+        return 0;
+}
+
+static int test_populate_mlock(void)
+{
+        char *addr;
+        int i, status;
+
+        printf("Testing MAP_POPULATE and mlock()\n");
+
+        /* Populated mappings look like any other */
+        test_assert(MAP_FAILED != (addr = mmap(NULL, PAGE_SIZE * 8, PROT_READ | PROT_WRITE,
+                                               MAP_PRIVATE | MAP_ANON | MAP_POPULATE, -1, 0)), NULL);
+        for (i = 0; i < 8; i++)
+                test_assert('\0' == *(addr + PAGE_SIZE * i), NULL);
+        *(addr + PAGE_SIZE * 7) = 'a';
+        test_assert('a' == *(addr + PAGE_SIZE * 7), NULL);
+
+        /* Locking keeps the contents */
+        test_assert(0 == mlock(addr + 1, PAGE_SIZE * 4), NULL);
+        test_assert(0 == mlock(addr, PAGE_SIZE * 8), NULL);
+        test_assert('a' == *(addr + PAGE_SIZE * 7), NULL);
+        *(addr + PAGE_SIZE * 3) = 'b';
+        test_assert('b' == *(addr + PAGE_SIZE * 3), NULL);
+        test_assert(0 == munlock(addr + PAGE_SIZE * 2, PAGE_SIZE * 2), NULL);
+        test_assert('b' == *(addr + PAGE_SIZE * 3), NULL);
+
+        /* Locked pages can't be dropped */
+        test_assert(-1 == madvise(addr + PAGE_SIZE * 3, PAGE_SIZE * 5, MADV_DONTNEED)
+                    && EINVAL == errno, NULL);
+        test_assert('b' == *(addr + PAGE_SIZE * 3), NULL);
+        test_assert('a' == *(addr + PAGE_SIZE * 7), NULL);
+        test_assert(0 == madvise(addr + PAGE_SIZE * 2, PAGE_SIZE * 2, MADV_DONTNEED), NULL);
+        test_assert('\0' == *(addr + PAGE_SIZE * 3), NULL);
+
+        /* Locks stay with the parent, which keeps its own copies */
+        test_fork_begin() {
+                *(addr + PAGE_SIZE * 7) = 'c';
+        } test_fork_end(&status);
+        test_assert('a' == *(addr + PAGE_SIZE * 7), NULL);
+        *(addr + PAGE_SIZE * 7) = 'd';
+        test_assert('d' == *(addr + PAGE_SIZE * 7), NULL);
+        test_assert(-1 == madvise(addr + PAGE_SIZE * 7, PAGE_SIZE, MADV_DONTNEED)
+                    && EINVAL == errno, NULL);
+
+        /* Unmapping unlocks, and unmapped pages can't be locked */
+        test_assert(0 == munmap(addr + PAGE_SIZE * 4, PAGE_SIZE * 4), NULL);
+        test_assert(-1 == mlock(addr, PAGE_SIZE * 8) && ENOMEM == errno, NULL);
+        test_assert(0 == munlock(addr, PAGE_SIZE * 8), NULL);
+        test_assert(0 == munmap(addr, PAGE_SIZE * 4), NULL);
+
+        /* There's a limit */
+        test_assert(MAP_FAILED != (addr = mmap(NULL, PAGE_SIZE * 4096, PROT_READ | PROT_WRITE,
+                                               MAP_PRIVATE | MAP_ANON, -1, 0)), NULL);
+        test_assert(-1 == mlock(addr, PAGE_SIZE * 4096) && ENOMEM == errno, NULL);
+        test_assert(0 == munmap(addr, PAGE_SIZE * 4096), NULL);
+
+        return 0;
+}
+
+#define LARGE_SIZE (PAGE_SIZE * 1024)
+
+static int test_large_pages(void)
+{
+        char *addr, *large;
+        int i, status;
+
+        printf("Testing anonymous memory big enough for 4mb pages\n");
+
+        /* Somewhere in here is an aligned 4mb piece, which the first write
+         * may map with a 4mb page if memory isn't short */
+        test_assert(MAP_FAILED != (addr = mmap(NULL, LARGE_SIZE * 2, PROT_READ | PROT_WRITE,
+                                               MAP_PRIVATE | MAP_ANON, -1, 0)), NULL);
+        large = (char *)(((uintptr_t)addr + LARGE_SIZE - 1) & ~(LARGE_SIZE - 1));
+        *large = 'a';
+        for (i = 0; i < 1024; i++)
+                test_assert('\0' == *(large + PAGE_SIZE * i + 1), NULL);
+        for (i = 0; i < 1024; i++)
+                *(large + PAGE_SIZE * i) = 'a' + i % 26;
+
+        /* Children get copies */
+        test_fork_begin() {
+                for (i = 0; i < 1024; i++) {
+                        if ('a' + i % 26 != *(large + PAGE_SIZE * i))
+                                return 1;
+                }
+                *(large + PAGE_SIZE * 10) = 'X';
+                return 'X' == *(large + PAGE_SIZE * 10) ? 0 : 1;
+        } test_fork_end(&status);
+        test_assert(0 == status, NULL);
+        test_assert('a' + 10 == *(large + PAGE_SIZE * 10), NULL);
+        *(large + PAGE_SIZE * 11) = 'Y';
+        test_assert('Y' == *(large + PAGE_SIZE * 11), NULL);
+
+        /* Single pages can be protected and unmapped */
+        test_assert(0 == mprotect(large + PAGE_SIZE * 20, PAGE_SIZE, PROT_READ), NULL);
+        assert_fault(*(large + PAGE_SIZE * 20) = 'Z', "");
+        test_assert('a' + 20 % 26 == *(large + PAGE_SIZE * 20), NULL);
+        assert_nofault(*(large + PAGE_SIZE * 21) = 'Z', "");
+        test_assert(0 == munmap(large + PAGE_SIZE * 30, PAGE_SIZE), NULL);
+        assert_fault(char foo = *(large + PAGE_SIZE * 30), "");
+        test_assert('a' + 29 % 26 == *(large + PAGE_SIZE * 29), NULL);
+        test_assert('a' + 31 % 26 == *(large + PAGE_SIZE * 31), NULL);
+        for (i = 32; i < 1024; i++)
+                test_assert('a' + i % 26 == *(large + PAGE_SIZE * i), NULL);
+
+        test_assert(0 == munmap(addr, LARGE_SIZE * 2), NULL);
+        return 0;
+}
+
 static int test_start_brk(void)
 {
         printf("Testing using brk() near starting brk\n");
@@ -525,6 +771,46 @@ static int test_mmap_repeat(void)
         return 0;
 }
 
+static int test_msync(void)
+{
+#define MSYNC_FILE "msynctest"
+
+        int fd;
+        char *addr, buf[1];
+
+        printf("Testing msync()\n");
+
+        /* Set up a two page test file */
+        test_assert(-1 != (fd = open(MSYNC_FILE, O_RDWR | O_CREAT, 0)), NULL);
+        test_assert(0 == unlink(MSYNC_FILE), NULL);
+        test_assert(PAGE_SIZE * 2 - 1 == lseek(fd, PAGE_SIZE * 2 - 1, SEEK_SET), NULL);
+        test_assert(1 == write(fd, "", 1), NULL);
+        test_assert(MAP_FAILED != (addr = mmap(NULL, PAGE_SIZE * 2,
+                                               PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)), NULL);
+
+        /* Bad arguments */
+        test_assert(-1 == msync(addr + 1, PAGE_SIZE, MS_SYNC) && EINVAL == errno, NULL);
+        test_assert(-1 == msync(addr, PAGE_SIZE, MS_SYNC | MS_ASYNC) && EINVAL == errno, NULL);
+        test_assert(-1 == msync(addr, PAGE_SIZE, 0x100) && EINVAL == errno, NULL);
+
+        /* Write both pages back, then write one again once it is clean */
+        *addr = 'a';
+        *(addr + PAGE_SIZE) = 'b';
+        test_assert(0 == msync(addr, PAGE_SIZE * 2, MS_SYNC), NULL);
+        *addr = 'c';
+        test_assert(0 == msync(addr, PAGE_SIZE, MS_ASYNC), NULL);
+        test_assert(0 == msync(addr, PAGE_SIZE, MS_SYNC), NULL);
+        test_assert(0 == lseek(fd, 0, SEEK_SET) && 1 == read(fd, buf, 1) && 'c' == buf[0], NULL);
+        test_assert(PAGE_SIZE == lseek(fd, PAGE_SIZE, SEEK_SET) && 1 == read(fd, buf, 1) && 'b' == buf[0], NULL);
+
+        /* The range has to be mapped */
+        test_assert(0 == munmap(addr, PAGE_SIZE * 2), NULL);
+        test_assert(-1 == msync(addr, PAGE_SIZE, MS_SYNC) && ENOMEM == errno, NULL);
+        test_assert(0 == close(fd), NULL);
+
+        return 0;
+}
+
 static int test_mmap_beyond(void)
 {
         /* <insert evil laughter here> */
@@ -617,10 +903,16 @@ int main(int argc, char **argv)
         childtest(test_mmap_bounds);
         childtest(test_brk_bounds);
         childtest(test_munmap);
+        childtest(test_mprotect);
+        childtest(test_user_copy);
+        childtest(test_madvise);
+        childtest(test_populate_mlock);
+        childtest(test_large_pages);
         childtest(test_start_brk);
         childtest(test_brk_mmap);
         childtest(test_mmap_fill);
         childtest(test_mmap_repeat);
+        childtest(test_msync);
         childtest(test_mmap_beyond);
         test_fini();
 
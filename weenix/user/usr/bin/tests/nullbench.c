@@ -0,0 +1,59 @@
+/*
+ * Measures the latency of a null system call (getpid) made with int
+ * $INTR_SYSCALL and with sysenter, which libc uses when the processor has
+ * it. Takes the number of calls to time (100000 by default), and prints
+ * the cycles per call each way.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <weenix/trap.h>
+
+static unsigned long long rdtsc(void)
+{
+        unsigned long long tsc;
+        __asm__ volatile("rdtsc" : "=A"(tsc));
+        return tsc;
+}
+
+int main(int argc, char **argv)
+{
+        int ncalls = 100000, i, pid = getpid();
+        unsigned long long start, cycles;
+
+        if (argc > 1)
+                ncalls = atoi(argv[1]);
+        if (ncalls <= 0) {
+                fprintf(stderr, "USAGE: nullbench [<calls>]\n");
+                return 1;
+        }
+
+        /* sysenter first: some hypervisors can't run int $n from user
+         * mode, so that one might not come back */
+        if (__trap_sysenter) {
+                start = rdtsc();
+                for (i = 0; i < ncalls; i++) {
+                        if (pid != __trap_sysenter_call(SYS_getpid, 0)) {
+                                fprintf(stderr, "nullbench: sysenter returned the wrong pid\n");
+                                return 1;
+                        }
+                }
+                cycles = rdtsc() - start;
+                printf("nullbench: sysenter: %llu cycles per call\n", cycles / ncalls);
+        } else {
+                printf("nullbench: no sysenter on this processor\n");
+        }
+
+        start = rdtsc();
+        for (i = 0; i < ncalls; i++) {
+                if (pid != __trap_int(SYS_getpid, 0)) {
+                        fprintf(stderr, "nullbench: int returned the wrong pid\n");
+                        return 1;
+                }
+        }
+        cycles = rdtsc() - start;
+        printf("nullbench: int $%#x: %llu cycles per call\n",
+               INTR_SYSCALL, cycles / ncalls);
+        return 0;
+}
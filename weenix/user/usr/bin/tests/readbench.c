@@ -0,0 +1,88 @@
+/*
+ * Writes a file of the given number of megabytes (4 by default) and reads
+ * it back a few times (4 by default), with reads and writes of the given
+ * number of kilobytes (64 by default), and prints the cycles taken per
+ * kilobyte. The first pass over the file may have to read it from disk
+ * if it didn't stay in the page cache. The others show how fast cached
+ * data gets to user memory. Run it on the s5fs root:
+ *
+ *    kshell> pcstat reset
+ *    (run /usr/bin/readbench 8 128)
+ *    kshell> pcstat
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#define FILENAME "/readbench.tmp"
+
+static unsigned long long rdtsc(void)
+{
+        unsigned long long tsc;
+        __asm__ volatile("rdtsc" : "=A"(tsc));
+        return tsc;
+}
+
+int main(int argc, char **argv)
+{
+        int mb = 4, kb = 64, passes = 4, fd, p, n;
+        unsigned long long start, cycles;
+        size_t len, bufsize, done;
+        char *buf;
+
+        if (argc > 1)
+                mb = atoi(argv[1]);
+        if (argc > 2)
+                kb = atoi(argv[2]);
+        if (argc > 3)
+                passes = atoi(argv[3]);
+        if (mb <= 0 || kb <= 0 || passes <= 0) {
+                fprintf(stderr, "USAGE: readbench [<megabytes> [<kilobytes per read> [<passes>]]]\n");
+                return 1;
+        }
+        len = (size_t)mb * 1024 * 1024;
+        bufsize = (size_t)kb * 1024;
+        if (NULL == (buf = malloc(bufsize))) {
+                fprintf(stderr, "readbench: out of memory\n");
+                return 1;
+        }
+        memset(buf, 'r', bufsize);
+
+        if (0 > (fd = open(FILENAME, O_RDWR | O_CREAT | O_TRUNC, 0))) {
+                fprintf(stderr, "readbench: can't create %s\n", FILENAME);
+                return 1;
+        }
+        start = rdtsc();
+        for (done = 0; done < len; done += n) {
+                if (0 >= (n = write(fd, buf, bufsize))) {
+                        fprintf(stderr, "readbench: write failed\n");
+                        goto out;
+                }
+        }
+        cycles = rdtsc() - start;
+        printf("readbench: wrote %d mb, %llu cycles per kb\n",
+               mb, cycles / (len / 1024));
+
+        for (p = 0; p < passes; p++) {
+                lseek(fd, 0, SEEK_SET);
+                start = rdtsc();
+                for (done = 0; done < len; done += n) {
+                        if (0 >= (n = read(fd, buf, bufsize))) {
+                                fprintf(stderr, "readbench: read failed\n");
+                                goto out;
+                        }
+                }
+                cycles = rdtsc() - start;
+                printf("readbench: pass %d read %d mb in %d kb reads, "
+                       "%llu cycles per kb\n", p, mb, kb, cycles / (len / 1024));
+        }
+
+out:
+        close(fd);
+        unlink(FILENAME);
+        free(buf);
+        return 0;
+}
@@ -0,0 +1,85 @@
+/*
+ * Maps a lot of anonymous memory and touches it one word per page, many
+ * times over and in a scattered order, so that nearly every access needs
+ * a different TLB entry. With 4mb pages each 4mb of memory takes one TLB
+ * entry (and one page fault) rather than 1024. Takes the number of
+ * megabytes to map (8 by default) and the number of passes over them (64
+ * by default), and prints the cycles taken by the first touch and per
+ * access afterwards. Compare runs with and without 4mb pages:
+ *
+ *    kshell> vmstat reset
+ *    (run /usr/bin/tlbbench)
+ *    kshell> vmstat
+ *    kshell> vmtune largepages 0
+ *    kshell> vmstat reset
+ *    (run /usr/bin/tlbbench again)
+ *    kshell> vmstat
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define PAGE_SIZE 4096
+#define LARGE_SIZE (PAGE_SIZE * 1024)
+/* odd, so that stepping by it visits every page before repeating */
+#define STRIDE 257
+
+static unsigned long long rdtsc(void)
+{
+        unsigned long long tsc;
+        __asm__ volatile("rdtsc" : "=A"(tsc));
+        return tsc;
+}
+
+int main(int argc, char **argv)
+{
+        int mb = 8, passes = 64, npages, i, p, page;
+        unsigned long long start, touch, access;
+        unsigned long sum = 0;
+        char *addr, *mem;
+        size_t len;
+
+        if (argc > 1)
+                mb = atoi(argv[1]);
+        if (argc > 2)
+                passes = atoi(argv[2]);
+        if (mb <= 0 || passes <= 0) {
+                fprintf(stderr, "USAGE: tlbbench [<megabytes> [<passes>]]\n");
+                return 1;
+        }
+
+        /* map 4mb extra so that the memory used can start 4mb aligned */
+        len = (size_t)mb * 1024 * 1024;
+        addr = mmap(NULL, len + LARGE_SIZE, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANON, -1, 0);
+        if (MAP_FAILED == addr) {
+                fprintf(stderr, "tlbbench: mmap failed\n");
+                return 1;
+        }
+        mem = (char *)(((unsigned long)addr + LARGE_SIZE - 1) & ~(LARGE_SIZE - 1));
+        npages = len / PAGE_SIZE;
+
+        start = rdtsc();
+        for (i = 0; i < npages; i++)
+                mem[i * PAGE_SIZE] = (char)i;
+        touch = rdtsc() - start;
+
+        start = rdtsc();
+        for (p = 0; p < passes; p++) {
+                for (i = 0, page = p; i < npages; i++) {
+                        page = (page + STRIDE) % npages;
+                        sum += mem[page * PAGE_SIZE];
+                }
+        }
+        access = rdtsc() - start;
+
+        printf("tlbbench: %d pages, first touch %llu cycles (%llu per page)\n",
+               npages, touch, touch / npages);
+        printf("tlbbench: %d passes, %llu cycles per access (sum %lu)\n",
+               passes, access / ((unsigned long long)npages * passes), sum);
+
+        munmap(addr, len + LARGE_SIZE);
+        return 0;
+}